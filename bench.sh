@@ -0,0 +1,124 @@
+#!/usr/bin/env bash
+# End-to-end ingest benchmark, run it as make bench.
+# Every scenario starts a fresh bench_gateway on loopback in a scratch directory, drives it with sensor_loadgen and
+# measures over the load after a warm-up:
+#   readings_per_s   rows handed to the storage backend per second, from the gateway's metrics endpoint
+#   latency_us       receive to the data file of 1 in BENCH_SAMPLE rows, from gateway.latency (sensor_gateway -S)
+#   send_latency_us  due to written by the load generator, how far the gateway's back-pressure delays the sensors
+#   cpu_cores        user + system time of the gateway process per second of the window
+#   rss_kb           peak resident set of the gateway process
+# The results go to bench-<commit>.json, or BENCH_OUT, so runs of different commits can be compared. Pin the stages
+# for repeatable numbers, e.g. BENCH_GATEWAY_OPTS="-a io=0-1 -a datamgr=2 -a db=3" (see placement.h).
+
+port=${BENCH_PORT:-5620}
+seconds=${BENCH_SECONDS:-10}    # Load per scenario, the first 'warmup' seconds are not measured.
+warmup=2
+sample=${BENCH_SAMPLE:-100}
+gateway_opts=${BENCH_GATEWAY_OPTS:-}
+max_conn=1024                   # The D_MAX_CONN bench_gateway is built with.
+metrics_url=http://127.0.0.1:9105/metrics
+
+cd "$(dirname "$0")" || exit 1
+repo=$(pwd)
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+out=${BENCH_OUT:-bench-$commit.json}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+hz=$(getconf CLK_TCK)
+
+metric() {
+    curl -s "$metrics_url" | awk -v m="$1" '$1 == m { print $2 }'
+}
+
+cpu_ticks() {
+    # utime and stime, the fields after the parenthesized command name.
+    sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+now() {
+    date +%s.%N
+}
+
+# Prints "p50 p99 p999" of the numbers on stdin.
+percentiles() {
+    sort -n | awk '{ v[NR] = $1 }
+        function at(q,  i) { i = int(q * NR + 0.999999); if (i < 1) i = 1; return v[i] }
+        END { if (NR) printf "%.1f %.1f %.1f", at(0.5), at(0.99), at(0.999); else printf "null null null" }'
+}
+
+# run_scenario <name> <gateway> <sensor_loadgen options...>
+run_scenario() {
+    local name=$1 gateway=$2
+    shift 2
+    local dir=$work/$name
+    mkdir -p "$dir"
+    cd "$dir" || exit 1
+    ln -s "$repo/lib" lib
+    "$repo/file_creator" > /dev/null # room_sensor.map
+
+    echo "***** $name *****"
+    "$repo/$gateway" -S "$sample" $gateway_opts "$port" > gateway.out 2>&1 &
+    local gw=$!
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "$metrics_url" && break
+        sleep 0.1
+    done
+
+    "$repo/sensor_loadgen" -d "$seconds" "$@" 127.0.0.1 "$port" > loadgen.out &
+    local lg=$!
+    sleep "$warmup"
+    local rows0 cpu0 t0 rows1 cpu1 t1 rss
+    rows0=$(metric gateway_db_rows_total)
+    cpu0=$(cpu_ticks $gw)
+    t0=$(now)
+    sleep $((seconds - warmup))
+    rows1=$(metric gateway_db_rows_total)
+    cpu1=$(cpu_ticks $gw)
+    t1=$(now)
+    rss=$(awk '/^VmHWM/ { print $2 }' "/proc/$gw/status")
+    wait $lg
+
+    # The gateway stops once D_MAX_CONN connections closed, open and close the ones the scenario did not use. A few
+    # at a time, connections beyond its listen backlog (MAX_PENDING) may never be accepted.
+    local opened
+    while opened=$(metric gateway_connections_opened_total) && [ -n "$opened" ] && ((opened < max_conn)); do
+        for ((i = 0; i < 8 && opened + i < max_conn; ++i)); do
+            exec 3<> "/dev/tcp/127.0.0.1/$port" && exec 3<&-
+        done
+        sleep 0.05
+    done
+    wait $gw
+
+    local sent stored lat send
+    sent=$(sed -n 's/^sent \([0-9]*\) readings in.*/\1/p' loadgen.out)
+    stored=$(wc -l < data.csv)
+    lat=$(awk '!/^#/ { printf "%.1f\n", $3 + $5 + $6 }' gateway.latency | percentiles)
+    send=$(sed -n 's/^send .* p50=\([0-9.]*\) .* p99=\([0-9.]*\) p99.9=\([0-9.]*\) .*/\1 \2 \3/p' loadgen.out)
+    read -r lat50 lat99 lat999 <<< "$lat"
+    read -r send50 send99 send999 <<< "${send:-null null null}"
+    awk -v name="$name" -v args="$*" -v sent="${sent:-0}" -v stored="$stored" -v rows="$((rows1 - rows0))" \
+        -v t0="$t0" -v t1="$t1" -v cpu="$((cpu1 - cpu0))" -v hz="$hz" -v rss="$rss" \
+        -v l50="$lat50" -v l99="$lat99" -v l999="$lat999" -v s50="$send50" -v s99="$send99" -v s999="$send999" \
+        'BEGIN { t = t1 - t0
+                printf "    {\"name\": \"%s\", \"loadgen\": \"%s\", \"sent\": %d, \"stored\": %d, " \
+                        "\"readings_per_s\": %.0f, \"latency_us\": {\"p50\": %s, \"p99\": %s, \"p999\": %s}, " \
+                        "\"send_latency_us\": {\"p50\": %s, \"p99\": %s, \"p999\": %s}, " \
+                        "\"cpu_cores\": %.2f, \"rss_kb\": %d}\n", name, args, sent, stored, rows / t,
+                        l50, l99, l999, s50, s99, s999, cpu / hz / t, rss }' >> "$work/results"
+    tail -n 4 loadgen.out
+    cd "$repo" || exit 1
+}
+
+# Scenario         gateway                 sensor_loadgen options
+run_scenario idle     bench_gateway          -n 500 -r 0.5 -a constant -c 500 -t 2 -m room_sensor.map
+run_scenario hot      bench_gateway          -n 1000 -r 100 -c 4 -t 2 -R 1 -m room_sensor.map
+run_scenario invalid  bench_gateway          -n 5000 -r 10 -c 4 -t 2 -R 1
+run_scenario slowdisk bench_gateway_slowdisk -n 1000 -r 50 -c 4 -t 2 -R 1 -m room_sensor.map
+
+{
+    printf '{\n  "commit": "%s",\n  "date": "%s",\n  "cpus": %d,\n  "seconds": %d,\n  "scenarios": [\n' \
+        "$commit" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(nproc)" "$seconds"
+    sed '$!s/$/,/' "$work/results"
+    printf '  ]\n}\n'
+} > "$out"
+echo "Results written to $out"
@@ -0,0 +1,218 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <wait.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "sensor_db.h"
+#include "sbuffer.h"
+#include "datamgr.h"
+#include "tsstore.h"
+#include "placement.h"
+
+// A record of the binary sensor_data file written by file_creator and sensor_node: <id><value><ts>, packed.
+#define RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+#ifndef BULK_THREADS
+#define BULK_THREADS 4 // Parser threads per file, unless -j says otherwise.
+#endif
+
+#ifndef BULK_WINDOW
+#define BULK_WINDOW 262144 // Records parsed at a time, the buffer holds at most two windows of them.
+#endif
+
+/**
+ * A slice of a mapped file that one parser thread turns into a chain of buffer nodes.
+ */
+typedef struct {
+    const unsigned char *start;
+    size_t n_records;
+    sbuffer_node_t *first, *last;
+    size_t parsed, skipped;
+    pthread_t tid;
+} bulk_chunk_t;
+
+static double now_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *bulk_parse(void *arg) {
+    bulk_chunk_t *c = arg;
+    c->first = c->last = NULL;
+    c->parsed = c->skipped = 0;
+    for (size_t i = 0; i < c->n_records; ++i) {
+        const unsigned char *p = c->start + i * RECORD_SIZE;
+        sensor_data_t *data = malloc(sizeof(sensor_data_t));
+        ERROR_HANDLER(data == NULL, "Record malloc failed.");
+        memset(data, 0, sizeof(sensor_data_t));
+        memcpy(&data->id, p, sizeof(sensor_id_t));
+        memcpy(&data->value, p + sizeof(sensor_id_t), sizeof(sensor_value_t));
+        memcpy(&data->ts, p + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(sensor_ts_t));
+        if (data->id == 0) {
+            // Id 0 is the EOF marker of the buffer, a record carrying it would stop both consumers.
+            free(data);
+            c->skipped++;
+            continue;
+        }
+
+        sbuffer_node_t *node = malloc(sizeof(sbuffer_node_t));
+        ERROR_HANDLER(node == NULL, "Node malloc failed.");
+        node->data = data;
+        node->next = NULL;
+        if (c->last) c->last->next = node;
+        else c->first = node;
+        c->last = node;
+        c->parsed++;
+    }
+    return NULL;
+}
+
+/**
+ * Waits until the datamgr and the DB thread have read everything in the buffer, the DB thread has written it, and
+ * frees what they are done with. Readings are malloc'd one by one, without this a backfill would keep all of them.
+ */
+static void bulk_drain() {
+    uint64_t appended = sbuffer_appended();
+    if (appended == 0) return;
+    ERROR_HANDLER(db_barrier() != 0, "DB closed improperly.");
+    while (datamgr_nodes_read() < appended) usleep(100);
+    sbuffer_reclaim(appended - 1);
+}
+
+/**
+ * Maps one file and parses it a window at a time, the chunks of a window in parallel. The consumers work on a window
+ * while the next one is parsed, it is appended once they are done. The buffer gets the chunks in file order, so
+ * every sensor's readings reach the datamgr and the DB thread in the order they were recorded.
+ * @return the number of readings inserted
+ */
+static size_t bulk_file(const char *path, int n_threads, size_t *skipped) {
+    int fd = open(path, O_RDONLY);
+    ERROR_HANDLER(fd == -1, "Input file cannot be opened.");
+    struct stat st;
+    ERROR_HANDLER(fstat(fd, &st) != 0, "Input file cannot be read.");
+    size_t n_records = st.st_size / RECORD_SIZE;
+    if (st.st_size % RECORD_SIZE) fprintf(stderr, "%s: ignoring %zu trailing bytes\n", path, st.st_size % RECORD_SIZE);
+    if (n_records == 0) {
+        close(fd);
+        return 0;
+    }
+    const unsigned char *map = mmap(NULL, n_records * RECORD_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    ERROR_HANDLER(map == MAP_FAILED, "Input file cannot be mapped.");
+    madvise((void *) map, n_records * RECORD_SIZE, MADV_SEQUENTIAL);
+
+    size_t inserted = 0;
+    for (size_t done = 0; done < n_records;) {
+        size_t window = n_records - done < BULK_WINDOW ? n_records - done : BULK_WINDOW;
+        int n_chunks = (size_t) n_threads > window ? (int) window : n_threads;
+        bulk_chunk_t chunks[n_chunks];
+        size_t per_chunk = window / n_chunks;
+        for (int i = 0; i < n_chunks; ++i) {
+            chunks[i].start = map + done * RECORD_SIZE;
+            chunks[i].n_records = i == n_chunks - 1 ? window - per_chunk * i : per_chunk;
+            done += chunks[i].n_records;
+            ERROR_HANDLER(pthread_create(&chunks[i].tid, NULL, bulk_parse, &chunks[i]) != 0,
+                          "Parser creation failed.");
+        }
+        for (int i = 0; i < n_chunks; ++i) pthread_join(chunks[i].tid, NULL);
+        bulk_drain();
+        for (int i = 0; i < n_chunks; ++i) {
+            if (chunks[i].first) sbuffer_insert_chain(chunks[i].first, chunks[i].last);
+            inserted += chunks[i].parsed;
+            *skipped += chunks[i].skipped;
+        }
+    }
+    munmap((void *) map, n_records * RECORD_SIZE);
+    return inserted;
+}
+
+static void report(const char *stage, size_t n, double seconds) {
+    printf("%-8s %12zu readings %9.3f s %14.0f readings/s\n", stage, n, seconds, seconds > 0 ? n / seconds : 0);
+}
+
+int main(int argc, char *argv[]) {
+    // Usage: bulk_ingest [-s csv|sqlite|seg] [-l text|binary] [-j threads] [-a stage=cpus]... <sensor_data file>...
+    int opt, n_threads = BULK_THREADS;
+    while ((opt = getopt(argc, argv, "s:l:j:a:")) != -1) {
+        switch (opt) {
+            case 's':
+                ERROR_HANDLER(db_select_backend(optarg) != 0, "Unknown storage backend.");
+                break;
+            case 'l':
+                ERROR_HANDLER(log_select_format(optarg) != 0, "Unknown log format.");
+                break;
+            case 'j':
+                n_threads = atoi(optarg);
+                ERROR_HANDLER(n_threads < 1, "The number of threads must be positive.");
+                break;
+            case 'a':
+                ERROR_HANDLER(placement_select(optarg) != 0, "Invalid thread placement."); // main runs the parsers.
+                break;
+            default:
+                ERROR_HANDLER(1, "Unknown option.");
+        }
+    }
+    ERROR_HANDLER(optind >= argc, "No input file.");
+
+    placement_apply(PLACEMENT_MAIN);
+    db_select_continue(); // A backfill adds to the store and the log, whatever is in them already stays.
+    log_init(); // Same pipeline as the gateway, minus the connection manager.
+    trace_init();
+    sbuffer_init();
+    tsstore_init();
+
+    double start = now_s();
+    pthread_t tid[2];
+    pthread_create(&tid[0], NULL, datamgr_init, NULL);
+    pthread_create(&tid[1], NULL, db_init, NULL);
+
+    size_t total = 0, skipped = 0;
+    for (int i = optind; i < argc; ++i) {
+        total += bulk_file(argv[i], n_threads, &skipped);
+    }
+    double parsed = now_s();
+
+    sensor_data_t *eof = malloc(sizeof(sensor_data_t));
+    ERROR_HANDLER(eof == NULL, "Record malloc failed.");
+    memset(eof, 0, sizeof(sensor_data_t));
+    sbuffer_insert(eof);
+
+    // Poll both consumers, so each stage gets its own finish time whichever ends first.
+    double finished[2] = {0, 0};
+    int running = 2;
+    while (running) {
+        for (int i = 0; i < 2; ++i) {
+            if (finished[i] == 0 && pthread_tryjoin_np(tid[i], NULL) == 0) {
+                finished[i] = now_s();
+                running--;
+            }
+        }
+        if (running) usleep(1000);
+    }
+
+    ERROR_HANDLER(db_close() != 0, "DB closed improperly.");
+    wait(NULL);
+
+    printf("\nbulk ingest of %d file(s) with %d parser thread(s), %zu records skipped\n", argc - optind, n_threads,
+           skipped);
+    report("parse", total, parsed - start);
+    report("datamgr", total, finished[0] - start);
+    report("db", total, finished[1] - start);
+
+    sbuffer_free();
+    tsstore_free();
+    return 0;
+}
@@ -0,0 +1,308 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "capture.h"
+#include "dbwriter.h"
+#include "metrics.h"
+
+/**
+ * An event as a connection stages it, with its time instead of a delta. Its bytes follow it.
+ */
+typedef struct {
+    int64_t ns;
+    capture_event_t event;
+} capture_staged_t;
+
+/**
+ * The events of one connection not handed off yet. Only its own thread and the capture thread take its lock, so
+ * it is almost never contended.
+ */
+typedef struct {
+    pthread_mutex_t mtx;
+    char buf[CAPTURE_STAGE_SIZE];
+    size_t len;
+} capture_stage_t;
+
+/**
+ * Where a handed off event is in the pending bytes, sorted by time before it goes to the file.
+ */
+typedef struct {
+    int64_t ns;
+    size_t off;
+} capture_ref_t;
+
+atomic_bool capture_on = false;
+
+static const char *capture_path = NULL;
+static int capture_fd = -1;
+static off_t capture_offset;
+static dbwriter_t *capture_writer;
+static char *capture_buf;           // The writer buffer being filled, only by the capture thread.
+static size_t capture_len;
+static int64_t capture_last_ns;     // Time of the previous event, as far as its delta_us reaches.
+static atomic_uint_least32_t capture_next_conn = 1;
+static _Thread_local capture_stage_t *my_stage = NULL; // The stage of the connection this thread serves.
+
+// Lock order: stages_mtx, then the lock of a stage, then pending_mtx.
+static pthread_mutex_t stages_mtx = PTHREAD_MUTEX_INITIALIZER;
+static capture_stage_t **stages = NULL;
+static size_t n_stages = 0, stages_cap = 0;
+
+static pthread_mutex_t pending_mtx = PTHREAD_MUTEX_INITIALIZER; // Guards the handed off events.
+static char *pending = NULL;
+static size_t pending_len = 0, pending_cap = 0;
+
+static pthread_t capture_tid;
+static pthread_mutex_t round_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_cond = PTHREAD_COND_INITIALIZER;
+static bool capture_stopping = false;
+
+void capture_select_file(const char *path) {
+    capture_path = path;
+}
+
+/**
+ * Adds staged events to the pending ones.
+ */
+static void pending_append(const char *events, size_t len) {
+    pthread_mutex_lock(&pending_mtx);
+    if (pending_len + len > pending_cap) {
+        pending_cap = pending_cap ? 2 * pending_cap : 256 * 1024;
+        if (pending_cap < pending_len + len) pending_cap = pending_len + len;
+        pending = realloc(pending, pending_cap);
+        ERROR_HANDLER(pending == NULL, "Capture pending realloc failed.");
+    }
+    memcpy(pending + pending_len, events, len);
+    pending_len += len;
+    pthread_mutex_unlock(&pending_mtx);
+}
+
+/**
+ * Moves the events of a stage to the pending ones. Called with the lock of the stage held.
+ */
+static void stage_hand_off(capture_stage_t *st) {
+    if (st->len == 0) return;
+    pending_append(st->buf, st->len);
+    st->len = 0;
+}
+
+static void capture_submit() {
+    if (capture_len == 0) return;
+    ERROR_HANDLER(dbwriter_submit(capture_writer, capture_fd, capture_offset, capture_len, &capture_buf) !=
+                  DBWRITER_SUCCESS, "Capture write failed.");
+    capture_offset += capture_len;
+    capture_len = 0;
+}
+
+/**
+ * Appends an event to the file buffer, after as many gaps as its distance to the previous event needs.
+ */
+static void capture_append(const char *staged) {
+    capture_staged_t s;
+    memcpy(&s, staged, sizeof(s)); // Staged events are packed, not aligned.
+    int64_t delta_us = s.ns > capture_last_ns ? (s.ns - capture_last_ns) / 1000 : 0;
+    capture_last_ns += delta_us * 1000;
+    capture_event_t event = s.event;
+    while (1) {
+        if (capture_len + sizeof(event) + event.len > CAPTURE_BUFFER_SIZE) capture_submit();
+        if (delta_us <= UINT32_MAX) break;
+        capture_event_t gap = {UINT32_MAX, 0, CAPTURE_GAP, 0, 0};
+        memcpy(capture_buf + capture_len, &gap, sizeof(gap));
+        capture_len += sizeof(gap);
+        delta_us -= UINT32_MAX;
+    }
+    event.delta_us = (uint32_t) delta_us;
+    memcpy(capture_buf + capture_len, &event, sizeof(event));
+    if (event.len) memcpy(capture_buf + capture_len + sizeof(event), staged + sizeof(s), event.len);
+    capture_len += sizeof(event) + event.len;
+}
+
+static int cmp_ref(const void *a, const void *b) {
+    const capture_ref_t *x = a, *y = b;
+    if (x->ns != y->ns) return (x->ns > y->ns) - (x->ns < y->ns);
+    return (x->off > y->off) - (x->off < y->off); // Events of one connection keep their order.
+}
+
+/**
+ * One round of the capture thread: takes the staged events of every connection and writes the ones before
+ * 'horizon' in the order of their times. An event stamped before the round started is staged by then, the lock
+ * of its stage is held while it is stamped, so nothing before 'horizon' can still come.
+ */
+static void capture_round(int64_t horizon) {
+    pthread_mutex_lock(&stages_mtx);
+    for (size_t i = 0; i < n_stages; ++i) {
+        pthread_mutex_lock(&stages[i]->mtx);
+        stage_hand_off(stages[i]);
+        pthread_mutex_unlock(&stages[i]->mtx);
+    }
+    pthread_mutex_unlock(&stages_mtx);
+
+    pthread_mutex_lock(&pending_mtx);
+    char *taken = pending;
+    size_t taken_len = pending_len;
+    pending = NULL;
+    pending_len = pending_cap = 0;
+    pthread_mutex_unlock(&pending_mtx);
+    if (taken_len == 0) {
+        free(taken);
+        return;
+    }
+
+    size_t n = 0, cap = 1024;
+    capture_ref_t *refs = malloc(cap * sizeof(capture_ref_t));
+    ERROR_HANDLER(refs == NULL, "Capture sort malloc failed.");
+    for (size_t off = 0; off < taken_len;) {
+        capture_staged_t s;
+        memcpy(&s, taken + off, sizeof(s));
+        if (n == cap) {
+            cap *= 2;
+            refs = realloc(refs, cap * sizeof(capture_ref_t));
+            ERROR_HANDLER(refs == NULL, "Capture sort realloc failed.");
+        }
+        refs[n].ns = s.ns;
+        refs[n++].off = off;
+        off += sizeof(capture_staged_t) + s.event.len;
+    }
+    qsort(refs, n, sizeof(capture_ref_t), cmp_ref);
+
+    size_t i = 0;
+    for (; i < n && refs[i].ns < horizon; ++i) capture_append(taken + refs[i].off);
+    // The later ones wait for the next round, an event of a connection not taken yet may come before them.
+    for (; i < n; ++i) {
+        capture_staged_t s;
+        memcpy(&s, taken + refs[i].off, sizeof(s));
+        pending_append(taken + refs[i].off, sizeof(s) + s.event.len);
+    }
+    free(refs);
+    free(taken);
+}
+
+static void *capture_thread() {
+    pthread_mutex_lock(&round_mtx);
+    while (!capture_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += CAPTURE_ROUND_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&round_cond, &round_mtx, &until);
+        pthread_mutex_unlock(&round_mtx);
+        capture_round(metrics_now());
+        pthread_mutex_lock(&round_mtx);
+    }
+    pthread_mutex_unlock(&round_mtx);
+    return NULL;
+}
+
+void capture_init() {
+    if (capture_path == NULL) return;
+    capture_fd = open(capture_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ERROR_HANDLER(capture_fd == -1, "Capture file creation did not work.");
+    char header[CAPTURE_HEADER_SIZE] = {0};
+    uint32_t size = sizeof(capture_event_t);
+    memcpy(header, CAPTURE_MAGIC, 8);
+    memcpy(header + 8, &size, sizeof(size));
+    ERROR_HANDLER(write(capture_fd, header, sizeof(header)) != sizeof(header), "Capture header write failed.");
+    capture_offset = sizeof(header);
+
+    // The connection threads only copy into memory, the capture thread orders the events and the writer thread
+    // of the csv backend does the disk.
+    capture_writer = dbwriter_create(CAPTURE_BUFFER_SIZE, 3, &capture_buf);
+    capture_len = 0;
+    capture_last_ns = metrics_now();
+    capture_stopping = false;
+    ERROR_HANDLER(pthread_create(&capture_tid, NULL, capture_thread, NULL) != 0, "Capture thread creation failed.");
+    capture_on = true;
+    TRACE_INFO("Capturing the traffic to %s", capture_path);
+}
+
+/**
+ * Stages an event of the connection of this thread, timed under the lock of its stage.
+ */
+static void capture_event(uint32_t conn, capture_type_t type, const void *bytes, uint8_t len) {
+    capture_stage_t *st = my_stage;
+    size_t size = sizeof(capture_staged_t) + len;
+    pthread_mutex_lock(&st->mtx);
+    if (st->len + size > CAPTURE_STAGE_SIZE) stage_hand_off(st);
+    capture_staged_t s = {metrics_now(), {0, conn, type, len, 0}};
+    memcpy(st->buf + st->len, &s, sizeof(s));
+    if (len) memcpy(st->buf + st->len + sizeof(s), bytes, len);
+    st->len += size;
+    pthread_mutex_unlock(&st->mtx);
+}
+
+uint32_t capture_conn_open() {
+    if (!capture_on) return 0;
+    capture_stage_t *st = malloc(sizeof(capture_stage_t));
+    ERROR_HANDLER(st == NULL, "Capture stage malloc failed.");
+    pthread_mutex_init(&st->mtx, NULL);
+    st->len = 0;
+    pthread_mutex_lock(&stages_mtx);
+    if (n_stages == stages_cap) {
+        stages_cap = stages_cap ? 2 * stages_cap : 64;
+        stages = realloc(stages, stages_cap * sizeof(capture_stage_t *));
+        ERROR_HANDLER(stages == NULL, "Capture stages realloc failed.");
+    }
+    stages[n_stages++] = st;
+    pthread_mutex_unlock(&stages_mtx);
+    my_stage = st;
+
+    uint32_t conn;
+    while ((conn = atomic_fetch_add(&capture_next_conn, 1)) == 0); // 0 means not captured, skip it on a wrap.
+    capture_event(conn, CAPTURE_OPEN, NULL, 0);
+    return conn;
+}
+
+void capture_conn_data(uint32_t conn, const void *bytes, uint8_t len) {
+    if (capture_on && my_stage) capture_event(conn, CAPTURE_DATA, bytes, len);
+}
+
+void capture_conn_close(uint32_t conn) {
+    capture_stage_t *st = my_stage;
+    if (!capture_on || st == NULL) return;
+    capture_event(conn, CAPTURE_CLOSE, NULL, 0);
+
+    // The stage leaves the list with its events handed off, the capture thread orders them in its next round.
+    pthread_mutex_lock(&stages_mtx);
+    pthread_mutex_lock(&st->mtx);
+    stage_hand_off(st);
+    pthread_mutex_unlock(&st->mtx);
+    for (size_t i = 0; i < n_stages; ++i) {
+        if (stages[i] == st) {
+            stages[i] = stages[--n_stages];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stages_mtx);
+    pthread_mutex_destroy(&st->mtx);
+    free(st);
+    my_stage = NULL;
+}
+
+void capture_close() {
+    if (!capture_on) return;
+    capture_on = false;
+    pthread_mutex_lock(&round_mtx);
+    capture_stopping = true;
+    pthread_cond_signal(&round_cond);
+    pthread_mutex_unlock(&round_mtx);
+    pthread_join(capture_tid, NULL);
+    capture_round(INT64_MAX); // The connections are done, everything staged goes out.
+    capture_submit();
+    dbwriter_free(&capture_writer); // Writes whatever is still queued.
+    close(capture_fd);
+    capture_fd = -1;
+    free(stages);
+    stages = NULL;
+    n_stages = stages_cap = 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "config.h"
+
+#ifndef CAPTURE_BUFFER_SIZE
+#define CAPTURE_BUFFER_SIZE (256 * 1024) // Bytes of events gathered before they are handed to the writer thread.
+#endif
+
+#ifndef CAPTURE_STAGE_SIZE
+#define CAPTURE_STAGE_SIZE (16 * 1024) // Bytes of events a connection gathers before it hands them off itself.
+#endif
+
+#ifndef CAPTURE_ROUND_MS
+#define CAPTURE_ROUND_MS 5 // Milliseconds between two rounds of the capture thread over the connections.
+#endif
+
+#define CAPTURE_MAGIC "GWCAP002"
+#define CAPTURE_HEADER_SIZE 16 // The magic and the size of an event header (uint32), then 4 reserved bytes.
+
+/*
+ * A capture is what the connection threads received, in the order they received it: a header, then events of an
+ * 12 byte capture_event_t followed by its 'len' bytes. Event times are microseconds since the previous event, so
+ * sensor_replay can play the traffic back with the same interleaving of the connections and the same gaps.
+ *
+ * Every connection thread stages its events with their times, under a lock of its own. Every CAPTURE_ROUND_MS the
+ * capture thread takes what the connections staged and writes the events older than the start of the round in
+ * the order of their times, so the connections never wait for each other.
+ */
+
+typedef enum {
+    CAPTURE_GAP,                // No connection, only moves the time on by a delta too long for one event.
+    CAPTURE_OPEN,               // A connection was accepted.
+    CAPTURE_DATA,               // A reading was received on the connection, the bytes are as they came in.
+    CAPTURE_CLOSE               // The connection was closed by the sensor or timed out.
+} capture_type_t;
+
+typedef struct {
+    uint32_t delta_us;          /**< microseconds since the previous event */
+    uint32_t conn;              /**< connection number, the first one is 1 */
+    uint8_t type;               /**< a capture_type_t value */
+    uint8_t len;                /**< bytes following the event */
+    uint16_t reserved;          /**< zero */
+} capture_event_t;
+
+extern atomic_bool capture_on; // Set by capture_init(), read by every connection thread.
+
+/**
+ * Captures the traffic to 'path' once capture_init() is called.
+ */
+void capture_select_file(const char *path);
+
+/**
+ * Creates the capture file and starts the capture and writer threads, if a file was selected.
+ */
+void capture_init();
+
+/**
+ * Writes what is still buffered and closes the file. Call after the connection manager finished.
+ */
+void capture_close();
+
+/**
+ * Records a new connection. The events of a connection are recorded by the thread that opened it.
+ * \return the number of the connection in the capture, 0 if nothing is captured
+ */
+uint32_t capture_conn_open();
+
+/**
+ * Records the bytes of a reading received on connection 'conn'.
+ */
+void capture_conn_data(uint32_t conn, const void *bytes, uint8_t len);
+
+/**
+ * Records the end of connection 'conn'.
+ */
+void capture_conn_close(uint32_t conn);
+
+#endif //_CAPTURE_H_
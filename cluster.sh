@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# A cluster of gateways behind sensor_router on loopback, run it as make cluster.
+# Starts CLUSTER_BACKENDS bench_gateways, each in its own scratch directory with its own metrics port, and a router
+# that knows all but the last of them. sensor_loadgen drives CLUSTER_SENSORS sensors through the router, one per
+# connection and reconnecting every few seconds; halfway through the last gateway is added and the router reloaded,
+# the sensors it takes over move to it as they reconnect. At the end every gateway reports what it received: the
+# totals add up to what the load generator sent, and only the sensors that moved were seen by two gateways.
+
+backends=${CLUSTER_BACKENDS:-3}
+sensors=${CLUSTER_SENSORS:-64}
+seconds=${CLUSTER_SECONDS:-10}
+rate=${CLUSTER_RATE:-50}
+router_port=${CLUSTER_PORT:-5650}
+backend_port=5660               # Gateway i listens on backend_port + i and serves its metrics on metrics_port + i.
+metrics_port=9110
+
+cd "$(dirname "$0")" || exit 1
+repo=$(pwd)
+work=$(mktemp -d)
+pids=()
+trap 'kill "${pids[@]}" 2> /dev/null; wait; rm -rf "$work"' EXIT
+
+metric() {
+    curl -s "http://127.0.0.1:$((metrics_port + $1))/metrics" | awk -v m="$2" '$1 == m { print $2 }'
+}
+
+cd "$work" || exit 1
+"$repo/file_creator" -n "$sensors" -d 0 > /dev/null # room_sensor.map
+for ((i = 0; i < backends; ++i)); do
+    mkdir "gw$i"
+    ln -s "$repo/lib" "gw$i/lib"
+    cp room_sensor.map "gw$i/"
+    (cd "gw$i" && exec "$repo/bench_gateway" -m $((metrics_port + i)) $((backend_port + i)) > gateway.out 2>&1) &
+    pids+=($!)
+    ((i < backends - 1)) && echo "127.0.0.1:$((backend_port + i))" >> backends
+done
+for ((i = 0; i < backends; ++i)); do
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "http://127.0.0.1:$((metrics_port + i))/metrics" && break
+        sleep 0.1
+    done
+done
+
+"$repo/sensor_router" "$router_port" backends > router.out 2>&1 &
+router=$!
+pids+=($router)
+sleep 0.2
+
+"$repo/sensor_loadgen" -n "$sensors" -c "$sensors" -t 2 -r "$rate" -C 2 -d "$seconds" -m room_sensor.map \
+    127.0.0.1 "$router_port" > loadgen.out &
+loadgen=$!
+sleep $((seconds / 2))
+echo "127.0.0.1:$((backend_port + backends - 1))" >> backends
+kill -HUP $router
+wait $loadgen
+sleep 1 # Let the router pass on what it still buffers.
+kill -USR1 $router
+sleep 0.2
+
+sent=$(sed -n 's/^sent \([0-9]*\) readings in.*/\1/p' loadgen.out)
+total=0
+for ((i = 0; i < backends; ++i)); do
+    received=$(metric $i gateway_readings_received_total)
+    opened=$(metric $i gateway_connections_opened_total)
+    ids=$(cut -d, -f1 "gw$i/data.csv" 2> /dev/null | sort -u | wc -l)
+    printf "gateway %d (port %d): %8d readings, %4d connections, %3d sensors\n" \
+        $i $((backend_port + i)) "${received:-0}" "${opened:-0}" "$ids"
+    total=$((total + ${received:-0}))
+    cut -d, -f1 "gw$i/data.csv" 2> /dev/null | sort -u >> seen
+done
+cat router.out
+echo "sent $sent readings, the gateways received $total, $(sort seen | uniq -d | wc -l) sensors moved"
+[ "$sent" = "$total" ]
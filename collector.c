@@ -0,0 +1,251 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "forward.h"
+#include "tsseg.h"
+#include "fmt.h"
+
+#define MAX_GATEWAYS 64
+#define SEEN_SIZE (1 << 16) // Frames remembered to drop the ones a gateway sent twice, must be a power of two.
+#define READ_SIZE (64 * 1024)
+
+/**
+ * A connected gateway and the bytes of its frame in progress.
+ */
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len, cap;
+} gateway_t;
+
+static volatile sig_atomic_t stop = 0;
+static gateway_t gateways[MAX_GATEWAYS];
+static uint64_t seen_epoch[SEEN_SIZE], seen_seq[SEEN_SIZE];
+static uint64_t frames, duplicates, readings, bytes, connections, errors;
+static FILE *out;
+static sensor_ts_t *points_ts;
+static sensor_value_t *points_value;
+static uint32_t points_cap;
+static char *rows;
+static size_t rows_cap;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static size_t seen_slot(uint64_t epoch, uint64_t seq) {
+    return (size_t) (epoch * 31 + seq) & (SEEN_SIZE - 1); // The frames of a run take consecutive slots.
+}
+
+/**
+ * Decodes a frame and appends its readings to the output as data.csv rows.
+ * \return 0 on success, -1 if the frame is corrupt
+ */
+static int frame_process(const uint8_t *frame, size_t len) {
+    uint64_t epoch, seq;
+    uint32_t n_readings, n_groups, total = 0;
+    memcpy(&epoch, frame + 8, sizeof(epoch));
+    memcpy(&seq, frame + 16, sizeof(seq));
+    memcpy(&n_readings, frame + 24, sizeof(n_readings));
+    memcpy(&n_groups, frame + 28, sizeof(n_groups));
+    size_t slot = seen_slot(epoch, seq);
+    if (seen_epoch[slot] == epoch && seen_seq[slot] == seq) {
+        duplicates++;
+        return 0;
+    }
+
+    size_t used = 0;
+    const uint8_t *p = frame + FORWARD_FRAME_HEADER, *end = frame + len;
+    for (uint32_t g = 0; g < n_groups; ++g) {
+        sensor_id_t id;
+        uint32_t count, nbytes;
+        if (end - p < FORWARD_GROUP_HEADER) return -1;
+        memcpy(&id, p, sizeof(id));
+        memcpy(&count, p + 4, sizeof(count));
+        memcpy(&nbytes, p + 8, sizeof(nbytes));
+        p += FORWARD_GROUP_HEADER;
+        if (count == 0 || nbytes > (size_t) (end - p) || count > n_readings - total) return -1;
+        if (count > points_cap) {
+            points_cap = count;
+            points_ts = realloc(points_ts, points_cap * sizeof(sensor_ts_t));
+            points_value = realloc(points_value, points_cap * sizeof(sensor_value_t));
+            ERROR_HANDLER(points_ts == NULL || points_value == NULL, "Points realloc failed.");
+        }
+        if (tsseg_unpack(p, nbytes, count, points_ts, points_value) != TSSEG_SUCCESS) return -1;
+        if (rows_cap - used < (size_t) count * FMT_ROW_MAX) {
+            rows_cap = used + (size_t) count * FMT_ROW_MAX * 2;
+            rows = realloc(rows, rows_cap);
+            ERROR_HANDLER(rows == NULL, "Rows realloc failed.");
+        }
+        for (uint32_t k = 0; k < count; ++k) used = fmt_row(rows + used, id, points_value[k], points_ts[k]) - rows;
+        total += count;
+        p += nbytes;
+    }
+    if (total != n_readings || p != end) return -1;
+    ERROR_HANDLER(fwrite(rows, 1, used, out) != used, "Output write failed.");
+    seen_epoch[slot] = epoch;
+    seen_seq[slot] = seq;
+    frames++;
+    readings += total;
+    bytes += len;
+    return 0;
+}
+
+static void gateway_close(gateway_t *g) {
+    close(g->fd);
+    g->fd = -1;
+    g->len = 0;
+}
+
+/**
+ * Reads what a gateway sent and answers every complete frame with its seq.
+ */
+static void gateway_read(gateway_t *g) {
+    if (g->cap - g->len < READ_SIZE) {
+        g->cap = g->cap ? g->cap * 2 : READ_SIZE * 2;
+        g->buf = realloc(g->buf, g->cap);
+        ERROR_HANDLER(g->buf == NULL, "Buffer realloc failed.");
+    }
+    ssize_t n = recv(g->fd, g->buf + g->len, g->cap - g->len, 0);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) {
+        gateway_close(g);
+        return;
+    }
+    g->len += n;
+
+    size_t off = 0;
+    while (g->len - off >= FORWARD_FRAME_HEADER) {
+        uint32_t magic, payload;
+        memcpy(&magic, g->buf + off, sizeof(magic));
+        memcpy(&payload, g->buf + off + 4, sizeof(payload));
+        if (magic != FORWARD_FRAME_MAGIC) {
+            errors++;
+            gateway_close(g);
+            return;
+        }
+        size_t len = FORWARD_FRAME_HEADER + (size_t) payload;
+        if (g->len - off < len) break;
+        if (frame_process(g->buf + off, len) != 0) {
+            errors++;
+            gateway_close(g);
+            return;
+        }
+        if (send(g->fd, g->buf + off + 16, FORWARD_ACK_SIZE, MSG_NOSIGNAL) != FORWARD_ACK_SIZE) {
+            gateway_close(g);
+            return;
+        }
+        off += len;
+    }
+    fflush(out);
+    memmove(g->buf, g->buf + off, g->len - off);
+    g->len -= off;
+}
+
+static void print_help(void) {
+    printf("Use this program as: collector [options] <port>\n");
+    printf("\t%-10s : file the readings are appended to as data.csv rows (default collector.csv)\n", "-o file");
+    printf("A stand-in for the upstream of sensor_gateway -f, prints what it received on SIGINT or SIGTERM.\n");
+}
+
+/**
+ * Receives the frames of forwarding gateways, see forward.h, acknowledges each one and writes its readings out.
+ * Frames a gateway sends again after a broken connection are acknowledged but written only once.
+ */
+int main(int argc, char *argv[]) {
+    const char *path = "collector.csv";
+    int opt;
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    out = fopen(path, "a");
+    ERROR_HANDLER(out == NULL, "Could not open the output file.");
+
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(lfd == -1, "Socket creation failed.");
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[optind]));
+    ERROR_HANDLER(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0, "Bind failed.");
+    ERROR_HANDLER(listen(lfd, MAX_GATEWAYS) != 0, "Listen failed.");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    for (int i = 0; i < MAX_GATEWAYS; ++i) gateways[i].fd = -1;
+
+    while (!stop) {
+        struct pollfd pfds[MAX_GATEWAYS + 1];
+        int slot[MAX_GATEWAYS + 1], n = 0;
+        pfds[n++] = (struct pollfd) {lfd, POLLIN, 0};
+        for (int i = 0; i < MAX_GATEWAYS; ++i) {
+            if (gateways[i].fd == -1) continue;
+            slot[n] = i;
+            pfds[n++] = (struct pollfd) {gateways[i].fd, POLLIN, 0};
+        }
+        if (poll(pfds, n, 200) <= 0) continue;
+        for (int k = 1; k < n; ++k) {
+            if (pfds[k].revents) gateway_read(&gateways[slot[k]]);
+        }
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd == -1) continue;
+            int i = 0;
+            while (i < MAX_GATEWAYS && gateways[i].fd != -1) i++;
+            if (i == MAX_GATEWAYS) {
+                close(fd);
+                continue;
+            }
+            gateways[i].fd = fd;
+            gateways[i].len = 0;
+            connections++;
+        }
+    }
+
+    for (int i = 0; i < MAX_GATEWAYS; ++i) {
+        if (gateways[i].fd != -1) gateway_close(&gateways[i]);
+        free(gateways[i].buf);
+    }
+    close(lfd);
+    fclose(out);
+    free(points_ts);
+    free(points_value);
+    free(rows);
+    printf("received %" PRIu64 " frames (%" PRIu64 " duplicates), %" PRIu64 " readings, %" PRIu64 " bytes, "
+           "%" PRIu64 " connections, %" PRIu64 " errors\n", frames, duplicates, readings, bytes, connections, errors);
+    return EXIT_SUCCESS;
+}
@@ -7,6 +7,9 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <stdatomic.h>
+
+#include "trace.h"
 
 /*
  * Use ERROR_HANDLER() for handling memory allocation problems, invalid sensor IDs, non-existing files, etc.
@@ -18,6 +21,10 @@
                       }                                             \
                     } while(0)
 
+/*
+ * DEBUG_PRINTF() is only compiled in with -DDEBUG, the gateway traces into trace.h rings instead.
+ */
+#ifdef DEBUG
 #define DEBUG_PRINTF(...) 									                                        \
         do {											                                            \
             fprintf(stdout,"\n%s:%s():%d: ", __FILE__, __func__, __LINE__);	    \
@@ -25,6 +32,9 @@
             fprintf(stdout, "\n");                                                               \
             fflush(stdout);                                                                         \
                 } while(0)
+#else
+#define DEBUG_PRINTF(...) (void)0
+#endif
 
 typedef uint16_t sensor_id_t;
 typedef double sensor_value_t;
@@ -35,6 +45,11 @@ typedef struct {
     sensor_id_t id;
     sensor_value_t value;
     sensor_ts_t ts;
+    uint64_t seq; // Sequence number given by the write-ahead log, 0 if the reading was not logged.
+    // CLOCK_MONOTONIC ns at which each stage saw the reading, for the latency metrics.
+    int64_t rx_ns; // connmgr received it, 0 if it did not come from a socket.
+    int64_t buf_ns; // It was appended to the shared buffer.
+    _Atomic int64_t dm_ns; // The datamgr processed it, read by the DB thread for sampled traces.
 } sensor_data_t;
 
 
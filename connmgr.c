@@ -1,6 +1,7 @@
 /**
  * \author Nicolas Gutierrez Suarez
  */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +15,10 @@
 #include "sensor_db.h"
 #include "lib/tcpsock.h"
 #include "sbuffer.h"
+#include "wal.h"
+#include "metrics.h"
+#include "capture.h"
+#include "placement.h"
 
 /**
  * Listens for data and inserts it into the shared buffer. Logs the events.
@@ -27,8 +32,9 @@ static void *connmgr_socket_start(void *_client) {
 
     bool is_logged = false; // State variable to only log the connection once.
     sensor_id_t id = 0; // Saving this id so if the connection stops, the id persists.
+    uint32_t cap = capture_conn_open(); // Its number in the capture, if the traffic is captured.
 
-    DEBUG_PRINTF("Connection started: %lu", pthread_self());
+    TRACE_INFO("Connection started: %lu", pthread_self());
 
     do {
         int result; // Save the result of tcp_receive.
@@ -40,6 +46,7 @@ static void *connmgr_socket_start(void *_client) {
         bytes = sizeof(sensor_id_t);
         result = tcp_receive(client, (void *) &data->id, &bytes, DTIMEOUT);
         ERROR_HANDLER(result == TCP_SOCKET_ERROR, "Error reading TCP data.");
+        if (bytes > 0) metrics_add(METRIC_CONN_BYTES, bytes);
 
         if (!is_logged) {
             // This runs once, when the connection begins, and logs the ID of the sensor connected.
@@ -52,29 +59,46 @@ static void *connmgr_socket_start(void *_client) {
         bytes = sizeof(data->value);
         result = tcp_receive(client, (void *) &data->value, &bytes, DTIMEOUT);
         ERROR_HANDLER(result == TCP_SOCKET_ERROR, "Error reading TCP data.");
+        if (bytes > 0) metrics_add(METRIC_CONN_BYTES, bytes);
 
         // Read timestamp
         bytes = sizeof(data->ts);
         result = tcp_receive(client, (void *) &data->ts, &bytes, DTIMEOUT);
+        if (bytes > 0) metrics_add(METRIC_CONN_BYTES, bytes);
 
         // Three distinct cases, if the client disconnects, we log it together with its ID.
         if (result == TCP_CONNECTION_CLOSED) {
-            DEBUG_PRINTF("Peer has closed connection.");
+            TRACE_INFO("Peer has closed connection.");
             log_pipe_write(LOG_CLOSED_CONNECTION, id, 0);
+            metrics_add(METRIC_CONN_CLOSED, 1);
+            capture_conn_close(cap);
             break;
         }
         // By setting SO_RCVTIMEO to the DTIMEOUT set in the preprocessor, if the client takes longer than
         // DTIMEOUT, the socket sets errno to EAGAIN.
         else if (errno == EAGAIN) {
-            DEBUG_PRINTF("Peer has timed-out.");
+            TRACE_INFO("Peer has timed-out.");
             log_pipe_write(LOG_TIMEOUT, id, 0);
+            metrics_add(METRIC_CONN_TIMEOUTS, 1);
+            metrics_add(METRIC_CONN_CLOSED, 1);
+            capture_conn_close(cap);
             break;
         }
         // If the bytes != 0 and result is not an error then we can insert that data to the buffer.
         else if ((result == TCP_NO_ERROR) && bytes) {
-            DEBUG_PRINTF("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld",
-                         data->id, data->value, (long int) data->ts);
-            sbuffer_insert(data);
+            TRACE_DEBUG("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld",
+                        data->id, data->value, (long int) data->ts);
+            metrics_add(METRIC_CONN_READINGS, 1);
+            data->rx_ns = metrics_now();
+            if (capture_on) {
+                // The bytes as they came in, tcp_receive() copied them into the fields unchanged.
+                unsigned char raw[sizeof(data->id) + sizeof(data->value) + sizeof(data->ts)];
+                memcpy(raw, &data->id, sizeof(data->id));
+                memcpy(raw + sizeof(data->id), &data->value, sizeof(data->value));
+                memcpy(raw + sizeof(data->id) + sizeof(data->value), &data->ts, sizeof(data->ts));
+                capture_conn_data(cap, raw, sizeof(raw));
+            }
+            wal_ingest(data);
         }
     } while (1);
 
@@ -87,12 +111,14 @@ void *connmgr_startup(void *port) {
     tcpsock_t *server, *client;
     int conn_counter = 0;
 
-    DEBUG_PRINTF("Server startup. %lu", pthread_self());
+    placement_apply(PLACEMENT_IO); // The connection threads inherit the cpus.
+    TRACE_INFO("Server startup. %lu", pthread_self());
     ERROR_HANDLER((tcp_passive_open(&server, *((int *) port)) != TCP_NO_ERROR), "Error opening TCP connection.");
     do {
 
         ERROR_HANDLER(tcp_wait_for_connection(server, &client) != TCP_NO_ERROR, "Error connecting to client");
-        DEBUG_PRINTF("Incoming client connection.");
+        TRACE_INFO("Incoming client connection.");
+        metrics_add(METRIC_CONN_OPENED, 1);
 
         // Start a new thread whenever there is a new incoming connection. Stop when the connection counter == D_MAX_CONN
         pthread_create(&tid[conn_counter], NULL, connmgr_socket_start, client);
@@ -105,7 +131,7 @@ void *connmgr_startup(void *port) {
     }
     ERROR_HANDLER(tcp_close(&server) != TCP_NO_ERROR, "Error closing TCP server.");
 
-    DEBUG_PRINTF("Server is shutting down.");
+    TRACE_INFO("Server is shutting down.");
 
     // Insert an EOF marker to the buffer.
     sensor_data_t *data = malloc(sizeof(sensor_data_t));
@@ -0,0 +1,94 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <float.h>
+
+#include "config.h"
+#include "csvindex.h"
+#include "fmt.h"
+
+/**
+ * State shared with the row callback.
+ */
+typedef struct {
+    long sensor;        // -1 for every sensor
+    int aggregate;
+    uint64_t count;
+    double sum, min, max;
+} range_query_t;
+
+static void print_help(void);
+
+static void range_row(sensor_id_t id, sensor_value_t value, sensor_ts_t ts, void *arg) {
+    range_query_t *q = arg;
+    if (q->sensor >= 0 && id != q->sensor) return;
+    q->count++;
+    if (q->aggregate) {
+        q->sum += value;
+        if (value < q->min) q->min = value;
+        if (value > q->max) q->max = value;
+        return;
+    }
+    char row[FMT_ROW_MAX];
+    fwrite(row, 1, fmt_row(row, id, value, ts) - row, stdout);
+}
+
+/**
+ * Reads a time range from the csv data segments through the sparse index data.idx, for example:
+ *   csv_range -s 37 -f 1672531200 -t 1672532100 -a
+ */
+int main(int argc, char *argv[]) {
+    range_query_t q = {-1, 0, 0, 0, DBL_MAX, -DBL_MAX};
+    const char *index = CSVINDEX_FILE_NAME;
+    sensor_ts_t from = INT64_MIN, to = INT64_MAX;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:f:t:i:ah")) != -1) {
+        switch (opt) {
+            case 's':
+                q.sensor = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                from = strtoll(optarg, NULL, 10);
+                break;
+            case 't':
+                to = strtoll(optarg, NULL, 10);
+                break;
+            case 'i':
+                index = optarg;
+                break;
+            case 'a':
+                q.aggregate = 1;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    long rows = csvindex_read_range(index, from, to, range_row, &q);
+    ERROR_HANDLER(rows == CSVINDEX_FAILURE, "Could not read the index.");
+    if (q.aggregate) {
+        if (q.count) printf("count=%" PRIu64 " avg=%g min=%g max=%g\n", q.count, q.sum / q.count, q.min, q.max);
+        else printf("count=0\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+static void print_help(void) {
+    printf("Use this program as: csv_range [options], in the directory of the gateway\n");
+    printf("\t%-10s : only readings of this sensor\n", "-s id");
+    printf("\t%-10s : only readings with ts >= t0\n", "-f t0");
+    printf("\t%-10s : only readings with ts <= t1\n", "-t t1");
+    printf("\t%-10s : index file (default %s)\n", "-i file", CSVINDEX_FILE_NAME);
+    printf("\t%-10s : print count/avg/min/max instead of the readings\n", "-a");
+}
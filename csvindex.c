@@ -0,0 +1,100 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csvindex.h"
+
+void csvindex_segment_name(char *buf, size_t size, uint32_t segment) {
+    if (segment == 0) snprintf(buf, size, "data.csv");
+    else snprintf(buf, size, "data-%06u.csv", segment);
+}
+
+int csvindex_append(int fd, const csvindex_entry_t *entry) {
+    return write(fd, entry, sizeof(*entry)) == sizeof(*entry) ? CSVINDEX_SUCCESS : CSVINDEX_FAILURE;
+}
+
+/**
+ * Parses the rows of one batch and passes the ones inside [t0, t1] on. Only rows ending in a newline are complete,
+ * parsing stops at a row cut off by a short read or a crash, like csv_complete_rows() cuts it off a data file.
+ * @return the number of rows passed to the callback
+ */
+static long csvindex_parse(char *buf, sensor_ts_t t0, sensor_ts_t t1,
+                           void (*callback)(sensor_id_t, sensor_value_t, sensor_ts_t, void *), void *arg) {
+    long found = 0;
+    char *p = buf, *end;
+    while (*p) {
+        unsigned long id = strtoul(p, &end, 10);
+        if (*end != ',') break;
+        sensor_value_t value = strtod(end + 1, &end);
+        if (*end != ',') break;
+        sensor_ts_t ts = strtoll(end + 1, &end, 10);
+        if (*end != '\n') break; // A torn tail, its timestamp may be missing digits.
+        p = end + 1;
+        if (ts < t0 || ts > t1) continue;
+        callback((sensor_id_t) id, value, ts, arg);
+        found++;
+    }
+    return found;
+}
+
+long csvindex_read_range(const char *index_path, sensor_ts_t t0, sensor_ts_t t1,
+                         void (*callback)(sensor_id_t id, sensor_value_t value, sensor_ts_t ts, void *arg),
+                         void *arg) {
+    int idx_fd = open(index_path, O_RDONLY);
+    if (idx_fd == -1) return CSVINDEX_FAILURE;
+    struct stat st;
+    if (fstat(idx_fd, &st) != 0) {
+        close(idx_fd);
+        return CSVINDEX_FAILURE;
+    }
+    size_t n_entries = st.st_size / sizeof(csvindex_entry_t); // A torn last entry is ignored.
+    if (n_entries == 0) {
+        close(idx_fd);
+        return 0;
+    }
+    const csvindex_entry_t *entries = mmap(NULL, n_entries * sizeof(csvindex_entry_t), PROT_READ, MAP_PRIVATE,
+                                           idx_fd, 0);
+    close(idx_fd);
+    if (entries == MAP_FAILED) return CSVINDEX_FAILURE;
+
+    long found = 0;
+    int data_fd = -1;
+    uint32_t open_segment = 0;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    for (size_t i = 0; i < n_entries; ++i) {
+        const csvindex_entry_t *e = &entries[i];
+        if (e->ts_max < t0 || e->ts_min > t1) continue; // The whole batch is outside the range.
+
+        if (data_fd == -1 || e->segment != open_segment) {
+            char name[64];
+            csvindex_segment_name(name, sizeof(name), e->segment);
+            if (data_fd != -1) close(data_fd);
+            data_fd = open(name, O_RDONLY);
+            open_segment = e->segment;
+            if (data_fd == -1) continue; // Deleted by retention, or not written yet.
+        }
+        if (e->length + 1 > buf_cap) {
+            buf_cap = e->length + 1;
+            buf = realloc(buf, buf_cap);
+            ERROR_HANDLER(buf == NULL, "Batch buffer realloc failed.");
+        }
+        ssize_t n = pread(data_fd, buf, e->length, (off_t) e->offset);
+        if (n <= 0) continue;
+        buf[n] = '\0';
+        found += csvindex_parse(buf, t0, t1, callback, arg);
+    }
+
+    if (data_fd != -1) close(data_fd);
+    free(buf);
+    munmap((void *) entries, n_entries * sizeof(csvindex_entry_t));
+    return found;
+}
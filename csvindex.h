@@ -0,0 +1,55 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _CSVINDEX_H_
+#define _CSVINDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "config.h"
+
+#define CSVINDEX_SUCCESS 0
+#define CSVINDEX_FAILURE -1
+
+#define CSVINDEX_FILE_NAME "data.idx"
+
+/**
+ * One entry of the sparse time index: where a written batch of rows lives and which timestamps it holds.
+ * The csv backend appends one entry per flushed batch, so a time range can be read by seeking straight to the
+ * batches that overlap it.
+ */
+typedef struct {
+    uint32_t segment;       /**< number of the data file, see csvindex_segment_name() */
+    uint32_t rows;          /**< rows in the batch */
+    uint64_t offset;        /**< byte offset of the batch in the data file */
+    uint64_t length;        /**< bytes of the batch */
+    int64_t ts_min;         /**< oldest timestamp in the batch */
+    int64_t ts_max;         /**< newest timestamp in the batch */
+} csvindex_entry_t;
+
+/**
+ * Writes the file name of data segment 'segment' into 'buf': segment 0 is the unrotated data.csv, rotated
+ * segments are data-000001.csv, data-000002.csv, ...
+ */
+void csvindex_segment_name(char *buf, size_t size, uint32_t segment);
+
+/**
+ * Appends an entry to the index file 'fd'.
+ * \return CSVINDEX_SUCCESS or CSVINDEX_FAILURE
+ */
+int csvindex_append(int fd, const csvindex_entry_t *entry);
+
+/**
+ * Calls 'callback' for every row with t0 <= ts <= t1, in the order they were written. Only the batches whose
+ * index entry overlaps [t0, t1] are read.
+ * \param index_path the index file, normally CSVINDEX_FILE_NAME
+ * \param callback called for each matching row, with 'arg' passed through
+ * \return the number of rows passed to the callback, CSVINDEX_FAILURE if the index cannot be read
+ */
+long csvindex_read_range(const char *index_path, sensor_ts_t t0, sensor_ts_t t1,
+                         void (*callback)(sensor_id_t id, sensor_value_t value, sensor_ts_t ts, void *arg),
+                         void *arg);
+
+#endif //_CSVINDEX_H_
@@ -8,23 +8,23 @@
 #include <memory.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "lib/dplist.h"
 #include "config.h"
 #include "datamgr.h"
+#include "datamgr_kernels.h"
 #include "sensor_db.h"
 #include "sbuffer.h"
+#include "tsstore.h"
+#include "metrics.h"
+#include "placement.h"
+#include "pubsub.h"
 
 #define SENSOR_MAP_NAME "room_sensor.map"
 
 static dplist_t *data_list; // Static global so no other process can access it.
-
-struct element {
-    sensor_id_t sensor_id;
-    int room_id; // Why is this even here?
-    sensor_value_t data_queue[RUN_AVG_LENGTH];
-    sensor_ts_t last_modified;
-}; // The data queue should only keep the number of elements needed.
+static atomic_uint_fast64_t nodes_read = 0; // Nodes of the buffer read, the datamgr is done with all but the last.
 
 /**
  * The callback to delete the element in a node.
@@ -42,25 +42,14 @@ static void datamgr_free() {
     ERROR_HANDLER(data_list != NULL, "Error freeing list");
 }
 
-/**
- * This function gets the average for all the saved values in a list.
- * @param data_queue the list of saved values
- * @return The average of all readings.
- */
-static sensor_value_t datamgr_get_avg(sensor_value_t const data_queue[RUN_AVG_LENGTH]) {
-    float cum_sum = 0;
-    for (int j = 0; j < RUN_AVG_LENGTH; ++j) {
-        cum_sum += data_queue[j];
-    }
-    return cum_sum / (float) RUN_AVG_LENGTH; // If you don't cast it, it truncates the decimals.
-}
-
 void *datamgr_init() {
     struct sensor_mapping {
         int room_id;
         int sensor_id;
     } sm; // Simple struct to hold the "key-value" pairs.
 
+    placement_apply(PLACEMENT_DATAMGR); // Before the sensor list is allocated, so it lands on the local node.
+
     // Open the sensor map, create the list to hold the data.
     FILE *fp_sensor_map = fopen(SENSOR_MAP_NAME, "r");
     ERROR_HANDLER(!fp_sensor_map, "Map file not read correctly.");
@@ -84,7 +73,7 @@ void *datamgr_init() {
 
         dpl_insert_at_index(data_list, el, 0);
     }
-    DEBUG_PRINTF("Started Data Manager");
+    TRACE_INFO("Started Data Manager");
 
     sbuffer_node_t *node = NULL; //This makes the datamgr remember its last position.
     sensor_data_t *data;
@@ -95,45 +84,43 @@ void *datamgr_init() {
             if (res != SBUFFER_NO_DATA) break;
             usleep(1); // Requires GNU_SOURCE
         } while (1);
+        atomic_fetch_add_explicit(&nodes_read, 1, memory_order_release);
 
         if (data->id == 0) break; // Stop if EOF in buffer.
+        metrics_add(METRIC_SBUFFER_READ_DATAMGR, 1);
+        int64_t now = metrics_now();
+        atomic_store_explicit(&data->dm_ns, now, memory_order_relaxed);
+        metrics_observe(METRIC_INSERT_TO_DATAMGR_NS, now - data->buf_ns);
 
-        // Find matching sensor id in list and store its index in idx.
-        element_t *tmp;
-        int found = false;
-        for (int i = 0; i < dpl_size(data_list); ++i) {
-            tmp = (element_t *) dpl_get_element_at_index(data_list, i);
-            if (tmp->sensor_id == data->id) {
-                found = true;
-                break;
-            }
-        }
+        // Find the matching sensor id in the list.
+        element_t *tmp = datamgr_find(data_list, data->id);
 
         // If the sensor exists, insert the newest data to the array, calculate the running average, and check
         // if it surpasses the preset limits.
-        if (found) {
-            DEBUG_PRINTF("Datum read: %i %f %li", data->id, data->value, data->ts);
+        if (tmp != NULL) {
+            TRACE_DEBUG("Datum read: %i %f %li", data->id, data->value, data->ts);
+            metrics_add(METRIC_DATAMGR_READINGS, 1);
 
-            // We shift the queue right and insert the newest value at the initial position.
-            for (int i = RUN_AVG_LENGTH - 1; i > 0; --i) {
-                tmp->data_queue[i] = tmp->data_queue[i - 1];
-            }
-            tmp->data_queue[0] = data->value;
-            tmp->last_modified = data->ts;
+            sensor_value_t avg = datamgr_add_reading(tmp, data->value, data->ts);
+            tsstore_insert(data->id, data->value, data->ts); // Keep the reading for range queries.
+            pubsub_publish(PUBSUB_READING, data->id, data->value, data->ts); // Ahead of the alerts it raises.
 
             // Check the average of the newly updated queue. Log them if they are outside the set range.
-            sensor_value_t avg = datamgr_get_avg(tmp->data_queue);
             if (avg > DSET_MAX_TEMP) {
-                DEBUG_PRINTF("Sensor %i too hot %f > %d", data->id, avg, DSET_MAX_TEMP);
+                TRACE_DEBUG("Sensor %i too hot %f > %d", data->id, avg, DSET_MAX_TEMP);
                 log_pipe_write(LOG_TOO_HOT, data->id, avg);
+                metrics_add(METRIC_DATAMGR_TOO_HOT, 1);
             } else if (avg < DSET_MIN_TEMP) {
-                DEBUG_PRINTF("Sensor %i too cold %f < %d", data->id, avg, DSET_MIN_TEMP);
+                TRACE_DEBUG("Sensor %i too cold %f < %d", data->id, avg, DSET_MIN_TEMP);
                 log_pipe_write(LOG_TOO_COLD, data->id, avg);
+                metrics_add(METRIC_DATAMGR_TOO_COLD, 1);
             }
         } else {
             // Log that the sensor id is wrong.
-            DEBUG_PRINTF("Sensor %i not in map", data->id);
+            TRACE_DEBUG("Sensor %i not in map", data->id);
+            pubsub_publish(PUBSUB_READING, data->id, data->value, data->ts);
             log_pipe_write(LOG_INVALID_ID, data->id, 0);
+            metrics_add(METRIC_DATAMGR_INVALID_ID, 1);
         }
     } while (1);
 
@@ -141,4 +128,8 @@ void *datamgr_init() {
     pthread_exit(NULL);
 }
 
+uint64_t datamgr_nodes_read() {
+    return atomic_load_explicit(&nodes_read, memory_order_acquire);
+}
+
 
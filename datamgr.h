@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "config.h"
 
@@ -32,4 +33,10 @@ typedef struct element element_t;
  */
 void *datamgr_init();
 
+/**
+ * \return the number of nodes of the shared buffer the datamgr has read, see sbuffer_appended(). Can be called from
+ * any thread.
+ */
+uint64_t datamgr_nodes_read();
+
 #endif  //DATAMGR_H_
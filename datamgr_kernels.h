@@ -0,0 +1,62 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef DATAMGR_KERNELS_H_
+#define DATAMGR_KERNELS_H_
+
+#include "lib/dplist.h"
+#include "datamgr.h"
+
+struct element {
+    sensor_id_t sensor_id;
+    int room_id; // Why is this even here?
+    sensor_value_t data_queue[RUN_AVG_LENGTH];
+    sensor_ts_t last_modified;
+}; // The data queue should only keep the number of elements needed.
+
+/*
+ * The work the datamgr does on every reading. It is here so that micro_bench times the code the gateway runs.
+ * Include lib/dplist.h before anything that includes stdbool.h, it brings its own bool.
+ */
+
+/**
+ * This function gets the average for all the saved values in a list.
+ * @param data_queue the list of saved values
+ * @return The average of all readings.
+ */
+static inline sensor_value_t datamgr_get_avg(sensor_value_t const data_queue[RUN_AVG_LENGTH]) {
+    float cum_sum = 0;
+    for (int j = 0; j < RUN_AVG_LENGTH; ++j) {
+        cum_sum += data_queue[j];
+    }
+    return cum_sum / (float) RUN_AVG_LENGTH; // If you don't cast it, it truncates the decimals.
+}
+
+/**
+ * Finds the element of a sensor in the list built from the sensor map.
+ * @return the element, or NULL if the sensor is not in the map
+ */
+static inline element_t *datamgr_find(dplist_t *list, sensor_id_t id) {
+    for (int i = 0; i < dpl_size(list); ++i) {
+        element_t *tmp = (element_t *) dpl_get_element_at_index(list, i);
+        if (tmp->sensor_id == id) return tmp;
+    }
+    return NULL;
+}
+
+/**
+ * Inserts the newest reading of a sensor into its queue.
+ * @return the running average with the reading
+ */
+static inline sensor_value_t datamgr_add_reading(element_t *el, sensor_value_t value, sensor_ts_t ts) {
+    // We shift the queue right and insert the newest value at the initial position.
+    for (int i = RUN_AVG_LENGTH - 1; i > 0; --i) {
+        el->data_queue[i] = el->data_queue[i - 1];
+    }
+    el->data_queue[0] = value;
+    el->last_modified = ts;
+    return datamgr_get_avg(el->data_queue);
+}
+
+#endif  //DATAMGR_KERNELS_H_
@@ -0,0 +1,245 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "sensor_db.h"
+#include "csvindex.h"
+#include "dbwriter.h"
+#include "fmt.h"
+
+static int db_fd = -1; // The file descriptor of the current data segment.
+static int idx_fd = -1; // The file descriptor of the sparse time index.
+static uint32_t segment = 0; // Number of the current data segment, 0 is data.csv when rotation is off.
+static uint64_t segment_size = 0;
+static long segment_window = 0; // The DB_ROTATE_WINDOW the current segment belongs to.
+
+static dbwriter_t *writer = NULL; // Writes the batches in the background, owns the buffers.
+static pthread_mutex_t writer_mtx = PTHREAD_MUTEX_INITIALIZER; // Guards 'writer' against csv_stats().
+static char *db_buf = NULL; // Rows waiting for the next group commit, the current buffer of the writer.
+static size_t db_buf_len = 0;
+static csvindex_entry_t batch; // Index entry of the rows in db_buf.
+
+static bool csv_rotating() {
+    return DB_ROTATE_SIZE > 0 || DB_ROTATE_WINDOW > 0;
+}
+
+static long csv_window() {
+    return DB_ROTATE_WINDOW > 0 ? (long) time(NULL) / DB_ROTATE_WINDOW : 0;
+}
+
+/**
+ * Parses the name of a rotated data segment. Only the exact names csvindex_segment_name() gives are accepted, so
+ * data-NNNNNN.csv.bak, data-<time>.seg or a data-1.csv of someone else are never taken for one of ours.
+ * @return true and the number in 'n' if 'name' is a rotated segment
+ */
+static bool csv_segment_number(const char *name, uint32_t *n) {
+    char expected[64];
+    int end = 0;
+    if (sscanf(name, "data-%u.csv%n", n, &end) != 1 || end == 0 || name[end] != '\0' || *n == 0) return false;
+    csvindex_segment_name(expected, sizeof(expected), *n);
+    return strcmp(name, expected) == 0;
+}
+
+/**
+ * Finds the highest numbered data segment in the working directory, so a restart continues after it.
+ */
+static uint32_t csv_last_segment() {
+    uint32_t last = 0, n;
+    DIR *dir = opendir(".");
+    if (dir == NULL) return 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (csv_segment_number(ent->d_name, &n) && n > last) last = n;
+    }
+    closedir(dir);
+    return last;
+}
+
+/**
+ * Cuts a row torn by a crash off the end of a data file that is continued.
+ * @return the size of the file up to its last complete row, -1 on an error
+ */
+static off_t csv_complete_rows(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    char tail[FMT_ROW_MAX];
+    off_t end = st.st_size;
+    while (end > 0) {
+        size_t n = end < (off_t) sizeof(tail) ? (size_t) end : sizeof(tail);
+        if (pread(fd, tail, n, end - n) != (ssize_t) n) return -1;
+        char *nl = memrchr(tail, '\n', n);
+        end -= n;
+        if (nl != NULL) {
+            end += nl - tail + 1;
+            break;
+        }
+    }
+    return end != st.st_size && ftruncate(fd, end) != 0 ? -1 : end;
+}
+
+/**
+ * Drops a torn last entry of the index and the entries of batches a crash kept out of the continued data file.
+ * @return 0 on success, -1 on an error
+ */
+static int csv_index_trim(off_t data_size) {
+    struct stat st;
+    if (fstat(idx_fd, &st) != 0) return -1;
+    off_t size = st.st_size - st.st_size % (off_t) sizeof(csvindex_entry_t);
+    csvindex_entry_t e;
+    while (size > 0 && pread(idx_fd, &e, sizeof(e), size - sizeof(e)) == sizeof(e) && e.segment == segment &&
+           e.offset + e.length > (uint64_t) data_size) {
+        size -= sizeof(e);
+    }
+    return size != st.st_size && ftruncate(idx_fd, size) != 0 ? -1 : 0;
+}
+
+static int csv_open_segment() {
+    char name[64];
+    csvindex_segment_name(name, sizeof(name), segment);
+    // Without rotation there is one data.csv per run, as before, unless the last run crashed: the WAL only replays
+    // what came after the checkpoint, the rows before it are in data.csv. A backfill adds to it as well. Rotated
+    // segments are never overwritten.
+    bool keep = !csv_rotating() && db_continuing();
+    db_fd = open(name, (keep ? O_RDWR : O_WRONLY) | O_CREAT | (csv_rotating() ? O_EXCL : keep ? 0 : O_TRUNC), 0644);
+    if (db_fd == -1) return -1;
+    segment_size = 0;
+    if (keep) {
+        off_t size = csv_complete_rows(db_fd);
+        if (size == -1) return -1;
+        segment_size = size;
+    }
+    segment_window = csv_window();
+    log_data_file(LOG_NEW_DATA_FILE, DB_STORE_CSV, segment);
+    return 0;
+}
+
+static int csv_close_segment() {
+    int res = dbwriter_drain(writer) == DBWRITER_SUCCESS ? 0 : -1; // Nothing may still be queued for db_fd.
+    if (close(db_fd) != 0) res = -1;
+    db_fd = -1;
+    log_data_file(LOG_DATA_FILE_CLOSED, DB_STORE_CSV, segment);
+    return res;
+}
+
+/**
+ * Deletes the closed segments whose last write is older than DB_RAW_RETENTION. Long ranges are answered from the
+ * rollups, which are kept. Index entries of deleted segments stay, readers skip segments that are gone.
+ */
+static void csv_prune() {
+    DIR *dir = opendir(".");
+    if (dir == NULL) return;
+    time_t limit = time(NULL) - DB_RAW_RETENTION;
+    struct dirent *ent;
+    struct stat st;
+    uint32_t n;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!csv_segment_number(ent->d_name, &n) || n >= segment) continue;
+        if (stat(ent->d_name, &st) == 0 && st.st_mtime < limit && unlink(ent->d_name) == 0) {
+            TRACE_INFO("Segment data-%u.csv is past the raw retention, deleted.", n);
+        }
+    }
+    closedir(dir);
+}
+
+static int csv_rotate() {
+    if (csv_close_segment() != 0) return -1;
+    segment++;
+    if (DB_RAW_RETENTION > 0) csv_prune();
+    return csv_open_segment();
+}
+
+static int csv_open() {
+    // The index goes with data.csv: kept when that is continued, and always when segments rotate.
+    bool keep = csv_rotating() || db_continuing();
+    idx_fd = open(CSVINDEX_FILE_NAME, O_RDWR | O_CREAT | O_APPEND | (keep ? 0 : O_TRUNC), 0644);
+    if (idx_fd == -1) return -1;
+    segment = csv_rotating() ? csv_last_segment() + 1 : 0;
+    pthread_mutex_lock(&writer_mtx);
+    writer = dbwriter_create(DB_FLUSH_SIZE + FMT_ROW_MAX, DB_WRITER_BUFFERS, &db_buf);
+    pthread_mutex_unlock(&writer_mtx);
+    db_buf_len = 0;
+    batch.rows = 0;
+    if (csv_open_segment() != 0) return -1;
+    return keep ? csv_index_trim(segment_size) : 0;
+}
+
+static int csv_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    if (batch.rows == 0 || ts < batch.ts_min) batch.ts_min = ts;
+    if (batch.rows == 0 || ts > batch.ts_max) batch.ts_max = ts;
+    batch.rows++;
+    db_buf_len = fmt_row(db_buf + db_buf_len, id, value, ts) - db_buf;
+    return 0;
+}
+
+static bool csv_full() {
+    return db_buf_len >= DB_FLUSH_SIZE;
+}
+
+/**
+ * Hands the buffered rows to the writer thread and indexes the batch. The index may briefly point past the end of
+ * the segment until the writer catches up, readers treat that like a batch cut short by a crash. A durable flush
+ * waits for the writer before syncing. A batch never straddles two segments: the time window is checked before
+ * writing, the size after.
+ */
+static int csv_flush(bool durable) {
+    if (db_buf_len) {
+        if (DB_ROTATE_WINDOW > 0 && csv_window() != segment_window && csv_rotate() != 0) return -1;
+
+        if (dbwriter_submit(writer, db_fd, segment_size, db_buf_len, &db_buf) != DBWRITER_SUCCESS) return -1;
+        batch.segment = segment;
+        batch.offset = segment_size;
+        batch.length = db_buf_len;
+        if (csvindex_append(idx_fd, &batch) != CSVINDEX_SUCCESS) return -1;
+        segment_size += db_buf_len;
+        db_buf_len = 0;
+        batch.rows = 0;
+    }
+    if (durable && (dbwriter_drain(writer) != DBWRITER_SUCCESS || fdatasync(db_fd) != 0 ||
+                    fdatasync(idx_fd) != 0)) {
+        return -1;
+    }
+    if (DB_ROTATE_SIZE > 0 && segment_size >= DB_ROTATE_SIZE) return csv_rotate();
+    return 0;
+}
+
+static int csv_close() {
+    int res = csv_close_segment();
+    if (close(idx_fd) != 0) res = -1;
+    idx_fd = -1;
+    pthread_mutex_lock(&writer_mtx);
+    dbwriter_free(&writer);
+    pthread_mutex_unlock(&writer_mtx);
+    db_buf = NULL;
+    return res;
+}
+
+static void csv_stats(FILE *out) {
+    pthread_mutex_lock(&writer_mtx);
+    if (writer) {
+        dbwriter_stats_t st;
+        dbwriter_stats(writer, &st);
+        fprintf(out, " writer_bytes=%" PRIu64 " writer_writes=%" PRIu64 " writer_depth=%d writer_max_depth=%d "
+                     "writer_stalls=%" PRIu64 " writer_stall_ms=%.3f", st.bytes, st.writes, st.depth,
+                st.max_depth, st.stalls, st.stall_ns / 1e6);
+    }
+    pthread_mutex_unlock(&writer_mtx);
+}
+
+static int csv_written(int64_t *ns, int max) {
+    return writer ? dbwriter_written(writer, ns, max) : 0;
+}
+
+const db_backend_t db_csv_backend = {"csv", csv_open, csv_insert, csv_full, csv_flush, csv_close,
+                                     csv_stats, csv_written};
@@ -0,0 +1,126 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sensor_db.h"
+#include "tsseg.h"
+
+#define DB_SEG_FILE_FORMAT "data-%ld.seg" // One new segment per run, named after its creation time.
+
+/**
+ * The readings of one sensor that are not compressed yet.
+ */
+typedef struct {
+    uint32_t n;
+    int slot;       // Index in open_ids.
+    time_t since;   // When the first reading of this block arrived.
+    sensor_ts_t ts[TSSEG_BLOCK_POINTS];
+    sensor_value_t values[TSSEG_BLOCK_POINTS];
+} seg_open_block_t;
+
+static tsseg_writer_t *segment = NULL;
+static long segment_time = 0; // Creation time in the name of the open segment.
+static seg_open_block_t *open_blocks[UINT16_MAX + 1];
+static sensor_id_t open_ids[DB_SEG_MAX_OPEN]; // The sensors that have a block allocated.
+static int n_open = 0;
+
+static int seg_seal(sensor_id_t id) {
+    seg_open_block_t *b = open_blocks[id];
+    int res = tsseg_append(segment, id, b->ts, b->values, b->n) == TSSEG_SUCCESS ? 0 : -1;
+    b->n = 0;
+    return res;
+}
+
+/**
+ * Seals the block of a sensor and gives it up, the sensor gets a new one with its next reading.
+ * @return the block, for the caller to reuse or free
+ */
+static seg_open_block_t *seg_release(sensor_id_t id, int *res) {
+    seg_open_block_t *b = open_blocks[id];
+    if (b->n && seg_seal(id) != 0) *res = -1;
+    open_blocks[id] = NULL;
+    sensor_id_t last = open_ids[--n_open];
+    if (last != id) {
+        open_ids[b->slot] = last;
+        open_blocks[last]->slot = b->slot;
+    }
+    return b;
+}
+
+static int seg_open() {
+    // Segments are never overwritten, if a file with this name exists we try the next second.
+    char name[64];
+    long t = (long) time(NULL);
+    for (int attempt = 0; attempt < 60; ++attempt, ++t) {
+        snprintf(name, sizeof(name), DB_SEG_FILE_FORMAT, t);
+        if (tsseg_create(&segment, name) == TSSEG_SUCCESS) {
+            TRACE_INFO("Segment " DB_SEG_FILE_FORMAT " created.", t);
+            segment_time = t;
+            log_data_file(LOG_NEW_DATA_FILE, DB_STORE_SEG, t);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int seg_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    seg_open_block_t *b = open_blocks[id];
+    int res = 0;
+    if (b == NULL) {
+        if (n_open == DB_SEG_MAX_OPEN) {
+            // Ids that are not in the map reach the DB thread as well, many of them must not pin a block each.
+            int oldest = 0;
+            for (int i = 1; i < n_open; ++i) {
+                if (open_blocks[open_ids[i]]->since < open_blocks[open_ids[oldest]]->since) oldest = i;
+            }
+            b = seg_release(open_ids[oldest], &res);
+        } else {
+            b = malloc(sizeof(seg_open_block_t));
+            ERROR_HANDLER(b == NULL, "Segment block malloc failed.");
+        }
+        b->n = 0;
+        b->slot = n_open;
+        open_blocks[id] = b;
+        open_ids[n_open++] = id;
+    }
+    if (b->n == 0) b->since = time(NULL);
+    b->ts[b->n] = ts;
+    b->values[b->n] = value;
+    b->n++;
+    if (b->n == TSSEG_BLOCK_POINTS && seg_seal(id) != 0) res = -1;
+    return res;
+}
+
+static bool seg_full() {
+    return false; // Full blocks are written as soon as they fill up.
+}
+
+/**
+ * Partial blocks are kept in memory so blocks stay large, they are only sealed when they are older than
+ * DB_SEG_SEAL_AGE, when the flush has to be durable, or to make room for another sensor. Sealed partial blocks
+ * are freed, a sensor that went quiet does not keep one.
+ */
+static int seg_flush(bool durable) {
+    time_t now = time(NULL);
+    int res = 0;
+    for (int i = n_open - 1; i >= 0; --i) {
+        seg_open_block_t *b = open_blocks[open_ids[i]];
+        if (durable || now - b->since >= DB_SEG_SEAL_AGE) free(seg_release(open_ids[i], &res));
+        if (res != 0) return -1;
+    }
+    return durable && tsseg_sync(segment) != TSSEG_SUCCESS ? -1 : 0;
+}
+
+static int seg_close() {
+    int res = seg_flush(true); // Frees every block.
+    if (tsseg_finish(&segment) != TSSEG_SUCCESS) res = -1;
+    log_data_file(LOG_DATA_FILE_CLOSED, DB_STORE_SEG, segment_time);
+    return res;
+}
+
+const db_backend_t db_seg_backend = {"seg", seg_open, seg_insert, seg_full, seg_flush, seg_close, NULL};
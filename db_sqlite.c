@@ -0,0 +1,98 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#include <sqlite3.h>
+
+#include "sensor_db.h"
+
+#define DB_SQLITE_FILE_NAME "data.db"
+
+static sqlite3 *db = NULL;
+static sqlite3_stmt *insert_stmt, *begin_stmt, *commit_stmt; // Prepared once, reused for every row and batch.
+static bool in_transaction = false;
+static int batch_rows = 0;
+
+/**
+ * Runs a prepared statement that returns no rows and resets it for the next use.
+ */
+static int sqlite_step(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        TRACE_ERROR("SQLite error: %s", sqlite3_errstr(sqlite3_extended_errcode(db)));
+        return -1;
+    }
+    return 0;
+}
+
+static int sqlite_open() {
+    // WAL lets readers query while we write, synchronous=NORMAL only syncs the WAL at checkpoints, a crash can
+    // lose the last transactions but never corrupts the database.
+    const char *schema =
+            "PRAGMA journal_mode=WAL;"
+            "PRAGMA synchronous=NORMAL;"
+            "CREATE TABLE IF NOT EXISTS sensor_data ("
+            "  sensor_id INTEGER NOT NULL,"
+            "  value REAL NOT NULL,"
+            "  ts INTEGER NOT NULL);"
+            "CREATE INDEX IF NOT EXISTS sensor_data_id_ts ON sensor_data (sensor_id, ts);";
+
+    if (sqlite3_open(DB_SQLITE_FILE_NAME, &db) != SQLITE_OK ||
+        sqlite3_exec(db, schema, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "INSERT INTO sensor_data (sensor_id, value, ts) VALUES (?, ?, ?);", -1,
+                           &insert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "BEGIN;", -1, &begin_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "COMMIT;", -1, &commit_stmt, NULL) != SQLITE_OK) {
+        TRACE_ERROR("SQLite error: %s", sqlite3_errstr(sqlite3_extended_errcode(db)));
+        return -1;
+    }
+    in_transaction = false;
+    batch_rows = 0;
+    log_data_file(LOG_NEW_DATA_FILE, DB_STORE_SQLITE, 0);
+    return 0;
+}
+
+static int sqlite_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    // The transaction is opened lazily, so an idle gateway does not hold one open.
+    if (!in_transaction) {
+        if (sqlite_step(begin_stmt) != 0) return -1;
+        in_transaction = true;
+    }
+    sqlite3_bind_int(insert_stmt, 1, id);
+    sqlite3_bind_double(insert_stmt, 2, value);
+    sqlite3_bind_int64(insert_stmt, 3, ts);
+    batch_rows++;
+    return sqlite_step(insert_stmt);
+}
+
+static bool sqlite_full() {
+    return batch_rows >= DB_SQLITE_BATCH;
+}
+
+static int sqlite_flush(bool durable) {
+    if (in_transaction) {
+        if (sqlite_step(commit_stmt) != 0) return -1;
+        in_transaction = false;
+        batch_rows = 0;
+    }
+    // A checkpoint syncs the WAL first, which is what makes the committed rows durable with synchronous=NORMAL.
+    if (durable && sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL) != SQLITE_OK) {
+        TRACE_ERROR("SQLite error: %s", sqlite3_errstr(sqlite3_extended_errcode(db)));
+        return -1;
+    }
+    return 0;
+}
+
+static int sqlite_close() {
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(begin_stmt);
+    sqlite3_finalize(commit_stmt);
+    int res = sqlite3_close(db) == SQLITE_OK ? 0 : -1;
+    db = NULL;
+    log_data_file(LOG_DATA_FILE_CLOSED, DB_STORE_SQLITE, 0);
+    return res;
+}
+
+const db_backend_t db_sqlite_backend = {"sqlite", sqlite_open, sqlite_insert, sqlite_full, sqlite_flush, sqlite_close,
+                                        NULL};
@@ -0,0 +1,213 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "dbwriter.h"
+
+/**
+ * Where a submitted buffer has to be written.
+ */
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t len;
+} dbwriter_job_t;
+
+struct dbwriter {
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t work;        // Signalled when a buffer is submitted or the writer has to stop.
+    pthread_cond_t done;        // Signalled when buffers are written.
+    int n_bufs;
+    char **bufs;
+    dbwriter_job_t *jobs;
+    int head;                   // Oldest queued buffer.
+    int queued;                 // Queued buffers, the one after them is being filled.
+    bool stop;
+    bool failed;
+    dbwriter_stats_t stats;
+    int64_t *written_ns;        // Ring of the times buffers were written, WRITTEN_LOG(n_bufs) entries.
+    uint64_t n_written, n_collected;
+};
+
+#define WRITTEN_LOG(n_bufs) (2 * (n_bufs))
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Writes 'count' queued buffers starting at 'first' that are contiguous in the same file, with as few
+ * pwritev() calls as the kernel allows. The calls and bytes are added to 'stats', which is not shared yet.
+ * @return 0 on success, -1 on a write error.
+ */
+static int dbwriter_write_run(dbwriter_t *w, int first, int count, dbwriter_stats_t *stats) {
+    struct iovec iov[count];
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = w->bufs[(first + i) % w->n_bufs];
+        iov[i].iov_len = w->jobs[(first + i) % w->n_bufs].len;
+    }
+    int fd = w->jobs[first].fd;
+    off_t offset = w->jobs[first].offset;
+    struct iovec *v = iov;
+    int n_iov = count;
+    while (n_iov > 0) {
+#if DBWRITER_DELAY_US > 0
+        usleep(DBWRITER_DELAY_US);
+#endif
+        ssize_t n = pwritev(fd, v, n_iov, offset);
+        if (n < 0) return -1;
+        stats->writes++;
+        stats->bytes += n;
+        offset += n;
+        // Skip what the kernel took, a partial write continues in the middle of an iovec.
+        while (n_iov > 0 && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void *dbwriter_thread(void *arg) {
+    dbwriter_t *w = arg;
+    pthread_mutex_lock(&w->mtx);
+    while (1) {
+        while (w->queued == 0 && !w->stop) pthread_cond_wait(&w->work, &w->mtx);
+        if (w->queued == 0) break;
+
+        // Take the run of queued buffers that continue each other in the same file.
+        int first = w->head, count = 1;
+        while (count < w->queued && count < IOV_MAX) {
+            dbwriter_job_t *prev = &w->jobs[(first + count - 1) % w->n_bufs];
+            dbwriter_job_t *next = &w->jobs[(first + count) % w->n_bufs];
+            if (next->fd != prev->fd || next->offset != prev->offset + (off_t) prev->len) break;
+            count++;
+        }
+        pthread_mutex_unlock(&w->mtx);
+
+        // The buffers being written are not touched by the filling thread, no lock needed.
+        dbwriter_stats_t run = {0};
+        int res = dbwriter_write_run(w, first, count, &run);
+
+        int64_t written = (int64_t) now_ns();
+        pthread_mutex_lock(&w->mtx);
+        w->stats.writes += run.writes;
+        w->stats.bytes += run.bytes;
+        for (int i = 0; i < count; ++i) w->written_ns[w->n_written++ % WRITTEN_LOG(w->n_bufs)] = written;
+        if (res != 0) w->failed = true;
+        w->head = (w->head + count) % w->n_bufs;
+        w->queued -= count;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->mtx);
+    return NULL;
+}
+
+dbwriter_t *dbwriter_create(size_t buf_size, int n_bufs, char **buf) {
+    dbwriter_t *w = calloc(1, sizeof(dbwriter_t));
+    ERROR_HANDLER(w == NULL || n_bufs < 2, "Writer creation failed.");
+    w->n_bufs = n_bufs;
+    w->bufs = malloc(n_bufs * sizeof(char *));
+    w->jobs = malloc(n_bufs * sizeof(dbwriter_job_t));
+    w->written_ns = malloc(WRITTEN_LOG(n_bufs) * sizeof(int64_t));
+    ERROR_HANDLER(w->bufs == NULL || w->jobs == NULL || w->written_ns == NULL, "Writer malloc failed.");
+    for (int i = 0; i < n_bufs; ++i) {
+        w->bufs[i] = malloc(buf_size);
+        ERROR_HANDLER(w->bufs[i] == NULL, "Writer buffer malloc failed.");
+    }
+    pthread_mutex_init(&w->mtx, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    ERROR_HANDLER(pthread_create(&w->tid, NULL, dbwriter_thread, w) != 0, "Writer thread creation failed.");
+    *buf = w->bufs[0];
+    return w;
+}
+
+int dbwriter_submit(dbwriter_t *w, int fd, off_t offset, size_t len, char **buf) {
+    pthread_mutex_lock(&w->mtx);
+    dbwriter_job_t *job = &w->jobs[(w->head + w->queued) % w->n_bufs];
+    job->fd = fd;
+    job->offset = offset;
+    job->len = len;
+    w->queued++;
+    if (w->queued > w->stats.max_depth) w->stats.max_depth = w->queued;
+    pthread_cond_signal(&w->work);
+
+    if (w->queued == w->n_bufs) {
+        // Every buffer waits for the disk, this is the only place where a disk stall reaches the caller.
+        uint64_t start = now_ns();
+        while (w->queued == w->n_bufs) pthread_cond_wait(&w->done, &w->mtx);
+        w->stats.stalls++;
+        w->stats.stall_ns += now_ns() - start;
+    }
+    *buf = w->bufs[(w->head + w->queued) % w->n_bufs]; // Free now, the writer thread only takes queued buffers.
+    int res = w->failed ? DBWRITER_FAILURE : DBWRITER_SUCCESS;
+    pthread_mutex_unlock(&w->mtx);
+    return res;
+}
+
+int dbwriter_drain(dbwriter_t *w) {
+    pthread_mutex_lock(&w->mtx);
+    while (w->queued > 0) pthread_cond_wait(&w->done, &w->mtx);
+    int res = w->failed ? DBWRITER_FAILURE : DBWRITER_SUCCESS;
+    pthread_mutex_unlock(&w->mtx);
+    return res;
+}
+
+int dbwriter_written(dbwriter_t *w, int64_t *ns, int max) {
+    pthread_mutex_lock(&w->mtx);
+    int n = 0;
+    for (; n < max && w->n_collected < w->n_written; ++n, ++w->n_collected) {
+        // Times that were overwritten before they were collected are replaced by the oldest one left.
+        uint64_t oldest = w->n_written > WRITTEN_LOG(w->n_bufs) ? w->n_written - WRITTEN_LOG(w->n_bufs) : 0;
+        uint64_t i = w->n_collected > oldest ? w->n_collected : oldest;
+        ns[n] = w->written_ns[i % WRITTEN_LOG(w->n_bufs)];
+    }
+    pthread_mutex_unlock(&w->mtx);
+    return n;
+}
+
+void dbwriter_stats(dbwriter_t *w, dbwriter_stats_t *stats) {
+    pthread_mutex_lock(&w->mtx);
+    *stats = w->stats;
+    stats->depth = w->queued;
+    pthread_mutex_unlock(&w->mtx);
+}
+
+void dbwriter_free(dbwriter_t **writer) {
+    dbwriter_t *w = *writer;
+    pthread_mutex_lock(&w->mtx);
+    w->stop = true;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->mtx);
+    pthread_join(w->tid, NULL); // The thread writes whatever is still queued before it stops.
+
+    for (int i = 0; i < w->n_bufs; ++i) free(w->bufs[i]);
+    free(w->bufs);
+    free(w->jobs);
+    free(w->written_ns);
+    pthread_mutex_destroy(&w->mtx);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->done);
+    free(w);
+    *writer = NULL;
+}
@@ -0,0 +1,78 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _DBWRITER_H_
+#define _DBWRITER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DBWRITER_SUCCESS 0
+#define DBWRITER_FAILURE -1
+
+#ifndef DBWRITER_DELAY_US
+#define DBWRITER_DELAY_US 0 // Sleep this long before every write, simulates a slow disk for make bench.
+#endif
+
+/**
+ * An asynchronous file writer. One thread fills a buffer while a writer thread writes the previously submitted
+ * ones with pwritev(), so a slow disk only stops the filling thread once every buffer is waiting to be written.
+ * Only one thread may fill and submit buffers.
+ */
+typedef struct dbwriter dbwriter_t;
+
+/**
+ * Counters of a writer, see dbwriter_stats().
+ */
+typedef struct {
+    uint64_t bytes;             /**< bytes written */
+    uint64_t writes;            /**< pwritev() calls, contiguous buffers are written by one call */
+    uint64_t stalls;            /**< times the filling thread waited for a free buffer */
+    uint64_t stall_ns;          /**< total time spent in those waits */
+    int depth;                  /**< buffers submitted and not written yet */
+    int max_depth;              /**< the highest depth seen */
+} dbwriter_stats_t;
+
+/**
+ * Allocates 'n_bufs' buffers of 'buf_size' bytes and starts the writer thread.
+ * @param buf set to the buffer to fill first
+ */
+dbwriter_t *dbwriter_create(size_t buf_size, int n_bufs, char **buf);
+
+/**
+ * Queues the first 'len' bytes of the buffer being filled to be written at 'offset' of 'fd' and hands out the
+ * next one, waiting if it is still queued.
+ * @param buf the buffer being filled, set to the buffer to fill next
+ * \return DBWRITER_FAILURE if an earlier write failed, DBWRITER_SUCCESS otherwise
+ */
+int dbwriter_submit(dbwriter_t *writer, int fd, off_t offset, size_t len, char **buf);
+
+/**
+ * Waits until every submitted buffer is written, call before syncing or closing a file.
+ * \return DBWRITER_FAILURE if a write failed, DBWRITER_SUCCESS otherwise
+ */
+int dbwriter_drain(dbwriter_t *writer);
+
+/**
+ * Collects the times (CLOCK_MONOTONIC ns) at which the submitted buffers were written, one per buffer in the
+ * order they were submitted, starting after the last one collected. Buffers whose time was not collected before
+ * 2 * n_bufs more were written get the oldest time still known.
+ * @param ns set to the times
+ * @param max the room in 'ns'
+ * \return the number of times put into 'ns'
+ */
+int dbwriter_written(dbwriter_t *writer, int64_t *ns, int max);
+
+/**
+ * Copies the counters of the writer into 'stats', can be called from any thread.
+ */
+void dbwriter_stats(dbwriter_t *writer, dbwriter_stats_t *stats);
+
+/**
+ * Drains the writer, stops its thread and frees it. '*writer' is set to NULL.
+ */
+void dbwriter_free(dbwriter_t **writer);
+
+#endif //_DBWRITER_H_
@@ -5,9 +5,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 
 #define FILE_ERROR(fp, error_msg)    do {               \
@@ -17,59 +19,261 @@
                       }                                 \
                     } while(0)
 
+#define ARG_ERROR(cond, error_msg)   do {               \
+                      if (cond) {                       \
+                        printf("%s\n",(error_msg));     \
+                        exit(EXIT_FAILURE);             \
+                      }                                 \
+                    } while(0)
+
 
 #define NUM_MEASUREMENTS    100
 #define SLEEP_TIME          30      // every SLEEP_TIME seconds, sensors wake up and measure temperature
 #define NUM_SENSORS         8       // also defines number of rooms (currently 1 room = 1 sensor)
 #define TEMP_DEV            5       // max afwijking vorige temperatuur in 0.1 celsius
+#define OUT_OF_RANGE_DEV    100     // an out-of-range reading is this far above or below the sensor's temperature
+#define MAX_SENSORS         (UINT16_MAX - 1) // ids are 16 bit and 0 is reserved, one id is left for invalid readings
+#define RECORD_SIZE         (sizeof(uint16_t) + sizeof(double) + sizeof(time_t)) // packed <id><value><ts>
+#define BUFFER_RECORDS      65536   // records a thread gathers before writing them to its shard
 
 uint16_t room_id[NUM_SENSORS] = {1, 2, 3, 4, 11, 12, 13, 14};
 uint16_t sensor_id[NUM_SENSORS] = {15, 21, 37, 49, 112, 129, 132, 142};
 double sensor_temperature[NUM_SENSORS] = {15, 17, 18, 19, 20, 23, 24, 25}; // starting temperatures
 
-int main(int argc, char *argv[]) {
-    FILE *fp_text, *fp_bin;
-    int i, j;
-    time_t starttime = time(&starttime);
-    srand48(time(NULL));
+/**
+ * A sensor of the data set, each has its own random stream so its readings only depend on the seed.
+ */
+typedef struct {
+    uint16_t id;
+    uint16_t room;
+    double temperature;
+    unsigned short xsubi[3];
+} sensor_t;
 
-    // generate ascii file room_sensor.map
-    fp_text = fopen("room_sensor.map", "w");
-    FILE_ERROR(fp_text, "Couldn't create room_sensor.map\n");
-    for (i = 0; i < NUM_SENSORS; i++) {
-        fprintf(fp_text, "%" PRIu16 " %" PRIu16 "\n", room_id[i], sensor_id[i]);
-    }
-    fclose(fp_text);
+static sensor_t *sensors;
+static uint32_t num_sensors = NUM_SENSORS, num_rooms = NUM_SENSORS;
+static uint64_t num_steps;          // readings per sensor
+static double period = SLEEP_TIME;  // seconds between two readings of a sensor
+static double jitter = 0, out_of_range = 0, invalid_id = 0;
+static time_t starttime;
+static int num_threads = 1, num_shards = 1;
+static const char *prefix = "sensor_data";
+static uint8_t valid_id[UINT16_MAX + 1];
 
-    // generate binary file sensor_data and corresponding log file
-    fp_bin = fopen("sensor_data", "w");
-    FILE_ERROR(fp_bin, "Couldn't create sensor_data\n");
+/**
+ * splitmix64, spreads consecutive seeds over the 48 bit state of erand48.
+ */
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void shard_name(char *name, size_t size, int shard) {
+    if (num_shards == 1) snprintf(name, size, "%s", prefix);
+    else snprintf(name, size, "%s.%d", prefix, shard);
+}
+
+/**
+ * Writes one shard: the readings of a contiguous range of sensors, in time order like the original sensor_data.
+ */
+static void generate_shard(int shard, unsigned char *buf) {
+    char name[256];
+    FILE *fp_bin;
+    uint32_t first = (uint64_t) num_sensors * shard / num_shards;
+    uint32_t last = (uint64_t) num_sensors * (shard + 1) / num_shards;
+    size_t used = 0;
 
+    shard_name(name, sizeof(name), shard);
+    fp_bin = fopen(name, "w");
+    FILE_ERROR(fp_bin, "Couldn't create sensor_data\n");
 #ifdef DEBUG // save sensor data also in text format for test purposes
-    fp_text = fopen("sensor_data_text", "w");
+    FILE *fp_text;
+    char text_name[sizeof(name) + 5];
+    snprintf(text_name, sizeof(text_name), "%s_text", name);
+    fp_text = fopen(text_name, "w");
     FILE_ERROR(fp_text,"Couldn't create sensor_data in text\n");
 #endif
 
-    for (i = 0; i < NUM_MEASUREMENTS; i++, starttime += SLEEP_TIME) {
-        for (j = 0; j < NUM_SENSORS; j++) {
-            // write current temperatures to file
-            fwrite(sensor_id + j, sizeof(sensor_id[0]), 1, fp_bin);
-            fwrite(&(sensor_temperature[j]), sizeof(sensor_temperature[0]), 1, fp_bin);
-            fwrite(&starttime, sizeof(time_t), 1, fp_bin);
+    for (uint64_t i = 0; i < num_steps; i++) {
+        time_t now = starttime + (time_t) (i * period);
+        for (uint32_t j = first; j < last; j++) {
+            sensor_t *s = sensors + j;
+            uint16_t id = s->id;
+            double value = s->temperature;
+            time_t ts = now;
+            if (jitter > 0) ts += (time_t) ((erand48(s->xsubi) - 0.5) * 2 * jitter);
+            if (out_of_range > 0 && erand48(s->xsubi) < out_of_range) {
+                value += erand48(s->xsubi) < 0.5 ? -OUT_OF_RANGE_DEV : OUT_OF_RANGE_DEV;
+            }
+            if (invalid_id > 0 && erand48(s->xsubi) < invalid_id) {
+                do {
+                    id = (uint16_t) (1 + erand48(s->xsubi) * UINT16_MAX);
+                } while (valid_id[id]);
+            }
+
+            // write current temperatures to the buffer
+            unsigned char *p = buf + used * RECORD_SIZE;
+            memcpy(p, &id, sizeof(id));
+            memcpy(p + sizeof(id), &value, sizeof(value));
+            memcpy(p + sizeof(id) + sizeof(value), &ts, sizeof(ts));
+            if (++used == BUFFER_RECORDS) {
+                ARG_ERROR(fwrite(buf, RECORD_SIZE, used, fp_bin) != used, "Couldn't write sensor_data");
+                used = 0;
+            }
 #ifdef DEBUG
-            fprintf(fp_text,"%" PRIu16 " %g %ld\n", sensor_id[j],sensor_temperature[j],(long)starttime);
+            fprintf(fp_text,"%" PRIu16 " %g %ld\n", id, value, (long)ts);
 #endif
 
             // get new temperature: still needs some fine-tuning ...
-            sensor_temperature[j] = sensor_temperature[j] + TEMP_DEV * ((drand48() - 0.5) / 10);
+            s->temperature = s->temperature + TEMP_DEV * ((erand48(s->xsubi) - 0.5) / 10);
         }
     }
+    ARG_ERROR(fwrite(buf, RECORD_SIZE, used, fp_bin) != used, "Couldn't write sensor_data");
 
-    fclose(fp_bin);
+    ARG_ERROR(fclose(fp_bin) != 0, "Couldn't write sensor_data");
 #ifdef DEBUG
     fclose(fp_text);
 #endif
+}
 
-    return 0;
+/**
+ * A thread writes the shards t, t + num_threads, ... so the files do not depend on the number of threads.
+ */
+static void *generate(void *arg) {
+    int t = (int) (intptr_t) arg;
+    unsigned char *buf = malloc(BUFFER_RECORDS * RECORD_SIZE);
+    FILE_ERROR(buf, "Couldn't allocate the output buffer");
+    for (int shard = t; shard < num_shards; shard += num_threads) generate_shard(shard, buf);
+    free(buf);
+    return NULL;
+}
+
+static void print_help(void) {
+    printf("Use this program as: file_creator [options]\n");
+    printf("Writes room_sensor.map and the binary readings to sensor_data, or sensor_data.<n> with -k.\n");
+    printf("\t%-14s : number of sensors, at most %d (default %d)\n", "-n sensors", MAX_SENSORS, NUM_SENSORS);
+    printf("\t%-14s : number of rooms the sensors are spread over (default the number of sensors)\n", "-m rooms");
+    printf("\t%-14s : seconds of data (default %d)\n", "-d duration", NUM_MEASUREMENTS * SLEEP_TIME);
+    printf("\t%-14s : readings per second of every sensor (default 1/%d)\n", "-r rate", SLEEP_TIME);
+    printf("\t%-14s : timestamps move up to this many seconds either way (default 0)\n", "-j jitter");
+    printf("\t%-14s : fraction of readings %d degrees off the sensor's temperature (default 0)\n", "-o fraction",
+           OUT_OF_RANGE_DEV);
+    printf("\t%-14s : fraction of readings with an id that is not in the map (default 0)\n", "-i fraction");
+    printf("\t%-14s : number of data files, each holds a range of the sensors (default 1)\n", "-k shards");
+    printf("\t%-14s : generator threads (default 1)\n", "-t threads");
+    printf("\t%-14s : seed of the random streams (default the time)\n", "-s seed");
+    printf("\t%-14s : timestamp of the first readings (default now)\n", "-b start");
+    printf("\t%-14s : name of the data files (default sensor_data)\n", "-p prefix");
+    printf("The same options with the same -s and -b give the same files, whatever the number of threads.\n");
 }
 
+int main(int argc, char *argv[]) {
+    FILE *fp_text;
+    uint32_t i;
+    double duration = NUM_MEASUREMENTS * SLEEP_TIME, rate = 1.0 / SLEEP_TIME;
+    uint64_t seed = (uint64_t) time(NULL);
+    int opt, rooms_given = 0;
+    time(&starttime);
+
+    while ((opt = getopt(argc, argv, "n:m:d:r:j:o:i:k:t:s:b:p:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_sensors = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                num_rooms = strtoul(optarg, NULL, 10);
+                rooms_given = 1;
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'j':
+                jitter = strtod(optarg, NULL);
+                break;
+            case 'o':
+                out_of_range = strtod(optarg, NULL);
+                break;
+            case 'i':
+                invalid_id = strtod(optarg, NULL);
+                break;
+            case 'k':
+                num_shards = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                starttime = (time_t) strtoll(optarg, NULL, 10);
+                break;
+            case 'p':
+                prefix = optarg;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (!rooms_given) num_rooms = num_sensors;
+    ARG_ERROR(optind != argc, "Unexpected argument, see file_creator -h");
+    ARG_ERROR(num_sensors < 1 || num_sensors > MAX_SENSORS, "Invalid number of sensors");
+    ARG_ERROR(num_rooms < 1 || num_rooms > UINT16_MAX, "Invalid number of rooms");
+    ARG_ERROR(duration < 0 || rate <= 0, "Invalid duration or rate");
+    ARG_ERROR(jitter < 0 || out_of_range < 0 || out_of_range > 1 || invalid_id < 0 || invalid_id > 1,
+              "Invalid jitter or fraction");
+    ARG_ERROR(num_shards < 1 || num_threads < 1, "Invalid number of shards or threads");
+    if (num_threads > num_shards) num_threads = num_shards;
+    num_steps = (uint64_t) (duration * rate + 0.5);
+    period = 1 / rate;
+
+    // the original 8 sensors unless asked for others, then ids 1..n spread round robin over rooms 1..m
+    sensors = calloc(num_sensors, sizeof(sensor_t));
+    FILE_ERROR(sensors, "Couldn't allocate the sensors");
+    int original = num_sensors == NUM_SENSORS && num_rooms == NUM_SENSORS;
+    for (i = 0; i < num_sensors; i++) {
+        sensor_t *s = sensors + i;
+        uint64_t r = mix(seed ^ mix(i));
+        s->xsubi[0] = (unsigned short) r;
+        s->xsubi[1] = (unsigned short) (r >> 16);
+        s->xsubi[2] = (unsigned short) (r >> 32);
+        s->id = original ? sensor_id[i] : (uint16_t) (i + 1);
+        s->room = original ? room_id[i] : (uint16_t) (i % num_rooms + 1);
+        s->temperature = original ? sensor_temperature[i] : 15 + 10 * erand48(s->xsubi);
+        valid_id[s->id] = 1;
+    }
+    valid_id[0] = 1; // never generated, id 0 marks the end of the gateway's buffer
+
+    // generate ascii file room_sensor.map
+    fp_text = fopen("room_sensor.map", "w");
+    FILE_ERROR(fp_text, "Couldn't create room_sensor.map\n");
+    for (i = 0; i < num_sensors; i++) {
+        fprintf(fp_text, "%" PRIu16 " %" PRIu16 "\n", sensors[i].room, sensors[i].id);
+    }
+    fclose(fp_text);
+
+    // generate the binary files, a thread per group of shards
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t tid[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        ARG_ERROR(pthread_create(tid + t, NULL, generate, (void *) (intptr_t) t) != 0, "Couldn't start a thread");
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(tid[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    uint64_t readings = num_steps * num_sensors;
+    printf("%" PRIu64 " readings of %" PRIu32 " sensors in %" PRIu32 " rooms to %d file(s), %.1f MB in %.2f s "
+           "(%.0f readings/s), seed %" PRIu64 ", start %ld\n", readings, num_sensors, num_rooms, num_shards,
+           readings * RECORD_SIZE / 1e6, seconds, seconds > 0 ? readings / seconds : 0, seed, (long) starttime);
+    free(sensors);
+
+    return 0;
+}
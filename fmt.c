@@ -0,0 +1,162 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fmt.h"
+
+__extension__ typedef unsigned __int128 u128;
+
+static const char digit_pairs[201] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+static const uint64_t pow10_u64[20] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/**
+ * Writes exactly 'width' digits of 'v' (zero padded) ending just before 'end'.
+ */
+static void fmt_digits_back(char *end, uint64_t v, int width) {
+    while (width >= 2) {
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * (v % 100), 2);
+        v /= 100;
+        width -= 2;
+    }
+    if (width) *--end = (char) ('0' + v % 10);
+}
+
+static int fmt_num_digits(uint64_t v) {
+    int n = 1;
+    while (n < 20 && v >= pow10_u64[n]) n++;
+    return n;
+}
+
+char *fmt_u64(char *dst, uint64_t v) {
+    int n = fmt_num_digits(v);
+    fmt_digits_back(dst + n, v, n);
+    return dst + n;
+}
+
+char *fmt_i64(char *dst, int64_t v) {
+    if (v < 0) {
+        *dst++ = '-';
+        return fmt_u64(dst, -(uint64_t) v);
+    }
+    return fmt_u64(dst, (uint64_t) v);
+}
+
+/**
+ * Writes n / 10^d with exactly d decimals, d = 0 writes an integer.
+ */
+static char *fmt_fixed_point(char *dst, uint64_t n, int d) {
+    dst = fmt_u64(dst, n / pow10_u64[d]);
+    if (d == 0) return dst;
+    *dst++ = '.';
+    fmt_digits_back(dst + d, n % pow10_u64[d], d);
+    return dst + d;
+}
+
+/**
+ * Slow path for values outside the range handled exactly below: try 1..17 significant digits with printf.
+ */
+static char *fmt_double_slow(char *dst, double v) {
+    char tmp[32];
+    int len = 0;
+    for (int prec = 1; prec <= 17; ++prec) {
+        len = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+        if (strtod(tmp, NULL) == v) break;
+    }
+    memcpy(dst, tmp, len);
+    return dst + len;
+}
+
+/**
+ * Checks whether some n / 10^d rounds to v = m / 2^k. Only the nearest n has to be tried: it lies inside the
+ * interval of reals that round to v when |n * 2^k - m * 10^d| < 10^d / 2, or 10^d / 4 below v when m is a power
+ * of two (the gap to the next smaller double is half as big there).
+ * @return 1 and the digits in '*digits' if it does, 0 otherwise.
+ */
+static int fmt_try_decimals(uint64_t m, int k, int d, uint64_t *digits) {
+    u128 x = (u128) m * pow10_u64[d];
+    u128 n = (x + ((u128) 1 << (k - 1))) >> k;
+    u128 scaled = n << k;
+    u128 diff = scaled > x ? scaled - x : x - scaled;
+    u128 limit = (scaled < x && m == (1ULL << 52)) ? diff * 4 : diff * 2;
+    if (limit >= pow10_u64[d] || (n >> 64) != 0) return 0;
+    *digits = (uint64_t) n;
+    return 1;
+}
+
+char *fmt_double(char *dst, double v) {
+    if (isnan(v) || isinf(v)) return fmt_double_slow(dst, v);
+    if (signbit(v)) {
+        *dst++ = '-';
+        v = -v;
+    }
+    if (v == 0) {
+        *dst++ = '0';
+        return dst;
+    }
+    if (v < 1e-2 || v >= 9007199254740992.0) return fmt_double_slow(dst, v);
+
+    // Like Ryu, look for the shortest decimal inside the interval of reals that round to v, but with exact
+    // 128-bit integer arithmetic instead of tables, which is enough for 1e-2 <= v < 2^53: v = m / 2^k with
+    // k <= 59, and 17 significant digits always fit in 19 decimals.
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint64_t m = (bits & ((1ULL << 52) - 1)) | (1ULL << 52);
+    int k = 1075 - (int) ((bits >> 52) & 0x7FF);
+
+    if (k <= 0) return fmt_u64(dst, m << -k); // An integer, it always fits in 53 bits here.
+
+    // If d decimals are enough, so are d + 1, so the smallest d can be found with a binary search.
+    int lo = 0, hi = 19;
+    uint64_t n = 0, found = 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (fmt_try_decimals(m, k, mid, &n)) {
+            hi = mid;
+            found = n;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (lo == 19 && !fmt_try_decimals(m, k, 19, &found)) return fmt_double_slow(dst, v);
+    return fmt_fixed_point(dst, found, lo);
+}
+
+char *fmt_double_fixed(char *dst, double v, int decimals) {
+    if (isnan(v) || isinf(v) || fabs(v) >= 1e15 || decimals < 0 || decimals > 9) return fmt_double(dst, v);
+    // The scaled value has to fit the uint64_t it is converted to.
+    if (fabs(v) >= (double) UINT64_MAX / (double) pow10_u64[decimals]) return fmt_double(dst, v);
+    double scaled = nearbyint(fabs(v) * (double) pow10_u64[decimals]);
+    if (signbit(v) && scaled != 0) *dst++ = '-';
+    return fmt_fixed_point(dst, (uint64_t) scaled, decimals);
+}
+
+char *fmt_row(char *dst, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    dst = fmt_u64(dst, id);
+    *dst++ = ',';
+#if FMT_DECIMALS >= 0
+    dst = fmt_double_fixed(dst, value, FMT_DECIMALS);
+#else
+    dst = fmt_double(dst, value);
+#endif
+    *dst++ = ',';
+    dst = fmt_i64(dst, (int64_t) ts);
+    *dst++ = '\n';
+    return dst;
+}
@@ -0,0 +1,49 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _FMT_H_
+#define _FMT_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define FMT_ROW_MAX 64 // Longest row fmt_row() can produce, including the newline.
+
+#ifndef FMT_DECIMALS
+#define FMT_DECIMALS -1 // Decimals of the value column, -1 writes the shortest string that round-trips.
+#endif
+
+/**
+ * Writes 'v' in decimal at 'dst', two digits at a time. No terminating '\0' is written.
+ * \return a pointer just past the last written character
+ */
+char *fmt_u64(char *dst, uint64_t v);
+
+/**
+ * Signed version of fmt_u64().
+ */
+char *fmt_i64(char *dst, int64_t v);
+
+/**
+ * Writes the shortest decimal string that strtod() reads back as exactly 'v'. At most 25 characters are written.
+ * \return a pointer just past the last written character
+ */
+char *fmt_double(char *dst, double v);
+
+/**
+ * Writes 'v' rounded to 'decimals' (0..9) decimals. Values of 1e15 and beyond, NaN and infinities are written
+ * with fmt_double() so the length stays bounded.
+ * \return a pointer just past the last written character
+ */
+char *fmt_double_fixed(char *dst, double v, int decimals);
+
+/**
+ * Writes one data.csv row "<id>,<value>,<ts>\n" at 'dst', which needs room for FMT_ROW_MAX characters. The value
+ * is written with fmt_double(), or with fmt_double_fixed() when FMT_DECIMALS is set.
+ * \return a pointer just past the newline
+ */
+char *fmt_row(char *dst, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+#endif //_FMT_H_
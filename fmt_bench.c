@@ -0,0 +1,159 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include "config.h"
+#include "fmt.h"
+
+#define DEFAULT_ROWS 1000000
+#define RUNS 5 // The best run is reported, the others only warm up caches and the branch predictor.
+#define OUT_BUF_SIZE (64 * 1024)
+
+static sensor_data_t *rows;
+static long n_rows;
+static char out_buf[OUT_BUF_SIZE + FMT_ROW_MAX];
+
+static double now_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * The path insert_sensor() used before the row formatter: fprintf() into a stdio stream.
+ */
+static void bench_fprintf(FILE *sink) {
+    for (long i = 0; i < n_rows; ++i) {
+        fprintf(sink, "%"PRIu16",%lf,%li\n", rows[i].id, rows[i].value, rows[i].ts);
+    }
+    fflush(sink);
+}
+
+/**
+ * fmt_row() straight into a buffer that is handed to the stream when full, like the DB batch buffer.
+ */
+static void bench_fmt_row(FILE *sink, int decimals) {
+    size_t len = 0;
+    for (long i = 0; i < n_rows; ++i) {
+        char *dst = out_buf + len;
+        if (decimals < 0) {
+            dst = fmt_row(dst, rows[i].id, rows[i].value, rows[i].ts);
+        } else {
+            dst = fmt_u64(dst, rows[i].id);
+            *dst++ = ',';
+            dst = fmt_double_fixed(dst, rows[i].value, decimals);
+            *dst++ = ',';
+            dst = fmt_i64(dst, rows[i].ts);
+            *dst++ = '\n';
+        }
+        len = dst - out_buf;
+        if (len >= OUT_BUF_SIZE) {
+            fwrite(out_buf, 1, len, sink);
+            len = 0;
+        }
+    }
+    fwrite(out_buf, 1, len, sink);
+    fflush(sink);
+}
+
+/**
+ * Formats every value and parses it back, the shortest mode must give the exact same double.
+ * @return the number of values that did not round-trip.
+ */
+static long check_round_trip() {
+    long bad = 0;
+    char buf[FMT_ROW_MAX];
+    for (long i = 0; i < n_rows; ++i) {
+        *fmt_double(buf, rows[i].value) = '\0';
+        if (strtod(buf, NULL) != rows[i].value) bad++;
+    }
+    return bad;
+}
+
+/**
+ * Formats every value, and values at the edges of the fixed-point range, with 0 to 9 decimals and compares them
+ * with what "%.*f" gives. Values too large for fixed point fall back to the shortest form, which must still parse
+ * back to the same number up to one unit of the last decimal.
+ * @return the number of values that differ.
+ */
+static long check_fixed() {
+    static const double edges[] = {0, -0.0, 0.5, -0.5, 1e-9, 123456.789, 1.8e10, 1.9e10, 1e11, -1e11, 9.99e14, 1e15,
+                                   1e19, -1.5e19, 1e300};
+    long bad = 0;
+    char buf[FMT_ROW_MAX], ref[512];
+    long n_edges = (long) (sizeof(edges) / sizeof(edges[0]));
+    for (long i = 0; i < n_rows + n_edges; ++i) {
+        double v = i < n_rows ? rows[i].value : edges[i - n_rows];
+        for (int d = 0; d <= 9; ++d) {
+            *fmt_double_fixed(buf, v, d) = '\0';
+            snprintf(ref, sizeof(ref), "%.*f", d, v);
+            double tolerance = pow(10, -d) * (1 + 1e-9) + fabs(v) * 1e-15; // Near ties may round either way.
+            if (fabs(strtod(buf, NULL) - strtod(ref, NULL)) > tolerance) bad++;
+        }
+    }
+    return bad;
+}
+
+static void report(const char *name, double best, double base) {
+    printf("%-28s %8.1f ns/row %8.2f Mrows/s  x%.2f\n", name, best * 1e9 / n_rows, n_rows / best / 1e6,
+           base / best);
+}
+
+int main(int argc, char *argv[]) {
+    n_rows = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_ROWS;
+    ERROR_HANDLER(n_rows <= 0, "Usage: fmt_bench [rows]");
+
+    rows = malloc(n_rows * sizeof(sensor_data_t));
+    ERROR_HANDLER(rows == NULL, "Rows malloc failed.");
+
+    // Same random walk as sensor_node, on a handful of sensors, one reading per second.
+    srand48(1);
+    double value = 20;
+    for (long i = 0; i < n_rows; ++i) {
+        value += 100 * ((drand48() - 0.5) / 10);
+        rows[i].id = (sensor_id_t) (15 + i % 8);
+        rows[i].value = value;
+        rows[i].ts = 1672531200 + i / 8;
+    }
+
+    FILE *sink = fopen("/dev/null", "w");
+    ERROR_HANDLER(sink == NULL, "Could not open /dev/null.");
+    setvbuf(sink, NULL, _IOFBF, OUT_BUF_SIZE);
+
+    double best[3] = {1e9, 1e9, 1e9};
+    for (int run = 0; run < RUNS; ++run) {
+        double t = now_s();
+        bench_fprintf(sink);
+        if (now_s() - t < best[0]) best[0] = now_s() - t;
+
+        t = now_s();
+        bench_fmt_row(sink, -1);
+        if (now_s() - t < best[1]) best[1] = now_s() - t;
+
+        t = now_s();
+        bench_fmt_row(sink, 2);
+        if (now_s() - t < best[2]) best[2] = now_s() - t;
+    }
+
+    printf("%ld rows, best of %d runs\n", n_rows, RUNS);
+    report("fprintf %lf", best[0], best[0]);
+    report("fmt_row shortest", best[1], best[0]);
+    report("fmt_row 2 decimals", best[2], best[0]);
+    long bad = check_round_trip();
+    printf("round-trip mismatches: %ld\n", bad);
+    long bad_fixed = check_fixed();
+    printf("fixed-point mismatches: %ld\n", bad_fixed);
+    bad += bad_fixed;
+
+    fclose(sink);
+    free(rows);
+    return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
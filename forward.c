@@ -0,0 +1,427 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "forward.h"
+#include "sbuffer.h"
+#include "tsseg.h"
+#include "metrics.h"
+#include "placement.h"
+
+bool forward_on = false;
+
+/**
+ * A sealed frame, kept in memory while it is in flight.
+ */
+typedef struct forward_frame {
+    struct forward_frame *next;
+    uint64_t seq;
+    uint32_t readings;
+    uint32_t len;               // Header included.
+    uint64_t spool_end;         // Offset just past the frame in the spool if it was sent from there, 0 otherwise.
+    uint8_t bytes[];
+} forward_frame_t;
+
+static struct sockaddr_in forward_addr;
+static int forward_fd = -1;
+static int64_t forward_retry_ns;    // Monotonic time of the next connect attempt.
+static uint64_t forward_epoch, forward_seq;
+
+// Frames sent on the connection and not acknowledged yet, oldest first: the collector acks in this order.
+static forward_frame_t *inflight_head, *inflight_tail;
+static int inflight_count;
+static uint8_t ack_buf[FORWARD_ACK_SIZE];
+static size_t ack_len;
+
+// Frames before spool_acked are acknowledged, from spool_drain on they still have to be sent.
+static int spool_fd = -1;
+static uint64_t spool_size, spool_drain, spool_acked;
+static double drain_tokens;         // Bytes of the spool that may be sent now.
+static int64_t drain_refill_ns;
+
+// The frame being gathered, in arrival order.
+static sensor_id_t batch_id[FORWARD_BATCH_READINGS];
+static sensor_ts_t batch_ts[FORWARD_BATCH_READINGS];
+static sensor_value_t batch_value[FORWARD_BATCH_READINGS];
+static uint32_t batch_order[FORWARD_BATCH_READINGS];
+static sensor_ts_t group_ts[FORWARD_BATCH_READINGS];
+static sensor_value_t group_value[FORWARD_BATCH_READINGS];
+static uint32_t batch_n;
+static int64_t batch_start_ns;
+static uint8_t *frame_buf;
+static size_t frame_cap;
+
+int forward_select_upstream(const char *upstream) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strrchr(upstream, ':');
+    if (colon == NULL || (size_t) (colon - upstream) >= sizeof(ip)) return -1;
+    memcpy(ip, upstream, colon - upstream);
+    ip[colon - upstream] = '\0';
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || port < 1 || port > 65535) return -1;
+    memset(&forward_addr, 0, sizeof(forward_addr));
+    forward_addr.sin_family = AF_INET;
+    forward_addr.sin_port = htons((uint16_t) port);
+    if (inet_pton(AF_INET, ip, &forward_addr.sin_addr) != 1) return -1;
+    forward_on = true;
+    return 0;
+}
+
+static void inflight_push(forward_frame_t *f) {
+    f->next = NULL;
+    if (inflight_tail) inflight_tail->next = f;
+    else inflight_head = f;
+    inflight_tail = f;
+    inflight_count++;
+}
+
+static forward_frame_t *inflight_pop() {
+    forward_frame_t *f = inflight_head;
+    inflight_head = f->next;
+    if (inflight_head == NULL) inflight_tail = NULL;
+    inflight_count--;
+    return f;
+}
+
+static void spool_write_header() {
+    uint8_t header[FORWARD_SPOOL_HEADER] = {0};
+    memcpy(header, FORWARD_SPOOL_MAGIC, 8);
+    memcpy(header + 8, &spool_acked, sizeof(spool_acked));
+    ERROR_HANDLER(pwrite(spool_fd, header, sizeof(header), 0) != sizeof(header), "Spool write failed.");
+}
+
+/**
+ * Opens the spool, keeping what an earlier run could not deliver.
+ */
+static void spool_open() {
+    spool_fd = open(FORWARD_SPOOL_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    ERROR_HANDLER(spool_fd == -1, "Spool file creation did not work.");
+    struct stat st;
+    ERROR_HANDLER(fstat(spool_fd, &st) != 0, "Spool file creation did not work.");
+    uint8_t header[FORWARD_SPOOL_HEADER];
+    if (st.st_size >= FORWARD_SPOOL_HEADER && pread(spool_fd, header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header, FORWARD_SPOOL_MAGIC, 8) == 0) {
+        spool_size = st.st_size;
+        memcpy(&spool_acked, header + 8, sizeof(spool_acked));
+        if (spool_acked < FORWARD_SPOOL_HEADER || spool_acked > spool_size) spool_acked = FORWARD_SPOOL_HEADER;
+    } else {
+        ERROR_HANDLER(ftruncate(spool_fd, 0) != 0, "Spool write failed.");
+        spool_size = spool_acked = FORWARD_SPOOL_HEADER;
+        spool_write_header();
+    }
+    spool_drain = spool_acked;
+    if (spool_size > spool_acked) TRACE_INFO("Spool holds %lu bytes of an earlier run.", spool_size - spool_acked);
+}
+
+static void spool_append(forward_frame_t *f) {
+    ERROR_HANDLER(pwrite(spool_fd, f->bytes, f->len, spool_size) != (ssize_t) f->len, "Spool write failed.");
+    spool_size += f->len;
+    metrics_add(METRIC_FORWARD_FRAMES_SPOOLED, 1);
+    free(f);
+}
+
+/**
+ * Reads the frame at spool_drain.
+ * \return the frame, NULL if the spool ends in a frame torn by a crash, which is then cut off
+ */
+static forward_frame_t *spool_read() {
+    uint8_t header[FORWARD_FRAME_HEADER];
+    uint32_t magic, payload;
+    if (spool_size - spool_drain >= FORWARD_FRAME_HEADER &&
+        pread(spool_fd, header, sizeof(header), spool_drain) == sizeof(header)) {
+        memcpy(&magic, header, sizeof(magic));
+        memcpy(&payload, header + 4, sizeof(payload));
+        if (magic == FORWARD_FRAME_MAGIC && payload <= spool_size - spool_drain - FORWARD_FRAME_HEADER) {
+            uint32_t len = FORWARD_FRAME_HEADER + payload;
+            forward_frame_t *f = malloc(sizeof(forward_frame_t) + len);
+            ERROR_HANDLER(f == NULL, "Frame malloc failed.");
+            if (pread(spool_fd, f->bytes, len, spool_drain) == (ssize_t) len) {
+                memcpy(&f->seq, f->bytes + 16, sizeof(f->seq));
+                memcpy(&f->readings, f->bytes + 24, sizeof(f->readings));
+                f->len = len;
+                spool_drain += len;
+                f->spool_end = spool_drain;
+                return f;
+            }
+            free(f);
+        }
+    }
+    TRACE_ERROR("Spool torn at %lu, %lu bytes dropped.", spool_drain, spool_size - spool_drain);
+    spool_size = spool_drain;
+    ERROR_HANDLER(ftruncate(spool_fd, spool_size) != 0, "Spool write failed.");
+    return NULL;
+}
+
+/**
+ * Moves the acknowledged part of the spool up to 'end', an empty spool starts over at the header.
+ */
+static void spool_ack(uint64_t end) {
+    spool_acked = end;
+    if (spool_acked == spool_size) {
+        spool_size = spool_drain = spool_acked = FORWARD_SPOOL_HEADER;
+        ERROR_HANDLER(ftruncate(spool_fd, spool_size) != 0, "Spool write failed.");
+    }
+    spool_write_header();
+}
+
+static int batch_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    if (batch_id[x] != batch_id[y]) return batch_id[x] < batch_id[y] ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Turns the gathered readings into a frame: grouped by sensor, in arrival order within a sensor, so every group
+ * compresses like a segment block does.
+ */
+static forward_frame_t *forward_seal() {
+    for (uint32_t i = 0; i < batch_n; ++i) batch_order[i] = i;
+    qsort(batch_order, batch_n, sizeof(batch_order[0]), batch_cmp);
+
+    size_t len = FORWARD_FRAME_HEADER;
+    uint32_t groups = 0;
+    for (uint32_t i = 0, j; i < batch_n; i = j) {
+        sensor_id_t id = batch_id[batch_order[i]];
+        for (j = i; j < batch_n && batch_id[batch_order[j]] == id; ++j) {
+            group_ts[j - i] = batch_ts[batch_order[j]];
+            group_value[j - i] = batch_value[batch_order[j]];
+        }
+        uint32_t count = j - i;
+        size_t at = len;
+        len += FORWARD_GROUP_HEADER;
+        while (frame_cap < len) {
+            frame_cap *= 2;
+            frame_buf = realloc(frame_buf, frame_cap);
+            ERROR_HANDLER(frame_buf == NULL, "Frame realloc failed.");
+        }
+        uint32_t nbytes = (uint32_t) tsseg_pack(&frame_buf, &frame_cap, len, group_ts, group_value, count);
+        uint16_t reserved = 0;
+        memcpy(frame_buf + at, &id, sizeof(id));
+        memcpy(frame_buf + at + 2, &reserved, sizeof(reserved));
+        memcpy(frame_buf + at + 4, &count, sizeof(count));
+        memcpy(frame_buf + at + 8, &nbytes, sizeof(nbytes));
+        len += nbytes;
+        groups++;
+    }
+
+    uint32_t magic = FORWARD_FRAME_MAGIC, payload = (uint32_t) (len - FORWARD_FRAME_HEADER);
+    uint64_t seq = ++forward_seq;
+    memcpy(frame_buf, &magic, sizeof(magic));
+    memcpy(frame_buf + 4, &payload, sizeof(payload));
+    memcpy(frame_buf + 8, &forward_epoch, sizeof(forward_epoch));
+    memcpy(frame_buf + 16, &seq, sizeof(seq));
+    memcpy(frame_buf + 24, &batch_n, sizeof(batch_n));
+    memcpy(frame_buf + 28, &groups, sizeof(groups));
+
+    forward_frame_t *f = malloc(sizeof(forward_frame_t) + len);
+    ERROR_HANDLER(f == NULL, "Frame malloc failed.");
+    memcpy(f->bytes, frame_buf, len);
+    f->seq = seq;
+    f->readings = batch_n;
+    f->len = (uint32_t) len;
+    f->spool_end = 0;
+    batch_n = 0;
+    return f;
+}
+
+static int forward_send(const forward_frame_t *f) {
+    size_t off = 0;
+    while (off < f->len) {
+        ssize_t n = send(forward_fd, f->bytes + off, f->len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1; // Also the send timeout, a collector that stopped reading is as good as down.
+        off += n;
+    }
+    metrics_add(METRIC_FORWARD_FRAMES_SENT, 1);
+    metrics_add(METRIC_FORWARD_BYTES_SENT, f->len);
+    return 0;
+}
+
+/**
+ * Drops the connection, the frames in flight stay and are sent again on the next one.
+ */
+static void forward_disconnect() {
+    close(forward_fd);
+    forward_fd = -1;
+    ack_len = 0;
+    forward_retry_ns = metrics_now() + FORWARD_RETRY_MS * 1000000LL;
+    TRACE_INFO("Collector connection lost, %i frames in flight.", inflight_count);
+}
+
+static void forward_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(fd == -1, "Socket creation failed.");
+    struct timeval timeout = {FORWARD_TIMEOUT_MS / 1000, FORWARD_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // Bounds connect() as well.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *) &forward_addr, sizeof(forward_addr)) != 0) {
+        close(fd);
+        forward_retry_ns = metrics_now() + FORWARD_RETRY_MS * 1000000LL;
+        return;
+    }
+    forward_fd = fd;
+    metrics_add(METRIC_FORWARD_CONNECTS, 1);
+    TRACE_INFO("Collector connected, %i frames in flight.", inflight_count);
+
+    // The frames in flight when the last connection broke may or may not have arrived, send them again.
+    for (forward_frame_t *f = inflight_head; f != NULL; f = f->next) {
+        if (forward_send(f) != 0) {
+            forward_disconnect();
+            return;
+        }
+    }
+}
+
+static void forward_read_acks() {
+    while (forward_fd != -1) {
+        ssize_t n = recv(forward_fd, ack_buf + ack_len, FORWARD_ACK_SIZE - ack_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            forward_disconnect();
+            return;
+        }
+        ack_len += n;
+        if (ack_len < FORWARD_ACK_SIZE) continue;
+        ack_len = 0;
+        uint64_t seq;
+        memcpy(&seq, ack_buf, sizeof(seq));
+        if (inflight_head == NULL || inflight_head->seq != seq) {
+            TRACE_ERROR("Collector acked frame %lu out of order.", seq);
+            forward_disconnect();
+            return;
+        }
+        forward_frame_t *f = inflight_pop();
+        metrics_add(METRIC_FORWARD_FRAMES_ACKED, 1);
+        metrics_add(METRIC_FORWARD_READINGS_ACKED, f->readings);
+        if (f->spool_end) spool_ack(f->spool_end);
+        free(f);
+    }
+}
+
+/**
+ * A live frame goes out right away while the collector keeps up and nothing older waits in the spool, otherwise it
+ * queues behind the spool so the collector gets the frames in order.
+ */
+static void forward_route(forward_frame_t *f) {
+    bool can_send = forward_fd != -1 && inflight_count < FORWARD_WINDOW;
+    if (can_send && spool_drain == spool_size) {
+        inflight_push(f);
+        if (forward_send(f) != 0) forward_disconnect();
+    } else {
+        // Only the backlog is held to FORWARD_DRAIN_RATE, a frame that could have gone out brings its own tokens.
+        if (can_send) drain_tokens += f->len;
+        spool_append(f);
+    }
+}
+
+/**
+ * Reconnects when it is time to, takes the acks in and sends from the spool.
+ */
+static void forward_pump(int64_t now) {
+    if (forward_fd == -1 && now >= forward_retry_ns) forward_connect();
+    forward_read_acks();
+
+    // The backlog goes at FORWARD_DRAIN_RATE on top of the live frames queued behind it, so a collector coming
+    // back is not flooded by every gateway at once. The refill is capped, the tokens live frames brought are not.
+    double cap = drain_tokens > FORWARD_DRAIN_RATE ? drain_tokens : FORWARD_DRAIN_RATE;
+    drain_tokens += (now - drain_refill_ns) / 1e9 * FORWARD_DRAIN_RATE;
+    if (drain_tokens > cap) drain_tokens = cap;
+    drain_refill_ns = now;
+    while (forward_fd != -1 && spool_drain < spool_size && inflight_count < FORWARD_WINDOW && drain_tokens > 0) {
+        forward_frame_t *f = spool_read();
+        if (f == NULL) break;
+        drain_tokens -= f->len;
+        inflight_push(f);
+        if (forward_send(f) != 0) forward_disconnect();
+    }
+}
+
+/**
+ * Waits a little for the acks of the frames in flight and spools whatever is not acknowledged.
+ */
+static void forward_close() {
+    int64_t deadline = metrics_now() + FORWARD_CLOSE_TIMEOUT_MS * 1000000LL;
+    while (inflight_count > 0 && forward_fd != -1 && metrics_now() < deadline) {
+        struct pollfd pfd = {forward_fd, POLLIN, 0};
+        poll(&pfd, 1, 10);
+        forward_read_acks();
+    }
+    while (inflight_head != NULL) {
+        forward_frame_t *f = inflight_pop();
+        if (f->spool_end == 0) spool_append(f);
+        else free(f); // Still in the spool after spool_acked.
+    }
+    if (forward_fd != -1) close(forward_fd);
+    forward_fd = -1;
+    if (spool_size > spool_acked) TRACE_INFO("Spool keeps %lu bytes for the next run.", spool_size - spool_acked);
+    fdatasync(spool_fd);
+    close(spool_fd);
+    spool_fd = -1;
+    free(frame_buf);
+    frame_buf = NULL;
+}
+
+void *forward_init() {
+    placement_apply(PLACEMENT_FORWARD);
+    spool_open();
+    frame_cap = 64 * 1024;
+    frame_buf = malloc(frame_cap);
+    ERROR_HANDLER(frame_buf == NULL, "Frame malloc failed.");
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    forward_epoch = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    drain_refill_ns = metrics_now();
+    forward_retry_ns = 0;
+
+    sbuffer_node_t *node = NULL;
+    sensor_data_t *data;
+    bool eof = false;
+    while (!eof) {
+        // Take what the buffer has, up to a frame. The buffer does not wait for this thread, it is always free to
+        // fall behind while the collector is slow.
+        int64_t t = metrics_now();
+        uint32_t got = 0;
+        while (batch_n < FORWARD_BATCH_READINGS && sbuffer_read(&node, &data) != SBUFFER_NO_DATA) {
+            if (data->id == 0) {
+                eof = true;
+                break;
+            }
+            metrics_add(METRIC_SBUFFER_READ_FORWARD, 1);
+            if (batch_n == 0) batch_start_ns = t;
+            batch_id[batch_n] = data->id;
+            batch_ts[batch_n] = data->ts;
+            batch_value[batch_n] = data->value;
+            batch_n++;
+            got++;
+        }
+        if (batch_n == FORWARD_BATCH_READINGS ||
+            (batch_n > 0 && (eof || t - batch_start_ns >= FORWARD_BATCH_MS * 1000000LL))) {
+            forward_route(forward_seal());
+        }
+        forward_pump(t);
+        if (got == 0 && !eof) {
+            struct pollfd pfd = {forward_fd, POLLIN, 0};
+            poll(&pfd, forward_fd != -1, 1); // Wake up for an ack, or after a millisecond.
+        }
+    }
+    forward_close();
+    pthread_exit(NULL);
+}
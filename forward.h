@@ -0,0 +1,80 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _FORWARD_H_
+#define _FORWARD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+#ifndef FORWARD_BATCH_READINGS
+#define FORWARD_BATCH_READINGS 4096 // Readings gathered into one frame.
+#endif
+
+#ifndef FORWARD_BATCH_MS
+#define FORWARD_BATCH_MS 100 // Milliseconds a frame is kept open for more readings, the latency added upstream.
+#endif
+
+#ifndef FORWARD_WINDOW
+#define FORWARD_WINDOW 16 // Frames sent and not yet acknowledged, newer ones go to the spool.
+#endif
+
+#ifndef FORWARD_RETRY_MS
+#define FORWARD_RETRY_MS 1000 // Milliseconds between attempts to reach the collector.
+#endif
+
+#ifndef FORWARD_TIMEOUT_MS
+#define FORWARD_TIMEOUT_MS 1000 // A connect or send that takes longer counts as the collector being down.
+#endif
+
+#ifndef FORWARD_DRAIN_RATE
+#define FORWARD_DRAIN_RATE (1024 * 1024) // Bytes per second of backlog sent once the collector is back, on top of live.
+#endif
+
+#ifndef FORWARD_CLOSE_TIMEOUT_MS
+#define FORWARD_CLOSE_TIMEOUT_MS 2000 // At shutdown, how long to wait for acks before spooling what is in flight.
+#endif
+
+#define FORWARD_SPOOL_FILE "forward.spool"
+#define FORWARD_SPOOL_MAGIC "FWDSPOOL"
+#define FORWARD_SPOOL_HEADER 16 // The magic, then the offset of the first frame not acknowledged yet (uint64).
+
+#define FORWARD_FRAME_MAGIC 0x31445746u // "FWD1"
+#define FORWARD_FRAME_HEADER 32
+#define FORWARD_GROUP_HEADER 12
+#define FORWARD_ACK_SIZE 8
+
+/*
+ * The forwarder is a third consumer of the shared buffer: it batches the readings into frames and sends them to a
+ * collector over TCP. It never holds up the connection manager, the buffer does not wait for its readers.
+ *   frame: magic (uint32) | payload bytes (uint32) | epoch (uint64) | seq (uint64) | readings (uint32) |
+ *          groups (uint32) | groups...
+ *   group: sensor id (uint16) | reserved (uint16) | points (uint32) | bytes (uint32) | the points, tsseg_pack()ed
+ * The epoch is the start time of the gateway run in ns and seq counts its frames from 1, together they name a frame.
+ * The collector answers every frame with its seq (uint64), in order. A frame that cannot be sent, or does not fit
+ * the window, is appended to FORWARD_SPOOL_FILE; once the collector is reachable the spool is sent in order at
+ * FORWARD_DRAIN_RATE. Live frames queue behind it until it is empty, so within a run frames reach the collector in
+ * seq order. The spool survives a restart; frames still in flight at shutdown are spooled after it, and reach the
+ * collector after the frames spooled before them. Delivery is at least once: frames in flight when a connection
+ * breaks are sent again, the collector drops the ones it already has. Integers are in host byte order, like the
+ * segments.
+ */
+
+extern bool forward_on;
+
+/**
+ * Forwards the readings to the collector at 'upstream' once the forwarder thread runs. Call before it starts.
+ * \param upstream "<ip>:<port>"
+ * \return 0 on success, -1 if it is not a valid address
+ */
+int forward_select_upstream(const char *upstream);
+
+/**
+ * The forwarder thread, reads the shared buffer until the EOF marker. Start it only if forward_on.
+ */
+void *forward_init();
+
+#endif //_FORWARD_H_
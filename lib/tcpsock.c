@@ -212,7 +212,8 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size, int timeout) {
     tv.tv_usec = 0;
     setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 
-    *buf_size = recv(socket->sd, buffer, *buf_size, 0);
+    // A reading arrives as one stream, MSG_WAITALL keeps a field split over two segments from being read in halves.
+    *buf_size = recv(socket->sd, buffer, *buf_size, MSG_WAITALL);
     TCP_DEBUG_PRINTF(*buf_size == 0, "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
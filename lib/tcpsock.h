@@ -15,7 +15,7 @@
 #define    TCP_CONNECTION_CLOSED    4   // send/receive indicate connection is closed
 #define    TCP_MEMORY_ERROR         5   // mem alloc error
 
-#define MAX_PENDING 10
+#define MAX_PENDING 1024 // Sensors reconnecting at once must not overflow it, the kernel caps it at net.core.somaxconn
 
 typedef struct tcpsock tcpsock_t;
 
@@ -0,0 +1,102 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "logfmt.h"
+
+static void print_help(void);
+
+/**
+ * Renders the binary gateway log as the text log, optionally filtered, for example:
+ *   log_decode -c TOO_HOT -c TOO_COLD -s 37 -f 1672531200 gateway.bin
+ */
+int main(int argc, char *argv[]) {
+    uint32_t codes = 0; // Bit per log code to show, 0 shows all.
+    long sensor = -1;
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    int raw = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:f:t:rh")) != -1) {
+        switch (opt) {
+            case 'c': {
+                int code = logfmt_code_parse(optarg);
+                ERROR_HANDLER(code < 0 || code >= 32, "Unknown log code.");
+                codes |= 1u << code;
+                break;
+            }
+            case 's':
+                sensor = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                from = strtoll(optarg, NULL, 10);
+                break;
+            case 't':
+                to = strtoll(optarg, NULL, 10);
+                break;
+            case 'r':
+                raw = 1;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : LOGFMT_BINARY_FILE;
+
+    int fd = open(path, O_RDONLY);
+    ERROR_HANDLER(fd == -1, "Could not open the log.");
+    struct stat st;
+    ERROR_HANDLER(fstat(fd, &st) != 0 || st.st_size < LOGFMT_HEADER_SIZE, "Not a binary gateway log.");
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    ERROR_HANDLER(map == MAP_FAILED, "Could not map the log.");
+    uint32_t size;
+    memcpy(&size, map + 8, sizeof(size));
+    ERROR_HANDLER(memcmp(map, LOGFMT_MAGIC, 8) != 0 || size != sizeof(logfmt_record_t), "Not a binary gateway log.");
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    // A record torn by a crash of the logger is ignored.
+    size_t n = (st.st_size - LOGFMT_HEADER_SIZE) / sizeof(logfmt_record_t);
+    for (size_t i = 0; i < n; ++i) {
+        logfmt_record_t r;
+        memcpy(&r, map + LOGFMT_HEADER_SIZE + i * sizeof(logfmt_record_t), sizeof(r));
+        if (codes && (r.code >= 32 || !(codes & (1u << r.code)))) continue;
+        if (sensor >= 0 && r.id != sensor) continue;
+        int64_t sec = r.real_ns / 1000000000;
+        if (sec < from || sec > to) continue;
+
+        if (raw) {
+            const char *name = logfmt_code_name(r.code);
+            printf("%" PRIu64 " %" PRId64 " %" PRId64 " %s %u %.17g\n", r.seq, r.real_ns, r.mono_ns,
+                   name ? name : "?", r.id, r.value);
+        } else {
+            logfmt_text(stdout, &r);
+        }
+    }
+    munmap((void *) map, st.st_size);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+static void print_help(void) {
+    printf("Use this program as: log_decode [options] [log file, default %s]\n", LOGFMT_BINARY_FILE);
+    printf("\t%-10s : only events with this code, by name (TOO_HOT) or number, can be repeated\n", "-c code");
+    printf("\t%-10s : only events of this sensor\n", "-s id");
+    printf("\t%-10s : only events at or after t0 (UTC seconds)\n", "-f t0");
+    printf("\t%-10s : only events at or before t1 (UTC seconds)\n", "-t t1");
+    printf("\t%-10s : print seq, realtime ns, monotonic ns, code, sensor and value instead of the text\n", "-r");
+}
@@ -0,0 +1,117 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "logfmt.h"
+
+_Static_assert(sizeof(logfmt_record_t) == 40, "Binary log records must not contain padding.");
+
+static const char *const code_names[] = {
+        [LOG_NEW_CONNECTION] = "NEW_CONNECTION",
+        [LOG_CLOSED_CONNECTION] = "CLOSED_CONNECTION",
+        [LOG_TOO_COLD] = "TOO_COLD",
+        [LOG_TOO_HOT] = "TOO_HOT",
+        [LOG_INVALID_ID] = "INVALID_ID",
+        [LOG_NEW_DATA_FILE] = "NEW_DATA_FILE",
+        [LOG_DATA_INSERT] = "DATA_INSERT",
+        [LOG_DATA_FILE_CLOSED] = "DATA_FILE_CLOSED",
+        [LOG_TIMEOUT] = "TIMEOUT",
+        [LOG_WAL_REPLAY] = "WAL_REPLAY",
+        [LOG_SUPPRESSED] = "SUPPRESSED",
+};
+
+#define N_CODES ((int) (sizeof(code_names) / sizeof(code_names[0])))
+
+/**
+ * Writes the name of the file a data file event is about into 'buf'.
+ */
+static void data_file_name(char *buf, size_t size, const logfmt_record_t *r) {
+    switch (r->aux) {
+        case DB_STORE_SQLITE:
+            snprintf(buf, size, "data.db");
+            break;
+        case DB_STORE_SEG:
+            snprintf(buf, size, "data-%.0lf.seg", r->value);
+            break;
+        default:
+            if (r->value == 0) snprintf(buf, size, "data.csv");
+            else snprintf(buf, size, "data-%06.0lf.csv", r->value);
+    }
+}
+
+void logfmt_text(FILE *out, const logfmt_record_t *r) {
+    char name[64];
+    fprintf(out, "%" PRIu64 " %lu ", r->seq, (unsigned long) (r->real_ns / 1000000000));
+    switch (r->code) {
+        case LOG_NEW_CONNECTION:
+            fprintf(out, "Sensor node %i has opened a new connection.\n", r->id);
+            break;
+        case LOG_CLOSED_CONNECTION:
+            fprintf(out, "Sensor node %i has closed the connection.\n", r->id);
+            break;
+        case LOG_TIMEOUT:
+            fprintf(out, "Sensor node %i has timed-out.\n", r->id);
+            break;
+        case LOG_TOO_COLD:
+            fprintf(out, "Sensor node %i reports it’s too cold (avg temp = %lf).\n", r->id, r->value);
+            break;
+        case LOG_TOO_HOT:
+            fprintf(out, "Sensor node %i reports it’s too hot (avg temp = %lf).\n", r->id, r->value);
+            break;
+        case LOG_INVALID_ID:
+            fprintf(out, "Received sensor data with invalid sensor node ID %i.\n", r->id);
+            break;
+        case LOG_NEW_DATA_FILE:
+            data_file_name(name, sizeof(name), r);
+            fprintf(out, "A new data file %s has been created.\n", name);
+            break;
+        case LOG_DATA_INSERT:
+            fprintf(out, "Data insertion of %.0lf readings succeeded.\n", r->value);
+            break;
+        case LOG_DATA_FILE_CLOSED:
+            data_file_name(name, sizeof(name), r);
+            fprintf(out, "The data file %s has been closed.\n", name);
+            break;
+        case LOG_WAL_REPLAY:
+            fprintf(out, "Recovered %.0lf readings from the write-ahead log.\n", r->value);
+            break;
+        case LOG_SUPPRESSED: {
+            const char *name = logfmt_code_name((int) r->aux);
+            if (r->id == 0) fprintf(out, "Suppressed %.0lf %s events.\n", r->value, name ? name : "unknown");
+            else fprintf(out, "Suppressed %.0lf %s events of sensor node %i.\n", r->value, name ? name : "unknown",
+                         r->id);
+            break;
+        }
+        default:
+            fprintf(out, "Unknown event %i (sensor %i, value %lf).\n", r->code, r->id, r->value);
+    }
+}
+
+const char *logfmt_code_name(int code) {
+    return code >= 0 && code < N_CODES ? code_names[code] : NULL;
+}
+
+int logfmt_code_parse(const char *name) {
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (*name && *end == '\0') return n >= 0 && n < N_CODES ? (int) n : -1;
+    if (strncasecmp(name, "LOG_", 4) == 0) name += 4;
+    for (int i = 0; i < N_CODES; ++i) {
+        if (code_names[i] && strcasecmp(name, code_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int logfmt_write_header(FILE *out) {
+    char header[LOGFMT_HEADER_SIZE] = {0};
+    uint32_t size = sizeof(logfmt_record_t);
+    memcpy(header, LOGFMT_MAGIC, 8);
+    memcpy(header + 8, &size, sizeof(size));
+    return fwrite(header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
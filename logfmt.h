@@ -0,0 +1,55 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _LOGFMT_H_
+#define _LOGFMT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sensor_db.h"
+
+#define LOGFMT_TEXT_FILE "gateway.log"
+#define LOGFMT_BINARY_FILE "gateway.bin"
+
+#define LOGFMT_MAGIC "GWLOG001"
+#define LOGFMT_HEADER_SIZE 16 // The magic and the size of a record (uint32), then 4 reserved bytes.
+
+/**
+ * One event of the binary log, as written to gateway.bin after its header. The timestamps are taken by the thread
+ * that raised the event, not by the logger.
+ */
+typedef struct {
+    uint64_t seq;               /**< number of the event, the first one is 1 */
+    int64_t mono_ns;            /**< CLOCK_MONOTONIC of the event, for durations between events */
+    int64_t real_ns;            /**< CLOCK_REALTIME of the event, nanoseconds since the epoch */
+    uint16_t code;              /**< a log_codes value */
+    uint16_t id;                /**< sensor id, 0 if the event has none */
+    uint32_t aux;               /**< code counted by SUPPRESSED, db_store_kind of a data file */
+    double value;               /**< the data of the event */
+} logfmt_record_t;
+
+/**
+ * Renders a record as a line of the text log: "<seq> <realtime seconds> <message>\n".
+ */
+void logfmt_text(FILE *out, const logfmt_record_t *record);
+
+/**
+ * \return the name of a log code without the LOG_ prefix, e.g. "TOO_HOT", or NULL if the code is unknown
+ */
+const char *logfmt_code_name(int code);
+
+/**
+ * Parses a log code given by name (with or without LOG_, any case) or by number.
+ * \return the code, or -1 if there is none
+ */
+int logfmt_code_parse(const char *name);
+
+/**
+ * Writes the header of a binary log.
+ * \return 0 on success, -1 on a write error
+ */
+int logfmt_write_header(FILE *out);
+
+#endif //_LOGFMT_H_
@@ -0,0 +1,194 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "logpolicy.h"
+#include "logfmt.h"
+
+typedef enum {
+    POLICY_ALWAYS,
+    POLICY_SAMPLE,
+    POLICY_RATE
+} policy_mode_t;
+
+/**
+ * A token bucket kept as the theoretical arrival time of the next event (GCRA), so one compare-and-swap updates
+ * it. An event passes if it is no more than 'tolerance' ahead of that time.
+ */
+typedef struct {
+    int64_t interval_ns;        // 1 / rate
+    int64_t tolerance_ns;       // (burst - 1) / rate
+} bucket_t;
+
+typedef struct {
+    atomic_llong tat;
+    atomic_ullong suppressed;
+} sensor_state_t;
+
+typedef struct {
+    policy_mode_t mode;
+    uint64_t sample_n;
+    bucket_t rate;
+    atomic_ullong seen;                 // Events offered, for sampling.
+    atomic_llong tat;
+    atomic_ullong suppressed;
+    bucket_t sensor_rate;               // interval_ns == 0 when there is no per-sensor rule.
+    sensor_state_t *sensors;            // UINT16_MAX + 1 entries when there is a per-sensor rule.
+    sensor_id_t *dirty[2];              // Sensors whose counter left 0 since the last report, in dirty[listing].
+    size_t n_dirty[2];
+    int listing;
+} code_policy_t;
+
+static code_policy_t policies[LOG_CODE_COUNT];
+static atomic_llong next_report = 0;
+static pthread_mutex_t dirty_mtx = PTHREAD_MUTEX_INITIALIZER; // Guards the dirty lists, taken once per sensor
+                                                               // and report interval.
+static pthread_mutex_t report_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static bool bucket_take(const bucket_t *b, atomic_llong *tat, int64_t now) {
+    long long cur = atomic_load_explicit(tat, memory_order_relaxed);
+    long long next;
+    do {
+        long long base = cur > now ? cur : now;
+        if (base - now > b->tolerance_ns) return false;
+        next = base + b->interval_ns;
+    } while (!atomic_compare_exchange_weak_explicit(tat, &cur, next, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+static int bucket_parse(bucket_t *b, const char *args) {
+    double rate, burst;
+    if (sscanf(args, "%lf %lf", &rate, &burst) != 2 || rate <= 0 || burst < 1) return -1;
+    b->interval_ns = (int64_t) (1e9 / rate);
+    if (b->interval_ns < 1) b->interval_ns = 1;
+    b->tolerance_ns = (int64_t) ((burst - 1) * b->interval_ns);
+    return 0;
+}
+
+/**
+ * Applies one rule line.
+ * @return 0 on success, -1 on a syntax error
+ */
+static int policy_rule(char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+    char name[32], kind[16];
+    int used = 0;
+    int fields = sscanf(line, "%31s %15s %n", name, kind, &used);
+    if (fields <= 0) return 0; // Empty or comment.
+    int code = logfmt_code_parse(name);
+    if (fields != 2 || code < 0 || code >= LOG_CODE_COUNT || code == LOG_SUPPRESSED) return -1;
+
+    code_policy_t *p = &policies[code];
+    const char *args = line + used;
+    if (strcmp(kind, "always") == 0) {
+        p->mode = POLICY_ALWAYS;
+    } else if (strcmp(kind, "sample") == 0) {
+        unsigned long long n;
+        if (sscanf(args, "%llu", &n) != 1 || n == 0) return -1;
+        p->mode = POLICY_SAMPLE;
+        p->sample_n = n;
+    } else if (strcmp(kind, "rate") == 0) {
+        if (bucket_parse(&p->rate, args) != 0) return -1;
+        p->mode = POLICY_RATE;
+    } else if (strcmp(kind, "sensor") == 0) {
+        if (bucket_parse(&p->sensor_rate, args) != 0) return -1;
+        if (p->sensors == NULL) {
+            p->sensors = calloc(UINT16_MAX + 1, sizeof(sensor_state_t));
+            p->dirty[0] = malloc((UINT16_MAX + 1) * sizeof(sensor_id_t));
+            p->dirty[1] = malloc((UINT16_MAX + 1) * sizeof(sensor_id_t));
+            ERROR_HANDLER(p->sensors == NULL || p->dirty[0] == NULL || p->dirty[1] == NULL,
+                          "Log policy malloc failed.");
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int logpolicy_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    char *line = NULL;
+    size_t cap = 0;
+    int res = 0, n = 0;
+    while (getline(&line, &cap, f) > 0) {
+        n++;
+        if (policy_rule(line) != 0) {
+            fprintf(stderr, "%s:%i: invalid log policy\n", path, n);
+            res = -1;
+        }
+    }
+    free(line);
+    fclose(f);
+    return res;
+}
+
+bool logpolicy_allow(log_codes code, sensor_id_t id, int64_t now_ns) {
+    if ((unsigned) code >= LOG_CODE_COUNT) return true;
+    code_policy_t *p = &policies[code];
+
+    bool pass = true;
+    if (p->mode == POLICY_SAMPLE) {
+        pass = atomic_fetch_add_explicit(&p->seen, 1, memory_order_relaxed) % p->sample_n == 0;
+    } else if (p->mode == POLICY_RATE) {
+        pass = bucket_take(&p->rate, &p->tat, now_ns);
+    }
+    if (!pass) {
+        atomic_fetch_add_explicit(&p->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+
+    if (p->sensors && !bucket_take(&p->sensor_rate, &p->sensors[id].tat, now_ns)) {
+        if (atomic_fetch_add_explicit(&p->sensors[id].suppressed, 1, memory_order_relaxed) == 0) {
+            // Only the report resets the counter, after it took the list: a sensor is listed at most once.
+            pthread_mutex_lock(&dirty_mtx);
+            p->dirty[p->listing][p->n_dirty[p->listing]++] = id;
+            pthread_mutex_unlock(&dirty_mtx);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool logpolicy_report_due(int64_t now_ns) {
+    long long due = atomic_load_explicit(&next_report, memory_order_relaxed);
+    if (now_ns < due) return false;
+    long long next = now_ns + LOGPOLICY_REPORT_INTERVAL * 1000000000LL;
+    if (due == 0) {
+        // The first call only starts the clock.
+        atomic_compare_exchange_strong(&next_report, &due, next);
+        return false;
+    }
+    return atomic_compare_exchange_strong(&next_report, &due, next);
+}
+
+void logpolicy_report(void (*emit)(log_codes code, sensor_id_t id, uint64_t suppressed)) {
+    pthread_mutex_lock(&report_mtx);
+    for (int code = 0; code < LOG_CODE_COUNT; ++code) {
+        code_policy_t *p = &policies[code];
+        uint64_t n = atomic_exchange_explicit(&p->suppressed, 0, memory_order_relaxed);
+        if (n) emit((log_codes) code, 0, n);
+        if (p->sensors == NULL) continue;
+
+        // New suppressions go to the other list while this one is reported.
+        pthread_mutex_lock(&dirty_mtx);
+        int taken = p->listing;
+        p->listing = !taken;
+        pthread_mutex_unlock(&dirty_mtx);
+        for (size_t i = 0; i < p->n_dirty[taken]; ++i) {
+            sensor_id_t id = p->dirty[taken][i];
+            n = atomic_exchange_explicit(&p->sensors[id].suppressed, 0, memory_order_relaxed);
+            if (n) emit((log_codes) code, id, n);
+        }
+        p->n_dirty[taken] = 0;
+    }
+    pthread_mutex_unlock(&report_mtx);
+}
@@ -0,0 +1,55 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _LOGPOLICY_H_
+#define _LOGPOLICY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor_db.h"
+
+#define LOGPOLICY_FILE "gateway.logpolicy"
+
+#ifndef LOGPOLICY_REPORT_INTERVAL
+#define LOGPOLICY_REPORT_INTERVAL 10 // Seconds between LOG_SUPPRESSED reports of what the policies held back.
+#endif
+
+/*
+ * Every log code starts with the "always" policy. A policy file, one rule per line, changes that:
+ *   <code>  always                     log every event (the default)
+ *   <code>  sample <n>                 log 1 in n events
+ *   <code>  rate <per second> <burst>  token bucket over all events of the code
+ *   <code>  sensor <per second> <burst> token bucket per sensor id, on top of the rule above
+ * Codes are given as in log_decode (TOO_HOT, LOG_TOO_HOT or the number), '#' starts a comment. Policies are
+ * checked in log_pipe_write() without locks, suppressed events are counted and reported as LOG_SUPPRESSED. A
+ * report costs one step per code and per sensor with suppressed events, it never scans every sensor id.
+ */
+
+/**
+ * Reads a policy file. A missing file leaves every code at "always". Must be called before any thread logs.
+ * \return 0 on success, -1 on a syntax error (the line is printed to stderr)
+ */
+int logpolicy_load(const char *path);
+
+/**
+ * Decides whether an event is logged, and counts it as suppressed if not.
+ * \param now_ns CLOCK_MONOTONIC of the event
+ */
+bool logpolicy_allow(log_codes code, sensor_id_t id, int64_t now_ns);
+
+/**
+ * \return true for exactly one caller once every LOGPOLICY_REPORT_INTERVAL, that caller should call
+ * logpolicy_report()
+ */
+bool logpolicy_report_due(int64_t now_ns);
+
+/**
+ * Hands every non-zero suppression counter to 'emit' and resets it. Only the sensors with suppressed events since
+ * the last report are visited. 'id' is 0 for events suppressed by the rule
+ * of the code, and the sensor for events suppressed by its per-sensor rule.
+ */
+void logpolicy_report(void (*emit)(log_codes code, sensor_id_t id, uint64_t suppressed));
+
+#endif //_LOGPOLICY_H_
@@ -0,0 +1,142 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "logring.h"
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+/**
+ * A slot is free for position p when seq == p, and holds the event of position p when seq == p + 1.
+ */
+typedef struct {
+    atomic_size_t seq;
+    log_payload payload;
+} log_slot_t;
+
+typedef struct {
+    atomic_size_t head;                             // Next position producers claim.
+    char pad1[64 - sizeof(atomic_size_t)];          // Producers and the logger work on different cache lines.
+    atomic_size_t tail;                             // Next position the logger reads, only the logger moves it.
+    atomic_int sleeping;                            // The logger blocks on the eventfd.
+    char pad2[64 - sizeof(atomic_size_t) - sizeof(atomic_int)];
+    log_slot_t slots[LOG_RING_SIZE];
+} log_ring_t;
+
+_Static_assert((LOG_RING_SIZE & LOG_RING_MASK) == 0, "LOG_RING_SIZE must be a power of two.");
+
+static log_ring_t *ring = NULL;
+static int ring_efd = -1;
+static pid_t logger_pid = 0;
+static atomic_bool logger_gone = false; // The logger exited, nobody empties the ring anymore.
+
+void logring_init() {
+    ring = mmap(NULL, sizeof(log_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ERROR_HANDLER(ring == MAP_FAILED, "Log ring mapping failed.");
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleeping, 0);
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i) atomic_init(&ring->slots[i].seq, i);
+    ring_efd = eventfd(0, EFD_CLOEXEC);
+    ERROR_HANDLER(ring_efd == -1, "Log eventfd creation failed.");
+}
+
+void logring_set_logger(pid_t pid) {
+    logger_pid = pid;
+}
+
+/**
+ * Checks whether the logger child exited, without reaping it: main still waits for it on shutdown.
+ */
+static bool logring_logger_gone() {
+    if (atomic_load_explicit(&logger_gone, memory_order_relaxed)) return true;
+    if (logger_pid <= 0) return false;
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, logger_pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0) return false;
+    atomic_store_explicit(&logger_gone, true, memory_order_relaxed);
+    return true;
+}
+
+static int64_t logring_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void logring_wake() {
+    if (atomic_load(&ring->sleeping) && atomic_exchange(&ring->sleeping, 0)) {
+        uint64_t one = 1;
+        write(ring_efd, &one, sizeof(one));
+    }
+}
+
+bool logring_push(const log_payload *payload) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    log_slot_t *slot;
+    int64_t give_up_ms = -1; // Set when the ring is first seen full.
+    while (1) {
+        slot = &ring->slots[pos & LOG_RING_MASK];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full: the logger is a whole ring behind. Make sure it is awake and give it the CPU, for a while.
+            if (logring_logger_gone()) return false;
+            int64_t now_ms = logring_now_ms();
+            if (give_up_ms < 0) give_up_ms = now_ms + LOG_RING_FULL_WAIT_MS;
+            else if (now_ms >= give_up_ms) return false;
+            logring_wake();
+            sched_yield();
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed); // Another producer took this slot.
+        }
+    }
+    slot->payload = *payload;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst); // Pairs with the fence in logring_idle().
+    logring_wake();
+    return true;
+}
+
+bool logring_pop(log_payload *payload) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    log_slot_t *slot = &ring->slots[pos & LOG_RING_MASK];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) return false;
+    *payload = slot->payload;
+    atomic_store_explicit(&slot->seq, pos + LOG_RING_SIZE, memory_order_release);
+    atomic_store_explicit(&ring->tail, pos + 1, memory_order_relaxed);
+    return true;
+}
+
+bool logring_idle() {
+    atomic_store(&ring->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    // Either a producer that published before the fence is seen here, or it sees 'sleeping' and writes the eventfd.
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->slots[pos & LOG_RING_MASK].seq, memory_order_acquire) == pos + 1) {
+        atomic_store(&ring->sleeping, 0);
+        return false;
+    }
+    return true;
+}
+
+int logring_fd() {
+    return ring_efd;
+}
@@ -0,0 +1,63 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _LOGRING_H_
+#define _LOGRING_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "sensor_db.h"
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 65536 // Log events the ring holds before producers have to wait, must be a power of two.
+#endif
+
+#ifndef LOG_RING_FULL_WAIT_MS
+#define LOG_RING_FULL_WAIT_MS 100 // How long a producer waits for room in a full ring before it drops its event.
+#endif
+
+/*
+ * A bounded multi-producer single-consumer queue of log_payload in MAP_SHARED memory, so the gateway threads and
+ * the logger child can share it across fork(). Producers claim slots with a compare-and-swap and publish them
+ * through a per-slot sequence number, no lock and no syscall is involved while the logger keeps up. The logger
+ * only blocks on an eventfd when the ring is empty, and producers write to it only if the logger said it sleeps.
+ */
+
+/**
+ * Maps the ring and creates its eventfd. Must be called before fork().
+ */
+void logring_init();
+
+/**
+ * Tells the producers which child takes the events, so a full ring can tell a slow logger from a dead one.
+ */
+void logring_set_logger(pid_t pid);
+
+/**
+ * Appends an event, waiting up to LOG_RING_FULL_WAIT_MS for the logger if the ring is full. Once the logger has
+ * exited, a full ring drops events right away. Can be called from any thread of the process that created the ring.
+ * \return true if the event is in the ring, false if it was dropped
+ */
+bool logring_push(const log_payload *payload);
+
+/**
+ * Takes the oldest event out of the ring. Only the logger process may call this.
+ * \return true if an event was copied into 'payload', false if the ring is empty
+ */
+bool logring_pop(log_payload *payload);
+
+/**
+ * Tells producers that the logger is about to block and checks the ring one last time, call before waiting on
+ * logring_fd(). Events pushed after this call wake the logger up.
+ * \return true if the logger may block, false if an event came in meanwhile
+ */
+bool logring_idle();
+
+/**
+ * \return the eventfd the logger blocks on, read it to reset it
+ */
+int logring_fd();
+
+#endif //_LOGRING_H_
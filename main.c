@@ -1,6 +1,7 @@
 /**
  * \author Nicolas Gutierrez Suarez
  */
+#define _GNU_SOURCE
 
 #include <unistd.h>
 #include <wait.h>
@@ -11,30 +12,88 @@
 #include "connmgr.h"
 #include "sbuffer.h"
 #include "datamgr.h"
+#include "tsstore.h"
+#include "query.h"
+#include "wal.h"
+#include "metrics.h"
+#include "capture.h"
+#include "placement.h"
+#include "forward.h"
+#include "pubsub.h"
 
 int main(int argc, char *argv[]) {
-    ERROR_HANDLER(argc != 2, "Wrong number of arguments.");
+    // Usage: sensor_gateway [-s csv|sqlite|seg] [-l text|binary] [-t] [-S n] [-c capture file] [-a stage=cpus]... [-f collector ip:port] [-m metrics port] <port>
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:tS:c:a:f:m:")) != -1) {
+        switch (opt) {
+            case 's':
+                ERROR_HANDLER(db_select_backend(optarg) != 0, "Unknown storage backend.");
+                break;
+            case 'l':
+                ERROR_HANDLER(log_select_format(optarg) != 0, "Unknown log format.");
+                break;
+            case 't':
+                trace_enable(true); // Trace from startup instead of waiting for SIGUSR1.
+                break;
+            case 'S':
+                db_select_latency_sample(strtoul(optarg, NULL, 10)); // Stage times of 1 in n rows.
+                break;
+            case 'c':
+                capture_select_file(optarg); // Record the received traffic for sensor_replay.
+                break;
+            case 'a':
+                ERROR_HANDLER(placement_select(optarg) != 0, "Invalid thread placement."); // Once per stage.
+                break;
+            case 'f':
+                ERROR_HANDLER(forward_select_upstream(optarg) != 0, "Invalid collector address.");
+                break;
+            case 'm':
+                metrics_select_port(atoi(optarg)); // 0 turns the endpoint off.
+                break;
+            default:
+                ERROR_HANDLER(1, "Unknown option.");
+        }
+    }
+    ERROR_HANDLER(argc - optind != 1, "Wrong number of arguments.");
 
-    long port = strtol(argv[1], NULL, 10);
+    long port = strtol(argv[optind], NULL, 10);
     ERROR_HANDLER(port == LONG_MAX || port == LONG_MIN, "Error parsing port.");
-    DEBUG_PRINTF("Port Selected: %li", port);
+    TRACE_INFO("Port Selected: %li", port);
 
+    placement_apply(PLACEMENT_MAIN); // Before anything is started, the other threads and the logger inherit it.
     log_init(); // Start the logger, the parent process will continue execution here.
+    trace_init(); // Before any thread is created, they inherit its signal mask.
     sbuffer_init(); // Start the buffer.
+    wal_init(); // Replay what a crashed run left in the write-ahead log, before any new reading comes in.
+    tsstore_init(); // Start the in-memory store for range queries, and the socket serving them.
+    query_init();
+    pubsub_init(); // The live stream of readings and events, see pubsub.h.
+    metrics_init();
+    capture_init();
 
-    // Create 3 threads for each part of the server. Join them to wait until all of them terminate.
-    pthread_t tid[3];
+    // Create 3 threads for each part of the server, and the forwarder if there is a collector. Join them to wait
+    // until all of them terminate.
+    pthread_t tid[4];
+    int n_threads = forward_on ? 4 : 3;
     pthread_create(&tid[0], NULL,connmgr_startup, (void *) &port);
     pthread_create(&tid[1], NULL, datamgr_init, NULL);
     pthread_create(&tid[2], NULL, db_init, NULL);
+    if (forward_on) pthread_create(&tid[3], NULL, forward_init, NULL);
 
-    for (int i = 0; i < 3; ++i) {
+    for (int i = 0; i < n_threads; ++i) {
         pthread_join(tid[i], NULL);
     }
 
+    capture_close();
+    query_close();
+    pubsub_close();
+    metrics_close();
+    wal_close();
+
     // When the database is closed, the child process will manage to terminate.
     ERROR_HANDLER(db_close() != 0, "DB closed improperly.");
     wait(NULL);
 
     sbuffer_free();
+    tsstore_free();
 }
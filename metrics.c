@@ -0,0 +1,237 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "metrics.h"
+
+#define METRICS_HIST_MIN_EXP 10 // Smallest bucket bound written, 2^10 ns is about a microsecond.
+#define METRICS_HIST_MAX_EXP 36 // Largest bucket bound written, 2^36 ns is about a minute.
+
+/**
+ * How a counter is written: its name, help and labels. Counters with the same name are one metric family.
+ */
+typedef struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+} counter_desc_t;
+
+static const counter_desc_t counter_desc[METRIC_COUNTERS] = {
+        [METRIC_CONN_OPENED] = {"gateway_connections_opened_total", NULL, "Sensor connections accepted."},
+        [METRIC_CONN_CLOSED] = {"gateway_connections_closed_total", NULL, "Sensor connections ended."},
+        [METRIC_CONN_TIMEOUTS] = {"gateway_connection_timeouts_total", NULL, "Sensor connections ended by a timeout."},
+        [METRIC_CONN_BYTES] = {"gateway_received_bytes_total", NULL, "Bytes received from sensors."},
+        [METRIC_CONN_READINGS] = {"gateway_readings_received_total", NULL, "Readings received from sensors."},
+        [METRIC_SBUFFER_INSERTED] = {"gateway_sbuffer_inserted_total", NULL, "Readings appended to the buffer."},
+        [METRIC_SBUFFER_READ_DATAMGR] = {"gateway_sbuffer_read_total", "consumer=\"datamgr\"",
+                                         "Readings taken from the buffer by a consumer."},
+        [METRIC_SBUFFER_READ_DB] = {"gateway_sbuffer_read_total", "consumer=\"db\"", NULL},
+        [METRIC_DATAMGR_READINGS] = {"gateway_datamgr_readings_total", NULL, "Readings of known sensors averaged."},
+        [METRIC_DATAMGR_TOO_HOT] = {"gateway_datamgr_alerts_total", "kind=\"too_hot\"",
+                                    "Running averages outside the allowed range."},
+        [METRIC_DATAMGR_TOO_COLD] = {"gateway_datamgr_alerts_total", "kind=\"too_cold\"", NULL},
+        [METRIC_DATAMGR_INVALID_ID] = {"gateway_datamgr_invalid_ids_total", NULL, "Readings of unknown sensors."},
+        [METRIC_DB_ROWS] = {"gateway_db_rows_total", NULL, "Rows handed to the storage backend."},
+        [METRIC_DB_FLUSHES] = {"gateway_db_flushes_total", NULL, "Batches written by the storage backend."},
+        [METRIC_SBUFFER_READ_FORWARD] = {"gateway_sbuffer_read_total", "consumer=\"forward\"", NULL},
+        [METRIC_FORWARD_CONNECTS] = {"gateway_forward_connects_total", NULL, "Connections made to the collector."},
+        [METRIC_FORWARD_FRAMES_SENT] = {"gateway_forward_frames_sent_total", NULL,
+                                        "Frames sent to the collector, resends included."},
+        [METRIC_FORWARD_BYTES_SENT] = {"gateway_forward_sent_bytes_total", NULL, "Bytes of frames sent."},
+        [METRIC_FORWARD_FRAMES_ACKED] = {"gateway_forward_frames_acked_total", NULL,
+                                         "Frames the collector acknowledged."},
+        [METRIC_FORWARD_READINGS_ACKED] = {"gateway_forward_readings_acked_total", NULL,
+                                           "Readings in the frames the collector acknowledged."},
+        [METRIC_FORWARD_FRAMES_SPOOLED] = {"gateway_forward_frames_spooled_total", NULL,
+                                           "Frames written to the spool to be sent later."},
+        [METRIC_PUBSUB_PUBLISHED] = {"gateway_pubsub_published_total", NULL, "Events put into the live stream."},
+        [METRIC_PUBSUB_SENT] = {"gateway_pubsub_sent_total", NULL, "Events queued for subscribers."},
+        [METRIC_PUBSUB_SKIPPED] = {"gateway_pubsub_skipped_total", NULL,
+                                   "Matching events sampled subscribers were too slow to get, at most."},
+        [METRIC_PUBSUB_SUBSCRIBED] = {"gateway_pubsub_subscribed_total", NULL, "Subscribers that joined the stream."},
+        [METRIC_PUBSUB_UNSUBSCRIBED] = {"gateway_pubsub_unsubscribed_total", NULL, "Subscribers that left the stream."},
+        [METRIC_PUBSUB_SLOW_DROPS] = {"gateway_pubsub_slow_drops_total", NULL,
+                                      "Subscribers disconnected because they fell behind the stream."},
+        [METRIC_LOG_DROPPED] = {"gateway_log_events_dropped_total", NULL,
+                                "Log events dropped because the logger stopped taking them."},
+};
+
+static const counter_desc_t histogram_desc[METRIC_HISTOGRAMS] = {
+        [METRIC_DB_FLUSH_NS] = {"gateway_db_flush_seconds", NULL,
+                                "Time the DB thread spends on the flush of one batch."},
+        [METRIC_RECEIVE_TO_INSERT_NS] = {"gateway_latency_receive_to_insert_seconds", NULL,
+                                         "From a reading received by connmgr to its insert into the buffer."},
+        [METRIC_INSERT_TO_DATAMGR_NS] = {"gateway_latency_insert_to_datamgr_seconds", NULL,
+                                         "From a reading inserted into the buffer to its processing by the datamgr."},
+        [METRIC_INSERT_TO_WRITE_NS] = {"gateway_latency_insert_to_write_seconds", NULL,
+                                       "From a reading inserted into the buffer to its row handed to the backend."},
+        [METRIC_WRITE_TO_DURABLE_NS] = {"gateway_latency_write_to_durable_seconds", NULL,
+                                        "From a row handed to the backend to its batch in the data file: written by "
+                                        "the csv writer thread or the flush of sqlite and seg, synced if durable."},
+        [METRIC_RECEIVE_TO_DURABLE_NS] = {"gateway_latency_receive_to_durable_seconds", NULL,
+                                          "From a reading received by connmgr to its row in the data file."},
+};
+
+static metrics_shard_t shards[METRICS_SHARDS];
+static atomic_uint next_shard = 0;
+_Thread_local metrics_shard_t *metrics_my_shard = NULL;
+
+static int metrics_port = METRICS_PORT;
+static int metrics_fd = -1;
+static pthread_t metrics_tid;
+static volatile bool metrics_closing = false;
+
+metrics_shard_t *metrics_shard() {
+    metrics_my_shard = &shards[atomic_fetch_add(&next_shard, 1) % METRICS_SHARDS];
+    return metrics_my_shard;
+}
+
+static uint64_t counter_sum(metric_counter_t c) {
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SHARDS; ++i) sum += atomic_load_explicit(&shards[i].counters[c], memory_order_relaxed);
+    return sum;
+}
+
+static void write_family(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes a histogram with a bucket at every power of two nanoseconds from METRICS_HIST_MIN_EXP on.
+ */
+static void write_histogram(FILE *out, metric_histogram_t h) {
+    uint64_t buckets[METRICS_HIST_BUCKETS] = {0};
+    uint64_t sum = 0, count = 0;
+    for (int i = 0; i < METRICS_SHARDS; ++i) {
+        for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) {
+            buckets[b] += atomic_load_explicit(&shards[i].hist[h][b], memory_order_relaxed);
+        }
+        sum += atomic_load_explicit(&shards[i].hist_sum[h], memory_order_relaxed);
+    }
+
+    const char *name = histogram_desc[h].name;
+    write_family(out, name, "histogram", histogram_desc[h].help);
+    int b = 0;
+    for (int e = METRICS_HIST_MIN_EXP; e <= METRICS_HIST_MAX_EXP; ++e) {
+        // Powers of two are bucket bounds, every value below 2^e is in a bucket below metrics_bucket(2^e).
+        for (int end = metrics_bucket(1ULL << e); b < end; ++b) count += buckets[b];
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", name, (double) (1ULL << e) / 1e9, count);
+    }
+    for (; b < METRICS_HIST_BUCKETS; ++b) count += buckets[b];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+    fprintf(out, "%s_sum %.9f\n%s_count %" PRIu64 "\n", name, sum / 1e9, name, count);
+}
+
+void metrics_write(FILE *out) {
+    uint64_t values[METRIC_COUNTERS];
+    for (int c = 0; c < METRIC_COUNTERS; ++c) values[c] = counter_sum(c);
+
+    for (int c = 0; c < METRIC_COUNTERS; ++c) {
+        const counter_desc_t *d = &counter_desc[c];
+        if (d->help) write_family(out, d->name, "counter", d->help);
+        if (d->labels) fprintf(out, "%s{%s} %" PRIu64 "\n", d->name, d->labels, values[c]);
+        else fprintf(out, "%s %" PRIu64 "\n", d->name, values[c]);
+    }
+
+    // Gauges, a reader that is ahead of a sum taken a moment earlier makes a difference negative, clamp it.
+    uint64_t inserted = values[METRIC_SBUFFER_INSERTED];
+    uint64_t read_datamgr = values[METRIC_SBUFFER_READ_DATAMGR], read_db = values[METRIC_SBUFFER_READ_DB];
+    uint64_t lag_datamgr = inserted > read_datamgr ? inserted - read_datamgr : 0;
+    uint64_t lag_db = inserted > read_db ? inserted - read_db : 0;
+    uint64_t lag_slowest = lag_datamgr > lag_db ? lag_datamgr : lag_db;
+    // The forwarder only reads the buffer when the gateway forwards, it shows up once it read something.
+    uint64_t read_forward = values[METRIC_SBUFFER_READ_FORWARD];
+    uint64_t lag_forward = inserted > read_forward ? inserted - read_forward : 0;
+    if (read_forward && lag_forward > lag_slowest) lag_slowest = lag_forward;
+    uint64_t opened = values[METRIC_CONN_OPENED], closed = values[METRIC_CONN_CLOSED];
+    write_family(out, "gateway_connections_active", "gauge", "Sensor connections currently open.");
+    fprintf(out, "gateway_connections_active %" PRIu64 "\n", opened > closed ? opened - closed : 0);
+    uint64_t subscribed = values[METRIC_PUBSUB_SUBSCRIBED], unsubscribed = values[METRIC_PUBSUB_UNSUBSCRIBED];
+    write_family(out, "gateway_pubsub_subscribers", "gauge", "Subscribers of the live stream.");
+    fprintf(out, "gateway_pubsub_subscribers %" PRIu64 "\n", subscribed > unsubscribed ? subscribed - unsubscribed : 0);
+    write_family(out, "gateway_sbuffer_depth", "gauge", "Readings in the buffer the slowest consumer has not read.");
+    fprintf(out, "gateway_sbuffer_depth %" PRIu64 "\n", lag_slowest);
+    write_family(out, "gateway_sbuffer_lag", "gauge", "Readings in the buffer a consumer has not read yet.");
+    fprintf(out, "gateway_sbuffer_lag{consumer=\"datamgr\"} %" PRIu64 "\n", lag_datamgr);
+    fprintf(out, "gateway_sbuffer_lag{consumer=\"db\"} %" PRIu64 "\n", lag_db);
+    if (read_forward) fprintf(out, "gateway_sbuffer_lag{consumer=\"forward\"} %" PRIu64 "\n", lag_forward);
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; ++h) write_histogram(out, h);
+}
+
+/**
+ * Answers one scrape. Every request gets the metrics, whatever its path, and the connection is closed after it.
+ */
+static void metrics_serve(int client) {
+    struct timeval tv = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char req[1024];
+    ssize_t n = read(client, req, sizeof(req)); // The request is not needed, only waited for.
+    FILE *out = fdopen(client, "w");
+    if (out == NULL) {
+        close(client);
+        return;
+    }
+    if (n > 0) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metrics_write(out);
+    }
+    fclose(out);
+}
+
+static void *metrics_thread() {
+    TRACE_INFO("Metrics served on port %i", metrics_port);
+    while (1) {
+        int client = accept(metrics_fd, NULL, NULL);
+        if (client == -1) {
+            if (metrics_closing) break;
+            continue;
+        }
+        metrics_serve(client);
+    }
+    pthread_exit(NULL);
+}
+
+void metrics_select_port(int port) {
+    metrics_port = port;
+}
+
+void metrics_init() {
+    if (metrics_port == 0) return;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(metrics_fd == -1, "Metrics socket creation failed.");
+    int on = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ERROR_HANDLER(bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, "Metrics socket bind failed.");
+    ERROR_HANDLER(listen(metrics_fd, 8) == -1, "Metrics socket listen failed.");
+
+    metrics_closing = false;
+    ERROR_HANDLER(pthread_create(&metrics_tid, NULL, metrics_thread, NULL) != 0, "Metrics thread creation failed.");
+}
+
+void metrics_close() {
+    if (metrics_fd == -1) return;
+    metrics_closing = true;
+    shutdown(metrics_fd, SHUT_RDWR);
+    pthread_join(metrics_tid, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+}
@@ -0,0 +1,151 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifndef METRICS_PORT
+#define METRICS_PORT 9105 // Local TCP port serving GET /metrics in Prometheus text format, 0 disables it.
+#endif
+
+#ifndef METRICS_SHARDS
+#define METRICS_SHARDS 16 // Threads are spread over this many copies of every counter.
+#endif
+
+#define METRICS_HIST_SUB 8 // Sub-buckets per power of two, values are kept within 1/8 of their size.
+#define METRICS_HIST_BUCKETS (41 * METRICS_HIST_SUB) // Up to 2^43 ns, over two hours.
+
+/*
+ * Counters are sharded: every thread adds to the shard it was given on its first update, with a relaxed atomic on a
+ * cache line no busy thread shares, and a scrape sums the shards. Histograms record nanoseconds in log-linear
+ * buckets like HDR histograms do, the same way.
+ */
+
+/**
+ * The counters. Gauges like the buffer depth are derived from them when the metrics are written.
+ */
+typedef enum {
+    METRIC_CONN_OPENED,
+    METRIC_CONN_CLOSED,
+    METRIC_CONN_TIMEOUTS,
+    METRIC_CONN_BYTES,
+    METRIC_CONN_READINGS,
+    METRIC_SBUFFER_INSERTED,
+    METRIC_SBUFFER_READ_DATAMGR,
+    METRIC_SBUFFER_READ_DB,
+    METRIC_DATAMGR_READINGS,
+    METRIC_DATAMGR_TOO_HOT,
+    METRIC_DATAMGR_TOO_COLD,
+    METRIC_DATAMGR_INVALID_ID,
+    METRIC_DB_ROWS,
+    METRIC_DB_FLUSHES,
+    METRIC_SBUFFER_READ_FORWARD,
+    METRIC_FORWARD_CONNECTS,
+    METRIC_FORWARD_FRAMES_SENT,
+    METRIC_FORWARD_BYTES_SENT,
+    METRIC_FORWARD_FRAMES_ACKED,
+    METRIC_FORWARD_READINGS_ACKED,
+    METRIC_FORWARD_FRAMES_SPOOLED,
+    METRIC_PUBSUB_PUBLISHED,
+    METRIC_PUBSUB_SENT,
+    METRIC_PUBSUB_SKIPPED,
+    METRIC_PUBSUB_SUBSCRIBED,
+    METRIC_PUBSUB_UNSUBSCRIBED,
+    METRIC_PUBSUB_SLOW_DROPS,
+    METRIC_LOG_DROPPED,
+    METRIC_COUNTERS // Not a counter, the number of counters.
+} metric_counter_t;
+
+/**
+ * The latency histograms, in nanoseconds.
+ */
+typedef enum {
+    METRIC_DB_FLUSH_NS,
+    METRIC_RECEIVE_TO_INSERT_NS,        // connmgr received a reading until it is in the shared buffer.
+    METRIC_INSERT_TO_DATAMGR_NS,        // In the buffer until the datamgr processed it.
+    METRIC_INSERT_TO_WRITE_NS,          // In the buffer until the DB thread handed it to the backend.
+    METRIC_WRITE_TO_DURABLE_NS,         // Handed to the backend until its batch is in the data file.
+    METRIC_RECEIVE_TO_DURABLE_NS,       // connmgr received a reading until its batch is in the data file.
+    METRIC_HISTOGRAMS // Not a histogram, the number of histograms.
+} metric_histogram_t;
+
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t counters[METRIC_COUNTERS];
+    atomic_uint_fast64_t hist[METRIC_HISTOGRAMS][METRICS_HIST_BUCKETS];
+    atomic_uint_fast64_t hist_sum[METRIC_HISTOGRAMS];
+} metrics_shard_t;
+
+extern _Thread_local metrics_shard_t *metrics_my_shard;
+
+/**
+ * \return CLOCK_MONOTONIC in nanoseconds, the clock of every latency
+ */
+static inline int64_t metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Gives the calling thread its shard, use metrics_add() and metrics_observe() instead.
+ */
+metrics_shard_t *metrics_shard();
+
+static inline void metrics_add(metric_counter_t c, uint64_t n) {
+    metrics_shard_t *s = metrics_my_shard ? metrics_my_shard : metrics_shard();
+    atomic_fetch_add_explicit(&s->counters[c], n, memory_order_relaxed);
+}
+
+/**
+ * \return the histogram bucket of a value: exact below 8, then 8 buckets per power of two
+ */
+static inline int metrics_bucket(uint64_t v) {
+    if (v < METRICS_HIST_SUB) return (int) v;
+    int e = 63 - __builtin_clzll(v); // 3 or more.
+    int b = (e - 2) * METRICS_HIST_SUB + (int) ((v >> (e - 3)) & (METRICS_HIST_SUB - 1));
+    return b < METRICS_HIST_BUCKETS ? b : METRICS_HIST_BUCKETS - 1;
+}
+
+/**
+ * \return the smallest value of a histogram bucket
+ */
+static inline uint64_t metrics_bucket_floor(int b) {
+    if (b < METRICS_HIST_SUB) return (uint64_t) b;
+    int e = b / METRICS_HIST_SUB + 2;
+    return (uint64_t) (METRICS_HIST_SUB + b % METRICS_HIST_SUB) << (e - 3);
+}
+
+static inline void metrics_observe(metric_histogram_t h, uint64_t ns) {
+    metrics_shard_t *s = metrics_my_shard ? metrics_my_shard : metrics_shard();
+    atomic_fetch_add_explicit(&s->hist[h][metrics_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->hist_sum[h], ns, memory_order_relaxed);
+}
+
+/**
+ * Writes every metric in the Prometheus text exposition format.
+ */
+void metrics_write(FILE *out);
+
+/**
+ * Serves the metrics on 'port' instead of METRICS_PORT, so gateways can share a machine. Call before metrics_init().
+ * \param port a TCP port, 0 disables the endpoint
+ */
+void metrics_select_port(int port);
+
+/**
+ * Starts the thread serving the metrics port on the loopback interface, if it is not 0.
+ */
+void metrics_init();
+
+/**
+ * Stops the metrics thread.
+ */
+void metrics_close();
+
+#endif //_METRICS_H_
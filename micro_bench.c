@@ -0,0 +1,413 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "lib/dplist.h"
+#include "config.h"
+#include "sbuffer.h"
+#include "datamgr_kernels.h"
+#include "fmt.h"
+
+#define DEFAULT_REPS 15
+#define DEFAULT_WARMUPS 3
+#define DEFAULT_THRESHOLD 10 // Percent a median may grow over the baseline before it counts as a regression.
+
+/**
+ * One kernel. run() does 'ops' operations, sets up whatever it needs first and returns the cycles of the operations
+ * alone.
+ */
+typedef struct {
+    const char *name;
+    uint64_t (*run)(long ops, long param);
+    long param;
+    long ops;
+} bench_t;
+
+/**
+ * What a kernel cost per operation over the repetitions, in nanoseconds.
+ */
+typedef struct {
+    double min, median, p90, mean, sd;
+} bench_stats_t;
+
+static double cycles_per_ns = 1;
+
+/**
+ * \return the time stamp counter, or the monotonic clock in ns where there is none. The TSC ticks at a constant
+ * rate, so these are reference cycles: they convert to time exactly, not to the core clock under frequency scaling.
+ */
+static inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence(); // Keep the read from being moved before the work it measures.
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static double now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static void calibrate() {
+    double t0 = now_ns();
+    uint64_t c0 = cycles();
+    while (now_ns() - t0 < 50e6);
+    cycles_per_ns = (cycles() - c0) / (now_ns() - t0);
+}
+
+/*
+ * The shared buffer. Readings are allocated before the clock starts, connmgr allocates them outside the buffer too,
+ * and freed with the buffer after it stops.
+ */
+
+static sensor_data_t **readings_alloc(long n) {
+    sensor_data_t **r = malloc(n * sizeof(sensor_data_t *));
+    ERROR_HANDLER(r == NULL, "Readings malloc failed.");
+    for (long i = 0; i < n; ++i) {
+        r[i] = calloc(1, sizeof(sensor_data_t));
+        ERROR_HANDLER(r[i] == NULL, "Reading malloc failed.");
+        r[i]->id = (sensor_id_t) (i % 1000 + 1);
+        r[i]->value = 20;
+        r[i]->ts = 1672531200 + i;
+    }
+    return r;
+}
+
+typedef struct {
+    pthread_barrier_t *start;
+    sensor_data_t **readings;
+    long n;
+} sbuffer_job_t;
+
+static void *sbuffer_writer(void *arg) {
+    sbuffer_job_t *job = arg;
+    pthread_barrier_wait(job->start);
+    for (long i = 0; i < job->n; ++i) sbuffer_insert(job->readings[i]);
+    return NULL;
+}
+
+static void *sbuffer_reader(void *arg) {
+    sbuffer_job_t *job = arg;
+    sbuffer_node_t *node = NULL;
+    sensor_data_t *data;
+    pthread_barrier_wait(job->start);
+    for (long i = 0; i < job->n;) {
+        if (sbuffer_read(&node, &data) == SBUFFER_SUCCESS) i++;
+    }
+    return NULL;
+}
+
+/**
+ * 'writers' threads insert 'ops' readings between them while 'readers' threads read every one of them, like the
+ * connection threads, the datamgr and the DB thread do. The clock runs until the last reader is done.
+ */
+static uint64_t sbuffer_run(long ops, int writers, int readers) {
+    sbuffer_init();
+    sensor_data_t **r = readings_alloc(ops);
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, writers + readers + 1);
+    pthread_t tid[writers + readers];
+    sbuffer_job_t jobs[writers + readers];
+    for (int i = 0; i < writers + readers; ++i) {
+        jobs[i].start = &start;
+        if (i < writers) {
+            long first = ops * i / writers;
+            jobs[i].readings = r + first;
+            jobs[i].n = ops * (i + 1) / writers - first;
+        } else {
+            jobs[i].n = ops;
+        }
+        ERROR_HANDLER(pthread_create(&tid[i], NULL, i < writers ? sbuffer_writer : sbuffer_reader, &jobs[i]) != 0,
+                      "Thread creation failed.");
+    }
+    pthread_barrier_wait(&start);
+    uint64_t t0 = cycles();
+    for (int i = 0; i < writers + readers; ++i) pthread_join(tid[i], NULL);
+    uint64_t t1 = cycles();
+    pthread_barrier_destroy(&start);
+    sbuffer_free();
+    free(r);
+    return t1 - t0;
+}
+
+static uint64_t bench_sbuffer_insert(long ops, long param) {
+    if (param > 1) return sbuffer_run(ops, (int) param, 0);
+    sbuffer_init();
+    sensor_data_t **r = readings_alloc(ops);
+    uint64_t t0 = cycles();
+    for (long i = 0; i < ops; ++i) sbuffer_insert(r[i]);
+    uint64_t t1 = cycles();
+    sbuffer_free();
+    free(r);
+    return t1 - t0;
+}
+
+static uint64_t bench_sbuffer_read(long ops, long param) {
+    (void) param;
+    sbuffer_init();
+    sensor_data_t **r = readings_alloc(ops);
+    for (long i = 0; i < ops; ++i) sbuffer_insert(r[i]);
+    sbuffer_node_t *node = NULL;
+    sensor_data_t *data;
+    double sum = 0;
+    uint64_t t0 = cycles();
+    while (sbuffer_read(&node, &data) == SBUFFER_SUCCESS) sum += data->value; // Touch it, as the consumers do.
+    uint64_t t1 = cycles();
+    ERROR_HANDLER(sum != 20.0 * ops, "Buffer read back wrong.");
+    sbuffer_free();
+    free(r);
+    return t1 - t0;
+}
+
+static uint64_t bench_sbuffer_pipeline(long ops, long param) {
+    return sbuffer_run(ops, (int) param, 2);
+}
+
+/*
+ * The datamgr kernels of datamgr.h, the ones datamgr.c runs on every reading: the scan of the list for the
+ * reading's sensor and the running average.
+ */
+
+static void bench_element_free(void **el) {
+    free(*el);
+}
+
+static uint64_t bench_datamgr_lookup(long ops, long map_size) {
+    dplist_t *list = dpl_create(bench_element_free);
+    for (long i = 0; i < map_size; ++i) {
+        element_t *el = calloc(1, sizeof(element_t));
+        ERROR_HANDLER(el == NULL, "Element malloc failed.");
+        el->sensor_id = (sensor_id_t) (i + 1);
+        dpl_insert_at_index(list, el, 0);
+    }
+    sensor_id_t *ids = malloc(ops * sizeof(sensor_id_t));
+    ERROR_HANDLER(ids == NULL, "Ids malloc failed.");
+    // A lookup costs more the further its sensor is down the list, so every repetition looks up the same ids,
+    // spread evenly over the list, in a shuffled order. Random ids made a handful of lookups measure luck.
+    for (long i = 0; i < ops; ++i) ids[i] = (sensor_id_t) ((2 * i + 1) * map_size / (2 * ops) % map_size + 1);
+    for (long i = ops - 1; i > 0; --i) {
+        long j = lrand48() % (i + 1);
+        sensor_id_t tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+
+    long found = 0;
+    uint64_t t0 = cycles();
+    for (long k = 0; k < ops; ++k) found += datamgr_find(list, ids[k]) != NULL;
+    uint64_t t1 = cycles();
+    ERROR_HANDLER(found != ops, "Lookup missed a sensor.");
+    free(ids);
+    dpl_free(&list);
+    return t1 - t0;
+}
+
+static uint64_t bench_datamgr_avg(long ops, long param) {
+    (void) param;
+    element_t el = {.data_queue = {15, 17, 18, 19, 20}};
+    volatile sensor_value_t sink = 0;
+    uint64_t t0 = cycles();
+    for (long k = 0; k < ops; ++k) sink = datamgr_add_reading(&el, (sensor_value_t) (k & 31), k);
+    uint64_t t1 = cycles();
+    (void) sink;
+    return t1 - t0;
+}
+
+/*
+ * The csv row formatter, into a batch buffer as the csv backend fills it.
+ */
+
+static uint64_t bench_fmt_row(long ops, long param) {
+    (void) param;
+    static char buf[64 * 1024 + FMT_ROW_MAX];
+    sensor_data_t *rows = malloc(ops * sizeof(sensor_data_t));
+    ERROR_HANDLER(rows == NULL, "Rows malloc failed.");
+    double value = 20;
+    for (long i = 0; i < ops; ++i) {
+        value += 100 * ((drand48() - 0.5) / 10); // The random walk of sensor_node.
+        rows[i].id = (sensor_id_t) (15 + i % 8);
+        rows[i].value = value;
+        rows[i].ts = 1672531200 + i / 8;
+    }
+    size_t len = 0, total = 0;
+    uint64_t t0 = cycles();
+    for (long i = 0; i < ops; ++i) {
+        len = fmt_row(buf + len, rows[i].id, rows[i].value, rows[i].ts) - buf;
+        if (len >= sizeof(buf) - FMT_ROW_MAX) {
+            total += len;
+            len = 0;
+        }
+    }
+    uint64_t t1 = cycles();
+    ERROR_HANDLER(total + len == 0, "Nothing formatted.");
+    free(rows);
+    return t1 - t0;
+}
+
+static const bench_t benches[] = {
+        {"sbuffer_insert/1t",          bench_sbuffer_insert,   1,    1000000},
+        {"sbuffer_insert/2t",          bench_sbuffer_insert,   2,    1000000},
+        {"sbuffer_insert/4t",          bench_sbuffer_insert,   4,    1000000},
+        {"sbuffer_read/1t",            bench_sbuffer_read,     0,    1000000},
+        {"sbuffer_pipeline/1w2r",      bench_sbuffer_pipeline, 1,    1000000},
+        {"sbuffer_pipeline/4w2r",      bench_sbuffer_pipeline, 4,    1000000},
+        {"datamgr_lookup/8",           bench_datamgr_lookup,   8,    1000000},
+        {"datamgr_lookup/64",          bench_datamgr_lookup,   64,   100000},
+        {"datamgr_lookup/512",         bench_datamgr_lookup,   512,  200},
+        {"datamgr_lookup/4096",        bench_datamgr_lookup,   4096, 16},
+        {"datamgr_avg",                bench_datamgr_avg,      0,    10000000},
+        {"fmt_row",                    bench_fmt_row,          0,    1000000},
+};
+
+#define N_BENCHES ((int) (sizeof(benches) / sizeof(benches[0])))
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static bench_stats_t bench_measure(const bench_t *b, int warmups, int reps) {
+    double ns[reps];
+    for (int i = 0; i < warmups; ++i) b->run(b->ops, b->param);
+    for (int i = 0; i < reps; ++i) ns[i] = b->run(b->ops, b->param) / cycles_per_ns / b->ops;
+    qsort(ns, reps, sizeof(double), cmp_double);
+    bench_stats_t s = {.min = ns[0], .median = ns[reps / 2], .p90 = ns[(reps * 9 + 9) / 10 - 1]};
+    for (int i = 0; i < reps; ++i) s.mean += ns[i] / reps;
+    for (int i = 0; i < reps; ++i) s.sd += (ns[i] - s.mean) * (ns[i] - s.mean) / (reps > 1 ? reps - 1 : 1);
+    s.sd = sqrt(s.sd);
+    return s;
+}
+
+/**
+ * Looks a kernel up in a results file written by -o or -b.
+ * @return its median in ns per operation, or -1 if the file does not have it
+ */
+static double baseline_median(FILE *f, const char *name) {
+    char line[256], key[128];
+    double median;
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%127s %lf", key, &median) == 2 && strcmp(key, name) == 0) return median;
+    }
+    return -1;
+}
+
+static void print_help(void) {
+    printf("Use this program as: micro_bench [options]\n");
+    printf("\t%-12s : only kernels whose name contains this text\n", "-f filter");
+    printf("\t%-12s : measured repetitions per kernel (default %d)\n", "-r reps", DEFAULT_REPS);
+    printf("\t%-12s : unmeasured repetitions first (default %d)\n", "-w warmups", DEFAULT_WARMUPS);
+    printf("\t%-12s : write the medians to this file\n", "-o file");
+    printf("\t%-12s : compare the medians with this file, and write it if it does not exist yet\n", "-b file");
+    printf("\t%-12s : percent a median may be slower than the baseline (default %d)\n", "-t percent",
+           DEFAULT_THRESHOLD);
+    printf("Exits with 1 if a kernel regressed against the baseline.\n");
+}
+
+/**
+ * Measures the kernels of the gateway's hot path in isolation, for example:
+ *   micro_bench -b microbench.baseline
+ */
+int main(int argc, char *argv[]) {
+    const char *filter = NULL, *out_path = NULL, *base_path = NULL;
+    int reps = DEFAULT_REPS, warmups = DEFAULT_WARMUPS;
+    double threshold = DEFAULT_THRESHOLD;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:r:w:o:b:t:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            case 'w':
+                warmups = atoi(optarg);
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'b':
+                base_path = optarg;
+                break;
+            case 't':
+                threshold = strtod(optarg, NULL);
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    ERROR_HANDLER(reps < 1 || warmups < 0, "Invalid option.");
+
+    FILE *base = NULL;
+    if (base_path) {
+        base = fopen(base_path, "r");
+        ERROR_HANDLER(base == NULL && errno != ENOENT, "Baseline cannot be opened.");
+        if (base == NULL && out_path == NULL) out_path = base_path; // The first run sets the baseline.
+    }
+    FILE *out = NULL;
+    if (out_path) {
+        out = fopen(out_path, "w");
+        ERROR_HANDLER(out == NULL, "Results file cannot be created.");
+        fprintf(out, "# kernel median_ns_per_op\n");
+    }
+
+    calibrate();
+    srand48(1);
+    printf("%.3f cycles/ns, %d repetitions after %d warm-ups, ns per operation\n", cycles_per_ns, reps, warmups);
+    printf("%-24s %10s %12s %12s %12s %12s %12s %s\n", "kernel", "ops", "min", "median", "p90", "mean", "sd",
+           base ? "vs baseline" : "");
+    int regressions = 0;
+    for (int i = 0; i < N_BENCHES; ++i) {
+        const bench_t *b = &benches[i];
+        if (filter && !strstr(b->name, filter)) continue;
+        bench_stats_t s = bench_measure(b, warmups, reps);
+        printf("%-24s %10ld %12.2f %12.2f %12.2f %12.2f %12.2f", b->name, b->ops, s.min, s.median, s.p90, s.mean,
+               s.sd);
+        if (base) {
+            double old = baseline_median(base, b->name);
+            if (old > 0) {
+                double change = (s.median / old - 1) * 100;
+                bool slower = change > threshold;
+                printf(" %+7.1f%%%s", change, slower ? " REGRESSION" : "");
+                regressions += slower;
+            } else {
+                printf("     new");
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+        if (out) fprintf(out, "%s %.3f\n", b->name, s.median);
+    }
+
+    if (out) fclose(out);
+    if (base) {
+        fclose(base);
+        printf("%d regression%s over %.0f%% against %s\n", regressions, regressions == 1 ? "" : "s", threshold,
+               base_path);
+    } else if (base_path) {
+        printf("Baseline written to %s\n", base_path);
+    }
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "placement.h"
+
+// From linux/mempolicy.h, the syscalls are called directly so the gateway does not need libnuma.
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+static const char *placement_names[PLACEMENT_STAGES] = {"main", "io", "datamgr", "db", "forward"};
+static cpu_set_t placement_cpus[PLACEMENT_STAGES];
+static bool placement_placed[PLACEMENT_STAGES];
+static cpu_set_t placement_start_cpus; // The cpus the process was started with, saved before main is pinned.
+
+/**
+ * Parses a cpu list like "0-3,8" into 'set'.
+ * @return 0 on success, -1 if it is not a valid, non-empty list.
+ */
+static int placement_parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int placement_select(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL) return -1;
+    for (int s = 0; s < PLACEMENT_STAGES; ++s) {
+        if (strlen(placement_names[s]) == (size_t) (eq - spec) && strncmp(spec, placement_names[s], eq - spec) == 0) {
+            if (placement_parse_cpus(eq + 1, &placement_cpus[s]) != 0) return -1;
+            placement_placed[s] = true;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * The NUMA node of a cpu, from its node<n> entry in sysfs.
+ * @return the node, -1 if the kernel does not tell.
+ */
+static int placement_node_of(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return -1;
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Writes 'set' as a cpu list like "0-3,8".
+ */
+static void placement_format_cpus(const cpu_set_t *set, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        if (last == cpu) len += snprintf(out + len, size - len, "%s%d", len ? "," : "", cpu);
+        else len += snprintf(out + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+void placement_apply(placement_stage_t stage) {
+    if (!placement_placed[stage]) {
+        // Threads inherit the cpus and memory policy of main, which started them. Once main is pinned, a stage
+        // nobody placed goes back to the cpus the process started with and to the default policy.
+        if (stage != PLACEMENT_MAIN && placement_placed[PLACEMENT_MAIN]) {
+            ERROR_HANDLER(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement_start_cpus) != 0,
+                          "Thread placement failed.");
+            syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        }
+        return;
+    }
+    if (stage == PLACEMENT_MAIN) {
+        ERROR_HANDLER(sched_getaffinity(0, sizeof(cpu_set_t), &placement_start_cpus) != 0, "Thread placement failed.");
+    }
+    ERROR_HANDLER(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement_cpus[stage]) != 0,
+                  "Thread placement failed.");
+
+    // What the thread actually got: the kernel drops cpus that are offline or outside the cpuset of the process.
+    cpu_set_t actual;
+    ERROR_HANDLER(pthread_getaffinity_np(pthread_self(), sizeof(actual), &actual) != 0, "Thread placement failed.");
+    int node = -2; // -2 none seen yet, -1 the cpus span nodes or the node is unknown.
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &actual)) continue;
+        int n = placement_node_of(cpu);
+        node = node == -2 || node == n ? n : -1;
+    }
+
+    // Prefer the node of the cpus for the pages this thread touches first, later allocations stay local even once
+    // malloc hands out memory of an arena another thread used.
+    bool preferred = false;
+    if (node >= 0 && node < (int) (8 * sizeof(unsigned long))) {
+        unsigned long mask = 1UL << node;
+        preferred = syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask)) == 0;
+    }
+    if (!preferred && stage != PLACEMENT_MAIN) syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0); // Not main's node.
+
+    // Touch a page to see which node memory of this stage lands on.
+    int mem_node = -1;
+    long page = sysconf(_SC_PAGESIZE);
+    char *probe = aligned_alloc(page, page);
+    if (probe != NULL) {
+        memset(probe, 0, page);
+        if (syscall(SYS_get_mempolicy, &mem_node, NULL, 0, probe, MPOL_F_NODE | MPOL_F_ADDR) != 0) mem_node = -1;
+        free(probe);
+    }
+
+    char cpus[256];
+    placement_format_cpus(&actual, cpus, sizeof(cpus));
+    printf("Placement: %-7s on cpus %s (running on %d), node %d, memory on node %d%s\n", placement_names[stage], cpus,
+           sched_getcpu(), node, mem_node, preferred ? " (preferred)" : "");
+    fflush(stdout);
+    TRACE_INFO("Stage %s placed on node %i, memory on node %i.", placement_names[stage], node, mem_node);
+}
@@ -0,0 +1,41 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#include "config.h"
+
+/*
+ * Pins the gateway's stages to chosen cores. A stage pins its thread as the first thing it does, before it
+ * allocates anything, and prefers the memory of the NUMA node of its cores, so the buffers it fills are first
+ * touched on the local node: the connection threads' readings (threads inherit the mask of connmgr), the sensor
+ * table of the datamgr and the write buffers of the DB backend. The readings are read by datamgr and DB as well,
+ * put the three stages on one node to keep them off the interconnect. The threads of a stage nobody placed run on
+ * the cpus the gateway was started with, even when main is placed and they would otherwise inherit its cpus.
+ */
+
+typedef enum {
+    PLACEMENT_MAIN,             // The main thread, and the WAL, query, metrics and logger it starts.
+    PLACEMENT_IO,               // connmgr, its acceptor and connection threads.
+    PLACEMENT_DATAMGR,
+    PLACEMENT_DB,               // The DB thread and the writer threads of its backend.
+    PLACEMENT_FORWARD,          // The forwarder, see forward.h.
+    PLACEMENT_STAGES            // Not a stage, the number of stages.
+} placement_stage_t;
+
+/**
+ * Places a stage, must be called before the stage starts.
+ * @param spec "<stage>=<cpus>" with a stage of main, io, datamgr, db or forward and a cpu list like "0-3,8"
+ * @return 0 on success, -1 if the stage or the cpu list is not valid.
+ */
+int placement_select(const char *spec);
+
+/**
+ * Pins the calling thread to the cpus of 'stage', if it was placed, and prints where it ended up. A stage that was
+ * not placed gets the cpus the process started with back. Call it for main first.
+ */
+void placement_apply(placement_stage_t stage);
+
+#endif //_PLACEMENT_H_
@@ -0,0 +1,411 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pubsub.h"
+#include "logfmt.h"
+#include "metrics.h"
+
+#define PUBSUB_MAP_NAME "room_sensor.map"
+#define PUBSUB_WORDS (sizeof(pubsub_event_t) / sizeof(uint64_t))
+#define PUBSUB_LINE_MAX 1024
+
+_Static_assert(sizeof(pubsub_event_t) == 32, "Stream events must not contain padding.");
+
+/**
+ * A slot of the ring, a seqlock: 'version' is odd while the event of position p is written into it and 2 * (p + 1)
+ * once it is complete. The event is kept in atomic words so a reader may copy it while it is overwritten, the
+ * version tells afterwards whether the copy is whole.
+ */
+typedef struct {
+    atomic_uint_fast64_t version;
+    atomic_uint_fast64_t words[PUBSUB_WORDS];
+} pubsub_slot_t;
+
+typedef struct {
+    int fd;
+    bool subscribed;            /**< the SUBSCRIBE line was answered */
+    bool sample;                /**< slow=sample, the default drops the subscriber */
+    bool all_ids, all_rooms, all_codes;
+    uint64_t cursor;            /**< next position of the ring to look at */
+    uint32_t stride;            /**< sends 1 of every 'stride' matching events */
+    uint32_t phase;
+    uint64_t skipped;           /**< matching events left out since the last one sent */
+    uint64_t codes;             /**< log codes it wants, bit 63 for readings */
+    uint8_t ids[(UINT16_MAX + 1) / 8], rooms[(UINT16_MAX + 1) / 8];
+    size_t line_len, out_len, out_off;
+    char line[PUBSUB_LINE_MAX];
+    uint8_t out[PUBSUB_SEND_BUF];
+} pubsub_sub_t;
+
+#define PUBSUB_CODE_READING 63
+
+static pubsub_slot_t pubsub_ring[PUBSUB_RING_SIZE];
+static atomic_uint_fast64_t pubsub_head;        // Positions claimed by publishers.
+static atomic_int pubsub_subscribers;           // Publishers skip the ring while it is 0.
+static uint16_t pubsub_room_of[UINT16_MAX + 1];
+static pubsub_sub_t *pubsub_subs[PUBSUB_MAX_SUBSCRIBERS];
+static int pubsub_fd = -1;
+static pthread_t pubsub_tid;
+static volatile bool pubsub_closing = false;
+
+void pubsub_publish(uint16_t code, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    if (atomic_load_explicit(&pubsub_subscribers, memory_order_relaxed) == 0) return;
+    uint64_t pos = atomic_fetch_add_explicit(&pubsub_head, 1, memory_order_relaxed);
+    pubsub_event_t ev = {.seq = pos, .ts = ts, .value = value, .code = code, .id = id, .room = pubsub_room_of[id]};
+    uint64_t words[PUBSUB_WORDS];
+    memcpy(words, &ev, sizeof(ev));
+
+    pubsub_slot_t *slot = &pubsub_ring[pos & (PUBSUB_RING_SIZE - 1)];
+    atomic_store_explicit(&slot->version, 2 * pos + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t w = 0; w < PUBSUB_WORDS; ++w) {
+        atomic_store_explicit(&slot->words[w], words[w], memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->version, 2 * pos + 2, memory_order_release);
+    metrics_add(METRIC_PUBSUB_PUBLISHED, 1);
+}
+
+/**
+ * Copies the event of position 'pos' out of the ring.
+ * \return 0 on success, 1 if it is not published yet, -1 if it was overwritten
+ */
+static int pubsub_read(uint64_t pos, pubsub_event_t *ev) {
+    pubsub_slot_t *slot = &pubsub_ring[pos & (PUBSUB_RING_SIZE - 1)];
+    uint64_t expected = 2 * pos + 2;
+    uint64_t version = atomic_load_explicit(&slot->version, memory_order_acquire);
+    if (version < expected) return 1;
+    if (version > expected) return -1;
+    uint64_t words[PUBSUB_WORDS];
+    for (size_t w = 0; w < PUBSUB_WORDS; ++w) {
+        words[w] = atomic_load_explicit(&slot->words[w], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->version, memory_order_relaxed) != expected) return -1;
+    memcpy(ev, words, sizeof(*ev));
+    return 0;
+}
+
+/**
+ * Sets the bits of a list of numbers and ranges like "1-10,15" in 'set'.
+ * \return 0 on success, -1 if the list is not valid
+ */
+static int pubsub_parse_list(const char *list, uint8_t *set) {
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (first < 0 || last < first || last > UINT16_MAX) return -1;
+        for (long i = first; i <= last; ++i) set[i / 8] |= 1 << (i % 8);
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        p = end;
+    }
+    return 0;
+}
+
+static int pubsub_parse_codes(char *list, uint64_t *codes) {
+    for (char *save, *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        int code = strcasecmp(name, "reading") == 0 ? PUBSUB_CODE_READING : logfmt_code_parse(name);
+        if (code < 0 || code > PUBSUB_CODE_READING) return -1;
+        *codes |= 1ULL << code;
+    }
+    return 0;
+}
+
+/**
+ * Applies the SUBSCRIBE line of a client.
+ * \return NULL on success, or the reason it is refused
+ */
+static const char *pubsub_parse(pubsub_sub_t *sub, char *line) {
+    char *save, *word = strtok_r(line, " \t\r", &save);
+    if (word == NULL || strcasecmp(word, "SUBSCRIBE") != 0) return "usage: SUBSCRIBE [ids=] [rooms=] [codes=] [slow=]";
+    while ((word = strtok_r(NULL, " \t\r", &save)) != NULL) {
+        if (strncasecmp(word, "ids=", 4) == 0) {
+            sub->all_ids = false;
+            if (pubsub_parse_list(word + 4, sub->ids) != 0) return "invalid ids";
+        } else if (strncasecmp(word, "rooms=", 6) == 0) {
+            sub->all_rooms = false;
+            if (pubsub_parse_list(word + 6, sub->rooms) != 0) return "invalid rooms";
+        } else if (strncasecmp(word, "codes=", 6) == 0) {
+            sub->all_codes = false;
+            if (pubsub_parse_codes(word + 6, &sub->codes) != 0) return "invalid codes";
+        } else if (strcasecmp(word, "slow=drop") == 0 || strcasecmp(word, "slow=sample") == 0) {
+            sub->sample = strcasecmp(word, "slow=sample") == 0;
+        } else {
+            return "unknown filter";
+        }
+    }
+    return NULL;
+}
+
+static bool pubsub_match(const pubsub_sub_t *sub, const pubsub_event_t *ev) {
+    int code = ev->code == PUBSUB_READING ? PUBSUB_CODE_READING : ev->code;
+    if (!sub->all_codes && (code > PUBSUB_CODE_READING || !(sub->codes & (1ULL << code)))) return false;
+    if (!sub->all_ids && !(sub->ids[ev->id / 8] & (1 << (ev->id % 8)))) return false;
+    if (!sub->all_rooms && !(sub->rooms[ev->room / 8] & (1 << (ev->room % 8)))) return false;
+    return true;
+}
+
+static void pubsub_queue(pubsub_sub_t *sub, const void *bytes, size_t len) {
+    memcpy(sub->out + sub->out_len, bytes, len);
+    sub->out_len += len;
+}
+
+static void pubsub_drop(int i) {
+    pubsub_sub_t *sub = pubsub_subs[i];
+    if (sub->subscribed) {
+        atomic_fetch_sub_explicit(&pubsub_subscribers, 1, memory_order_relaxed);
+        metrics_add(METRIC_PUBSUB_UNSUBSCRIBED, 1);
+    }
+    close(sub->fd);
+    free(sub);
+    pubsub_subs[i] = NULL;
+}
+
+/**
+ * Moves a sampled subscriber whose events were overwritten to half a ring behind the head, the events in between
+ * are lost to it. Those still in the ring are counted as skipped if they match its filters, those already
+ * overwritten cannot be looked at and are all counted.
+ */
+static void pubsub_resume(pubsub_sub_t *sub, uint64_t head) {
+    uint64_t resume = head - PUBSUB_RING_SIZE / 2;
+    if (resume <= sub->cursor) resume = sub->cursor + 1;
+    uint64_t skipped = 0;
+    for (; sub->cursor < resume; sub->cursor++) {
+        pubsub_event_t ev;
+        if (pubsub_read(sub->cursor, &ev) != 0 || pubsub_match(sub, &ev)) skipped++;
+    }
+    sub->skipped += skipped;
+    metrics_add(METRIC_PUBSUB_SKIPPED, skipped);
+}
+
+/**
+ * Moves the events of a subscriber from the ring into its send buffer, as far as there is room.
+ * \return 0 on success, -1 if the subscriber fell too far behind and is to be dropped
+ */
+static int pubsub_fill(pubsub_sub_t *sub) {
+    uint64_t head = atomic_load_explicit(&pubsub_head, memory_order_acquire);
+    if (head - sub->cursor > PUBSUB_RING_SIZE) {
+        // Its next event is gone, even if its send buffer is too full to look at it.
+        if (!sub->sample) return -1;
+        pubsub_resume(sub, head);
+    }
+    if (sub->sample) {
+        // Thin the stream out while the subscriber lags, give it back in full once it caught up.
+        uint64_t lag = head - sub->cursor;
+        if (lag > PUBSUB_RING_SIZE / 2 && sub->stride < 1024) sub->stride *= 2;
+        else if (lag < PUBSUB_RING_SIZE / 8 && sub->stride > 1) sub->stride /= 2;
+    }
+    // Room for an event and the PUBSUB_SKIPPED event that may have to go in front of it.
+    while (sub->cursor < head && PUBSUB_SEND_BUF - sub->out_len >= 2 * sizeof(pubsub_event_t)) {
+        pubsub_event_t ev;
+        int res = pubsub_read(sub->cursor, &ev);
+        if (res == 1) break;
+        if (res == -1) {
+            if (!sub->sample) return -1;
+            pubsub_resume(sub, atomic_load_explicit(&pubsub_head, memory_order_acquire));
+            continue;
+        }
+        sub->cursor++;
+        if (!pubsub_match(sub, &ev)) continue;
+        if (++sub->phase < sub->stride) {
+            sub->skipped++;
+            metrics_add(METRIC_PUBSUB_SKIPPED, 1);
+            continue;
+        }
+        sub->phase = 0;
+        if (sub->skipped) {
+            pubsub_event_t note = {.seq = ev.seq, .ts = ev.ts, .value = (sensor_value_t) sub->skipped,
+                                   .code = PUBSUB_SKIPPED};
+            pubsub_queue(sub, &note, sizeof(note));
+            sub->skipped = 0;
+        }
+        pubsub_queue(sub, &ev, sizeof(ev));
+        metrics_add(METRIC_PUBSUB_SENT, 1);
+    }
+    return 0;
+}
+
+/**
+ * Writes as much of the send buffer of a subscriber as its socket takes.
+ * \return 0 on success, -1 if the subscriber is gone
+ */
+static int pubsub_flush(pubsub_sub_t *sub, int flags) {
+    while (sub->out_off < sub->out_len) {
+        ssize_t n = send(sub->fd, sub->out + sub->out_off, sub->out_len - sub->out_off, MSG_NOSIGNAL | flags);
+        if (n > 0) {
+            sub->out_off += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    sub->out_off = sub->out_len = 0;
+    return 0;
+}
+
+/**
+ * Reads from a client: the SUBSCRIBE line, later only whether it is still there.
+ * \return 0 on success, -1 if the client is to be dropped
+ */
+static int pubsub_receive(pubsub_sub_t *sub) {
+    char buf[256];
+    ssize_t n = recv(sub->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    if (n == 0) return -1;
+    if (sub->subscribed) return 0; // Anything after the SUBSCRIBE line is ignored.
+
+    for (ssize_t k = 0; k < n; ++k) {
+        if (buf[k] != '\n') {
+            if (sub->line_len == PUBSUB_LINE_MAX - 1) return -1;
+            sub->line[sub->line_len++] = buf[k];
+            continue;
+        }
+        sub->line[sub->line_len] = '\0';
+        const char *err = pubsub_parse(sub, sub->line);
+        char reply[128];
+        if (err != NULL) {
+            int len = snprintf(reply, sizeof(reply), "ERR %s\n", err);
+            send(sub->fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            return -1;
+        }
+        // Publishers start filling the ring once there is a subscriber, its stream starts from there.
+        atomic_fetch_add_explicit(&pubsub_subscribers, 1, memory_order_relaxed);
+        sub->cursor = atomic_load_explicit(&pubsub_head, memory_order_acquire);
+        sub->subscribed = true;
+        metrics_add(METRIC_PUBSUB_SUBSCRIBED, 1);
+        int len = snprintf(reply, sizeof(reply), "OK %" PRIu64 "\n", sub->cursor);
+        pubsub_queue(sub, reply, len);
+        TRACE_INFO("Subscriber %i joined the stream at %li.", sub->fd, (long) sub->cursor);
+        return 0;
+    }
+    return 0;
+}
+
+static void pubsub_accept() {
+    int fd = accept4(pubsub_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) return;
+    int i = 0;
+    while (i < PUBSUB_MAX_SUBSCRIBERS && pubsub_subs[i] != NULL) i++;
+    pubsub_sub_t *sub = i < PUBSUB_MAX_SUBSCRIBERS ? calloc(1, sizeof(pubsub_sub_t)) : NULL;
+    if (sub == NULL) {
+        const char reply[] = "ERR too many subscribers\n";
+        send(fd, reply, sizeof(reply) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        return;
+    }
+    sub->fd = fd;
+    sub->all_ids = sub->all_rooms = sub->all_codes = true;
+    sub->stride = 1;
+    pubsub_subs[i] = sub;
+}
+
+static void *pubsub_thread() {
+    TRACE_INFO("Stream listening on %s", PUBSUB_SOCKET_NAME);
+    while (!pubsub_closing) {
+        struct pollfd pfds[PUBSUB_MAX_SUBSCRIBERS + 1];
+        int slot[PUBSUB_MAX_SUBSCRIBERS + 1], n = 0;
+        pfds[n++] = (struct pollfd) {pubsub_fd, POLLIN, 0};
+        for (int i = 0; i < PUBSUB_MAX_SUBSCRIBERS; ++i) {
+            pubsub_sub_t *sub = pubsub_subs[i];
+            if (sub == NULL) continue;
+            slot[n] = i;
+            pfds[n++] = (struct pollfd) {sub->fd, POLLIN | (sub->out_len ? POLLOUT : 0), 0};
+        }
+        poll(pfds, n, PUBSUB_INTERVAL_MS);
+        for (int k = 1; k < n; ++k) {
+            if ((pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) && pubsub_receive(pubsub_subs[slot[k]]) != 0) {
+                pubsub_drop(slot[k]);
+            }
+        }
+        if (pfds[0].revents & POLLIN) pubsub_accept();
+
+        // Every round, not only when a socket has room: the ring moves on whether the subscribers read or not.
+        for (int i = 0; i < PUBSUB_MAX_SUBSCRIBERS; ++i) {
+            pubsub_sub_t *sub = pubsub_subs[i];
+            if (sub == NULL) continue;
+            if (sub->subscribed && pubsub_fill(sub) != 0) {
+                TRACE_INFO("Subscriber %i fell behind the stream, dropped.", sub->fd);
+                metrics_add(METRIC_PUBSUB_SLOW_DROPS, 1);
+                pubsub_drop(i);
+            } else if (pubsub_flush(sub, MSG_DONTWAIT) != 0) {
+                pubsub_drop(i);
+            }
+        }
+    }
+
+    // The gateway stopped publishing, hand every subscriber the rest of its stream, a stuck one gets a second.
+    for (int i = 0; i < PUBSUB_MAX_SUBSCRIBERS; ++i) {
+        pubsub_sub_t *sub = pubsub_subs[i];
+        if (sub == NULL) continue;
+        struct timeval tv = {1, 0};
+        setsockopt(sub->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        pubsub_flush(sub, 0);
+        while (sub->subscribed && sub->out_len == 0 && pubsub_fill(sub) == 0 && sub->out_len > 0) {
+            if (pubsub_flush(sub, 0) != 0) break;
+        }
+        pubsub_drop(i);
+    }
+    pthread_exit(NULL);
+}
+
+/**
+ * Reads the room of every sensor, so subscribers can filter on rooms.
+ */
+static void pubsub_load_rooms() {
+    FILE *fp = fopen(PUBSUB_MAP_NAME, "r");
+    if (fp == NULL) return; // Events then have room 0, the datamgr reports a missing map itself.
+    unsigned int room, id;
+    while (fscanf(fp, "%u %u", &room, &id) == 2) {
+        if (id <= UINT16_MAX) pubsub_room_of[id] = room <= UINT16_MAX ? (uint16_t) room : 0;
+    }
+    fclose(fp);
+}
+
+void pubsub_init() {
+    pubsub_load_rooms();
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, PUBSUB_SOCKET_NAME, sizeof(addr.sun_path) - 1);
+
+    pubsub_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(pubsub_fd == -1, "Stream socket creation failed.");
+    unlink(PUBSUB_SOCKET_NAME); // A previous run may have left the socket behind.
+    ERROR_HANDLER(bind(pubsub_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, "Stream socket bind failed.");
+    ERROR_HANDLER(listen(pubsub_fd, PUBSUB_MAX_SUBSCRIBERS) == -1, "Stream socket listen failed.");
+
+    pubsub_closing = false;
+    ERROR_HANDLER(pthread_create(&pubsub_tid, NULL, pubsub_thread, NULL) != 0, "Stream thread creation failed.");
+}
+
+void pubsub_close() {
+    pubsub_closing = true;
+    pthread_join(pubsub_tid, NULL);
+    close(pubsub_fd);
+    unlink(PUBSUB_SOCKET_NAME);
+    TRACE_INFO("Stream closed.");
+}
@@ -0,0 +1,81 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _PUBSUB_H_
+#define _PUBSUB_H_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "sensor_db.h"
+
+#ifndef PUBSUB_SOCKET_NAME
+#define PUBSUB_SOCKET_NAME "gateway.pub" // Unix domain socket of the live stream.
+#endif
+
+#ifndef PUBSUB_RING_SIZE
+#define PUBSUB_RING_SIZE 65536 // Events the ring holds for subscribers that fall behind, must be a power of two.
+#endif
+
+#ifndef PUBSUB_MAX_SUBSCRIBERS
+#define PUBSUB_MAX_SUBSCRIBERS 32
+#endif
+
+#ifndef PUBSUB_INTERVAL_MS
+#define PUBSUB_INTERVAL_MS 10 // Milliseconds between two rounds of the subscribers, the most an event waits.
+#endif
+
+#define PUBSUB_SEND_BUF (64 * 1024) // Bytes of events a subscriber has queued before it stops taking more.
+
+#define PUBSUB_READING 0xffff // Code of a reading, log events carry their log_codes.
+#define PUBSUB_SKIPPED 0xfffe // Code of the note that at most 'value' events of this subscriber were left out.
+
+/*
+ * A live stream of readings and log events for local consumers. The datamgr publishes every reading it processed
+ * and log_pipe_write() every event it is given, before the log policies, into one ring that overwrites the oldest
+ * event and never waits: publishing is a few stores, nothing at all while nobody subscribed. The pubsub thread
+ * copies the events of every subscriber past its cursor that match its filters into the subscriber's socket.
+ *
+ * A client connects to PUBSUB_SOCKET_NAME and sends one line,
+ *   SUBSCRIBE [ids=<list>] [rooms=<list>] [codes=<names>] [slow=drop|sample]
+ * with lists of numbers and ranges like "1-10,15" and codes like "reading,too_hot,too_cold" (see logfmt.h). A
+ * missing filter matches everything, rooms are those of room_sensor.map. It is answered with "OK <seq>\n", the seq
+ * of the first event it may get, or "ERR <reason>\n", followed by pubsub_event_t records.
+ *
+ * A subscriber that does not read fast enough never slows ingest down, the ring moves on without it. With slow=drop
+ * it is disconnected once events it should have gotten are overwritten. With slow=sample it gets every 2nd, 4th, ...
+ * matching event while it is more than half the ring behind, and the full stream again once it caught up; events
+ * it missed are announced by a PUBSUB_SKIPPED event before the next one it gets. Its count is exact for events
+ * left out by sampling, events overwritten before they could be matched are counted whether they matched or not.
+ */
+
+/**
+ * An event of the stream, in host byte order.
+ */
+typedef struct {
+    uint64_t seq;               /**< position in the ring, events of one subscriber are in increasing order */
+    sensor_ts_t ts;             /**< the timestamp of a reading, the time a log event was raised */
+    sensor_value_t value;       /**< the reading, or the data of a log event */
+    uint16_t code;              /**< PUBSUB_READING, PUBSUB_SKIPPED or a log_codes value */
+    sensor_id_t id;             /**< sensor id, 0 if the event has none */
+    uint16_t room;              /**< room of the sensor, 0 if it is not in the map */
+    uint16_t reserved;
+} pubsub_event_t;
+
+/**
+ * Reads the rooms of room_sensor.map, opens the stream socket and starts the thread serving it.
+ */
+void pubsub_init();
+
+/**
+ * Adds an event to the stream. Can be called from any thread, never blocks.
+ */
+void pubsub_publish(uint16_t code, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Sends the subscribers what they still have coming, disconnects them and removes the socket.
+ */
+void pubsub_close();
+
+#endif //_PUBSUB_H_
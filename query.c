@@ -0,0 +1,190 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "query.h"
+#include "tsstore.h"
+#include "sensor_db.h"
+#include "rollup.h"
+
+static int query_fd = -1; // The listening socket.
+static pthread_t query_tid;
+static volatile bool query_closing = false;
+
+/**
+ * Answers the range aggregate commands, 'cmd' selects which field is sent back.
+ * @param out the client stream
+ * @param cmd the command name
+ * @param args the rest of the line
+ */
+static void query_aggregate(FILE *out, const char *cmd, const char *args) {
+    unsigned int id;
+    long t0, t1;
+    ts_aggregate_t agg;
+
+    if (sscanf(args, "%u %li %li", &id, &t0, &t1) != 3 || id > UINT16_MAX) {
+        fprintf(out, "ERR usage: %s <sensor id> <t0> <t1>\n", cmd);
+        return;
+    }
+    if (tsstore_query((sensor_id_t) id, (sensor_ts_t) t0, (sensor_ts_t) t1, &agg) != TSSTORE_SUCCESS) {
+        if (strcasecmp(cmd, "COUNT") == 0) fprintf(out, "0\n");
+        else fprintf(out, "ERR no data\n");
+        return;
+    }
+
+    if (strcasecmp(cmd, "AGG") == 0) {
+        fprintf(out, "count=%" PRIu64 " avg=%g min=%g max=%g\n", agg.count, agg.avg, agg.min, agg.max);
+    } else if (strcasecmp(cmd, "AVG") == 0) {
+        fprintf(out, "%g\n", agg.avg);
+    } else if (strcasecmp(cmd, "MIN") == 0) {
+        fprintf(out, "%g\n", agg.min);
+    } else if (strcasecmp(cmd, "MAX") == 0) {
+        fprintf(out, "%g\n", agg.max);
+    } else {
+        fprintf(out, "%" PRIu64 "\n", agg.count);
+    }
+}
+
+/**
+ * Answers ROLLUP from the bucket files, so ranges far beyond what the in-memory store keeps stay cheap.
+ * @param out the client stream
+ * @param args the rest of the line
+ */
+static void query_rollup(FILE *out, const char *args) {
+    char level[8];
+    unsigned int id;
+    long t0, t1;
+    rollup_bucket_t b;
+
+    if (sscanf(args, "%7s %u %li %li", level, &id, &t0, &t1) != 4 || id > UINT16_MAX || rollup_level(level) < 0) {
+        fprintf(out, "ERR usage: ROLLUP 1m|1h <sensor id> <t0> <t1>\n");
+        return;
+    }
+    int res = rollup_query(rollup_level(level), (sensor_id_t) id, (sensor_ts_t) t0, (sensor_ts_t) t1, &b);
+    if (res == ROLLUP_FAILURE) {
+        fprintf(out, "ERR no rollups\n");
+    } else if (res == ROLLUP_NO_DATA) {
+        fprintf(out, "ERR no data\n");
+    } else {
+        fprintf(out, "count=%" PRIu64 " avg=%g min=%g max=%g first=%g last=%g\n", b.count, b.sum / b.count, b.min,
+                b.max, b.first, b.last);
+    }
+}
+
+/**
+ * Switches tracing or dumps the trace rings.
+ * @param out the client stream
+ * @param args the rest of the line
+ */
+static void query_trace(FILE *out, const char *args) {
+    char what[8];
+    if (sscanf(args, "%7s", what) != 1) {
+        fprintf(out, "ERR usage: TRACE ON|OFF|DUMP\n");
+    } else if (strcasecmp(what, "ON") == 0 || strcasecmp(what, "OFF") == 0) {
+        trace_enable(strcasecmp(what, "ON") == 0);
+        fprintf(out, "OK\n");
+    } else if (strcasecmp(what, "DUMP") == 0) {
+        if (trace_dump_file(TRACE_DUMP_FILE) == 0) fprintf(out, "OK %s\n", TRACE_DUMP_FILE);
+        else fprintf(out, "ERR cannot write %s\n", TRACE_DUMP_FILE);
+    } else {
+        fprintf(out, "ERR usage: TRACE ON|OFF|DUMP\n");
+    }
+}
+
+/**
+ * Reads commands from one client until it disconnects or times out.
+ * @param client the connected socket
+ */
+static void query_serve(int client) {
+    struct timeval tv = {QUERY_TIMEOUT, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    FILE *in = fdopen(client, "r");
+    FILE *out = fdopen(dup(client), "w");
+    if (in == NULL || out == NULL) {
+        if (in) fclose(in);
+        else close(client);
+        if (out) fclose(out);
+        return;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, in) > 0) {
+        char cmd[16];
+        int used = 0;
+        if (sscanf(line, "%15s %n", cmd, &used) != 1) continue;
+        const char *args = line + used;
+
+        if (strcasecmp(cmd, "AGG") == 0 || strcasecmp(cmd, "AVG") == 0 || strcasecmp(cmd, "MIN") == 0 ||
+            strcasecmp(cmd, "MAX") == 0 || strcasecmp(cmd, "COUNT") == 0) {
+            query_aggregate(out, cmd, args);
+        } else if (strcasecmp(cmd, "ROLLUP") == 0) {
+            query_rollup(out, args);
+        } else if (strcasecmp(cmd, "SYNC") == 0) {
+            fprintf(out, db_barrier() == 0 ? "OK\n" : "ERR database closed\n");
+        } else if (strcasecmp(cmd, "STATS") == 0) {
+            db_stats(out);
+        } else if (strcasecmp(cmd, "TRACE") == 0) {
+            query_trace(out, args);
+        } else {
+            fprintf(out, "ERR unknown command %s\n", cmd);
+        }
+        fflush(out);
+    }
+    free(line);
+    fclose(out);
+    fclose(in);
+}
+
+static void *query_thread() {
+    TRACE_INFO("Query interface listening on %s", QUERY_SOCKET_NAME);
+    while (1) {
+        int client = accept(query_fd, NULL, NULL);
+        if (client == -1) {
+            if (query_closing) break;
+            continue;
+        }
+        query_serve(client);
+    }
+    pthread_exit(NULL);
+}
+
+void query_init() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, QUERY_SOCKET_NAME, sizeof(addr.sun_path) - 1);
+
+    query_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ERROR_HANDLER(query_fd == -1, "Query socket creation failed.");
+    unlink(QUERY_SOCKET_NAME); // A previous run may have left the socket behind.
+    ERROR_HANDLER(bind(query_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, "Query socket bind failed.");
+    ERROR_HANDLER(listen(query_fd, 8) == -1, "Query socket listen failed.");
+
+    query_closing = false;
+    ERROR_HANDLER(pthread_create(&query_tid, NULL, query_thread, NULL) != 0, "Query thread creation failed.");
+}
+
+void query_close() {
+    // Shutting the listening socket down makes the blocked accept() return.
+    query_closing = true;
+    shutdown(query_fd, SHUT_RDWR);
+    pthread_join(query_tid, NULL);
+    close(query_fd);
+    unlink(QUERY_SOCKET_NAME);
+    TRACE_INFO("Query interface closed.");
+}
@@ -0,0 +1,35 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#ifndef QUERY_SOCKET_NAME
+#define QUERY_SOCKET_NAME "gateway.sock" // Unix domain socket of the local query interface.
+#endif
+
+#ifndef QUERY_TIMEOUT
+#define QUERY_TIMEOUT 5 // Seconds a connected client may stay silent before it is dropped.
+#endif
+
+/**
+ * Opens the local query socket and starts the thread serving it. Clients send one command per line and get one
+ * line back:
+ *   AGG <sensor id> <t0> <t1>       -> count=<n> avg=<v> min=<v> max=<v>
+ *   AVG|MIN|MAX|COUNT <id> <t0> <t1> -> <v>
+ *   ROLLUP 1m|1h <id> <t0> <t1>      -> count=<n> avg=<v> min=<v> max=<v> first=<v> last=<v> of the written
+ *                                       buckets that start within the range
+ *   SYNC                             -> OK once every row received so far is written and synced (db_barrier())
+ *   STATS                            -> backend=<name> followed by its I/O counters as key=value pairs
+ *   TRACE ON|OFF|DUMP                -> OK once tracing is switched, or the rings are dumped to TRACE_DUMP_FILE
+ * Timestamps are UTC seconds, the range is inclusive. Errors are answered with a line starting with ERR.
+ */
+void query_init();
+
+/**
+ * Stops the query thread and removes the socket.
+ */
+void query_close();
+
+#endif //_QUERY_H_
@@ -0,0 +1,350 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rollup.h"
+#include "fmt.h"
+#include "wal.h"
+
+#define ROLLUP_ROW_MAX 192 // Longest bucket row: two integers, the count and five doubles.
+#define ROLLUP_SCAN_CHUNK (64 * 1024) // Bytes read at once from a rollup file.
+
+static const char *const level_name[ROLLUP_LEVELS] = {"1m", "1h"};
+static const char *const level_file[ROLLUP_LEVELS] = {"rollup-1m.csv", "rollup-1h.csv"};
+static const char *const level_index[ROLLUP_LEVELS] = {"rollup-1m.idx", "rollup-1h.idx"};
+static const sensor_ts_t level_width[ROLLUP_LEVELS] = {60, 3600};
+
+/**
+ * Closed buckets of one level waiting to be written.
+ */
+typedef struct {
+    int fd;
+    int idx_fd;
+    off_t size;                 // Bytes in the file, where the next write goes.
+    char *buf;
+    size_t len, cap;
+    sensor_ts_t start_min, start_max; // Bucket starts of the rows in 'buf'.
+} rollup_out_t;
+
+/**
+ * An entry of a rollup index: one write of rows to the rollup file.
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    int64_t start_min;
+    int64_t start_max;
+} rollup_index_t;
+
+_Static_assert(sizeof(rollup_index_t) == 32, "Rollup index entries must not contain padding.");
+
+/**
+ * Buckets of one sensor merged by rollup_query().
+ */
+typedef struct {
+    sensor_id_t id;
+    sensor_ts_t t0, t1;
+    rollup_bucket_t acc;
+    sensor_ts_t last_start;
+} rollup_merge_t;
+
+static rollup_bucket_t *series[UINT16_MAX + 1][ROLLUP_LEVELS]; // Open buckets, only sensors with data have them.
+static sensor_id_t active[UINT16_MAX + 1];
+static size_t n_active = 0;
+static rollup_out_t out[ROLLUP_LEVELS];
+static sensor_ts_t stream_time = 0; // Newest timestamp the DB thread has seen.
+static sensor_ts_t (*rolled)[ROLLUP_LEVELS] = NULL; // Newest bucket start per sensor written before a crash.
+
+static sensor_ts_t bucket_start(sensor_ts_t ts, int level) {
+    sensor_ts_t w = level_width[level];
+    return ts - ((ts % w) + w) % w;
+}
+
+static void bucket_reset(rollup_bucket_t *b, sensor_value_t value, sensor_ts_t start) {
+    b->start = start;
+    b->count = 1;
+    b->sum = b->min = b->max = b->first = b->last = value;
+}
+
+/**
+ * Appends a bucket as a csv row to the output of its level.
+ */
+static void bucket_emit(int level, sensor_id_t id, const rollup_bucket_t *b) {
+    rollup_out_t *o = &out[level];
+    if (o->len + ROLLUP_ROW_MAX > o->cap) {
+        o->cap = o->cap ? 2 * o->cap : 64 * 1024;
+        o->buf = realloc(o->buf, o->cap);
+        ERROR_HANDLER(o->buf == NULL, "Rollup buffer realloc failed.");
+    }
+    if (o->len == 0 || b->start < o->start_min) o->start_min = b->start;
+    if (o->len == 0 || b->start > o->start_max) o->start_max = b->start;
+    char *p = o->buf + o->len;
+    p = fmt_u64(p, id);
+    *p++ = ',';
+    p = fmt_i64(p, b->start);
+    *p++ = ',';
+    p = fmt_u64(p, b->count);
+    const sensor_value_t fields[] = {b->sum, b->min, b->max, b->first, b->last};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        *p++ = ',';
+        p = fmt_double(p, fields[i]);
+    }
+    *p++ = '\n';
+    o->len = p - o->buf;
+}
+
+/**
+ * Parses the complete rows between 'from' and 'to' of a rollup file and passes each on, a row still being
+ * written at the end is left out.
+ */
+static void rollup_scan(int fd, off_t from, off_t to, void (*row)(sensor_id_t, const rollup_bucket_t *, void *),
+                        void *arg) {
+    char *buf = malloc(ROLLUP_SCAN_CHUNK + 1);
+    ERROR_HANDLER(buf == NULL, "Rollup scan malloc failed.");
+    size_t have = 0;
+    while (from < to) {
+        size_t want = ROLLUP_SCAN_CHUNK - have;
+        if ((off_t) want > to - from) want = to - from;
+        ssize_t n = pread(fd, buf + have, want, from);
+        if (n <= 0) break;
+        from += n;
+        have += n;
+        buf[have] = '\0';
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            char *end;
+            rollup_bucket_t b;
+            unsigned long id = strtoul(line, &end, 10);
+            if (*end == ',') {
+                b.start = strtoll(end + 1, &end, 10);
+                b.count = strtoull(end + 1, &end, 10);
+                b.sum = strtod(end + 1, &end);
+                b.min = strtod(end + 1, &end);
+                b.max = strtod(end + 1, &end);
+                b.first = strtod(end + 1, &end);
+                b.last = strtod(end + 1, &end);
+                if (end == nl && b.count != 0 && id <= UINT16_MAX) row((sensor_id_t) id, &b, arg);
+            }
+            line = nl + 1;
+        }
+        have -= line - buf;
+        if (have == ROLLUP_SCAN_CHUNK) have = 0; // Not a row, skip it.
+        memmove(buf, line, have);
+    }
+    free(buf);
+}
+
+/**
+ * Remembers the newest bucket start of every sensor, see rollup_update().
+ */
+static void rollup_note_rolled(sensor_id_t id, const rollup_bucket_t *b, void *arg) {
+    int level = *(int *) arg;
+    if (b->start > rolled[id][level]) rolled[id][level] = b->start;
+}
+
+/**
+ * Merges a bucket into the result of a query if it is of the queried sensor and range.
+ */
+static void rollup_merge(sensor_id_t id, const rollup_bucket_t *b, void *arg) {
+    rollup_merge_t *m = arg;
+    if (id != m->id || b->start < m->t0 || b->start > m->t1) return;
+    rollup_bucket_t *acc = &m->acc;
+    if (acc->count == 0 || b->start < acc->start) {
+        acc->start = b->start;
+        acc->first = b->first;
+    }
+    if (acc->count == 0 || b->start >= m->last_start) {
+        m->last_start = b->start;
+        acc->last = b->last;
+    }
+    if (acc->count == 0 || b->min < acc->min) acc->min = b->min;
+    if (acc->count == 0 || b->max > acc->max) acc->max = b->max;
+    acc->count += b->count;
+    acc->sum += b->sum;
+}
+
+int rollup_level(const char *name) {
+    for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+        if (strcmp(name, level_name[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int rollup_open() {
+    for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+        // Rollups outlive a run, unlike data.csv: long-range queries need every bucket ever written.
+        out[i].fd = open(level_file[i], O_RDWR | O_CREAT | O_APPEND, 0644);
+        out[i].idx_fd = open(level_index[i], O_WRONLY | O_CREAT | O_APPEND, 0644);
+        struct stat st, idx_st;
+        if (out[i].fd == -1 || out[i].idx_fd == -1 || fstat(out[i].fd, &st) != 0 ||
+            fstat(out[i].idx_fd, &idx_st) != 0) {
+            return ROLLUP_FAILURE;
+        }
+        // A crash may have torn the last entry, the ones after it have to stay aligned.
+        if (idx_st.st_size % sizeof(rollup_index_t) &&
+            ftruncate(out[i].idx_fd, idx_st.st_size - idx_st.st_size % sizeof(rollup_index_t)) != 0) {
+            return ROLLUP_FAILURE;
+        }
+        out[i].size = st.st_size;
+        out[i].len = 0;
+    }
+    stream_time = 0;
+
+    if (wal_recovered()) {
+        rolled = malloc((UINT16_MAX + 1) * sizeof(*rolled));
+        ERROR_HANDLER(rolled == NULL, "Rollup malloc failed.");
+        for (int id = 0; id <= UINT16_MAX; ++id) {
+            for (int i = 0; i < ROLLUP_LEVELS; ++i) rolled[id][i] = LONG_MIN;
+        }
+        for (int i = 0; i < ROLLUP_LEVELS; ++i) rollup_scan(out[i].fd, 0, out[i].size, rollup_note_rolled, &i);
+    }
+    return ROLLUP_SUCCESS;
+}
+
+void rollup_update(sensor_id_t id, sensor_value_t value, sensor_ts_t ts, bool replayed) {
+    if (ts > stream_time) stream_time = ts;
+    if (series[id][0] == NULL) {
+        for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+            series[id][i] = malloc(sizeof(rollup_bucket_t));
+            ERROR_HANDLER(series[id][i] == NULL, "Rollup malloc failed.");
+            series[id][i]->count = 0;
+        }
+        active[n_active++] = id;
+    }
+
+    for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+        rollup_bucket_t *b = series[id][i];
+        sensor_ts_t start = bucket_start(ts, i);
+        if (replayed && rolled != NULL && start <= rolled[id][i]) continue; // Written before the crash.
+        if (b->count == 0 || start > b->start) {
+            if (b->count) bucket_emit(i, id, b);
+            bucket_reset(b, value, start);
+        } else if (start < b->start) {
+            // The bucket of this reading is already written, it becomes a bucket of its own.
+            rollup_bucket_t late;
+            bucket_reset(&late, value, start);
+            bucket_emit(i, id, &late);
+        } else {
+            b->count++;
+            b->sum += value;
+            if (value < b->min) b->min = value;
+            if (value > b->max) b->max = value;
+            b->last = value;
+        }
+    }
+}
+
+/**
+ * Writes the closed buckets of every level, and syncs them if 'durable'.
+ */
+static int rollup_write(bool durable) {
+    for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+        size_t done = 0;
+        while (done < out[i].len) {
+            ssize_t n = write(out[i].fd, out[i].buf + done, out[i].len - done);
+            if (n < 0) return ROLLUP_FAILURE;
+            done += n;
+        }
+        if (out[i].len) {
+            // The entry follows the rows, a reader never finds one for rows that are not there yet.
+            rollup_index_t e = {out[i].size, out[i].len, out[i].start_min, out[i].start_max};
+            if (write(out[i].idx_fd, &e, sizeof(e)) != sizeof(e)) return ROLLUP_FAILURE;
+            out[i].size += out[i].len;
+        }
+        out[i].len = 0;
+        if (durable && fdatasync(out[i].fd) != 0) return ROLLUP_FAILURE;
+    }
+    return ROLLUP_SUCCESS;
+}
+
+int rollup_flush(bool durable) {
+    // A sensor that went quiet would keep its bucket open forever, the stream time closes it instead.
+    for (size_t k = 0; k < n_active; ++k) {
+        for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+            rollup_bucket_t *b = series[active[k]][i];
+            if (b->count && b->start + level_width[i] + ROLLUP_GRACE <= stream_time) {
+                bucket_emit(i, active[k], b);
+                b->count = 0;
+            }
+        }
+    }
+    return rollup_write(durable);
+}
+
+int rollup_close() {
+    for (size_t k = 0; k < n_active; ++k) {
+        for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+            rollup_bucket_t *b = series[active[k]][i];
+            if (b->count) bucket_emit(i, active[k], b);
+            free(b);
+            series[active[k]][i] = NULL;
+        }
+    }
+    n_active = 0;
+
+    int res = rollup_write(true);
+    for (int i = 0; i < ROLLUP_LEVELS; ++i) {
+        if (close(out[i].fd) != 0 || close(out[i].idx_fd) != 0) res = ROLLUP_FAILURE;
+        out[i].fd = out[i].idx_fd = -1;
+        free(out[i].buf);
+        out[i].buf = NULL;
+        out[i].cap = 0;
+    }
+    free(rolled);
+    rolled = NULL;
+    return res;
+}
+
+int rollup_query(int level, sensor_id_t id, sensor_ts_t t0, sensor_ts_t t1, rollup_bucket_t *res) {
+    if (level < 0 || level >= ROLLUP_LEVELS) return ROLLUP_FAILURE;
+    int fd = open(level_file[level], O_RDONLY);
+    if (fd == -1) return ROLLUP_FAILURE;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return ROLLUP_FAILURE;
+    }
+
+    // Rows without an index entry, written before there was an index or just before a crash, are scanned whole.
+    const rollup_index_t *entries = NULL;
+    size_t n_entries = 0;
+    int idx_fd = open(level_index[level], O_RDONLY);
+    struct stat idx_st;
+    if (idx_fd != -1 && fstat(idx_fd, &idx_st) == 0 && idx_st.st_size >= (off_t) sizeof(rollup_index_t)) {
+        n_entries = idx_st.st_size / sizeof(rollup_index_t);
+        entries = mmap(NULL, n_entries * sizeof(rollup_index_t), PROT_READ, MAP_PRIVATE, idx_fd, 0);
+        if (entries == MAP_FAILED) {
+            entries = NULL;
+            n_entries = 0;
+        }
+    }
+    if (idx_fd != -1) close(idx_fd);
+
+    rollup_merge_t m = {.id = id, .t0 = t0, .t1 = t1};
+    off_t covered = 0;
+    for (size_t i = 0; i < n_entries; ++i) {
+        const rollup_index_t *e = &entries[i];
+        if ((off_t) e->offset > covered) rollup_scan(fd, covered, e->offset, rollup_merge, &m);
+        if (e->start_max >= t0 && e->start_min <= t1) {
+            rollup_scan(fd, e->offset, e->offset + e->length, rollup_merge, &m);
+        }
+        if ((off_t) (e->offset + e->length) > covered) covered = e->offset + e->length;
+    }
+    rollup_scan(fd, covered, st.st_size, rollup_merge, &m);
+    if (entries != NULL) munmap((void *) entries, n_entries * sizeof(rollup_index_t));
+    close(fd);
+
+    if (m.acc.count == 0) return ROLLUP_NO_DATA;
+    *res = m.acc;
+    return ROLLUP_SUCCESS;
+}
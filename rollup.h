@@ -0,0 +1,89 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+#define ROLLUP_SUCCESS 0
+#define ROLLUP_FAILURE -1
+#define ROLLUP_NO_DATA 1
+
+#define ROLLUP_LEVELS 2 // 1 minute and 1 hour buckets.
+
+#ifndef ROLLUP_GRACE
+#define ROLLUP_GRACE 5 // Seconds a bucket stays open past its end for readings that arrive a little late.
+#endif
+
+/*
+ * Every reading the DB thread stores also updates one open bucket per sensor and level. A bucket is closed when a
+ * reading of the same sensor falls into a later bucket, or when the newest timestamp seen by the DB thread is
+ * ROLLUP_GRACE seconds past its end. Closed buckets are appended to rollup-1m.csv and rollup-1h.csv as
+ *   sensor id,bucket start,count,sum,min,max,first,last
+ * A reading that arrives after its bucket was closed is written as a bucket of its own with the same start, and
+ * so is the open bucket on shutdown: readers merge rows with the same sensor and start. Every write of a level
+ * appends the byte range and the bucket starts it covers to rollup-1m.idx or rollup-1h.idx, so a query only reads
+ * the rows of the writes that overlap its range.
+ *
+ * After a crash the WAL replays the readings past the checkpoint, some of which are already in written buckets.
+ * A replayed reading is left out of the rollups if its sensor has a bucket written at or after its own.
+ */
+
+/**
+ * The merge of one or more buckets.
+ */
+typedef struct {
+    sensor_ts_t start;          /**< start of the (first) bucket */
+    uint64_t count;             /**< number of readings */
+    sensor_value_t sum;         /**< sum of the readings */
+    sensor_value_t min;         /**< smallest reading */
+    sensor_value_t max;         /**< largest reading */
+    sensor_value_t first;       /**< oldest reading */
+    sensor_value_t last;        /**< newest reading */
+} rollup_bucket_t;
+
+/**
+ * \return the level whose name ("1m" or "1h") is 'name', -1 if there is none
+ */
+int rollup_level(const char *name);
+
+/**
+ * Opens the rollup files for appending, and after a crash reads which buckets they already hold. Called by the DB
+ * thread after wal_init().
+ * \return ROLLUP_SUCCESS or ROLLUP_FAILURE
+ */
+int rollup_open();
+
+/**
+ * Adds a reading to the open buckets of its sensor. Called by the DB thread.
+ * \param replayed the reading comes from the WAL replay of a crashed run
+ */
+void rollup_update(sensor_id_t id, sensor_value_t value, sensor_ts_t ts, bool replayed);
+
+/**
+ * Closes the buckets that are over and writes every closed bucket out. Called by the DB thread.
+ * \param durable also fdatasync() the rollup files
+ * \return ROLLUP_SUCCESS or ROLLUP_FAILURE
+ */
+int rollup_flush(bool durable);
+
+/**
+ * Writes the open buckets, syncs and closes the rollup files. Called by the DB thread.
+ * \return ROLLUP_SUCCESS or ROLLUP_FAILURE
+ */
+int rollup_close();
+
+/**
+ * Merges the written buckets of sensor 'id' at 'level' that start within [t0, t1]. Can be called from any thread,
+ * buckets still open in the DB thread are not included.
+ * \param res a pointer to pre-allocated space for the result
+ * \return ROLLUP_SUCCESS, ROLLUP_NO_DATA if no bucket matched or ROLLUP_FAILURE if the file cannot be read
+ */
+int rollup_query(int level, sensor_id_t id, sensor_ts_t t0, sensor_ts_t t1, rollup_bucket_t *res);
+
+#endif //_ROLLUP_H_
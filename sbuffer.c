@@ -1,6 +1,7 @@
 /**
  * \author Nicolas Gutierrez Suarez
  */
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,11 +9,14 @@
 #include <stdbool.h>
 
 #include "sbuffer.h"
+#include "metrics.h"
 
 
 pthread_mutex_t write_lock_mtx;
 
 sbuffer_t *sbuffer;
+static uint64_t sbuffer_nodes = 0; // Nodes ever appended, the EOF marker included, guarded by write_lock_mtx.
+static uint64_t sbuffer_freed = 0; // Nodes freed by sbuffer_reclaim(), guarded by write_lock_mtx.
 
 void sbuffer_init() {
     // Initialize the buffer and the mutex.
@@ -23,7 +27,7 @@ void sbuffer_init() {
     sbuffer->head = NULL;
     sbuffer->tail = NULL;
 
-    DEBUG_PRINTF("Buffer initialized");
+    TRACE_INFO("Buffer initialized");
 }
 
 void sbuffer_free() {
@@ -41,7 +45,7 @@ void sbuffer_free() {
     sbuffer = NULL;
     pthread_mutex_unlock(&write_lock_mtx);
     pthread_mutex_destroy(&write_lock_mtx); // Destroy the mutex for good measure.
-    DEBUG_PRINTF("Buffer freed successfully.");
+    TRACE_INFO("Buffer freed successfully.");
 }
 
 int sbuffer_read(sbuffer_node_t **node, sensor_data_t **data) {
@@ -76,6 +80,8 @@ int sbuffer_insert(sensor_data_t *data) {
     temp->next = NULL;
 
     pthread_mutex_lock(&write_lock_mtx); // Make sure only one thread writes concurrently.
+    // Stamped under the lock, the consumers may read the reading as soon as it is linked.
+    data->buf_ns = metrics_now();
 
     if (!sbuffer->tail) // buffer empty (buffer->head should also be NULL
     {
@@ -85,7 +91,55 @@ int sbuffer_insert(sensor_data_t *data) {
         sbuffer->tail->next = temp;
         sbuffer->tail = sbuffer->tail->next;
     }
+    sbuffer_nodes++;
     pthread_mutex_unlock(&write_lock_mtx);
+    if (data->id) metrics_add(METRIC_SBUFFER_INSERTED, 1); // The EOF marker is never read as a reading.
+    if (data->rx_ns) metrics_observe(METRIC_RECEIVE_TO_INSERT_NS, data->buf_ns - data->rx_ns);
 
     return SBUFFER_SUCCESS;
 }
+
+int sbuffer_insert_chain(sbuffer_node_t *first, sbuffer_node_t *last) {
+    ERROR_HANDLER(sbuffer == NULL, "Buffer is NULL.");
+    if (first == NULL || last == NULL || last->next != NULL) return SBUFFER_FAILURE;
+    uint64_t n = 1;
+    int64_t now = metrics_now();
+    for (sbuffer_node_t *node = first; node != last; node = node->next) {
+        node->data->buf_ns = now;
+        n++;
+    }
+    last->data->buf_ns = now;
+
+    pthread_mutex_lock(&write_lock_mtx);
+    if (!sbuffer->tail) {
+        sbuffer->head = first;
+    } else {
+        sbuffer->tail->next = first;
+    }
+    sbuffer->tail = last;
+    sbuffer_nodes += n;
+    pthread_mutex_unlock(&write_lock_mtx);
+    metrics_add(METRIC_SBUFFER_INSERTED, n);
+
+    return SBUFFER_SUCCESS;
+}
+
+uint64_t sbuffer_appended() {
+    pthread_mutex_lock(&write_lock_mtx);
+    uint64_t n = sbuffer_nodes;
+    pthread_mutex_unlock(&write_lock_mtx);
+    return n;
+}
+
+void sbuffer_reclaim(uint64_t n) {
+    pthread_mutex_lock(&write_lock_mtx);
+    // The tail stays, inserts link to it.
+    while (sbuffer_freed < n && sbuffer->head != sbuffer->tail) {
+        sbuffer_node_t *temp = sbuffer->head;
+        sbuffer->head = sbuffer->head->next;
+        free(temp->data);
+        free(temp);
+        sbuffer_freed++;
+    }
+    pthread_mutex_unlock(&write_lock_mtx);
+}
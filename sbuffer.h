@@ -56,4 +56,27 @@ int sbuffer_read(sbuffer_node_t **node, sensor_data_t **data);
 */
 int sbuffer_insert(sensor_data_t *data);
 
+/**
+ * Appends a chain of nodes, linked through 'next' and allocated with malloc() like sbuffer_insert() does, at the
+ * end of the buffer under a single lock. Readers see the whole chain in order.
+ * \param first the first node of the chain
+ * \param last the last node of the chain, its 'next' must be NULL
+ * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occured
+ */
+int sbuffer_insert_chain(sbuffer_node_t *first, sbuffer_node_t *last);
+
+/**
+ * \return the number of nodes appended to the buffer so far, the EOF marker included. A reader that has read this
+ * many nodes has read everything that was in the buffer when this was called.
+ */
+uint64_t sbuffer_appended();
+
+/**
+ * Frees the oldest nodes of the buffer and their data until 'n' nodes were freed since sbuffer_init(). Every
+ * reader must have read more than 'n' nodes, a reader still holds the last node it read. The buffer otherwise
+ * keeps every node until sbuffer_free(), this bounds it for a producer that can wait for its readers.
+ * \param n the number of nodes to have freed, at most sbuffer_appended() - 1
+ */
+void sbuffer_reclaim(uint64_t n);
+
 #endif  //_SBUFFER_H_
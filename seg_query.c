@@ -0,0 +1,136 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <float.h>
+
+#include "config.h"
+#include "tsseg.h"
+#include "fmt.h"
+
+#define OUT_BUF_SIZE (64 * 1024)
+
+static void print_help(void);
+
+/**
+ * Reads segment files written by the seg storage backend, for example:
+ *   seg_query -s 37 -f 1672531200 -t 1672532100 -a data-*.seg
+ * Blocks whose header shows they cannot contain matching readings are skipped without being decompressed.
+ */
+int main(int argc, char *argv[]) {
+    long sensor = -1;
+    sensor_ts_t from = INT64_MIN, to = INT64_MAX;
+    int aggregate = 0, verbose = 0, opt;
+
+    while ((opt = getopt(argc, argv, "s:f:t:avh")) != -1) {
+        switch (opt) {
+            case 's':
+                sensor = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                from = strtoll(optarg, NULL, 10);
+                break;
+            case 't':
+                to = strtoll(optarg, NULL, 10);
+                break;
+            case 'a':
+                aggregate = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind == argc) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    static char out[OUT_BUF_SIZE + FMT_ROW_MAX];
+    size_t out_len = 0;
+    sensor_ts_t *ts = malloc(TSSEG_BLOCK_POINTS * sizeof(sensor_ts_t));
+    sensor_value_t *values = malloc(TSSEG_BLOCK_POINTS * sizeof(sensor_value_t));
+    size_t cap = TSSEG_BLOCK_POINTS;
+    ERROR_HANDLER(ts == NULL || values == NULL, "Malloc failed.");
+
+    uint64_t blocks = 0, skipped = 0, decoded = 0, matched = 0, bytes = 0;
+    double sum = 0, min = DBL_MAX, max = -DBL_MAX;
+
+    for (int f = optind; f < argc; ++f) {
+        tsseg_reader_t *reader;
+        if (tsseg_open(&reader, argv[f]) != TSSEG_SUCCESS) {
+            fprintf(stderr, "%s: not a readable segment\n", argv[f]);
+            continue;
+        }
+        for (int i = 0; i < tsseg_block_count(reader); ++i) {
+            const tsseg_block_info_t *b = tsseg_block(reader, i);
+            blocks++;
+            if ((sensor >= 0 && b->id != sensor) || b->ts_max < from || b->ts_min > to) {
+                skipped++;
+                continue;
+            }
+            if (b->count > cap) {
+                cap = b->count;
+                ts = realloc(ts, cap * sizeof(sensor_ts_t));
+                values = realloc(values, cap * sizeof(sensor_value_t));
+                ERROR_HANDLER(ts == NULL || values == NULL, "Realloc failed.");
+            }
+            if (tsseg_decode(reader, i, ts, values) != TSSEG_SUCCESS) {
+                fprintf(stderr, "%s: block %d is corrupt\n", argv[f], i);
+                continue;
+            }
+            decoded += b->count;
+            bytes += b->nbytes;
+            for (uint32_t k = 0; k < b->count; ++k) {
+                if (ts[k] < from || ts[k] > to) continue;
+                matched++;
+                if (aggregate) {
+                    sum += values[k];
+                    if (values[k] < min) min = values[k];
+                    if (values[k] > max) max = values[k];
+                    continue;
+                }
+                out_len = fmt_row(out + out_len, b->id, values[k], ts[k]) - out;
+                if (out_len >= OUT_BUF_SIZE) {
+                    fwrite(out, 1, out_len, stdout);
+                    out_len = 0;
+                }
+            }
+        }
+        tsseg_close(&reader);
+    }
+    fwrite(out, 1, out_len, stdout);
+
+    if (aggregate) {
+        if (matched) printf("count=%" PRIu64 " avg=%g min=%g max=%g\n", matched, sum / matched, min, max);
+        else printf("count=0\n");
+    }
+    if (verbose) {
+        fprintf(stderr, "blocks: %" PRIu64 " total, %" PRIu64 " skipped; readings: %" PRIu64 " decoded, %" PRIu64
+                        " matched; %.2f compressed bytes per reading\n", blocks, skipped, decoded, matched,
+                decoded ? (double) bytes / decoded : 0.0);
+    }
+    free(ts);
+    free(values);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+static void print_help(void) {
+    printf("Use this program as: seg_query [options] <segment file>...\n");
+    printf("\t%-10s : only readings of this sensor\n", "-s id");
+    printf("\t%-10s : only readings with ts >= t0\n", "-f t0");
+    printf("\t%-10s : only readings with ts <= t1\n", "-t t1");
+    printf("\t%-10s : print count/avg/min/max instead of the readings\n", "-a");
+    printf("\t%-10s : print block and compression statistics on stderr\n", "-v");
+}
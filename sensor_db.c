@@ -4,127 +4,463 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "sensor_db.h"
 #include "sbuffer.h"
-#include <inttypes.h>
+#include "wal.h"
+#include "rollup.h"
+#include "logring.h"
+#include "logfmt.h"
+#include "logpolicy.h"
+#include "metrics.h"
+#include "placement.h"
+#include "pubsub.h"
 
-#define LOG_FILE_NAME "gateway.log"
-#define DB_FILE_NAME "data.csv"
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE (1024 * 1024) // Bytes of log lines the logger gathers before it writes them.
+#endif
 
 #define READ_END 0
 #define WRITE_END 1
 
-FILE *log_file, *db_file; // The pointer to the file stream for the log and the DB.
+FILE *log_file; // The pointer to the file stream for the log.
+static bool log_binary = false; // Write gateway.bin records instead of gateway.log lines.
+static bool db_continue = false; // Add to the files of the earlier runs, see db_select_continue().
 int fd[2]; // The file descriptor for the pipe.
 
+static const db_backend_t *const db_backends[] = {&db_csv_backend, &db_sqlite_backend, &db_seg_backend};
+static const db_backend_t *db_backend = NULL; // Picked by db_select_backend(), DB_BACKEND if nobody did.
+
+static int db_pending = 0; // Rows inserted into the backend since its last flush.
+static long db_first_pending = 0; // Monotonic ms at which the oldest pending row was inserted.
+static unsigned long db_flushes = 0;
+static uint64_t db_seq = 0; // WAL sequence number of the newest row handed to the backend.
+static long db_last_checkpoint = 0; // Monotonic ms of the last WAL checkpoint.
+
 /**
- * This function inserts a new line into the log file. It flushes the stream to make sure the data is written
- * on the fly in case there is a signal that ends the process before closing the file.
- * @param id The sensor ID
- * @param value The reported value of the sensor.
- * @param ts The timestamp of the datum.
- * @return Number of characters written, negative if there is an error.
+ * A row whose stages are written to DB_LATENCY_FILE once its batch is written. The reading stays in the buffer
+ * until sbuffer_free(), or sbuffer_reclaim() after a db_barrier() wrote it, the pointer outlives the batch.
  */
-static int insert_sensor( sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
-    int res = fprintf(db_file, "%"PRIu16",%lf,%li\n", id, value, ts);
-    fflush(db_file);
-    return res;
+typedef struct {
+    const sensor_data_t *data;
+    int64_t write_ns;
+} db_sample_t;
+
+/**
+ * The rows of a batch, kept until the backend wrote it to take their latencies.
+ */
+typedef struct {
+    int rows;
+    int64_t *write_ns;          // Monotonic ns at which each row was handed to the backend.
+    int64_t *rx_ns;             // Monotonic ns at which connmgr received each row, 0 if it did not.
+    size_t cap;
+    db_sample_t *samples;       // Sampled rows.
+    size_t n_samples, samples_cap;
+    bool durable;
+} db_batch_t;
+
+#define DB_BATCHES (DB_WRITER_BUFFERS + 1) // The csv writer has at most DB_WRITER_BUFFERS - 1 queued after a flush.
+
+// Ring of the flushed batches not written yet, oldest first, followed by the pending one.
+static db_batch_t db_batches[DB_BATCHES];
+static int db_batch_head = 0, db_in_flight = 0;
+static unsigned db_sample_every = DB_LATENCY_SAMPLE;
+static uint64_t db_rows = 0;
+static FILE *db_latency_file = NULL;
+
+// Barrier requests are numbered, the DB thread completes them in order once it read up to the buffer tail the
+// newest one saw.
+static pthread_mutex_t barrier_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long barrier_requested = 0, barrier_done = 0;
+static uint64_t barrier_target = 0; // sbuffer_appended() when the newest barrier was requested.
+static uint64_t db_nodes_read = 0; // Nodes of the buffer the DB thread has read, only touched by it.
+static bool db_closed = false;
+
+static long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static double stage_us(int64_t from, int64_t to) {
+    return from && to ? (to - from) / 1e3 : -1;
+}
+
+static db_batch_t *db_pending_batch() {
+    return &db_batches[(db_batch_head + db_in_flight) % DB_BATCHES];
+}
+
+/**
+ * Records how long the rows of a batch the backend wrote waited for it, and writes the sampled ones.
+ * @param done_ns when it was written, or synced if durable
+ */
+static void db_written(db_batch_t *b, int64_t done_ns) {
+    for (int i = 0; i < b->rows; ++i) {
+        metrics_observe(METRIC_WRITE_TO_DURABLE_NS, done_ns - b->write_ns[i]);
+        if (b->rx_ns[i]) metrics_observe(METRIC_RECEIVE_TO_DURABLE_NS, done_ns - b->rx_ns[i]);
+    }
+    for (size_t i = 0; i < b->n_samples; ++i) {
+        const sensor_data_t *d = b->samples[i].data;
+        int64_t dm_ns = atomic_load_explicit(&d->dm_ns, memory_order_relaxed);
+        fprintf(db_latency_file, "%" PRIu64 " %u %.1f %.1f %.1f %.1f %i\n", d->seq, d->id,
+                stage_us(d->rx_ns, d->buf_ns), stage_us(d->buf_ns, dm_ns), stage_us(d->buf_ns, b->samples[i].write_ns),
+                stage_us(b->samples[i].write_ns, done_ns), b->durable);
+    }
+    if (b->n_samples) fflush(db_latency_file);
+    b->rows = 0;
+    b->n_samples = 0;
+}
+
+/**
+ * Takes the batches the backend wrote in the background since the last call. A durable batch counts as written
+ * once its flush synced it, at 'sync_ns', which is 0 outside of that flush.
+ */
+static void db_collect_written(int64_t sync_ns) {
+    if (db_backend->written == NULL) return;
+    int64_t ns[DB_BATCHES];
+    int n = db_backend->written(ns, DB_BATCHES);
+    for (int i = 0; i < n && db_in_flight > 0; ++i) {
+        db_batch_t *b = &db_batches[db_batch_head];
+        db_written(b, b->durable && sync_ns ? sync_ns : ns[i]);
+        db_batch_head = (db_batch_head + 1) % DB_BATCHES;
+        db_in_flight--;
+    }
+}
+
+/**
+ * Lets the backend write its batch and logs it. A durable flush moves the WAL checkpoint up to the newest row,
+ * one is forced every WAL_CHECKPOINT_INTERVAL seconds so the WAL does not grow without bound.
+ * @param durable also sync it to disk, regardless of DB_SYNC_EVERY.
+ * @return 0 on success, -1 if writing failed.
+ */
+static int db_flush(bool durable) {
+    if (db_pending) {
+        db_flushes++;
+#if DB_SYNC_EVERY > 0
+        if (db_flushes % DB_SYNC_EVERY == 0) durable = true;
+#endif
+        if (WAL_ENABLED && now_ms() - db_last_checkpoint >= WAL_CHECKPOINT_INTERVAL * 1000L) durable = true;
+    }
+    if (db_pending) {
+        // The pending batch joins those the backend is writing, the next one needs a free slot.
+        db_collect_written(0);
+        while (db_in_flight >= DB_BATCHES - 1) {
+            usleep(100);
+            db_collect_written(0);
+        }
+        db_pending_batch()->durable = durable;
+        db_in_flight++;
+    }
+    int64_t start = metrics_now();
+    if (db_backend->flush(durable) != 0 || rollup_flush(durable) != ROLLUP_SUCCESS) return -1;
+    int64_t end = metrics_now();
+    if (db_pending || durable) {
+        metrics_observe(METRIC_DB_FLUSH_NS, end - start);
+        metrics_add(METRIC_DB_FLUSHES, 1);
+    }
+    if (db_backend->written) {
+        db_collect_written(end);
+    } else {
+        // Written by the flush.
+        for (; db_in_flight > 0; --db_in_flight, db_batch_head = (db_batch_head + 1) % DB_BATCHES) {
+            db_written(&db_batches[db_batch_head], end);
+        }
+    }
+    if (durable) {
+        wal_checkpoint(db_seq);
+        db_last_checkpoint = now_ms();
+    }
+    if (db_pending) log_pipe_write(LOG_DATA_INSERT, 0, db_pending);
+    db_pending = 0;
+    return 0;
+}
+
+/**
+ * Completes the barriers requested so far, called by the DB thread only.
+ */
+static void db_serve_barrier() {
+    pthread_mutex_lock(&barrier_mtx);
+    unsigned long requested = barrier_requested;
+    uint64_t target = barrier_target;
+    pthread_mutex_unlock(&barrier_mtx);
+    if (requested == barrier_done || db_nodes_read < target) return; // Readings still queued in the buffer.
+
+    ERROR_HANDLER(db_flush(true) != 0, "Error writing to DB.");
+    pthread_mutex_lock(&barrier_mtx);
+    barrier_done = requested;
+    pthread_cond_broadcast(&barrier_cond);
+    pthread_mutex_unlock(&barrier_mtx);
+}
+
+/**
+ * Flushes the batch when the oldest row has waited DB_FLUSH_INTERVAL ms.
+ */
+static void db_flush_if_due() {
+    if (db_pending && now_ms() - db_first_pending >= DB_FLUSH_INTERVAL) {
+        ERROR_HANDLER(db_flush(false) != 0, "Error writing to DB.");
+    }
+}
+
+/**
+ * This function hands a new row to the backend. The batch is written out once the backend is full, or by
+ * db_flush_if_due() and db_barrier(), so a signal that ends the process loses at most one batch that is not
+ * older than DB_FLUSH_INTERVAL.
+ * @param data The reading.
+ * @return 0 on success, negative if there is an error.
+ */
+static int insert_sensor(const sensor_data_t *data) {
+    if (db_backend->insert(data->id, data->value, data->ts) != 0) return -1;
+    rollup_update(data->id, data->value, data->ts, data->seq != 0 && data->seq <= wal_replay_end());
+    metrics_add(METRIC_DB_ROWS, 1);
+
+    int64_t now = metrics_now();
+    metrics_observe(METRIC_INSERT_TO_WRITE_NS, now - data->buf_ns);
+    db_batch_t *b = db_pending_batch();
+    if ((size_t) b->rows == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 1024;
+        b->write_ns = realloc(b->write_ns, b->cap * sizeof(int64_t));
+        b->rx_ns = realloc(b->rx_ns, b->cap * sizeof(int64_t));
+        ERROR_HANDLER(b->write_ns == NULL || b->rx_ns == NULL, "Pending rows realloc failed.");
+    }
+    b->write_ns[b->rows] = now;
+    b->rx_ns[b->rows++] = data->rx_ns;
+    if (db_sample_every && ++db_rows % db_sample_every == 0) {
+        if (b->n_samples == b->samples_cap) {
+            b->samples_cap = b->samples_cap ? 2 * b->samples_cap : 64;
+            b->samples = realloc(b->samples, b->samples_cap * sizeof(db_sample_t));
+            ERROR_HANDLER(b->samples == NULL, "Latency samples realloc failed.");
+        }
+        b->samples[b->n_samples++] = (db_sample_t) {data, now};
+    }
+
+    if (db_pending == 0) db_first_pending = now / 1000000;
+    db_pending++;
+    if (db_backend->full() && db_flush(false) != 0) return -1;
+    return 0;
+}
+
+void db_select_latency_sample(unsigned n) {
+    db_sample_every = n;
+}
+
+void db_select_continue() {
+    db_continue = true;
+}
+
+bool db_continuing() {
+    return db_continue || wal_recovered();
+}
+
+int db_select_backend(const char *name) {
+    for (size_t i = 0; i < sizeof(db_backends) / sizeof(db_backends[0]); ++i) {
+        if (strcmp(db_backends[i]->name, name) == 0) {
+            db_backend = db_backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void db_stats(FILE *out) {
+    const db_backend_t *backend = db_backend;
+    if (backend == NULL) {
+        fprintf(out, "backend=none\n");
+        return;
+    }
+    fprintf(out, "backend=%s", backend->name);
+    if (backend->stats) backend->stats(out);
+    fprintf(out, "\n");
+}
+
+static void log_push(log_codes code, sensor_id_t id, sensor_value_t data, uint32_t aux, int64_t mono_ns);
+
+/**
+ * Logs what the log policies suppressed, called from logpolicy_report().
+ */
+static void log_suppressed(log_codes code, sensor_id_t id, uint64_t suppressed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    log_push(LOG_SUPPRESSED, id, (sensor_value_t) suppressed, code, (int64_t) now.tv_sec * 1000000000 + now.tv_nsec);
 }
 
 int db_close() {
+    logpolicy_report(log_suppressed); // Whatever was suppressed since the last report.
     return close(fd[WRITE_END]); // Important to let the child die.
 }
 
+int db_barrier() {
+    uint64_t target = sbuffer_appended();
+    pthread_mutex_lock(&barrier_mtx);
+    unsigned long ticket = ++barrier_requested;
+    if (target > barrier_target) barrier_target = target;
+    while (!db_closed && barrier_done < ticket) {
+        pthread_cond_wait(&barrier_cond, &barrier_mtx);
+    }
+    int res = barrier_done >= ticket ? 0 : -1;
+    pthread_mutex_unlock(&barrier_mtx);
+    return res;
+}
+
 void *db_init() {
-    db_file = fopen(DB_FILE_NAME, "w");
-    ERROR_HANDLER(db_file == NULL, "File creation did not work.");
-    log_pipe_write(LOG_NEW_DATA_FILE, 0, 0);
+    placement_apply(PLACEMENT_DB); // Before the backend allocates its buffers and starts its writer threads.
+    if (db_backend == NULL) ERROR_HANDLER(db_select_backend(DB_BACKEND) != 0, "Unknown DB backend.");
+    ERROR_HANDLER(db_backend->open() != 0, "File creation did not work.");
+    ERROR_HANDLER(rollup_open() != ROLLUP_SUCCESS, "Rollup file creation did not work.");
+    TRACE_INFO("DB backend %s opened.", db_backend->name);
+    if (db_sample_every) {
+        db_latency_file = fopen(DB_LATENCY_FILE, "w");
+        ERROR_HANDLER(db_latency_file == NULL, "Latency file creation did not work.");
+        fprintf(db_latency_file, "# seq id receive_to_insert_us insert_to_datamgr_us insert_to_write_us "
+                                 "write_to_durable_us durable\n");
+    }
+    db_last_checkpoint = now_ms();
 
     sbuffer_node_t *node = NULL;
     sensor_data_t *data;
     do {
-        // Same idea as with the datamgr, read until the EOF is sent. Insert all data into the database, write the
-        // log as required.
+        // Same idea as with the datamgr, read until the EOF is sent. Insert all data into the database, the log
+        // gets one line per written batch.
         int res;
         do {
+            db_serve_barrier();
+            db_flush_if_due(); // Nothing new came in, don't let the pending rows wait for a full buffer.
+            db_collect_written(0);
             res = sbuffer_read(&node, &data);
-            usleep(10);
+            if (res == SBUFFER_NO_DATA) usleep(10);
         } while (res == SBUFFER_NO_DATA);
+        db_nodes_read++;
         if (data->id == 0) break;
-        DEBUG_PRINTF("Datum read: %i %f %li", data->id, data->value, data->ts);
-        ERROR_HANDLER(insert_sensor(data->id, data->value, data->ts) < 0, "Error writing to file.");
-        log_pipe_write(LOG_DATA_INSERT, data->id, 0);
+        metrics_add(METRIC_SBUFFER_READ_DB, 1);
+        TRACE_DEBUG("Datum read: %i %f %li", data->id, data->value, data->ts);
+        ERROR_HANDLER(insert_sensor(data) < 0, "Error writing to file.");
+        if (data->seq) db_seq = data->seq;
     } while (1);
 
-    ERROR_HANDLER(fclose(db_file) != 0, "Error closing DB");
-    log_pipe_write(LOG_DATA_FILE_CLOSED, 0, 0);
+    // Everything left is written and synced, then whoever still waits on a barrier is released.
+    ERROR_HANDLER(db_flush(true) != 0 || db_backend->close() != 0 || rollup_close() != ROLLUP_SUCCESS,
+                  "Error closing DB");
+    if (db_latency_file) fclose(db_latency_file);
+    db_latency_file = NULL;
+    for (int i = 0; i < DB_BATCHES; ++i) {
+        free(db_batches[i].write_ns);
+        free(db_batches[i].rx_ns);
+        free(db_batches[i].samples);
+        db_batches[i] = (db_batch_t) {0};
+    }
+    db_batch_head = db_in_flight = 0;
+    pthread_mutex_lock(&barrier_mtx);
+    barrier_done = barrier_requested;
+    db_closed = true;
+    pthread_cond_broadcast(&barrier_cond);
+    pthread_mutex_unlock(&barrier_mtx);
     pthread_exit(NULL);
 }
 
-void log_pipe_write(log_codes code, sensor_id_t id, sensor_value_t data) {
+/**
+ * Puts an event into the ring, past the log policies.
+ */
+static void log_push(log_codes code, sensor_id_t id, sensor_value_t data, uint32_t aux, int64_t mono_ns) {
     log_payload payload;
     memset(&payload, 0, sizeof(log_payload)); // This avoids unsafe behavior due to padding.
     payload.id = id;
     payload.data = data;
     payload.code = code;
-    write(fd[WRITE_END], &payload, sizeof(log_payload));
+    payload.aux = aux;
+    payload.mono_ns = mono_ns;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    payload.real_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    if (!logring_push(&payload)) metrics_add(METRIC_LOG_DROPPED, 1);
+}
+
+/**
+ * Publishes an event and puts it into the ring unless a log policy suppresses it.
+ */
+static void log_raise(log_codes code, sensor_id_t id, sensor_value_t data, uint32_t aux) {
+    // The policies only need the vDSO clock, a suppressed event costs no syscall and never touches the ring.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t mono_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    pubsub_publish(code, id, data, time(NULL)); // Subscribers filter for themselves, they see every event.
+    if (logpolicy_report_due(mono_ns)) logpolicy_report(log_suppressed);
+    if (!logpolicy_allow(code, id, mono_ns)) return;
+    log_push(code, id, data, aux, mono_ns);
+}
+
+void log_pipe_write(log_codes code, sensor_id_t id, sensor_value_t data) {
+    log_raise(code, id, data, 0);
+}
+
+void log_data_file(log_codes code, db_store_kind store, sensor_value_t number) {
+    log_raise(code, 0, number, store);
+}
+
+/**
+ * Writes one event to the log, as a text line or as a binary record. Both go into the stdio buffer of log_file.
+ * @param payload the event
+ * @param last_log the number of the event
+ */
+static void log_format(const log_payload *payload, uint64_t last_log) {
+    logfmt_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.seq = last_log;
+    record.mono_ns = payload->mono_ns;
+    record.real_ns = payload->real_ns;
+    record.code = (uint16_t) payload->code;
+    record.id = payload->id;
+    record.aux = payload->aux;
+    record.value = payload->data;
+    if (log_binary) fwrite(&record, sizeof(record), 1, log_file);
+    else logfmt_text(log_file, &record);
 }
 
 static void log_child_process() {
     close(fd[WRITE_END]);
-    ssize_t n;
+    // Lines are written in batches: the buffer goes to the file whenever the ring runs dry, or when it is full.
+    ERROR_HANDLER(setvbuf(log_file, NULL, _IOFBF, LOG_BUFFER_SIZE) != 0, "Error buffering log file.");
     log_payload payload;
-    int last_log = 0;
-    while ((n = read(fd[READ_END], &payload, sizeof(payload))) > 0) {
-        // We read the stream until the EOF is reached (when the parent closes the WRITE_END pipe).
-        // Also count how many logs have been generated so far.
-        last_log++;
-        fprintf(log_file, "%i %lu ", last_log, (unsigned long) time(NULL));
-        switch (payload.code) {
-            case LOG_NEW_CONNECTION:
-                fprintf(log_file, "Sensor node %i has opened a new connection.\n", payload.id);
-                break;
-            case LOG_CLOSED_CONNECTION:
-                fprintf(log_file, "Sensor node %i has closed the connection.\n", payload.id);
-                break;
-            case LOG_TIMEOUT:
-                fprintf(log_file, "Sensor node %i has timed-out.\n", payload.id);
-                break;
-            case LOG_TOO_COLD:
-                fprintf(log_file, "Sensor node %i reports it’s too cold (avg temp = %lf).\n", payload.id,
-                        payload.data);
-                break;
-            case LOG_TOO_HOT:
-                fprintf(log_file, "Sensor node %i reports it’s too hot (avg temp = %lf).\n", payload.id,
-                        payload.data);
-                break;
-            case LOG_INVALID_ID:
-                fprintf(log_file, "Received sensor data with invalid sensor node ID %i.\n", payload.id);
-                break;
-            case LOG_NEW_DATA_FILE:
-                fprintf(log_file, "A new data.csv file has been created.\n");
-                break;
-            case LOG_DATA_INSERT:
-                fprintf(log_file, "Data insertion from sensor %i succeeded.\n", payload.id);
-                break;
-            case LOG_DATA_FILE_CLOSED:
-                fprintf(log_file, "The data.csv file has been closed.\n");
-                break;
-        }
+    uint64_t last_log = 0; // Count how many logs have been generated so far.
+    bool parent_gone = false;
+    while (1) {
+        while (logring_pop(&payload)) log_format(&payload, ++last_log);
         fflush(log_file);
+        // The parent closes the WRITE_END pipe once it stops logging, the ring is drained one last time above.
+        if (parent_gone) break;
+        if (!logring_idle()) continue;
+
+        struct pollfd fds[2] = {{logring_fd(), POLLIN, 0}, {fd[READ_END], POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) continue;
+        if (fds[0].revents & POLLIN) {
+            uint64_t wakeups;
+            read(logring_fd(), &wakeups, sizeof(wakeups));
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) parent_gone = true;
     }
 
-    ERROR_HANDLER(n == -1 || close(fd[READ_END]) == -1 || fclose(log_file) != 0, "Error stopping logger.");
+    ERROR_HANDLER(close(fd[READ_END]) == -1 || fclose(log_file) != 0, "Error stopping logger.");
     _exit(EXIT_SUCCESS);
 }
 
+int log_select_format(const char *name) {
+    if (strcmp(name, "text") == 0) log_binary = false;
+    else if (strcmp(name, "binary") == 0) log_binary = true;
+    else return -1;
+    return 0;
+}
+
 void log_init() {
     // We fork the main thread and initialize the log file only in the child (the parent has no use for it)
+    // The events travel through the shared ring, the pipe only tells the child when the parent is done.
+    ERROR_HANDLER(logpolicy_load(LOGPOLICY_FILE) != 0, "Invalid log policy file.");
+    logring_init();
     ERROR_HANDLER(pipe(fd) == -1, "Pipe creation unsuccessful.");
 
     pid_t pid = fork();
@@ -132,13 +468,18 @@ void log_init() {
 
     if (pid != 0) {
         close(fd[READ_END]);
-        DEBUG_PRINTF("Parent process %i.", getpid());
+        logring_set_logger(pid);
+        TRACE_INFO("Parent process %i.", getpid());
         return;
     } else {
-        log_file = fopen(LOG_FILE_NAME, "w");
+        log_file = fopen(log_binary ? LOGFMT_BINARY_FILE : LOGFMT_TEXT_FILE, db_continue ? "a" : "w");
         ERROR_HANDLER(log_file == NULL, "Error creating log file.");
+        // A continued binary log already has its header, unless it is new.
+        ERROR_HANDLER(fseek(log_file, 0, SEEK_END) != 0, "Error opening log file.");
+        ERROR_HANDLER(log_binary && ftell(log_file) == 0 && logfmt_write_header(log_file) != 0,
+                      "Error writing log header.");
     }
-    DEBUG_PRINTF("Child process %i and log file created successfully.", getpid());
+    TRACE_INFO("Child process %i and log file created successfully.", getpid());
     log_child_process();
 }
 
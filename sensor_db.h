@@ -10,6 +10,56 @@
 #ifndef DB_H
 #define DB_H
 
+#ifndef DB_BACKEND
+#define DB_BACKEND "csv" // Storage backend used unless db_select_backend() picks another one: csv, sqlite, seg.
+#endif
+
+#ifndef DB_FLUSH_SIZE
+#define DB_FLUSH_SIZE (64 * 1024) // Bytes of rows gathered by the csv backend before they are written in one go.
+#endif
+
+#ifndef DB_WRITER_BUFFERS
+#define DB_WRITER_BUFFERS 3 // Buffers of the csv writer thread: one being filled, the others queued for the disk.
+#endif
+
+#ifndef DB_ROTATE_SIZE
+#define DB_ROTATE_SIZE 0 // Start a new csv segment once the current one has this many bytes, 0 never does.
+#endif
+
+#ifndef DB_ROTATE_WINDOW
+#define DB_ROTATE_WINDOW 0 // Start a new csv segment every this many seconds of wall-clock time, 0 never does.
+#endif
+
+#ifndef DB_RAW_RETENTION
+#define DB_RAW_RETENTION 0 // Delete rotated csv segments last written this many seconds ago, 0 keeps them all.
+#endif
+
+#ifndef DB_SQLITE_BATCH
+#define DB_SQLITE_BATCH 10000 // Rows the sqlite backend inserts per transaction.
+#endif
+
+#ifndef DB_SEG_SEAL_AGE
+#define DB_SEG_SEAL_AGE 60 // Seconds the seg backend keeps a partial block in memory before it is written anyway.
+#endif
+
+#ifndef DB_SEG_MAX_OPEN
+#define DB_SEG_MAX_OPEN 1024 // Partial blocks the seg backend keeps in memory, the oldest is written to make room.
+#endif
+
+#ifndef DB_FLUSH_INTERVAL
+#define DB_FLUSH_INTERVAL 100 // Milliseconds a row may wait in the buffer before it is written anyway.
+#endif
+
+#ifndef DB_SYNC_EVERY
+#define DB_SYNC_EVERY 0 // Make every Nth flush durable, 0 only syncs on a barrier and on close.
+#endif
+
+#ifndef DB_LATENCY_SAMPLE
+#define DB_LATENCY_SAMPLE 0 // Write the stage times of every Nth row to DB_LATENCY_FILE, 0 writes none.
+#endif
+
+#define DB_LATENCY_FILE "gateway.latency"
+
 /**
  * The available log events.
  */
@@ -22,7 +72,10 @@ typedef enum {
     LOG_NEW_DATA_FILE,
     LOG_DATA_INSERT,
     LOG_DATA_FILE_CLOSED,
-    LOG_TIMEOUT
+    LOG_TIMEOUT,
+    LOG_WAL_REPLAY,
+    LOG_SUPPRESSED,
+    LOG_CODE_COUNT // Not an event, the number of codes.
 } log_codes;
 
 /**
@@ -32,32 +85,126 @@ typedef struct {
     log_codes code;
     sensor_id_t id;
     sensor_value_t data;
+    int64_t mono_ns; // CLOCK_MONOTONIC and CLOCK_REALTIME when the event was raised, not when it was logged.
+    int64_t real_ns;
+    uint32_t aux; // The code a LOG_SUPPRESSED event counts, the db_store_kind of a data file event, else 0.
 } log_payload;
 
 
+/**
+ * A storage backend of the DB thread. Rows are inserted one by one and written in batches: the DB thread calls
+ * flush() when full() says the batch is big enough, when its oldest row is DB_FLUSH_INTERVAL ms old, on a
+ * barrier and before close(). A backend that writes in the background has a written() that tells when the
+ * batches it was given were written, a durable flush() still returns only once they are synced. Backends log
+ * LOG_NEW_DATA_FILE and LOG_DATA_FILE_CLOSED themselves, once per file they write. All functions but stats() are
+ * only called from the DB thread.
+ */
+typedef struct {
+    const char *name;                                                           /**< name used to select it */
+    int (*open)();                                                              /**< 0 on success */
+    int (*insert)(sensor_id_t id, sensor_value_t value, sensor_ts_t ts);        /**< 0 on success */
+    bool (*full)();                                                             /**< the batch should go out */
+    int (*flush)(bool durable);                                                 /**< write, and sync if durable */
+    int (*close)();                                                             /**< 0 on success */
+    void (*stats)(FILE *out);                           /**< prints ' key=value' counters, may be NULL */
+    int (*written)(int64_t *ns, int max);       /**< when flushed batches were written, NULL if flush() writes */
+} db_backend_t;
+
+/**
+ * The kind of file a LOG_NEW_DATA_FILE or LOG_DATA_FILE_CLOSED event is about, its data names the file.
+ */
+typedef enum {
+    DB_STORE_CSV,       // data.csv if the data is 0, else the rotated segment data-NNNNNN.csv
+    DB_STORE_SQLITE,    // data.db
+    DB_STORE_SEG,       // data-<data>.seg
+} db_store_kind;
+
+extern const db_backend_t db_csv_backend;       // data.csv or rotated data-NNNNNN.csv, see db_csv.c
+extern const db_backend_t db_sqlite_backend;    // data.db, see db_sqlite.c
+extern const db_backend_t db_seg_backend;       // data-<time>.seg compressed segments, see db_seg.c
+
+/**
+ * Selects the storage backend by name. Must be called before the DB thread starts.
+ * @param name the name of the backend, "csv", "sqlite" or "seg"
+ * @return 0 on success, -1 if there is no backend with that name.
+ */
+int db_select_backend(const char *name);
+
+/**
+ * Makes db_init() and log_init() add to the data files and the log of the earlier runs instead of starting them
+ * over, as a backfill into an existing store needs. Must be called before log_init().
+ */
+void db_select_continue();
+
+/**
+ * \return true if the data files of the earlier run are continued: db_select_continue() was called, or wal_init()
+ * found a run that crashed and replays what it missed
+ */
+bool db_continuing();
+
+/**
+ * Traces the stages of every nth row into DB_LATENCY_FILE, one line per row once its batch is written:
+ * "<seq> <sensor id> <receive to insert> <insert to datamgr> <insert to write> <write to durable> <durable>",
+ * times in microseconds, -1 for a stage the row did not pass (yet). The last stage ends when the row is in the
+ * data file: written by the writer thread of the csv backend, by the flush of the others, synced if durable.
+ * Must be called before the DB thread starts.
+ * @param n 1 in n rows is traced, 0 turns tracing off
+ */
+void db_select_latency_sample(unsigned n);
+
 /**
  * Initialize the Database.
  */
 void *db_init();
 
+/**
+ * Selects how the logger writes events. Must be called before log_init().
+ * @param name "text" for gateway.log (the default) or "binary" for gateway.bin, see logfmt.h and log_decode
+ * @return 0 on success, -1 if there is no format with that name.
+ */
+int log_select_format(const char *name);
+
 /**
  * Adds an event to the database.
  */
 void log_init();
 
 /**
- * Closes the database and the file descriptor's write end.
+ * Closes the write end of the pipe to the logger, which then drains the ring and exits.
  * Should only be called from the parent process.
  * @return
  */
 int db_close();
 
 /**
- * Adds an event to the pipe for logging.
+ * Durability barrier: waits until the DB thread has taken every reading that was in the shared buffer at the call,
+ * written them and fdatasync()ed the file. Can be called from any thread.
+ * @return 0 when the readings in the buffer before the call are on disk, -1 if the DB is already closed.
+ */
+int db_barrier();
+
+/**
+ * Prints one line with the name and the counters of the storage backend, e.g. for the STATS command of the
+ * query interface.
+ * @param out the stream to print to
+ */
+void db_stats(FILE *out);
+
+/**
+ * Adds an event to the shared ring of the logger process (see logring.h). Costs no syscall unless the logger
+ * is idle and has to be woken up.
  * @param code An enum with the possible log events.
  * @param data The data saved to the log.
  * @param id The id of the sensor.
  */
 void log_pipe_write(log_codes code, sensor_id_t id, sensor_value_t data);
 
+/**
+ * Logs that a backend opened or closed a data file, like log_pipe_write().
+ * @param code LOG_NEW_DATA_FILE or LOG_DATA_FILE_CLOSED
+ * @param store the kind of file
+ * @param number the number of the file, see db_store_kind
+ */
+void log_data_file(log_codes code, db_store_kind store, sensor_value_t number);
+
 #endif //DB_H
@@ -0,0 +1,472 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "metrics.h"
+
+// A reading on the wire, as sensor_node sends it: <id><value><ts>, packed.
+#define RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+#ifndef LOADGEN_BACKLOG
+#define LOADGEN_BACKLOG 65536 // Readings a connection queues while the gateway does not read, later ones are dropped.
+#endif
+
+#define INITIAL_TEMPERATURE 20
+#define TEMP_DEV 1000 // Same random walk as sensor_node.
+
+typedef enum {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_OPEN
+} conn_state_t;
+
+/**
+ * One connection and the sensors it carries. Readings are queued in 'out' together with the time they were due,
+ * so the send latency counts the time a reading waited for the gateway, not only the write.
+ */
+typedef struct {
+    int fd;
+    conn_state_t state;
+    int64_t connect_start;
+    int64_t close_at;               // Churn: close and reconnect once due, 0 never.
+    size_t first_sensor, n_sensors; // Slice of the global sensor table.
+    size_t next_sensor;             // Constant arrivals go round-robin over the sensors.
+    int64_t next_arrival;           // Time the next reading is due.
+    double load;                    // conn_load() at next_arrival.
+    unsigned char *out;
+    size_t out_off, out_len;
+    int64_t *due;                   // Ring of due times of the queued readings.
+    size_t due_head, due_len;
+    uint64_t written;               // Bytes written on this connection, to know which readings are out.
+} lg_conn_t;
+
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    lg_conn_t *conns;
+    size_t n_conns;
+    unsigned short rng[3];
+    atomic_uint_fast64_t sent;
+    uint64_t dropped, connects, errors;
+    uint64_t connect_hist[METRICS_HIST_BUCKETS];
+    uint64_t send_hist[METRICS_HIST_BUCKETS];
+} lg_thread_t;
+
+// Settings, fixed before the threads start.
+static struct sockaddr_in server;
+static sensor_id_t *sensor_ids;
+static sensor_value_t *sensor_values;
+static double rate = 1;             // Readings per second per sensor.
+static bool poisson = true;
+static double ramp = 0;             // Seconds to reach the full rate.
+static double churn = 0;            // Mean lifetime of a connection in seconds, 0 keeps them open.
+static int64_t start_ns, stop_ns;
+static atomic_bool stopping = false;
+
+static int64_t now_ns() {
+    return metrics_now();
+}
+
+/**
+ * @return the readings a connection is expected to have sent from the start of the run to 'now', the integral of
+ * its rate over a linear ramp and the full rate after it
+ */
+static double conn_load(const lg_conn_t *c, int64_t now) {
+    double r = rate * c->n_sensors, x = (now - start_ns) / 1e9;
+    if (x <= 0) return 0;
+    if (x < ramp) return r * x * x / (2 * ramp);
+    return r * (x - ramp / 2);
+}
+
+/**
+ * @return the time at which a connection is expected to have sent 'load' readings, the inverse of conn_load()
+ */
+static int64_t conn_time(const lg_conn_t *c, double load) {
+    double r = rate * c->n_sensors, x;
+    if (load < r * ramp / 2) x = sqrt(2 * ramp * load / r);
+    else x = load / r + ramp / 2;
+    return start_ns + (int64_t) (x * 1e9);
+}
+
+/**
+ * Schedules the next reading of a connection. Arrivals are spaced in expected readings rather than in time:
+ * exponential steps for Poisson arrivals, steps of one otherwise, mapped back to time through the rate. That keeps
+ * the rate of every connection right while it ramps up, whatever it was when the previous reading was due.
+ */
+static void next_arrival(lg_thread_t *t, lg_conn_t *c) {
+    c->load += poisson ? -log(1 - erand48(t->rng)) : 1;
+    int64_t due = conn_time(c, c->load);
+    c->next_arrival = due > c->next_arrival ? due : c->next_arrival + 1;
+}
+
+static void conn_open(lg_thread_t *t, lg_conn_t *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(c->fd == -1, "Socket creation failed.");
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->connect_start = now_ns();
+    if (connect(c->fd, (struct sockaddr *) &server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        t->errors++;
+        close(c->fd);
+        c->fd = -1;
+        c->state = CONN_CLOSED;
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLET, .data.ptr = c};
+    ERROR_HANDLER(epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0, "epoll_ctl failed.");
+}
+
+/**
+ * Closes a connection, the readings it still queued are dropped.
+ */
+static void conn_close(lg_thread_t *t, lg_conn_t *c) {
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+    t->dropped += c->due_len;
+    c->out_off = c->out_len = 0;
+    c->due_head = c->due_len = 0;
+    c->written = 0;
+}
+
+/**
+ * Writes what the connection queued and records the send latency of every reading that is out completely.
+ */
+static void conn_flush(lg_thread_t *t, lg_conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            t->errors++;
+            conn_close(t, c);
+            return;
+        }
+        c->out_off += n;
+        c->written += n;
+    }
+    int64_t now = now_ns();
+    uint64_t done = 0;
+    while (c->due_len && c->written >= RECORD_SIZE) {
+        t->send_hist[metrics_bucket(now - c->due[c->due_head])]++;
+        c->due_head = (c->due_head + 1) % LOADGEN_BACKLOG;
+        c->due_len--;
+        c->written -= RECORD_SIZE;
+        done++;
+    }
+    atomic_fetch_add_explicit(&t->sent, done, memory_order_relaxed);
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+}
+
+/**
+ * Queues every reading of a connection that is due by 'now'.
+ */
+static void conn_generate(lg_thread_t *t, lg_conn_t *c, int64_t now) {
+    sensor_ts_t ts = time(NULL);
+    while (c->next_arrival <= now && c->next_arrival < stop_ns) {
+        int64_t due = c->next_arrival;
+        next_arrival(t, c);
+        if (c->due_len == LOADGEN_BACKLOG) {
+            t->dropped++;
+            continue;
+        }
+        size_t s = c->first_sensor + (poisson ? (size_t) (erand48(t->rng) * c->n_sensors) % c->n_sensors
+                                              : c->next_sensor++ % c->n_sensors);
+        sensor_values[s] += TEMP_DEV * ((erand48(t->rng) - 0.5) / 10);
+
+        if (c->out_off && c->out_len + RECORD_SIZE > LOADGEN_BACKLOG * RECORD_SIZE) {
+            memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+            c->out_len -= c->out_off;
+            c->out_off = 0;
+        }
+        unsigned char *p = c->out + c->out_len;
+        memcpy(p, &sensor_ids[s], sizeof(sensor_id_t));
+        memcpy(p + sizeof(sensor_id_t), &sensor_values[s], sizeof(sensor_value_t));
+        memcpy(p + sizeof(sensor_id_t) + sizeof(sensor_value_t), &ts, sizeof(sensor_ts_t));
+        c->out_len += RECORD_SIZE;
+        c->due[(c->due_head + c->due_len++) % LOADGEN_BACKLOG] = due;
+    }
+}
+
+static void *lg_thread(void *arg) {
+    lg_thread_t *t = arg;
+    struct epoll_event events[64];
+    for (size_t i = 0; i < t->n_conns; ++i) conn_open(t, &t->conns[i]);
+
+    while (!atomic_load(&stopping)) {
+        int64_t now = now_ns();
+        int64_t wake = now + 10000000; // Look at the connections at least every 10 ms.
+        for (size_t i = 0; i < t->n_conns; ++i) {
+            lg_conn_t *c = &t->conns[i];
+            if (c->state == CONN_CLOSED) {
+                conn_open(t, c);
+                continue;
+            }
+            if (c->state != CONN_OPEN) continue;
+            conn_generate(t, c, now);
+            if (c->out_len) conn_flush(t, c);
+            if (c->state == CONN_OPEN && c->close_at && now >= c->close_at && c->out_len == 0) {
+                conn_close(t, c);
+                conn_open(t, c);
+                continue;
+            }
+            if (c->next_arrival < wake) wake = c->next_arrival;
+        }
+
+        int timeout = wake > now ? (int) ((wake - now + 999999) / 1000000) : 0;
+        int n = epoll_wait(t->epfd, events, 64, timeout);
+        for (int i = 0; i < n; ++i) {
+            lg_conn_t *c = events[i].data.ptr;
+            if (c->state == CONN_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    t->errors++;
+                    conn_close(t, c);
+                    usleep(1000); // The gateway may not listen (yet), do not spin on it.
+                    continue;
+                }
+                now = now_ns();
+                t->connects++;
+                t->connect_hist[metrics_bucket(now - c->connect_start)]++;
+                c->state = CONN_OPEN;
+                c->next_arrival = now;
+                c->load = conn_load(c, now);
+                c->close_at = churn > 0 ? now + (int64_t) (-log(1 - erand48(t->rng)) * churn * 1e9) : 0;
+            } else if (c->state == CONN_OPEN) {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    t->errors++;
+                    conn_close(t, c);
+                } else if (c->out_len) {
+                    conn_flush(t, c);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < t->n_conns; ++i) {
+        if (t->conns[i].state == CONN_OPEN) conn_flush(t, &t->conns[i]);
+        conn_close(t, &t->conns[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Prints percentiles of a histogram in microseconds.
+ */
+static void print_percentiles(const char *what, const uint64_t *hist) {
+    uint64_t total = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) total += hist[b];
+    printf("%-8s latency (us) n=%" PRIu64, what, total);
+    if (total == 0) {
+        printf("\n");
+        return;
+    }
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+    const char *names[] = {"p50", "p90", "p99", "p99.9", "max"};
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+        uint64_t rank = (uint64_t) ceil(quantiles[q] * total), seen = 0;
+        int b = 0;
+        while (b < METRICS_HIST_BUCKETS - 1 && (seen += hist[b]) < rank) b++;
+        printf(" %s=%.1f", names[q], metrics_bucket_floor(b) / 1e3);
+    }
+    printf("\n");
+}
+
+/**
+ * Reads the sensor ids of a room_sensor.map file, "<room id> <sensor id>" per line.
+ * @return the number of ids read into 'ids'
+ */
+static size_t read_map(const char *path, sensor_id_t *ids, size_t max) {
+    FILE *f = fopen(path, "r");
+    ERROR_HANDLER(f == NULL, "Sensor map cannot be opened.");
+    unsigned room, id;
+    size_t n = 0;
+    while (n < max && fscanf(f, "%u %u", &room, &id) == 2) ids[n++] = (sensor_id_t) id;
+    fclose(f);
+    return n;
+}
+
+static void print_help(void) {
+    printf("Use this program as: sensor_loadgen [options] <server IP> <server port>\n");
+    printf("\t%-12s : simulated sensors, ids 1..n unless -m is given (default 1000)\n", "-n sensors");
+    printf("\t%-12s : take the sensor ids from a room_sensor.map file, repeated up to -n sensors\n", "-m map");
+    printf("\t%-12s : readings per second per sensor, may be below 1 (default 1)\n", "-r rate");
+    printf("\t%-12s : poisson (default) or constant arrivals\n", "-a arrivals");
+    printf("\t%-12s : TCP connections the sensors are spread over (default 3)\n", "-c conns");
+    printf("\t%-12s : sender threads the connections are spread over (default 2)\n", "-t threads");
+    printf("\t%-12s : seconds to run (default 10)\n", "-d seconds");
+    printf("\t%-12s : seconds to ramp up linearly to the full rate (default 0)\n", "-R seconds");
+    printf("\t%-12s : mean seconds a connection lives before it is reopened, 0 never (default 0)\n", "-C seconds");
+    printf("\t%-12s : seed of the random values and arrivals (default the time)\n", "-s seed");
+    printf("Every connection the gateway accepts counts against its D_MAX_CONN, size it for -c and -C.\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t n_sensors = 1000;
+    int n_conns = 3, n_threads = 2;
+    double duration = 10;
+    const char *map = NULL;
+    long seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:r:a:c:t:d:R:C:s:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                n_sensors = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                map = optarg;
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'a':
+                ERROR_HANDLER(strcmp(optarg, "poisson") != 0 && strcmp(optarg, "constant") != 0,
+                              "Arrivals are poisson or constant.");
+                poisson = strcmp(optarg, "poisson") == 0;
+                break;
+            case 'c':
+                n_conns = atoi(optarg);
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                break;
+            case 'R':
+                ramp = strtod(optarg, NULL);
+                break;
+            case 'C':
+                churn = strtod(optarg, NULL);
+                break;
+            case 's':
+                seed = strtol(optarg, NULL, 10);
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    ERROR_HANDLER(n_sensors < 1 || n_conns < 1 || n_threads < 1 || rate <= 0 || duration <= 0, "Invalid option.");
+    if ((size_t) n_conns > n_sensors) n_conns = (int) n_sensors;
+    if (n_threads > n_conns) n_threads = n_conns;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind + 1]));
+    ERROR_HANDLER(inet_pton(AF_INET, argv[optind], &server.sin_addr) != 1, "Invalid server IP.");
+
+    sensor_ids = malloc(n_sensors * sizeof(sensor_id_t));
+    sensor_values = malloc(n_sensors * sizeof(sensor_value_t));
+    ERROR_HANDLER(sensor_ids == NULL || sensor_values == NULL, "Sensor table malloc failed.");
+    size_t n_map = map ? read_map(map, sensor_ids, n_sensors) : 0;
+    ERROR_HANDLER(map && n_map == 0, "Sensor map is empty.");
+    for (size_t i = 0; i < n_sensors; ++i) {
+        // Without a map the ids run 1..65535 and wrap, id 0 would end the gateway's buffer.
+        sensor_ids[i] = map ? sensor_ids[i % n_map] : (sensor_id_t) (i % UINT16_MAX + 1);
+        sensor_values[i] = INITIAL_TEMPERATURE;
+    }
+
+    lg_conn_t *conns = calloc(n_conns, sizeof(lg_conn_t));
+    lg_thread_t *threads = calloc(n_threads, sizeof(lg_thread_t));
+    ERROR_HANDLER(conns == NULL || threads == NULL, "Connection malloc failed.");
+    for (int i = 0; i < n_conns; ++i) {
+        lg_conn_t *c = &conns[i];
+        c->fd = -1;
+        c->first_sensor = n_sensors * i / n_conns;
+        c->n_sensors = n_sensors * (i + 1) / n_conns - c->first_sensor;
+        c->out = malloc(LOADGEN_BACKLOG * RECORD_SIZE);
+        c->due = malloc(LOADGEN_BACKLOG * sizeof(int64_t));
+        ERROR_HANDLER(c->out == NULL || c->due == NULL, "Connection buffer malloc failed.");
+    }
+    start_ns = now_ns();
+    stop_ns = start_ns + (int64_t) (duration * 1e9);
+    for (int i = 0, first = 0; i < n_threads; ++i) {
+        lg_thread_t *t = &threads[i];
+        int end = n_conns * (i + 1) / n_threads;
+        t->conns = conns + first;
+        t->n_conns = end - first;
+        first = end;
+        t->rng[0] = (unsigned short) seed;
+        t->rng[1] = (unsigned short) (seed >> 16);
+        t->rng[2] = (unsigned short) i;
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        ERROR_HANDLER(t->epfd == -1, "epoll creation failed.");
+        ERROR_HANDLER(pthread_create(&t->tid, NULL, lg_thread, t) != 0, "Thread creation failed.");
+    }
+
+    printf("%zu sensors at %g readings/s each over %d connections, %d threads, %s arrivals, target %.0f readings/s\n",
+           n_sensors, rate, n_conns, n_threads, poisson ? "poisson" : "constant", rate * n_sensors);
+    uint64_t last = 0;
+    for (int s = 1; now_ns() < stop_ns; ++s) {
+        int64_t wake = start_ns + s * 1000000000LL;
+        if (wake > stop_ns) wake = stop_ns;
+        int64_t left = wake - now_ns();
+        struct timespec ts = {left / 1000000000, left % 1000000000};
+        if (left > 0) nanosleep(&ts, NULL);
+        uint64_t sent = 0;
+        for (int i = 0; i < n_threads; ++i) sent += atomic_load_explicit(&threads[i].sent, memory_order_relaxed);
+        printf("t=%3ds sent %10.0f readings/s\n", s, (double) (sent - last));
+        fflush(stdout);
+        last = sent;
+    }
+    usleep(200000); // Let the threads write what is still queued.
+    atomic_store(&stopping, true);
+
+    uint64_t connect_hist[METRICS_HIST_BUCKETS] = {0}, send_hist[METRICS_HIST_BUCKETS] = {0};
+    uint64_t sent = 0, dropped = 0, connects = 0, errors = 0;
+    for (int i = 0; i < n_threads; ++i) {
+        lg_thread_t *t = &threads[i];
+        pthread_join(t->tid, NULL);
+        close(t->epfd);
+        sent += atomic_load(&t->sent);
+        dropped += t->dropped;
+        connects += t->connects;
+        errors += t->errors;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) {
+            connect_hist[b] += t->connect_hist[b];
+            send_hist[b] += t->send_hist[b];
+        }
+    }
+    double seconds = (now_ns() - start_ns) / 1e9;
+    printf("\nsent %" PRIu64 " readings in %.2f s, %.0f readings/s (target %.0f), %" PRIu64 " dropped, "
+           "%" PRIu64 " connects, %" PRIu64 " errors\n", sent, seconds, sent / seconds, rate * n_sensors, dropped,
+           connects, errors);
+    print_percentiles("connect", connect_hist);
+    print_percentiles("send", send_hist);
+
+    for (int i = 0; i < n_conns; ++i) {
+        free(conns[i].out);
+        free(conns[i].due);
+    }
+    free(conns);
+    free(threads);
+    free(sensor_ids);
+    free(sensor_values);
+    return sent ? EXIT_SUCCESS : EXIT_FAILURE;
+}
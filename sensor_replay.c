@@ -0,0 +1,249 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "capture.h"
+#include "metrics.h"
+
+/**
+ * The socket of an open connection, under its number in the capture. Number 0 marks a free slot.
+ */
+typedef struct {
+    uint32_t conn;
+    int fd;
+} conn_slot_t;
+
+static struct sockaddr_in server;
+// Open addressing by connection number. The numbers are handed out in order, so the low bits spread them and the
+// table only grows with the connections open at once, not with all the captured ones.
+static conn_slot_t *slots = NULL;
+static size_t n_slots = 0, n_open = 0;
+static uint64_t connects, closes, readings, bytes, errors;
+static uint64_t late_hist[METRICS_HIST_BUCKETS];
+
+static int conn_open() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(fd == -1, "Socket creation failed.");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *) &server, sizeof(server)) != 0) {
+        errors++;
+        close(fd);
+        return -1;
+    }
+    connects++;
+    return fd;
+}
+
+/**
+ * \return the slot of connection 'conn', or the free slot it would take
+ */
+static conn_slot_t *conn_find(uint32_t conn) {
+    size_t i = conn & (n_slots - 1);
+    while (slots[i].conn != 0 && slots[i].conn != conn) i = (i + 1) & (n_slots - 1);
+    return &slots[i];
+}
+
+/**
+ * Adds connection 'conn', which must not be in the table yet.
+ */
+static void conn_insert(uint32_t conn, int fd) {
+    if (2 * (n_open + 1) > n_slots) {
+        conn_slot_t *old = slots;
+        size_t n_old = n_slots;
+        n_slots = n_slots ? 2 * n_slots : 1024;
+        slots = calloc(n_slots, sizeof(conn_slot_t));
+        ERROR_HANDLER(slots == NULL, "Connection table calloc failed.");
+        for (size_t i = 0; i < n_old; ++i) {
+            if (old[i].conn != 0) *conn_find(old[i].conn) = old[i];
+        }
+        free(old);
+    }
+    conn_slot_t *slot = conn_find(conn);
+    n_open++;
+    slot->conn = conn;
+    slot->fd = fd;
+}
+
+/**
+ * Closes the connection of 'slot' and frees the slot, moving later entries of its probe run back into the gap.
+ */
+static void conn_remove(conn_slot_t *slot) {
+    close(slot->fd);
+    n_open--;
+    size_t gap = slot - slots, i = gap;
+    while (1) {
+        i = (i + 1) & (n_slots - 1);
+        if (slots[i].conn == 0) break;
+        size_t home = slots[i].conn & (n_slots - 1);
+        // The entry may fill the gap unless its home lies cyclically in (gap, i].
+        if (((i - home) & (n_slots - 1)) >= ((i - gap) & (n_slots - 1))) {
+            slots[gap] = slots[i];
+            gap = i;
+        }
+    }
+    slots[gap].conn = 0;
+}
+
+/**
+ * Writes the bytes of one event, a connection that fails is closed and its later events are skipped.
+ */
+static void conn_write(conn_slot_t *slot, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(slot->fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            errors++;
+            conn_remove(slot);
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * Prints percentiles of a histogram in microseconds.
+ */
+static void print_percentiles(const char *what, const uint64_t *hist) {
+    uint64_t total = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) total += hist[b];
+    printf("%-8s (us) n=%" PRIu64, what, total);
+    const double quantiles[] = {0.5, 0.99, 0.999, 1};
+    const char *names[] = {"p50", "p99", "p99.9", "max"};
+    for (size_t q = 0; total && q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+        uint64_t rank = (uint64_t) ceil(quantiles[q] * total), seen = 0;
+        int b = 0;
+        while (b < METRICS_HIST_BUCKETS - 1 && (seen += hist[b]) < rank) b++;
+        printf(" %s=%.1f", names[q], metrics_bucket_floor(b) / 1e3);
+    }
+    printf("\n");
+}
+
+static void print_help(void) {
+    printf("Use this program as: sensor_replay [options] <capture file> <server IP> <server port>\n");
+    printf("\t%-10s : speed-up of the recorded gaps, 1 plays in real time, 0 as fast as possible (default 1)\n",
+           "-x speed");
+    printf("Every captured connection is opened again, size the gateway's D_MAX_CONN for them.\n");
+}
+
+/**
+ * Plays a capture written by sensor_gateway -c back against a gateway: every connection is opened, fed the same
+ * bytes and closed in the order and, scaled by the speed, with the gaps they were received with. A single thread
+ * goes through the events in file order, so the interleaving of the connections is the captured one.
+ */
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:h")) != -1) {
+        switch (opt) {
+            case 'x':
+                speed = strtod(optarg, NULL);
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 3) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    ERROR_HANDLER(speed < 0, "Invalid speed.");
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind + 2]));
+    ERROR_HANDLER(inet_pton(AF_INET, argv[optind + 1], &server.sin_addr) != 1, "Invalid server IP.");
+    signal(SIGPIPE, SIG_IGN); // A gateway that went away shows up as a write error.
+
+    int fd = open(argv[optind], O_RDONLY);
+    ERROR_HANDLER(fd == -1, "Could not open the capture.");
+    struct stat st;
+    ERROR_HANDLER(fstat(fd, &st) != 0 || st.st_size < CAPTURE_HEADER_SIZE, "Not a gateway capture.");
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    ERROR_HANDLER(map == MAP_FAILED, "Could not map the capture.");
+    uint32_t size;
+    memcpy(&size, map + 8, sizeof(size));
+    ERROR_HANDLER(memcmp(map, CAPTURE_MAGIC, 8) != 0 || size != sizeof(capture_event_t), "Not a gateway capture.");
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    int64_t start = metrics_now();
+    int64_t at_us = 0; // Capture time of the current event.
+    size_t off = CAPTURE_HEADER_SIZE;
+    while (off + sizeof(capture_event_t) <= (size_t) st.st_size) {
+        capture_event_t e;
+        memcpy(&e, map + off, sizeof(e));
+        if (off + sizeof(e) + e.len > (size_t) st.st_size) break; // Torn by a crash of the gateway.
+        const unsigned char *payload = map + off + sizeof(e);
+        off += sizeof(e) + e.len;
+        at_us += e.delta_us;
+        if (e.type == CAPTURE_GAP) continue;
+
+        if (speed > 0) {
+            int64_t due = start + (int64_t) (at_us * 1000 / speed);
+            int64_t now = metrics_now();
+            if (due > now) {
+                struct timespec ts = {due / 1000000000, due % 1000000000};
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+            } else {
+                late_hist[metrics_bucket(now - due)]++;
+            }
+        }
+
+        conn_slot_t *slot = n_slots ? conn_find(e.conn) : NULL;
+        if (slot && slot->conn == 0) slot = NULL;
+        switch (e.type) {
+            case CAPTURE_OPEN: {
+                if (slot) conn_remove(slot); // Opened again without a close.
+                int cfd = conn_open();
+                if (cfd != -1) conn_insert(e.conn, cfd);
+                break;
+            }
+            case CAPTURE_DATA:
+                if (slot == NULL) break; // Its connection failed, or was opened before the capture started.
+                conn_write(slot, payload, e.len);
+                readings++;
+                bytes += e.len;
+                break;
+            case CAPTURE_CLOSE:
+                if (slot == NULL) break;
+                conn_remove(slot);
+                closes++;
+                break;
+            default:
+                ERROR_HANDLER(1, "Unknown capture event.");
+        }
+    }
+    for (size_t i = 0; i < n_slots; ++i) {
+        if (slots[i].conn != 0) close(slots[i].fd);
+    }
+    free(slots);
+    munmap((void *) map, st.st_size);
+
+    double seconds = (metrics_now() - start) / 1e9;
+    printf("replayed %" PRIu64 " readings (%" PRIu64 " bytes) of %.2f s in %.2f s, %.0f readings/s, "
+           "%" PRIu64 " connects, %" PRIu64 " closes, %" PRIu64 " errors\n", readings, bytes, at_us / 1e6, seconds,
+           readings / seconds, connects, closes, errors);
+    if (speed > 0) print_percentiles("late", late_hist);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,515 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+
+#ifndef ROUTER_VNODES
+#define ROUTER_VNODES 128 // Points of every backend on the hash ring, more spread the sensors more evenly.
+#endif
+
+#ifndef ROUTER_CONNECT_TIMEOUT_MS
+#define ROUTER_CONNECT_TIMEOUT_MS 500 // A backend that does not accept in time is skipped for the next one.
+#endif
+
+#define ROUTER_BUF 16384 // Bytes buffered per direction of a connection.
+#define MAX_BACKENDS 64
+#define MAX_EVENTS 256
+
+/**
+ * A backend gateway, by the "ip:port" it has in the backends file.
+ */
+typedef struct {
+    char name[64];
+    struct sockaddr_in addr;
+    uint64_t routed;            /**< connections handed to it, kept over reloads */
+} backend_t;
+
+typedef struct {
+    uint64_t hash;
+    int backend;
+} vnode_t;
+
+typedef struct conn conn_t;
+
+/**
+ * One of the two sockets of a connection, the epoll data of that socket.
+ */
+typedef struct {
+    conn_t *conn;
+    int side;
+} endpoint_t;
+
+/**
+ * A proxied connection, side 0 is the sensor and side 1 its backend. buf[s] holds what was read from side s and
+ * is not written to the other side yet. While 'connecting', fd[1] is a connect to 'backend' still in progress,
+ * the sensor's bytes wait in buf[0].
+ */
+struct conn {
+    int fd[2];
+    endpoint_t ep[2];
+    uint32_t events[2];
+    bool eof[2];
+    size_t len[2], off[2];
+    bool closed;
+    conn_t *next_closed;
+    bool connecting;
+    int backend;                // Backend of fd[1].
+    int ring_pos, ring_step;    // Where the sensor id is on the ring and how far the failover went from there.
+    bool tried[MAX_BACKENDS];
+    int n_tried;
+    long deadline_ms;           // When a connect in progress is given up.
+    conn_t *prev_connecting, *next_connecting;
+    char buf[2][ROUTER_BUF];
+};
+
+static backend_t backends[MAX_BACKENDS];
+static int n_backends;
+static vnode_t ring[MAX_BACKENDS * ROUTER_VNODES];
+static int ring_len;
+static const char *backends_path;
+static int epfd;
+static conn_t *closed_conns; // Closed in this round of events, freed once the round is over.
+static conn_t *connecting_conns; // Connections waiting for their backend to accept.
+static uint64_t accepted, active, routed, failovers, unroutable, bytes;
+
+/**
+ * splitmix64, spreads sensor ids and backend names over the ring.
+ */
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (const char *p = name; *p; ++p) h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+    return h;
+}
+
+static int vnode_cmp(const void *a, const void *b) {
+    uint64_t x = ((const vnode_t *) a)->hash, y = ((const vnode_t *) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * \return the position on the ring of the first vnode at or after the hash of 'id'
+ */
+static int ring_find(sensor_id_t id) {
+    uint64_t h = mix(id);
+    int lo = 0, hi = ring_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo == ring_len ? 0 : lo;
+}
+
+/**
+ * Reads the backends file, one "ip:port" per line, and rebuilds the ring. A file that cannot be read or holds an
+ * invalid line leaves the ring as it was. A sensor only moves when a backend is added or removed next to its point
+ * of the ring, the report says how many of all sensor ids did.
+ * \return 0 on success, -1 if the ring was kept
+ */
+static int backends_load() {
+    FILE *fp = fopen(backends_path, "r");
+    if (fp == NULL) {
+        printf("router: cannot read %s, ring unchanged\n", backends_path);
+        return -1;
+    }
+    backend_t next[MAX_BACKENDS];
+    int n = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char name[64], ip[INET_ADDRSTRLEN];
+        int port;
+        if (sscanf(line, "%63s", name) != 1 || name[0] == '#') continue;
+        if (n == MAX_BACKENDS || sscanf(name, "%15[0-9.]:%d", ip, &port) != 2 || port < 1 || port > 65535) {
+            printf("router: invalid backend '%s', ring unchanged\n", name);
+            fclose(fp);
+            return -1;
+        }
+        memset(&next[n], 0, sizeof(next[n]));
+        snprintf(next[n].name, sizeof(next[n].name), "%s", name);
+        next[n].addr.sin_family = AF_INET;
+        next[n].addr.sin_port = htons((uint16_t) port);
+        if (inet_pton(AF_INET, ip, &next[n].addr.sin_addr) != 1) {
+            printf("router: invalid backend '%s', ring unchanged\n", name);
+            fclose(fp);
+            return -1;
+        }
+        for (int i = 0; i < n_backends; ++i) {
+            if (strcmp(backends[i].name, name) == 0) next[n].routed = backends[i].routed;
+        }
+        n++;
+    }
+    fclose(fp);
+    if (n == 0) {
+        printf("router: no backends in %s, ring unchanged\n", backends_path);
+        return -1;
+    }
+
+    // The owner of every sensor id before the reload, to count the ones that move.
+    static char old_owner[UINT16_MAX + 1][64];
+    bool had_ring = ring_len > 0;
+    for (int id = 1; had_ring && id <= UINT16_MAX; ++id) {
+        memcpy(old_owner[id], backends[ring[ring_find((sensor_id_t) id)].backend].name, 64);
+    }
+
+    memcpy(backends, next, sizeof(backend_t) * n);
+    n_backends = n;
+    ring_len = 0;
+    for (int b = 0; b < n_backends; ++b) {
+        uint64_t h = name_hash(backends[b].name);
+        for (int v = 0; v < ROUTER_VNODES; ++v) ring[ring_len++] = (vnode_t) {mix(h + v), b};
+    }
+    qsort(ring, ring_len, sizeof(ring[0]), vnode_cmp);
+
+    int moved = 0;
+    for (int id = 1; had_ring && id <= UINT16_MAX; ++id) {
+        moved += strcmp(old_owner[id], backends[ring[ring_find((sensor_id_t) id)].backend].name) != 0;
+    }
+    printf("router: %d backends, %d points on the ring", n_backends, ring_len);
+    if (had_ring) printf(", %d of %d sensor ids moved (%.1f%%)", moved, UINT16_MAX, 100.0 * moved / UINT16_MAX);
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+static long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void connecting_remove(conn_t *c) {
+    if (!c->connecting) return;
+    if (c->prev_connecting) c->prev_connecting->next_connecting = c->next_connecting;
+    else connecting_conns = c->next_connecting;
+    if (c->next_connecting) c->next_connecting->prev_connecting = c->prev_connecting;
+    c->connecting = false;
+}
+
+static void conn_close(conn_t *c) {
+    connecting_remove(c);
+    for (int s = 0; s < 2; ++s) {
+        if (c->fd[s] == -1) continue;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd[s], NULL);
+        close(c->fd[s]);
+        c->fd[s] = -1;
+    }
+    active--;
+    c->closed = true;
+    c->next_closed = closed_conns;
+    closed_conns = c;
+}
+
+/**
+ * Registers what each side waits for: more to read while its buffer has room, and room to write while the other
+ * side's buffer holds bytes for it.
+ */
+static void conn_watch(conn_t *c) {
+    for (int s = 0; s < 2; ++s) {
+        if (c->fd[s] == -1 || (s == 1 && c->connecting)) continue;
+        uint32_t events = 0;
+        if (!c->eof[s] && c->len[s] < ROUTER_BUF) events |= EPOLLIN;
+        if (c->fd[!s] != -1 && c->len[!s] > c->off[!s]) events |= EPOLLOUT;
+        if (events == c->events[s]) continue;
+        struct epoll_event ev = {.events = events, .data.ptr = &c->ep[s]};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd[s], &ev);
+        c->events[s] = events;
+    }
+}
+
+/**
+ * Starts a connect to a backend without waiting for it.
+ * \return the socket, or -1 if the connect failed right away
+ */
+static int backend_connect(const backend_t *b) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(fd == -1, "Socket creation failed.");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *) &b->addr, sizeof(b->addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts a connect to the next backend on the ring the connection has not tried yet. A backend that is down is
+ * skipped for the next one, as if it had been removed. The event loop goes on meanwhile, conn_connected() sees
+ * how the connect ended.
+ * \return 0 if a connect is in progress, -1 if no backend is left
+ */
+static int conn_try_next(conn_t *c) {
+    for (; c->ring_step < ring_len && c->n_tried < n_backends; ++c->ring_step) {
+        int b = ring[(c->ring_pos + c->ring_step) % ring_len].backend;
+        if (c->tried[b]) continue;
+        c->tried[b] = true;
+        c->n_tried++;
+        int fd = backend_connect(&backends[b]);
+        if (fd == -1) {
+            failovers++;
+            continue;
+        }
+        c->fd[1] = fd;
+        c->backend = b;
+        c->events[1] = EPOLLOUT;
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = &c->ep[1]};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        c->connecting = true;
+        c->deadline_ms = now_ms() + ROUTER_CONNECT_TIMEOUT_MS;
+        c->prev_connecting = NULL;
+        c->next_connecting = connecting_conns;
+        if (connecting_conns) connecting_conns->prev_connecting = c;
+        connecting_conns = c;
+        return 0;
+    }
+    unroutable++;
+    return -1;
+}
+
+/**
+ * Starts routing the sensor to the owner of the id its first record starts with.
+ * \return 0 if a connect is in progress, -1 if no backend could be reached
+ */
+static int conn_route(conn_t *c) {
+    sensor_id_t id;
+    memcpy(&id, c->buf[0], sizeof(id));
+    c->ring_pos = ring_find(id);
+    c->ring_step = 0;
+    c->n_tried = 0;
+    memset(c->tried, 0, sizeof(c->tried));
+    return conn_try_next(c);
+}
+
+/**
+ * Ends a connect in progress: on success the connection is proxied from now on, on an error or a timeout the next
+ * backend is tried.
+ * \return 0 if the connection goes on, -1 if it was closed
+ */
+static int conn_connected(conn_t *c, bool timed_out) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (timed_out || getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = ETIMEDOUT;
+    connecting_remove(c);
+    if (err != 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd[1], NULL);
+        close(c->fd[1]);
+        c->fd[1] = -1;
+        failovers++;
+        if (conn_try_next(c) != 0) {
+            conn_close(c);
+            return -1;
+        }
+        return 0;
+    }
+    backends[c->backend].routed++;
+    routed++;
+    return 0;
+}
+
+static void conn_io(conn_t *c, int s, uint32_t events) {
+    if (s == 1 && c->connecting) {
+        // EPOLLERR or EPOLLHUP as well as EPOLLOUT end the connect, SO_ERROR tells which way.
+        if (conn_connected(c, false) != 0 || c->connecting) return;
+        events = 0;
+    }
+    if (events & EPOLLERR) {
+        conn_close(c);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP)) && !c->eof[s] && c->len[s] < ROUTER_BUF) {
+        if (c->off[s]) {
+            memmove(c->buf[s], c->buf[s] + c->off[s], c->len[s] - c->off[s]);
+            c->len[s] -= c->off[s];
+            c->off[s] = 0;
+        }
+        ssize_t n = read(c->fd[s], c->buf[s] + c->len[s], ROUTER_BUF - c->len[s]);
+        if (n > 0) c->len[s] += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR)) c->eof[s] = true;
+    }
+    if (c->fd[1] == -1) {
+        // Until the id of the first record is in, there is nothing to route on.
+        if (c->len[0] >= sizeof(sensor_id_t)) {
+            if (conn_route(c) != 0) {
+                conn_close(c);
+                return;
+            }
+        } else if (c->eof[0]) {
+            conn_close(c);
+            return;
+        }
+    }
+    if (c->connecting) {
+        // Nothing goes to the backend before it accepted, the sensor's bytes wait in its buffer.
+        if (c->eof[0] && c->len[0] == 0) conn_close(c);
+        else conn_watch(c);
+        return;
+    }
+    for (int d = 0; d < 2; ++d) {
+        if (c->fd[!d] == -1 || c->len[d] == c->off[d]) continue;
+        ssize_t n = send(c->fd[!d], c->buf[d] + c->off[d], c->len[d] - c->off[d], MSG_NOSIGNAL);
+        if (n > 0) {
+            c->off[d] += n;
+            bytes += n;
+            if (c->off[d] == c->len[d]) c->off[d] = c->len[d] = 0;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            conn_close(c);
+            return;
+        }
+    }
+    // A side that ended, once everything it sent is passed on, ends the connection: the gateway sees its sensor
+    // go away, the sensor sees its gateway close it.
+    if ((c->eof[0] && c->len[0] == 0) || (c->eof[1] && c->len[1] == 0)) {
+        conn_close(c);
+        return;
+    }
+    conn_watch(c);
+}
+
+static void accept_all(int lfd) {
+    while (1) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        conn_t *c = malloc(sizeof(conn_t));
+        ERROR_HANDLER(c == NULL, "Connection malloc failed.");
+        c->fd[0] = fd;
+        c->fd[1] = -1;
+        for (int s = 0; s < 2; ++s) {
+            c->ep[s] = (endpoint_t) {c, s};
+            c->eof[s] = false;
+            c->len[s] = c->off[s] = 0;
+        }
+        c->closed = false;
+        c->connecting = false;
+        c->events[0] = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &c->ep[0]};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        accepted++;
+        active++;
+    }
+}
+
+static void print_stats() {
+    printf("router: %" PRIu64 " accepted, %" PRIu64 " active, %" PRIu64 " routed, %" PRIu64 " failovers, "
+           "%" PRIu64 " unroutable, %" PRIu64 " bytes\n", accepted, active, routed, failovers, unroutable, bytes);
+    for (int b = 0; b < n_backends; ++b) printf("router:   %-21s %" PRIu64 " connections\n", backends[b].name,
+                                                backends[b].routed);
+    fflush(stdout);
+}
+
+static void print_help(void) {
+    printf("Use this program as: sensor_router <port> <backends file>\n");
+    printf("Routes every sensor connection to one of the gateways in the backends file, one \"ip:port\" per line,\n");
+    printf("by consistent hashing of the sensor id of its first record, and proxies it from there. A connection\n");
+    printf("has to carry a single sensor: the records of any other sensor on it go to the same gateway.\n");
+    printf("SIGHUP reloads the backends file, SIGUSR1 prints the counters, SIGINT and SIGTERM stop the router.\n");
+}
+
+/**
+ * A front for a cluster of gateways: every sensor always lands on the same gateway, so the running averages of a
+ * sensor live in one place, and adding a gateway only moves the sensors it takes over. Connections already routed
+ * stay on their gateway after a reload, a sensor moves when it reconnects. Only the first record of a connection is
+ * looked at, a sensor has to have a connection of its own (sensor_loadgen -c equal to -n).
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    backends_path = argv[2];
+    ERROR_HANDLER(backends_load() != 0, "Could not load the backends.");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    ERROR_HANDLER(sfd == -1, "Signalfd creation failed.");
+
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(lfd == -1, "Socket creation failed.");
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[1]));
+    ERROR_HANDLER(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0, "Bind failed.");
+    ERROR_HANDLER(listen(lfd, 1024) != 0, "Listen failed.");
+
+    static endpoint_t listen_ep, signal_ep;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ERROR_HANDLER(epfd == -1, "Epoll creation failed.");
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_ep};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.ptr = &signal_ep;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+    bool stop = false;
+    while (!stop) {
+        // Wake up for the first connect in progress that runs out of time.
+        int timeout = -1;
+        long now = now_ms();
+        for (conn_t *c = connecting_conns; c != NULL; c = c->next_connecting) {
+            long left = c->deadline_ms > now ? c->deadline_ms - now : 0;
+            if (timeout == -1 || left < timeout) timeout = (int) left;
+        }
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; ++i) {
+            endpoint_t *ep = events[i].data.ptr;
+            if (ep == &listen_ep) {
+                accept_all(lfd);
+            } else if (ep == &signal_ep) {
+                struct signalfd_siginfo si;
+                if (read(sfd, &si, sizeof(si)) != sizeof(si)) continue;
+                if (si.ssi_signo == SIGHUP) backends_load();
+                else if (si.ssi_signo == SIGUSR1) print_stats();
+                else stop = true;
+            } else if (!ep->conn->closed) {
+                conn_io(ep->conn, ep->side, events[i].events);
+            }
+        }
+        now = now_ms();
+        for (conn_t *c = connecting_conns, *next; c != NULL; c = next) {
+            next = c->next_connecting;
+            if (c->deadline_ms <= now && conn_connected(c, true) == 0) conn_watch(c);
+        }
+        while (closed_conns != NULL) {
+            conn_t *c = closed_conns;
+            closed_conns = c->next_closed;
+            free(c);
+        }
+    }
+    print_stats();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "pubsub.h"
+#include "logfmt.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static void print_help(void) {
+    printf("Use this program as: sensor_subscribe [options] [socket]\n");
+    printf("\t%-12s : sensor ids to follow, like 1-10,15 (default all)\n", "-i ids");
+    printf("\t%-12s : rooms to follow, as in room_sensor.map (default all)\n", "-r rooms");
+    printf("\t%-12s : events to follow, reading or log codes like too_hot,too_cold (default all)\n", "-e codes");
+    printf("\t%-12s : if it cannot keep up, be sampled instead of disconnected\n", "-s");
+    printf("\t%-12s : stop after this many events, 0 never (default 0)\n", "-n count");
+    printf("\t%-12s : print the raw pubsub_event_t records instead of text\n", "-b");
+    printf("Prints the live stream of the gateway in this directory, or of 'socket' (default %s), until\n",
+           PUBSUB_SOCKET_NAME);
+    printf("SIGINT or SIGTERM: \"<seq> <ts> <event> <sensor id> <room> <value>\" per event.\n");
+}
+
+/**
+ * Connects to the stream of a gateway and prints what it sends, see pubsub.h.
+ */
+int main(int argc, char *argv[]) {
+    char request[1024] = "SUBSCRIBE";
+    size_t len = strlen(request);
+    uint64_t limit = 0;
+    int binary = 0, opt;
+    while ((opt = getopt(argc, argv, "i:r:e:sn:bh")) != -1) {
+        switch (opt) {
+            case 'i':
+                len += snprintf(request + len, sizeof(request) - len, " ids=%s", optarg);
+                break;
+            case 'r':
+                len += snprintf(request + len, sizeof(request) - len, " rooms=%s", optarg);
+                break;
+            case 'e':
+                len += snprintf(request + len, sizeof(request) - len, " codes=%s", optarg);
+                break;
+            case 's':
+                len += snprintf(request + len, sizeof(request) - len, " slow=sample");
+                break;
+            case 'n':
+                limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            default:
+                print_help();
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        ERROR_HANDLER(len >= sizeof(request) - 1, "Filters too long.");
+    }
+    if (argc - optind > 1) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    request[len++] = '\n';
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argc > optind ? argv[optind] : PUBSUB_SOCKET_NAME, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HANDLER(fd == -1, "Socket creation failed.");
+    ERROR_HANDLER(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0, "Could not connect to the gateway.");
+    ERROR_HANDLER(send(fd, request, len, MSG_NOSIGNAL) != (ssize_t) len, "Could not subscribe.");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // The reply line, then the events, read through one buffer.
+    static uint8_t buf[64 * 1024];
+    size_t have = 0, off = 0;
+    int answered = 0;
+    uint64_t events = 0, skipped = 0, first = 0;
+    while (!stop && (limit == 0 || events < limit)) {
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - have, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+        if (!answered) {
+            uint8_t *nl = memchr(buf, '\n', have);
+            if (nl == NULL) continue;
+            *nl = '\0';
+            if (strncmp((char *) buf, "OK ", 3) != 0) {
+                fprintf(stderr, "%s\n", (char *) buf);
+                exit(EXIT_FAILURE);
+            }
+            first = strtoull((char *) buf + 3, NULL, 10);
+            off = nl + 1 - buf;
+            answered = 1;
+        }
+        for (; have - off >= sizeof(pubsub_event_t) && (limit == 0 || events < limit); off += sizeof(pubsub_event_t)) {
+            pubsub_event_t ev;
+            memcpy(&ev, buf + off, sizeof(ev));
+            if (ev.code == PUBSUB_SKIPPED) skipped += (uint64_t) ev.value;
+            else events++;
+            if (binary) {
+                fwrite(&ev, sizeof(ev), 1, stdout);
+            } else if (ev.code == PUBSUB_SKIPPED) {
+                printf("# at most %.0f events skipped\n", ev.value);
+            } else {
+                const char *name = ev.code == PUBSUB_READING ? "READING" : logfmt_code_name(ev.code);
+                printf("%" PRIu64 " %ld %s %u %u %g\n", ev.seq, (long) ev.ts, name ? name : "UNKNOWN", ev.id, ev.room,
+                       ev.value);
+            }
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+        off = 0;
+        fflush(stdout);
+    }
+    close(fd);
+    fprintf(stderr, "received %" PRIu64 " events from seq %" PRIu64 ", %" PRIu64 " skipped\n", events, first,
+            skipped);
+    return EXIT_SUCCESS;
+}
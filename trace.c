@@ -0,0 +1,222 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+_Static_assert((TRACE_RING_SIZE & TRACE_RING_MASK) == 0, "TRACE_RING_SIZE must be a power of two.");
+
+typedef struct {
+    int64_t ns;
+    const trace_site_t *site;
+    uint64_t args[4];
+} trace_entry_t;
+
+/**
+ * The ring of one thread. Rings are never freed: when a thread exits its ring is kept for the dump and handed to
+ * the next thread that traces, so connection threads coming and going do not grow the memory.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;
+    atomic_int in_use;
+    pid_t tid;
+    atomic_size_t head;         // Traces written so far, the newest is at head - 1.
+    trace_entry_t entries[TRACE_RING_SIZE];
+} trace_ring_t;
+
+atomic_int trace_on = TRACE_ENABLED;
+
+static _Atomic(trace_ring_t *) rings = NULL;
+static _Thread_local trace_ring_t *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static const char *const level_name[] = {"NONE", "ERROR", "INFO", "DEBUG"};
+
+static void ring_release(void *ring) {
+    atomic_store(&((trace_ring_t *) ring)->in_use, 0);
+}
+
+static void ring_key_create() {
+    ERROR_HANDLER(pthread_key_create(&ring_key, ring_release) != 0, "Trace key creation failed.");
+}
+
+static trace_ring_t *ring_attach() {
+    pthread_once(&ring_key_once, ring_key_create);
+    trace_ring_t *ring;
+    for (ring = atomic_load(&rings); ring; ring = ring->next) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &free_ring, 1)) break;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        ERROR_HANDLER(ring == NULL, "Trace ring malloc failed.");
+        atomic_init(&ring->in_use, 1);
+        atomic_init(&ring->head, 0);
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+    }
+    ring->tid = gettid();
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+void trace_record(const trace_site_t *site, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3) {
+    trace_ring_t *ring = my_ring;
+    if (ring == NULL) ring = my_ring = ring_attach();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_entry_t *e = &ring->entries[head & TRACE_RING_MASK];
+    e->ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    e->site = site;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    e->args[2] = a2;
+    e->args[3] = a3;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_enable(bool on) {
+    atomic_store(&trace_on, on);
+}
+
+/**
+ * Applies the format of a trace to its raw arguments, one conversion at a time: the length modifiers of the
+ * format are replaced by the width the argument was stored with.
+ * @return the length written to 'out', at most 'size' - 1
+ */
+static size_t trace_format(char *out, size_t size, const trace_entry_t *e) {
+    const char *f = e->site->fmt;
+    size_t len = 0;
+    int arg = 0;
+    while (*f && len + 1 < size) {
+        if (*f != '%') {
+            out[len++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[len++] = '%';
+            f += 2;
+            continue;
+        }
+        char spec[32];
+        size_t n = 0;
+        spec[n++] = *f++;
+        while (*f && strchr("-+ #0123456789.", *f) && n < sizeof(spec) - 4) spec[n++] = *f++;
+        while (*f && strchr("hlLqjzt", *f)) f++;
+        char conv = *f ? *f++ : '\0';
+        if (arg >= e->site->n_args || conv == '\0') {
+            spec[n] = '\0';
+            len += snprintf(out + len, size - len, "%s?", spec);
+        } else {
+            uint64_t v = e->args[arg++];
+            if (strchr("di", conv)) {
+                spec[n++] = 'l', spec[n++] = 'l', spec[n++] = conv, spec[n] = '\0';
+                len += snprintf(out + len, size - len, spec, (long long) v);
+            } else if (strchr("uoxX", conv)) {
+                spec[n++] = 'l', spec[n++] = 'l', spec[n++] = conv, spec[n] = '\0';
+                len += snprintf(out + len, size - len, spec, (unsigned long long) v);
+            } else if (strchr("fFeEgGaA", conv)) {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                spec[n++] = conv, spec[n] = '\0';
+                len += snprintf(out + len, size - len, spec, d);
+            } else if (conv == 's') {
+                spec[n++] = conv, spec[n] = '\0';
+                const char *s = (const char *) (uintptr_t) v;
+                len += snprintf(out + len, size - len, spec, s ? s : "(null)");
+            } else if (conv == 'c') {
+                spec[n++] = conv, spec[n] = '\0';
+                len += snprintf(out + len, size - len, spec, (int) v);
+            } else {
+                len += snprintf(out + len, size - len, "%%%c?", conv);
+            }
+        }
+        if (len >= size) len = size - 1;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+void trace_dump(int fd) {
+    char line[512];
+    for (trace_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        int len = snprintf(line, sizeof(line), "== thread %i, %zu traces, %zu dropped\n", (int) ring->tid,
+                           head - first, first);
+        write(fd, line, len);
+        for (size_t i = first; i < head; ++i) {
+            trace_entry_t e = ring->entries[i & TRACE_RING_MASK];
+            if (e.site == NULL) continue;
+            const char *file = strrchr(e.site->file, '/');
+            len = snprintf(line, sizeof(line), "%" PRId64 ".%06" PRId64 " %-5s %s:%d %s(): ",
+                           e.ns / 1000000000, e.ns % 1000000000 / 1000, level_name[e.site->level],
+                           file ? file + 1 : e.site->file, e.site->line, e.site->func);
+            if (len >= (int) sizeof(line)) len = sizeof(line) - 1;
+            len += trace_format(line + len, sizeof(line) - len - 1, &e);
+            line[len++] = '\n';
+            write(fd, line, len);
+        }
+    }
+}
+
+int trace_dump_file(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    trace_dump(fd);
+    return close(fd);
+}
+
+/**
+ * Serves SIGUSR1 and SIGUSR2. They are blocked in every other thread, so no blocking call of the gateway is ever
+ * interrupted by them.
+ */
+static void *trace_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGUSR1) trace_enable(!atomic_load(&trace_on));
+        else trace_dump_file(TRACE_DUMP_FILE);
+    }
+    return NULL;
+}
+
+static void trace_crash(int sig) {
+    // Formatting is not async-signal-safe, but a process that crashed has nothing left to lose.
+    trace_dump_file(TRACE_DUMP_FILE);
+    raise(sig); // The handler was reset, this ends the process as the signal would have.
+}
+
+void trace_init() {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    ERROR_HANDLER(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0, "Trace signal mask failed.");
+    pthread_t tid;
+    ERROR_HANDLER(pthread_create(&tid, NULL, trace_signal_thread, &set) != 0, "Trace thread creation failed.");
+    pthread_detach(tid);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_crash;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    const int crashes[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (size_t i = 0; i < sizeof(crashes) / sizeof(crashes[0]); ++i) sigaction(crashes[i], &sa, NULL);
+}
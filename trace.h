@@ -0,0 +1,146 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3 // Once per reading, the hot path.
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DEBUG // Traces above this level are not compiled in at all.
+#endif
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0 // Record traces from startup, otherwise only once SIGUSR1 or the TRACE query turns them on.
+#endif
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096 // Newest traces kept per thread, must be a power of two.
+#endif
+
+#ifndef TRACE_DUMP_FILE
+#define TRACE_DUMP_FILE "gateway.trace" // Where SIGUSR2 and a crash dump the rings.
+#endif
+
+/*
+ * Traces are written by the thread that raises them into a ring of its own, without locks and without formatting:
+ * a trace is the monotonic time, its call site and up to four raw arguments. The format string is only applied
+ * when the rings are dumped. Numbers are stored as they are, a %s argument is stored as a pointer and must outlive
+ * the trace (a literal, or a name of a static table).
+ *   TRACE_DEBUG("Datum read: %i %f %li", data->id, data->value, data->ts);
+ * SIGUSR1 toggles tracing, SIGUSR2 dumps the rings to TRACE_DUMP_FILE, and so does a crash.
+ */
+
+/**
+ * A call site, one static instance per trace macro.
+ */
+typedef struct {
+    const char *file;
+    const char *func;
+    int line;
+    int level;
+    int n_args;
+    const char *fmt;
+} trace_site_t;
+
+extern atomic_int trace_on;
+
+/**
+ * Records a trace in the ring of the calling thread, use the TRACE_ macros instead.
+ */
+void trace_record(const trace_site_t *site, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+
+/**
+ * Installs the SIGUSR1, SIGUSR2 and crash handlers. Call after log_init(), the logger has no traces, and before
+ * any other thread is started, so they all inherit the blocked SIGUSR1 and SIGUSR2.
+ */
+void trace_init();
+
+/**
+ * Turns tracing on or off at runtime.
+ */
+void trace_enable(bool on);
+
+/**
+ * Writes every thread's ring to 'fd', oldest trace first. Safe to call from a signal handler as long as the
+ * traced threads are stopped or keep writing (a trace overwritten meanwhile may come out garbled, never unsafe).
+ */
+void trace_dump(int fd);
+
+/**
+ * Dumps every thread's ring into a new file at 'path'.
+ * \return 0 on success, -1 if the file could not be written
+ */
+int trace_dump_file(const char *path);
+
+static inline uint64_t trace_arg_int(long long v) { return (uint64_t) v; }
+
+static inline uint64_t trace_arg_uint(unsigned long long v) { return (uint64_t) v; }
+
+static inline uint64_t trace_arg_double(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static inline uint64_t trace_arg_str(const char *s) { return (uint64_t) (uintptr_t) s; }
+
+#define TRACE_ARG(x) _Generic((x),                                                          \
+        float: trace_arg_double, double: trace_arg_double,                                  \
+        char *: trace_arg_str, const char *: trace_arg_str,                                 \
+        unsigned char: trace_arg_uint, unsigned short: trace_arg_uint,                      \
+        unsigned int: trace_arg_uint, unsigned long: trace_arg_uint,                        \
+        unsigned long long: trace_arg_uint,                                                 \
+        default: trace_arg_int)(x)
+
+// The format string counts as the first argument, so a trace without arguments is still valid C11.
+#define TRACE_COUNT_(_1, _2, _3, _4, _5, n, ...) n
+#define TRACE_COUNT(...) TRACE_COUNT_(__VA_ARGS__, 4, 3, 2, 1, 0, 0)
+#define TRACE_FMT_(fmt, ...) fmt
+#define TRACE_FMT(...) TRACE_FMT_(__VA_ARGS__, 0)
+#define TRACE_ARGS_0(f) 0, 0, 0, 0
+#define TRACE_ARGS_1(f, a) TRACE_ARG(a), 0, 0, 0
+#define TRACE_ARGS_2(f, a, b) TRACE_ARG(a), TRACE_ARG(b), 0, 0
+#define TRACE_ARGS_3(f, a, b, c) TRACE_ARG(a), TRACE_ARG(b), TRACE_ARG(c), 0
+#define TRACE_ARGS_4(f, a, b, c, d) TRACE_ARG(a), TRACE_ARG(b), TRACE_ARG(c), TRACE_ARG(d)
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+
+#define TRACE_AT(lvl, ...)                                                                  \
+        do {                                                                                \
+            if (atomic_load_explicit(&trace_on, memory_order_relaxed)) {                    \
+                static const trace_site_t trace_site = {__FILE__, __func__, __LINE__, lvl,  \
+                        TRACE_COUNT(__VA_ARGS__), TRACE_FMT(__VA_ARGS__)};                  \
+                trace_record(&trace_site, TRACE_CAT(TRACE_ARGS_, TRACE_COUNT(__VA_ARGS__))(__VA_ARGS__)); \
+            }                                                                               \
+        } while (0)
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(...) TRACE_AT(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define TRACE_ERROR(...) (void)0
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(...) TRACE_AT(TRACE_LEVEL_INFO, __VA_ARGS__)
+#else
+#define TRACE_INFO(...) (void)0
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(...) TRACE_AT(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(...) (void)0
+#endif
+
+#endif //_TRACE_H_
@@ -0,0 +1,459 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tsseg.h"
+
+#define TSSEG_FILE_MAGIC "TSSEG001"
+#define TSSEG_BLOCK_MAGIC 0x314B4C42u  // "BLK1"
+#define TSSEG_INDEX_MAGIC 0x58495354u  // "TSIX"
+
+#define TSSEG_FILE_HEADER 16    // magic, creation time
+#define TSSEG_BLOCK_HEADER 48   // magic, id, pad, count, nbytes, ts_min, ts_max, v_min, v_max
+#define TSSEG_INDEX_ENTRY 56    // block header followed by the offset of the points
+#define TSSEG_TRAILER 16        // index offset, number of blocks, magic
+
+// All integers are stored in host byte order, segments are not meant to move between architectures.
+
+struct tsseg_writer {
+    int fd;
+    uint64_t offset;                // Current size of the file.
+    tsseg_block_info_t *index;      // Every block appended so far, written as footer.
+    int n_blocks, cap_blocks;
+    uint8_t *buf;                   // Block under construction, header included.
+    size_t buf_cap;
+};
+
+struct tsseg_reader {
+    const uint8_t *map;
+    size_t size;
+    tsseg_block_info_t *index;
+    int n_blocks;
+};
+
+/**
+ * Bit stream writer, bits are packed most significant first.
+ */
+typedef struct {
+    uint8_t **buf;
+    size_t *cap;
+    size_t len;
+    uint64_t acc;
+    int n_acc;
+} bit_writer_t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t n_bits;
+    size_t pos;
+    int error;
+} bit_reader_t;
+
+static void bw_byte(bit_writer_t *w, uint8_t byte) {
+    if (w->len == *w->cap) {
+        *w->cap *= 2;
+        *w->buf = realloc(*w->buf, *w->cap);
+        ERROR_HANDLER(*w->buf == NULL, "Segment buffer realloc failed.");
+    }
+    (*w->buf)[w->len++] = byte;
+}
+
+/**
+ * Appends the 'n' low bits of 'v'.
+ */
+static void bw_put(bit_writer_t *w, uint64_t v, int n) {
+    if (n > 32) {
+        bw_put(w, v >> 32, n - 32);
+        n = 32;
+    }
+    w->acc = (w->acc << n) | (v & ((1ULL << n) - 1));
+    w->n_acc += n;
+    while (w->n_acc >= 8) {
+        w->n_acc -= 8;
+        bw_byte(w, (uint8_t) (w->acc >> w->n_acc));
+    }
+}
+
+static void bw_finish(bit_writer_t *w) {
+    if (w->n_acc) bw_byte(w, (uint8_t) (w->acc << (8 - w->n_acc)));
+    w->n_acc = 0;
+}
+
+static uint64_t br_get(bit_reader_t *r, int n) {
+    if (n > 32) {
+        uint64_t hi = br_get(r, n - 32);
+        return (hi << 32) | br_get(r, 32);
+    }
+    if (r->pos + n > r->n_bits) {
+        r->error = 1;
+        return 0;
+    }
+    uint64_t v = 0;
+    while (n > 0) {
+        int avail = 8 - (int) (r->pos & 7);
+        int take = avail < n ? avail : n;
+        uint8_t bits = (uint8_t) (r->buf[r->pos >> 3] >> (avail - take)) & (uint8_t) ((1u << take) - 1);
+        v = (v << take) | bits;
+        r->pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+static uint64_t double_bits(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static double bits_double(uint64_t bits) {
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+size_t tsseg_pack(uint8_t **buf, size_t *cap, size_t offset, const sensor_ts_t *ts, const sensor_value_t *values,
+                  uint32_t n) {
+    bit_writer_t bw = {buf, cap, offset, 0, 0};
+
+    bw_put(&bw, (uint64_t) ts[0], 64);
+    bw_put(&bw, double_bits(values[0]), 64);
+
+    int64_t prev_delta = 0;
+    uint64_t prev_bits = double_bits(values[0]);
+    int prev_lead = -1, prev_trail = 0;
+    for (uint32_t i = 1; i < n; ++i) {
+        // Timestamp: delta-of-delta, 1 bit when the sensor reports at a steady pace.
+        int64_t delta = (int64_t) (ts[i] - ts[i - 1]);
+        int64_t dod = delta - prev_delta;
+        prev_delta = delta;
+        if (dod == 0) {
+            bw_put(&bw, 0, 1);
+        } else if (dod >= -63 && dod <= 64) {
+            bw_put(&bw, 2, 2);
+            bw_put(&bw, (uint64_t) (dod + 63), 7);
+        } else if (dod >= -255 && dod <= 256) {
+            bw_put(&bw, 6, 3);
+            bw_put(&bw, (uint64_t) (dod + 255), 9);
+        } else if (dod >= -2047 && dod <= 2048) {
+            bw_put(&bw, 14, 4);
+            bw_put(&bw, (uint64_t) (dod + 2047), 12);
+        } else {
+            bw_put(&bw, 15, 4);
+            bw_put(&bw, (uint64_t) dod, 64);
+        }
+
+        // Value: XOR with the previous one, only the meaningful bits are stored.
+        uint64_t bits = double_bits(values[i]);
+        uint64_t x = bits ^ prev_bits;
+        prev_bits = bits;
+        if (x == 0) {
+            bw_put(&bw, 0, 1);
+            continue;
+        }
+        int lead = __builtin_clzll(x), trail = __builtin_ctzll(x);
+        if (lead > 31) lead = 31;
+        if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail) {
+            // Fits in the previous window, no need to repeat its position.
+            bw_put(&bw, 2, 2);
+            bw_put(&bw, x >> prev_trail, 64 - prev_lead - prev_trail);
+        } else {
+            int sig = 64 - lead - trail;
+            bw_put(&bw, 3, 2);
+            bw_put(&bw, (uint64_t) lead, 5);
+            bw_put(&bw, (uint64_t) (sig - 1), 6);
+            bw_put(&bw, x >> trail, sig);
+            prev_lead = lead;
+            prev_trail = trail;
+        }
+    }
+    bw_finish(&bw);
+    return bw.len - offset;
+}
+
+/**
+ * Compresses the points after the block header in the writer buffer.
+ * @return the number of bytes of compressed points.
+ */
+static size_t tsseg_encode(tsseg_writer_t *w, const sensor_ts_t *ts, const sensor_value_t *values, uint32_t n) {
+    return tsseg_pack(&w->buf, &w->buf_cap, TSSEG_BLOCK_HEADER, ts, values, n);
+}
+
+static void header_put(uint8_t *dst, const tsseg_block_info_t *b) {
+    uint32_t magic = TSSEG_BLOCK_MAGIC;
+    uint16_t pad = 0;
+    int64_t ts_min = b->ts_min, ts_max = b->ts_max;
+    memcpy(dst, &magic, 4);
+    memcpy(dst + 4, &b->id, 2);
+    memcpy(dst + 6, &pad, 2);
+    memcpy(dst + 8, &b->count, 4);
+    memcpy(dst + 12, &b->nbytes, 4);
+    memcpy(dst + 16, &ts_min, 8);
+    memcpy(dst + 24, &ts_max, 8);
+    memcpy(dst + 32, &b->v_min, 8);
+    memcpy(dst + 40, &b->v_max, 8);
+}
+
+/**
+ * @return 0 if 'src' holds a valid block header, -1 otherwise.
+ */
+static int header_get(const uint8_t *src, tsseg_block_info_t *b) {
+    uint32_t magic;
+    int64_t ts_min, ts_max;
+    memcpy(&magic, src, 4);
+    if (magic != TSSEG_BLOCK_MAGIC) return -1;
+    memcpy(&b->id, src + 4, 2);
+    memcpy(&b->count, src + 8, 4);
+    memcpy(&b->nbytes, src + 12, 4);
+    memcpy(&ts_min, src + 16, 8);
+    memcpy(&ts_max, src + 24, 8);
+    memcpy(&b->v_min, src + 32, 8);
+    memcpy(&b->v_max, src + 40, 8);
+    b->ts_min = (sensor_ts_t) ts_min;
+    b->ts_max = (sensor_ts_t) ts_max;
+    return b->count == 0 ? -1 : 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) return TSSEG_FAILURE;
+        p += n;
+        len -= n;
+    }
+    return TSSEG_SUCCESS;
+}
+
+int tsseg_create(tsseg_writer_t **writer, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) return TSSEG_FAILURE;
+
+    uint8_t header[TSSEG_FILE_HEADER];
+    int64_t created = (int64_t) time(NULL);
+    memcpy(header, TSSEG_FILE_MAGIC, 8);
+    memcpy(header + 8, &created, 8);
+    if (write_all(fd, header, sizeof(header)) != TSSEG_SUCCESS) {
+        close(fd);
+        return TSSEG_FAILURE;
+    }
+
+    tsseg_writer_t *w = malloc(sizeof(tsseg_writer_t));
+    ERROR_HANDLER(w == NULL, "Segment writer malloc failed.");
+    w->fd = fd;
+    w->offset = TSSEG_FILE_HEADER;
+    w->n_blocks = 0;
+    w->cap_blocks = 64;
+    w->index = malloc(w->cap_blocks * sizeof(tsseg_block_info_t));
+    w->buf_cap = 4096;
+    w->buf = malloc(w->buf_cap);
+    ERROR_HANDLER(w->index == NULL || w->buf == NULL, "Segment writer malloc failed.");
+    *writer = w;
+    return TSSEG_SUCCESS;
+}
+
+int tsseg_append(tsseg_writer_t *w, sensor_id_t id, const sensor_ts_t *ts, const sensor_value_t *values,
+                 uint32_t n) {
+    if (n == 0) return TSSEG_SUCCESS;
+
+    tsseg_block_info_t b = {id, n, 0, ts[0], ts[0], values[0], values[0], 0};
+    for (uint32_t i = 1; i < n; ++i) {
+        if (ts[i] < b.ts_min) b.ts_min = ts[i];
+        if (ts[i] > b.ts_max) b.ts_max = ts[i];
+        if (values[i] < b.v_min) b.v_min = values[i];
+        if (values[i] > b.v_max) b.v_max = values[i];
+    }
+    b.nbytes = (uint32_t) tsseg_encode(w, ts, values, n);
+    b.offset = w->offset + TSSEG_BLOCK_HEADER;
+    header_put(w->buf, &b);
+
+    if (write_all(w->fd, w->buf, TSSEG_BLOCK_HEADER + b.nbytes) != TSSEG_SUCCESS) return TSSEG_FAILURE;
+    w->offset += TSSEG_BLOCK_HEADER + b.nbytes;
+
+    if (w->n_blocks == w->cap_blocks) {
+        w->cap_blocks *= 2;
+        w->index = realloc(w->index, w->cap_blocks * sizeof(tsseg_block_info_t));
+        ERROR_HANDLER(w->index == NULL, "Segment index realloc failed.");
+    }
+    w->index[w->n_blocks++] = b;
+    return TSSEG_SUCCESS;
+}
+
+int tsseg_sync(tsseg_writer_t *w) {
+    return fdatasync(w->fd) == 0 ? TSSEG_SUCCESS : TSSEG_FAILURE;
+}
+
+int tsseg_finish(tsseg_writer_t **writer) {
+    tsseg_writer_t *w = *writer;
+    int res = TSSEG_SUCCESS;
+
+    // The footer: every block header with its offset, then the trailer pointing back at it.
+    uint8_t entry[TSSEG_INDEX_ENTRY];
+    uint64_t index_offset = w->offset;
+    for (int i = 0; i < w->n_blocks && res == TSSEG_SUCCESS; ++i) {
+        header_put(entry, &w->index[i]);
+        memcpy(entry + TSSEG_BLOCK_HEADER, &w->index[i].offset, 8);
+        res = write_all(w->fd, entry, sizeof(entry));
+    }
+    uint8_t trailer[TSSEG_TRAILER];
+    uint32_t n_blocks = (uint32_t) w->n_blocks, magic = TSSEG_INDEX_MAGIC;
+    memcpy(trailer, &index_offset, 8);
+    memcpy(trailer + 8, &n_blocks, 4);
+    memcpy(trailer + 12, &magic, 4);
+    if (res == TSSEG_SUCCESS) res = write_all(w->fd, trailer, sizeof(trailer));
+    if (res == TSSEG_SUCCESS) res = tsseg_sync(w);
+    if (close(w->fd) != 0) res = TSSEG_FAILURE;
+
+    free(w->index);
+    free(w->buf);
+    free(w);
+    *writer = NULL;
+    return res;
+}
+
+/**
+ * Loads the index from the footer.
+ * @return 0 on success, -1 if the segment has no valid footer.
+ */
+static int tsseg_load_footer(tsseg_reader_t *r) {
+    if (r->size < TSSEG_FILE_HEADER + TSSEG_TRAILER) return -1;
+    const uint8_t *trailer = r->map + r->size - TSSEG_TRAILER;
+    uint64_t index_offset;
+    uint32_t n_blocks, magic;
+    memcpy(&index_offset, trailer, 8);
+    memcpy(&n_blocks, trailer + 8, 4);
+    memcpy(&magic, trailer + 12, 4);
+    if (magic != TSSEG_INDEX_MAGIC || index_offset + (uint64_t) n_blocks * TSSEG_INDEX_ENTRY + TSSEG_TRAILER != r->size) {
+        return -1;
+    }
+
+    r->index = malloc((n_blocks ? n_blocks : 1) * sizeof(tsseg_block_info_t));
+    ERROR_HANDLER(r->index == NULL, "Segment index malloc failed.");
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+        const uint8_t *entry = r->map + index_offset + (uint64_t) i * TSSEG_INDEX_ENTRY;
+        tsseg_block_info_t *b = &r->index[i];
+        memcpy(&b->offset, entry + TSSEG_BLOCK_HEADER, 8);
+        if (header_get(entry, b) != 0 || b->offset + b->nbytes > index_offset) {
+            free(r->index);
+            r->index = NULL;
+            return -1;
+        }
+    }
+    r->n_blocks = (int) n_blocks;
+    return 0;
+}
+
+/**
+ * Rebuilds the index by walking the block headers, for segments that were never finished.
+ */
+static void tsseg_scan_blocks(tsseg_reader_t *r) {
+    int cap = 64;
+    r->index = malloc(cap * sizeof(tsseg_block_info_t));
+    ERROR_HANDLER(r->index == NULL, "Segment index malloc failed.");
+    r->n_blocks = 0;
+
+    uint64_t pos = TSSEG_FILE_HEADER;
+    tsseg_block_info_t b;
+    while (pos + TSSEG_BLOCK_HEADER <= r->size && header_get(r->map + pos, &b) == 0 &&
+           pos + TSSEG_BLOCK_HEADER + b.nbytes <= r->size) {
+        b.offset = pos + TSSEG_BLOCK_HEADER;
+        if (r->n_blocks == cap) {
+            cap *= 2;
+            r->index = realloc(r->index, cap * sizeof(tsseg_block_info_t));
+            ERROR_HANDLER(r->index == NULL, "Segment index realloc failed.");
+        }
+        r->index[r->n_blocks++] = b;
+        pos = b.offset + b.nbytes;
+    }
+}
+
+int tsseg_open(tsseg_reader_t **reader, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return TSSEG_FAILURE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < TSSEG_FILE_HEADER) {
+        close(fd);
+        return TSSEG_FAILURE;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive.
+    if (map == MAP_FAILED) return TSSEG_FAILURE;
+    if (memcmp(map, TSSEG_FILE_MAGIC, 8) != 0) {
+        munmap(map, st.st_size);
+        return TSSEG_FAILURE;
+    }
+
+    tsseg_reader_t *r = malloc(sizeof(tsseg_reader_t));
+    ERROR_HANDLER(r == NULL, "Segment reader malloc failed.");
+    r->map = map;
+    r->size = st.st_size;
+    r->index = NULL;
+    r->n_blocks = 0;
+    if (tsseg_load_footer(r) != 0) tsseg_scan_blocks(r);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *reader = r;
+    return TSSEG_SUCCESS;
+}
+
+void tsseg_close(tsseg_reader_t **reader) {
+    tsseg_reader_t *r = *reader;
+    munmap((void *) r->map, r->size);
+    free(r->index);
+    free(r);
+    *reader = NULL;
+}
+
+int tsseg_block_count(tsseg_reader_t *r) {
+    return r->n_blocks;
+}
+
+const tsseg_block_info_t *tsseg_block(tsseg_reader_t *r, int i) {
+    return &r->index[i];
+}
+
+int tsseg_decode(tsseg_reader_t *r, int i, sensor_ts_t *ts, sensor_value_t *values) {
+    const tsseg_block_info_t *b = &r->index[i];
+    return tsseg_unpack(r->map + b->offset, b->nbytes, b->count, ts, values);
+}
+
+int tsseg_unpack(const uint8_t *bytes, size_t nbytes, uint32_t n, sensor_ts_t *ts, sensor_value_t *values) {
+    bit_reader_t br = {bytes, nbytes * 8, 0, 0};
+
+    ts[0] = (sensor_ts_t) br_get(&br, 64);
+    uint64_t prev_bits = br_get(&br, 64);
+    values[0] = bits_double(prev_bits);
+
+    int64_t prev_delta = 0;
+    int lead = 0, trail = 0;
+    for (uint32_t k = 1; k < n && !br.error; ++k) {
+        int64_t dod;
+        if (br_get(&br, 1) == 0) dod = 0;
+        else if (br_get(&br, 1) == 0) dod = (int64_t) br_get(&br, 7) - 63;
+        else if (br_get(&br, 1) == 0) dod = (int64_t) br_get(&br, 9) - 255;
+        else if (br_get(&br, 1) == 0) dod = (int64_t) br_get(&br, 12) - 2047;
+        else dod = (int64_t) br_get(&br, 64);
+        prev_delta += dod;
+        ts[k] = ts[k - 1] + prev_delta;
+
+        if (br_get(&br, 1) == 1) {
+            if (br_get(&br, 1) == 1) {
+                lead = (int) br_get(&br, 5);
+                int sig = (int) br_get(&br, 6) + 1;
+                trail = 64 - lead - sig;
+                if (trail < 0) return TSSEG_FAILURE;
+            }
+            prev_bits ^= br_get(&br, 64 - lead - trail) << trail;
+        }
+        values[k] = bits_double(prev_bits);
+    }
+    return br.error ? TSSEG_FAILURE : TSSEG_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _TSSEG_H_
+#define _TSSEG_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define TSSEG_SUCCESS 0
+#define TSSEG_FAILURE -1
+
+#ifndef TSSEG_BLOCK_POINTS
+#define TSSEG_BLOCK_POINTS 1024 // Readings of one sensor gathered before they are compressed into a block.
+#endif
+
+/*
+ * A segment file is append-only:
+ *   file header | block | block | ... | footer index | trailer
+ * Every block starts with a tsseg_block_info_t (without the offset) followed by the compressed points:
+ * timestamps as delta-of-deltas and values XOR'ed with the previous value, as in Facebook's Gorilla.
+ * The footer repeats all block headers with their offsets, so a reader can skip blocks without touching them.
+ * A segment that was not finished (crash) has no footer, readers then walk the block headers instead.
+ */
+
+/**
+ * Summary of one block, used by readers to skip blocks that cannot match a query.
+ */
+typedef struct {
+    sensor_id_t id;             /**< the sensor all points of the block belong to */
+    uint32_t count;             /**< number of points */
+    uint32_t nbytes;            /**< size of the compressed points */
+    sensor_ts_t ts_min;         /**< oldest timestamp */
+    sensor_ts_t ts_max;         /**< newest timestamp */
+    sensor_value_t v_min;       /**< smallest value */
+    sensor_value_t v_max;       /**< largest value */
+    uint64_t offset;            /**< file offset of the compressed points */
+} tsseg_block_info_t;
+
+typedef struct tsseg_writer tsseg_writer_t;
+typedef struct tsseg_reader tsseg_reader_t;
+
+/**
+ * Creates a new segment file, an existing file is never overwritten.
+ * \param writer a double pointer, that will be filled out with the new writer
+ * \param path the file to create
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE
+ */
+int tsseg_create(tsseg_writer_t **writer, const char *path);
+
+/**
+ * Compresses 'n' points of one sensor into a block and appends it to the segment.
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE
+ */
+int tsseg_append(tsseg_writer_t *writer, sensor_id_t id, const sensor_ts_t *ts, const sensor_value_t *values,
+                 uint32_t n);
+
+/**
+ * fdatasync()s the blocks appended so far.
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE
+ */
+int tsseg_sync(tsseg_writer_t *writer);
+
+/**
+ * Writes the footer index, syncs and closes the segment. '*writer' is set to NULL.
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE
+ */
+int tsseg_finish(tsseg_writer_t **writer);
+
+/**
+ * Maps a segment file for reading and loads its block index.
+ * \param reader a double pointer, that will be filled out with the new reader
+ * \param path the segment file
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE if the file cannot be mapped or is not a segment
+ */
+int tsseg_open(tsseg_reader_t **reader, const char *path);
+
+/**
+ * Unmaps the segment and frees the reader. '*reader' is set to NULL.
+ */
+void tsseg_close(tsseg_reader_t **reader);
+
+/**
+ * \return the number of blocks in the segment
+ */
+int tsseg_block_count(tsseg_reader_t *reader);
+
+/**
+ * \return the summary of block 'i' (0 <= i < tsseg_block_count())
+ */
+const tsseg_block_info_t *tsseg_block(tsseg_reader_t *reader, int i);
+
+/**
+ * Decompresses block 'i' into 'ts' and 'values', which need room for tsseg_block(reader, i)->count points.
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE if the block is corrupt
+ */
+int tsseg_decode(tsseg_reader_t *reader, int i, sensor_ts_t *ts, sensor_value_t *values);
+
+/**
+ * Compresses 'n' (at least 1) points of one sensor the way blocks are, appending them at 'offset' of a malloc'ed
+ * buffer that is grown as needed. For other users of the codec, like the frames of the forwarder.
+ * \param buf the buffer, may be moved by realloc
+ * \param cap its capacity, updated when it grows
+ * \return the number of bytes of compressed points
+ */
+size_t tsseg_pack(uint8_t **buf, size_t *cap, size_t offset, const sensor_ts_t *ts, const sensor_value_t *values,
+                  uint32_t n);
+
+/**
+ * Decompresses 'n' points written by tsseg_pack() from the 'nbytes' at 'bytes'.
+ * \return TSSEG_SUCCESS or TSSEG_FAILURE if the points are corrupt
+ */
+int tsseg_unpack(const uint8_t *bytes, size_t nbytes, uint32_t n, sensor_ts_t *ts, sensor_value_t *values);
+
+#endif //_TSSEG_H_
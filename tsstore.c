@@ -0,0 +1,327 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tsstore.h"
+
+#define TSSTORE_SLOT(k) ((k) & (TSSTORE_MAX_CHUNKS - 1))
+
+/**
+ * A fixed block of readings, sorted by timestamp.
+ */
+typedef struct {
+    sensor_ts_t ts[TSSTORE_CHUNK_LEN];
+    sensor_value_t value[TSSTORE_CHUNK_LEN];
+    int len;
+} ts_chunk_t;
+
+/**
+ * The min/max/sum/count summary of a chunk or a range of chunks.
+ */
+typedef struct {
+    sensor_value_t min, max, sum;
+    uint64_t count;
+} ts_summary_t;
+
+/**
+ * All chunks of one sensor. The chunks form a ring indexed by an ever increasing chunk number, the segment tree
+ * holds the summary of every closed chunk at the leaf of its ring slot.
+ */
+typedef struct {
+    size_t first;                                   // Number of the oldest live chunk.
+    size_t count;                                   // Number of live chunks, the newest one is still open.
+    sensor_id_t id;
+    size_t heap_pos;                                // Position in 'oldest'.
+    ts_chunk_t *chunks[TSSTORE_MAX_CHUNKS];
+    ts_summary_t tree[2 * TSSTORE_MAX_CHUNKS];
+} ts_series_t;
+
+static pthread_mutex_t store_mtx;
+static ts_series_t *series[UINT16_MAX + 1]; // Direct lookup by sensor id, only sensors with data are allocated.
+// Min-heap of the allocated series by the first timestamp of their oldest chunk: its top holds the oldest chunk
+// of the whole store, the one to evict when the budget is exhausted or to expire first.
+static ts_series_t *oldest[UINT16_MAX + 1];
+static size_t n_series;
+static size_t mem_used; // Bytes of chunks and series, charged against TSSTORE_MEM_BUDGET.
+static sensor_ts_t store_time; // Newest timestamp inserted, the clock of TSSTORE_RETENTION.
+
+static const ts_summary_t empty_summary = {DBL_MAX, -DBL_MAX, 0, 0};
+
+static ts_summary_t summary_merge(ts_summary_t a, ts_summary_t b) {
+    ts_summary_t res;
+    res.min = a.min < b.min ? a.min : b.min;
+    res.max = a.max > b.max ? a.max : b.max;
+    res.sum = a.sum + b.sum;
+    res.count = a.count + b.count;
+    return res;
+}
+
+static ts_chunk_t *chunk_at(ts_series_t *s, size_t k) {
+    return s->chunks[TSSTORE_SLOT(k)];
+}
+
+/**
+ * Sets the leaf of 'slot' and recomputes its ancestors.
+ */
+static void tree_set(ts_series_t *s, size_t slot, ts_summary_t summary) {
+    size_t pos = slot + TSSTORE_MAX_CHUNKS;
+    s->tree[pos] = summary;
+    for (pos >>= 1; pos >= 1; pos >>= 1) {
+        s->tree[pos] = summary_merge(s->tree[2 * pos], s->tree[2 * pos + 1]);
+    }
+}
+
+/**
+ * Merges the leaves of the slots lo..hi (inclusive) in O(log TSSTORE_MAX_CHUNKS).
+ */
+static ts_summary_t tree_query(ts_series_t *s, size_t lo, size_t hi) {
+    ts_summary_t res = empty_summary;
+    for (lo += TSSTORE_MAX_CHUNKS, hi += TSSTORE_MAX_CHUNKS + 1; lo < hi; lo >>= 1, hi >>= 1) {
+        if (lo & 1) res = summary_merge(res, s->tree[lo++]);
+        if (hi & 1) res = summary_merge(res, s->tree[--hi]);
+    }
+    return res;
+}
+
+static ts_summary_t chunk_scan(ts_chunk_t *c, sensor_ts_t t0, sensor_ts_t t1) {
+    ts_summary_t res = empty_summary;
+    for (int i = 0; i < c->len; ++i) {
+        if (c->ts[i] < t0 || c->ts[i] > t1) continue;
+        ts_summary_t one = {c->value[i], c->value[i], c->value[i], 1};
+        res = summary_merge(res, one);
+    }
+    return res;
+}
+
+static ts_summary_t chunk_summary(ts_chunk_t *c) {
+    return chunk_scan(c, c->ts[0], c->ts[c->len - 1]);
+}
+
+/**
+ * Removes the oldest chunk of a series and returns it so it can be reused or freed.
+ */
+static ts_chunk_t *series_evict(ts_series_t *s) {
+    ts_chunk_t *c = chunk_at(s, s->first);
+    tree_set(s, TSSTORE_SLOT(s->first), empty_summary);
+    s->chunks[TSSTORE_SLOT(s->first)] = NULL;
+    s->first++;
+    s->count--;
+    return c;
+}
+
+static sensor_ts_t series_key(ts_series_t *s) {
+    return chunk_at(s, s->first)->ts[0];
+}
+
+static void heap_swap(size_t a, size_t b) {
+    ts_series_t *tmp = oldest[a];
+    oldest[a] = oldest[b];
+    oldest[b] = tmp;
+    oldest[a]->heap_pos = a;
+    oldest[b]->heap_pos = b;
+}
+
+/**
+ * Moves a series to its place in the heap after the key of it changed.
+ */
+static void heap_fix(ts_series_t *s) {
+    size_t pos = s->heap_pos;
+    while (pos > 0 && series_key(oldest[pos]) < series_key(oldest[(pos - 1) / 2])) {
+        heap_swap(pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+    while (1) {
+        size_t min = pos, l = 2 * pos + 1, r = 2 * pos + 2;
+        if (l < n_series && series_key(oldest[l]) < series_key(oldest[min])) min = l;
+        if (r < n_series && series_key(oldest[r]) < series_key(oldest[min])) min = r;
+        if (min == pos) break;
+        heap_swap(pos, min);
+        pos = min;
+    }
+}
+
+/**
+ * Frees a series that has no chunk left.
+ */
+static void series_free(ts_series_t *s) {
+    size_t pos = s->heap_pos;
+    if (pos != --n_series) {
+        heap_swap(pos, n_series);
+        heap_fix(oldest[pos]);
+    }
+    series[s->id] = NULL;
+    free(s);
+    mem_used -= sizeof(ts_series_t);
+}
+
+/**
+ * Removes the oldest chunk of the store, its series goes as well if that was its last chunk unless it is 'keep'.
+ * @return the chunk, for the caller to reuse or free
+ */
+static ts_chunk_t *store_evict_oldest(ts_series_t *keep) {
+    ts_series_t *s = oldest[0];
+    ts_chunk_t *c = series_evict(s);
+    if (s->count) heap_fix(s);
+    else if (s != keep) series_free(s);
+    return c;
+}
+
+/**
+ * Drops the chunks that are completely older than the retention window, oldest first, whichever sensor they
+ * belong to: a sensor that went quiet loses its history like the others, and then its series.
+ */
+static void store_expire() {
+#if TSSTORE_RETENTION > 0
+    while (n_series) {
+        ts_chunk_t *c = chunk_at(oldest[0], oldest[0]->first);
+        if (c->ts[c->len - 1] >= store_time - TSSTORE_RETENTION) break;
+        free(store_evict_oldest(NULL));
+        mem_used -= sizeof(ts_chunk_t);
+    }
+#endif
+}
+
+void tsstore_init() {
+    pthread_mutex_init(&store_mtx, NULL);
+    n_series = 0;
+    mem_used = 0;
+    store_time = 0;
+    TRACE_INFO("Time-series store initialized, room for %zu chunks.", (size_t) TSSTORE_MEM_BUDGET / sizeof(ts_chunk_t));
+}
+
+void tsstore_free() {
+    pthread_mutex_lock(&store_mtx);
+    while (n_series) {
+        ts_series_t *s = oldest[n_series - 1];
+        while (s->count) free(series_evict(s));
+        series[s->id] = NULL;
+        free(s);
+        n_series--;
+    }
+    mem_used = 0;
+    pthread_mutex_unlock(&store_mtx);
+    pthread_mutex_destroy(&store_mtx);
+}
+
+void tsstore_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    pthread_mutex_lock(&store_mtx);
+
+    // The clock only moves forward, and never past the wall clock: one bogus timestamp must not expire it all.
+    sensor_ts_t now = time(NULL);
+    if (ts > store_time) store_time = ts < now ? ts : now;
+    store_expire();
+
+    ts_series_t *s = series[id];
+    ts_chunk_t *last = s && s->count ? chunk_at(s, s->first + s->count - 1) : NULL;
+    if (last && ts < last->ts[last->len - 1]) {
+        // Out of order, keeping the series sorted is what makes the binary searches possible.
+        pthread_mutex_unlock(&store_mtx);
+        return;
+    }
+
+    if (s == NULL) {
+        while (n_series && mem_used + sizeof(ts_series_t) > TSSTORE_MEM_BUDGET) {
+            free(store_evict_oldest(NULL));
+            mem_used -= sizeof(ts_chunk_t);
+        }
+        s = malloc(sizeof(ts_series_t));
+        ERROR_HANDLER(s == NULL, "Series malloc failed.");
+        mem_used += sizeof(ts_series_t);
+        s->first = s->count = 0;
+        s->id = id;
+        for (int i = 0; i < TSSTORE_MAX_CHUNKS; ++i) s->chunks[i] = NULL;
+        for (int i = 0; i < 2 * TSSTORE_MAX_CHUNKS; ++i) s->tree[i] = empty_summary;
+        series[id] = s;
+        s->heap_pos = SIZE_MAX; // Joins the heap with its first reading.
+    }
+
+    if (last == NULL || last->len == TSSTORE_CHUNK_LEN) {
+        if (last) {
+            // Close the full chunk, from now on it is answered from the tree.
+            tree_set(s, TSSTORE_SLOT(s->first + s->count - 1), chunk_summary(last));
+        }
+
+        ts_chunk_t *c;
+        if (s->count == TSSTORE_MAX_CHUNKS) {
+            c = series_evict(s);
+        } else if (n_series && mem_used + sizeof(ts_chunk_t) > TSSTORE_MEM_BUDGET) {
+            c = store_evict_oldest(s);
+        } else {
+            c = malloc(sizeof(ts_chunk_t));
+            ERROR_HANDLER(c == NULL, "Chunk malloc failed.");
+            mem_used += sizeof(ts_chunk_t);
+        }
+        c->len = 0;
+        s->chunks[TSSTORE_SLOT(s->first + s->count)] = c;
+        s->count++;
+        last = c;
+    }
+
+    last->ts[last->len] = ts;
+    last->value[last->len] = value;
+    last->len++;
+    if (s->heap_pos == SIZE_MAX) {
+        s->heap_pos = n_series;
+        oldest[n_series++] = s;
+    }
+    heap_fix(s);
+
+    pthread_mutex_unlock(&store_mtx);
+}
+
+int tsstore_query(sensor_id_t id, sensor_ts_t t0, sensor_ts_t t1, ts_aggregate_t *agg) {
+    ts_summary_t res = empty_summary;
+
+    pthread_mutex_lock(&store_mtx);
+    ts_series_t *s = series[id];
+    if (s && s->count && t0 <= t1) {
+        // lo: first chunk whose last reading is >= t0, hi: last chunk whose first reading is <= t1.
+        size_t lo = s->first, hi = s->first + s->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            ts_chunk_t *c = chunk_at(s, mid);
+            if (c->ts[c->len - 1] < t0) lo = mid + 1;
+            else hi = mid;
+        }
+        size_t c_lo = lo;
+
+        lo = s->first, hi = s->first + s->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (chunk_at(s, mid)->ts[0] <= t1) lo = mid + 1;
+            else hi = mid;
+        }
+
+        if (lo > s->first && c_lo < lo) {
+            size_t c_hi = lo - 1;
+            res = chunk_scan(chunk_at(s, c_lo), t0, t1);
+            if (c_hi != c_lo) {
+                res = summary_merge(res, chunk_scan(chunk_at(s, c_hi), t0, t1));
+            }
+            if (c_hi > c_lo + 1) {
+                // Every chunk in between is fully covered and closed, the ring may wrap around.
+                size_t a = TSSTORE_SLOT(c_lo + 1), b = TSSTORE_SLOT(c_hi - 1);
+                if (a <= b) {
+                    res = summary_merge(res, tree_query(s, a, b));
+                } else {
+                    res = summary_merge(res, tree_query(s, a, TSSTORE_MAX_CHUNKS - 1));
+                    res = summary_merge(res, tree_query(s, 0, b));
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&store_mtx);
+
+    if (res.count == 0) return TSSTORE_NO_DATA;
+    agg->count = res.count;
+    agg->avg = res.sum / (sensor_value_t) res.count;
+    agg->min = res.min;
+    agg->max = res.max;
+    return TSSTORE_SUCCESS;
+}
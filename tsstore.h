@@ -0,0 +1,73 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _TSSTORE_H_
+#define _TSSTORE_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define TSSTORE_SUCCESS 0
+#define TSSTORE_NO_DATA 1
+
+#ifndef TSSTORE_CHUNK_LEN
+#define TSSTORE_CHUNK_LEN 64 // Readings per chunk, edge chunks of a query are scanned.
+#endif
+
+#ifndef TSSTORE_MAX_CHUNKS
+#define TSSTORE_MAX_CHUNKS 256 // Chunks kept per sensor, must be a power of two.
+#endif
+
+#ifndef TSSTORE_RETENTION
+#define TSSTORE_RETENTION 3600 // Seconds of history kept before the newest reading, 0 keeps everything that fits.
+#endif
+
+#ifndef TSSTORE_MEM_BUDGET
+#define TSSTORE_MEM_BUDGET (32 * 1024 * 1024) // Bytes of chunks and per-sensor series shared by all sensors.
+#endif
+
+/**
+ * The result of a range aggregate query.
+ */
+typedef struct {
+    uint64_t count;         /**< number of readings in the range */
+    sensor_value_t avg;     /**< average of the readings */
+    sensor_value_t min;     /**< smallest reading */
+    sensor_value_t max;     /**< largest reading */
+} ts_aggregate_t;
+
+/**
+ * Allocates the in-memory time-series store.
+ */
+void tsstore_init();
+
+/**
+ * Frees every series and chunk in the store.
+ */
+void tsstore_free();
+
+/**
+ * Appends a reading to the series of sensor 'id'. Readings older than the newest one of that sensor are ignored,
+ * so every series stays sorted by timestamp. The oldest chunks of the whole store are evicted according to
+ * TSSTORE_RETENTION, measured from the newest reading of any sensor, and TSSTORE_MEM_BUDGET, a series goes with
+ * its last chunk.
+ * \param id the sensor ID
+ * \param value the reading
+ * \param ts the timestamp of the reading
+ */
+void tsstore_insert(sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Computes count, average, min and max of the readings of sensor 'id' with t0 <= ts <= t1. Fully covered chunks
+ * are answered from their summaries in logarithmic time, only the two edge chunks are scanned.
+ * \param id the sensor ID
+ * \param t0 start of the range (inclusive)
+ * \param t1 end of the range (inclusive)
+ * \param agg a pointer to pre-allocated space for the result
+ * \return TSSTORE_SUCCESS if readings were found, TSSTORE_NO_DATA otherwise
+ */
+int tsstore_query(sensor_id_t id, sensor_ts_t t0, sensor_ts_t t1, ts_aggregate_t *agg);
+
+#endif //_TSSTORE_H_
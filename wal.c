@@ -0,0 +1,374 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "sbuffer.h"
+#include "sensor_db.h"
+
+#define WAL_MAGIC "GWWAL001"
+#define WAL_HEADER_SIZE 16 // The magic and the sequence number of the first record.
+#define WAL_NAME_MAX 64
+
+/**
+ * One reading as it is stored in a segment. The CRC covers the whole record with 'crc' set to 0.
+ */
+typedef struct {
+    uint64_t seq;
+    uint16_t id;
+    uint16_t pad;
+    uint32_t crc;
+    double value;
+    int64_t ts;
+} wal_record_t;
+
+_Static_assert(sizeof(wal_record_t) == 32, "WAL records must not contain padding.");
+
+/**
+ * Records of one group commit.
+ */
+typedef struct {
+    wal_record_t *rec;
+    size_t len, cap;
+} wal_batch_t;
+
+static pthread_mutex_t wal_mtx = PTHREAD_MUTEX_INITIALIZER; // Guards next_seq, the queued batch and stopping.
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;
+static pthread_t wal_tid;
+static uint64_t next_seq = 1;
+static wal_batch_t queued, writing; // Records wait in 'queued', the commit thread swaps it with 'writing'.
+static bool wal_stopping = false;
+
+static pthread_mutex_t seg_mtx = PTHREAD_MUTEX_INITIALIZER; // Guards the segment list against wal_checkpoint().
+static uint64_t *seg_first = NULL; // First sequence number of every live segment, oldest first.
+static size_t n_segs = 0, segs_cap = 0;
+static int seg_fd = -1; // The segment records are appended to.
+static size_t seg_bytes = 0;
+static uint64_t ckpt_seq = 0;
+static bool recovered = false; // Segments of an unclean shutdown were found at startup.
+static uint64_t replay_end = 0;
+
+static uint32_t crc_table[256];
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t record_crc(const wal_record_t *r) {
+    wal_record_t copy = *r;
+    copy.crc = 0;
+    return crc32(&copy, sizeof(copy));
+}
+
+static void segment_name(char *name, size_t size, uint64_t first) {
+    snprintf(name, size, "wal-%020" PRIu64 ".log", first);
+}
+
+static void segments_push(uint64_t first) {
+    if (n_segs == segs_cap) {
+        segs_cap = segs_cap ? 2 * segs_cap : 16;
+        seg_first = realloc(seg_first, segs_cap * sizeof(uint64_t));
+        ERROR_HANDLER(seg_first == NULL, "WAL segment list realloc failed.");
+    }
+    seg_first[n_segs++] = first;
+}
+
+static void segment_unlink_oldest() {
+    char name[WAL_NAME_MAX];
+    segment_name(name, sizeof(name), seg_first[0]);
+    unlink(name);
+    memmove(seg_first, seg_first + 1, (n_segs - 1) * sizeof(uint64_t));
+    n_segs--;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Starts a new segment whose first record will be 'first'. The caller holds seg_mtx.
+ */
+static void segment_open(uint64_t first) {
+    char name[WAL_NAME_MAX];
+    segment_name(name, sizeof(name), first);
+    seg_fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    ERROR_HANDLER(seg_fd == -1, "WAL segment creation failed.");
+
+    char header[WAL_HEADER_SIZE];
+    memcpy(header, WAL_MAGIC, 8);
+    memcpy(header + 8, &first, sizeof(first));
+    ERROR_HANDLER(write(seg_fd, header, sizeof(header)) != sizeof(header), "WAL header write failed.");
+    seg_bytes = sizeof(header);
+    segments_push(first);
+}
+
+static uint64_t checkpoint_read() {
+    uint64_t seq = 0;
+    FILE *f = fopen(WAL_CHECKPOINT_FILE, "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%" SCNu64, &seq) != 1) seq = 0;
+    fclose(f);
+    return seq;
+}
+
+/**
+ * Replays one segment from a read-only mapping. Sequence numbers in a segment are consecutive from the one in its
+ * header, the scan stops at the first record that breaks that or fails its CRC: that is where a crashed run
+ * stopped writing.
+ * @param name the segment file
+ * @param last set to the sequence number of the last valid record, untouched if there is none
+ * @return the number of readings inserted into the shared buffer
+ */
+static uint64_t segment_replay(const char *name, uint64_t *last) {
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < WAL_HEADER_SIZE + sizeof(wal_record_t)) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    uint64_t replayed = 0, expect;
+    memcpy(&expect, map + 8, sizeof(expect));
+    if (memcmp(map, WAL_MAGIC, 8) == 0) {
+        size_t n = (st.st_size - WAL_HEADER_SIZE) / sizeof(wal_record_t);
+        const wal_record_t *rec = (const wal_record_t *) (map + WAL_HEADER_SIZE);
+        for (size_t i = 0; i < n; ++i, ++expect) {
+            wal_record_t r;
+            memcpy(&r, rec + i, sizeof(r));
+            if (r.seq != expect || r.crc != record_crc(&r)) break;
+            *last = r.seq;
+            if (r.seq <= ckpt_seq) continue;
+
+            sensor_data_t *data = malloc(sizeof(sensor_data_t));
+            ERROR_HANDLER(data == NULL, "WAL replay malloc failed.");
+            memset(data, 0, sizeof(sensor_data_t));
+            data->id = r.id;
+            data->value = r.value;
+            data->ts = (sensor_ts_t) r.ts;
+            data->seq = r.seq;
+            sbuffer_insert(data);
+            replayed++;
+        }
+    }
+    munmap(map, st.st_size);
+    return replayed;
+}
+
+/**
+ * Replays every segment in order and rebuilds the segment list. Segments without a single valid record are
+ * deleted, so a new segment never collides with one left behind by a crash.
+ * @return the number of readings inserted into the shared buffer
+ */
+static uint64_t wal_recover() {
+    ckpt_seq = checkpoint_read();
+
+    DIR *dir = opendir(".");
+    ERROR_HANDLER(dir == NULL, "WAL directory cannot be read.");
+    struct dirent *ent;
+    uint64_t first;
+    uint64_t *found = NULL;
+    size_t n_found = 0, cap = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "wal-%" SCNu64 ".log", &first) != 1) continue;
+        if (n_found == cap) {
+            cap = cap ? 2 * cap : 16;
+            found = realloc(found, cap * sizeof(uint64_t));
+            ERROR_HANDLER(found == NULL, "WAL segment list realloc failed.");
+        }
+        found[n_found++] = first;
+    }
+    closedir(dir);
+    qsort(found, n_found, sizeof(uint64_t), cmp_u64);
+    recovered = n_found > 0; // A clean shutdown deletes every segment.
+
+    uint64_t replayed = 0, max_seq = ckpt_seq;
+    for (size_t i = 0; i < n_found; ++i) {
+        char name[WAL_NAME_MAX];
+        segment_name(name, sizeof(name), found[i]);
+        uint64_t last = 0;
+        replayed += segment_replay(name, &last);
+        if (last == 0) {
+            unlink(name);
+            continue;
+        }
+        segments_push(found[i]);
+        if (last > max_seq) max_seq = last;
+    }
+    free(found);
+    next_seq = max_seq + 1;
+    replay_end = replayed ? max_seq : 0;
+    return replayed;
+}
+
+/**
+ * Appends the records of a group commit to the current segment and syncs them, starting a new segment when the
+ * current one is full.
+ */
+static void batch_commit(wal_batch_t *b) {
+    pthread_mutex_lock(&seg_mtx);
+    if (seg_bytes >= WAL_SEGMENT_SIZE) {
+        ERROR_HANDLER(close(seg_fd) != 0, "WAL segment close failed.");
+        segment_open(b->rec[0].seq);
+    }
+    int fd = seg_fd;
+    pthread_mutex_unlock(&seg_mtx);
+
+    size_t len = b->len * sizeof(wal_record_t), done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (char *) b->rec + done, len - done);
+        ERROR_HANDLER(n < 0, "WAL write failed.");
+        done += n;
+    }
+    ERROR_HANDLER(fdatasync(fd) != 0, "WAL sync failed.");
+    seg_bytes += len;
+    b->len = 0;
+}
+
+static void *wal_thread() {
+    pthread_mutex_lock(&wal_mtx);
+    while (1) {
+        while (queued.len == 0 && !wal_stopping) pthread_cond_wait(&wal_work, &wal_mtx);
+        if (queued.len == 0) break;
+        if (WAL_SYNC_INTERVAL > 0 && !wal_stopping) {
+            // Let the readings of the next few milliseconds join this commit, one fdatasync() covers them all.
+            pthread_mutex_unlock(&wal_mtx);
+            usleep(WAL_SYNC_INTERVAL * 1000);
+            pthread_mutex_lock(&wal_mtx);
+        }
+        wal_batch_t tmp = queued;
+        queued = writing;
+        writing = tmp;
+        pthread_mutex_unlock(&wal_mtx);
+
+        batch_commit(&writing);
+
+        pthread_mutex_lock(&wal_mtx);
+    }
+    pthread_mutex_unlock(&wal_mtx);
+    pthread_exit(NULL);
+}
+
+void wal_init() {
+    if (!WAL_ENABLED) return;
+    crc_init();
+    uint64_t replayed = wal_recover();
+    if (replayed) log_pipe_write(LOG_WAL_REPLAY, 0, (sensor_value_t) replayed);
+    TRACE_INFO("WAL replayed %" PRIu64 " readings after checkpoint %" PRIu64 ".", replayed, ckpt_seq);
+
+    pthread_mutex_lock(&seg_mtx);
+    segment_open(next_seq);
+    pthread_mutex_unlock(&seg_mtx);
+    wal_stopping = false;
+    ERROR_HANDLER(pthread_create(&wal_tid, NULL, wal_thread, NULL) != 0, "WAL thread creation failed.");
+}
+
+bool wal_recovered() {
+    return recovered;
+}
+
+uint64_t wal_replay_end() {
+    return replay_end;
+}
+
+void wal_ingest(sensor_data_t *data) {
+    if (!WAL_ENABLED) {
+        sbuffer_insert(data);
+        return;
+    }
+    pthread_mutex_lock(&wal_mtx);
+    data->seq = next_seq++;
+    if (queued.len == queued.cap) {
+        queued.cap = queued.cap ? 2 * queued.cap : 1024;
+        queued.rec = realloc(queued.rec, queued.cap * sizeof(wal_record_t));
+        ERROR_HANDLER(queued.rec == NULL, "WAL batch realloc failed.");
+    }
+    wal_record_t *r = &queued.rec[queued.len++];
+    memset(r, 0, sizeof(wal_record_t));
+    r->seq = data->seq;
+    r->id = data->id;
+    r->value = data->value;
+    r->ts = data->ts;
+    r->crc = record_crc(r);
+    if (queued.len == 1) pthread_cond_signal(&wal_work);
+    // Still under the WAL lock, so the shared buffer receives the readings in sequence order.
+    sbuffer_insert(data);
+    pthread_mutex_unlock(&wal_mtx);
+}
+
+void wal_checkpoint(uint64_t seq) {
+    if (!WAL_ENABLED || seq <= ckpt_seq) return;
+
+    // Write the new checkpoint next to the old one and swap them, a crash leaves one of both intact.
+    int fd = open(WAL_CHECKPOINT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ERROR_HANDLER(fd == -1, "WAL checkpoint creation failed.");
+    ERROR_HANDLER(dprintf(fd, "%" PRIu64 "\n", seq) < 0 || fdatasync(fd) != 0 || close(fd) != 0,
+                  "WAL checkpoint write failed.");
+    ERROR_HANDLER(rename(WAL_CHECKPOINT_FILE ".tmp", WAL_CHECKPOINT_FILE) != 0, "WAL checkpoint rename failed.");
+    int dir = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+
+    pthread_mutex_lock(&seg_mtx);
+    ckpt_seq = seq;
+    // A segment is obsolete once the next one starts at or before the first record that is not stored yet.
+    while (n_segs >= 2 && seg_first[1] <= seq + 1) segment_unlink_oldest();
+    pthread_mutex_unlock(&seg_mtx);
+}
+
+void wal_close() {
+    if (!WAL_ENABLED) return;
+    pthread_mutex_lock(&wal_mtx);
+    wal_stopping = true;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_mtx);
+    pthread_join(wal_tid, NULL);
+
+    pthread_mutex_lock(&seg_mtx);
+    ERROR_HANDLER(close(seg_fd) != 0, "WAL segment close failed.");
+    seg_fd = -1;
+    // After a clean shutdown the checkpoint covers everything and the next start has nothing to replay.
+    if (ckpt_seq + 1 >= next_seq) {
+        while (n_segs) segment_unlink_oldest();
+    }
+    pthread_mutex_unlock(&seg_mtx);
+
+    free(seg_first);
+    seg_first = NULL;
+    n_segs = segs_cap = 0;
+    free(queued.rec);
+    free(writing.rec);
+    memset(&queued, 0, sizeof(queued));
+    memset(&writing, 0, sizeof(writing));
+}
@@ -0,0 +1,75 @@
+/**
+ * \author Nicolas Gutierrez Suarez
+ */
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+#ifndef WAL_ENABLED
+#define WAL_ENABLED 1 // Log every accepted reading before it enters the shared buffer, 0 turns the WAL off.
+#endif
+
+#ifndef WAL_SYNC_INTERVAL
+#define WAL_SYNC_INTERVAL 10 // Milliseconds readings are gathered before a group commit, the most a crash loses.
+#endif
+
+#ifndef WAL_SEGMENT_SIZE
+#define WAL_SEGMENT_SIZE (64 * 1024 * 1024) // Bytes after which a new WAL segment is started.
+#endif
+
+#ifndef WAL_CHECKPOINT_INTERVAL
+#define WAL_CHECKPOINT_INTERVAL 30 // Seconds between durable DB flushes that move the checkpoint forward.
+#endif
+
+#define WAL_CHECKPOINT_FILE "gateway.ckpt"
+
+/*
+ * The WAL is a series of segment files wal-<first seq>.log, each a 16 byte header followed by fixed size records
+ * carrying a sequence number and a CRC32. The checkpoint file holds the highest sequence number that the storage
+ * backend has synced to disk, segments that lie completely before it are deleted.
+ */
+
+/**
+ * Replays every record after the checkpoint into the shared buffer, so the datamgr and the DB thread see them
+ * before any new reading, then starts the thread that commits new records. Call after sbuffer_init() and before
+ * the connection manager starts.
+ */
+void wal_init();
+
+/**
+ * \return true if wal_init() found segments of a run that did not shut down cleanly, whose data files then hold
+ * the readings up to the checkpoint and must not be truncated
+ */
+bool wal_recovered();
+
+/**
+ * \return the highest sequence number wal_init() replayed, 0 if it replayed nothing
+ */
+uint64_t wal_replay_end();
+
+/**
+ * Gives 'data' the next sequence number, queues it for the next group commit and inserts it into the shared
+ * buffer. Can be called from any thread, the order of the shared buffer is the order of the sequence numbers.
+ * \param data a reading allocated with malloc(), ownership goes to the shared buffer
+ */
+void wal_ingest(sensor_data_t *data);
+
+/**
+ * Records that every reading up to 'seq' is durably stored by the DB thread and deletes the segments that are no
+ * longer needed.
+ * \param seq the highest sequence number stored
+ */
+void wal_checkpoint(uint64_t seq);
+
+/**
+ * Commits what is still queued, stops the commit thread and deletes the segments covered by the checkpoint.
+ * Call after the DB thread finished.
+ */
+void wal_close();
+
+#endif //_WAL_H_